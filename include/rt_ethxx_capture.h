@@ -19,6 +19,7 @@ extern void rte_pktopts_config (struct rt_ethxx_trapper *rte, const char *flags)
 extern struct rt_ethxx_trapper *rte_default_trapper ();
 extern int rte_open (struct rt_ethxx_trapper *rte);
 extern void rte_preview (struct rt_ethxx_trapper *rte);
+extern struct rt_task_t *rte_dispatch_task ();
 
 #endif
 
@@ -44,7 +44,13 @@ struct rt_ethxx_trapper{
 
 	int32_t    link;
 
-	int (*flush)(const char *fname, void *pkthdr,
+	/** Recorded packets are batched into per-flow pcap files of this many MB or seconds */
+	int			record_batches;
+	int			record_flows;
+	int			record_file_size;
+	int			record_file_time;
+
+	int (*flush)(const char *flow, void *pkthdr,
 	                    void *val, size_t __attribute__((__unused__))s);
 
 	void (*display_ops)(const void *pkthdr,
@@ -20,13 +20,22 @@ typedef enum
 
 mq_errno rt_fifo_push (MQ_ID qid, message msg, int s);
 mq_errno rt_fifo_pop (MQ_ID qid, message *msg, int *s);
+int rt_fifo_push_batch (MQ_ID qid, message *msgs, int *s, int n);
+int rt_fifo_pop_batch (MQ_ID qid, message *msgs, int *s, int n);
 MQ_ID rt_fifo_create (const char *desc);
+MQ_ID rt_fifo_create_bounded (const char *desc, int capacity);
 int rt_fifo_destroy (MQ_ID qid);
+/** List queue against the bounded ring, single and batched, printed as msg/s */
+void rt_fifo_bench (int producers, int consumers, long msgs);
 
 
 #define rt_mq_create(desc) rt_fifo_create(desc)
+/** Lock-free and allocation-free, send fails with MQ_FAILURE when full */
+#define rt_mq_create_bounded(desc,capacity) rt_fifo_create_bounded(desc,capacity)
 #define rt_mq_send(qid,msg,s) rt_fifo_push(qid,msg,s)
 #define rt_mq_recv(qid,msg,s) rt_fifo_pop(qid,msg,s)
+#define rt_mq_send_batch(qid,msgs,s,n) rt_fifo_push_batch(qid,msgs,s,n)
+#define rt_mq_recv_batch(qid,msgs,s,n) rt_fifo_pop_batch(qid,msgs,s,n)
 
 #endif
 
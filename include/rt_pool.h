@@ -33,7 +33,48 @@ struct rt_pool_bucket_t{
     struct rt_pool_bucket_t *prev;
 };
 
+/** Per-thread bucket cache, see RT_POOL_F_MAGAZINE */
+#define RT_POOL_MAG_SIZE    64
+struct rt_pool_magazine_t{
+
+    int n;
+
+    struct rt_pool_bucket_t *rounds[RT_POOL_MAG_SIZE];
+
+    /** counters, only written by the owner thread */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t spills;
+
+    void *pool;
+
+    struct list_head	list;
+};
+
+struct rt_pool_stats_t{
+
+    /** get served by the calling thread's magazine */
+    uint64_t hits;
+
+    /** get had to take the shared lock */
+    uint64_t misses;
+
+    /** put found the magazine full and went to the shared list */
+    uint64_t spills;
+
+    /** buckets created on demand after start-up */
+    uint64_t grows;
+
+    /** buckets cached in magazines */
+    int cached;
+
+    int magazines;
+};
+
 struct rt_pool_t{
+
+#define RT_POOL_F_MAGAZINE  (1 << 0)    /** thread-local magazines in front of the shared list */
+    int flags;
     
     struct rt_pool_bucket_t *top;
 
@@ -62,16 +103,37 @@ struct rt_pool_t{
     * this callback is very much encouraged!
     */
     void (*del)(void *val);
+
+    /** RT_POOL_F_MAGAZINE only */
+    pthread_key_t mag_key;
+    struct list_head mag_list;
+    /** counters of magazines whose thread has exited */
+    struct rt_pool_stats_t retired;
+
+    volatile uint64_t grows;
     
 };
 
 
+/**
+* flags: 0 or RT_POOL_F_MAGAZINE.
+* Do not use RT_POOL_F_MAGAZINE on a pool which is used as a queue between
+* threads (push on one thread, get on another expecting that very bucket),
+* a pushed bucket may stay in the pusher's magazine.
+*/
 extern struct rt_pool_t *
 rt_pool_initialize(int buckets,
                         void *(*priv_alloc)(),
                         void (*priv_free)(void *),
                         int flags);
 
+extern void rt_pool_stats(struct rt_pool_t *pool, struct rt_pool_stats_t *stats);
+
+/**
+* The pool must be quiesced: no thread may get or push buckets while or after
+* it is destroyed. Magazines of threads which are still alive are freed here,
+* a thread touching the pool afterwards uses freed memory.
+*/
 extern void rt_pool_destroy(struct rt_pool_t *pool);
 
 extern struct rt_pool_bucket_t *
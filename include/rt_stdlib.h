@@ -23,7 +23,7 @@ extern void *kcalloc(int c, int s,
 
 extern void *kmalloc(int s, 
                         int flags, 
-                        int __attribute__((__unused__)) node);
+                        int node);
 
 extern void *krealloc(void *sp,  int s, 
                         int flags, 
@@ -31,5 +31,9 @@ extern void *krealloc(void *sp,  int s,
 
 extern void kfree(void *p);
 
+extern int rt_mempolicy_prefer(int node);
+extern void rt_mempolicy_restore(int node);
+extern int rt_mempolicy_node();
+
 #endif
 
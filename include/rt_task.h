@@ -28,6 +28,9 @@ struct rt_task_t {
 	/** proc core, kernel schedule if eque INVALID_CORE */
 	int core;
 
+	/** preferred memory node from task-affinity, -1 if none; set by task_registry */
+	int node;
+
 	/** attr of current task */
 	rt_pthread_attr *attr;
 
@@ -50,10 +53,14 @@ struct rt_task_t {
 	struct list_head   list;
 	struct hlist_head	hlist;
 
+#define TASK_PLACEMENT_SIZE 64
+	/** Where the task actually runs, filled in at start */
+	char placement[TASK_PLACEMENT_SIZE];
+
 };
 
-extern void task_spawn(char *desc, uint32_t prio, void *attr, void * (*func)(void *), void *arg);
-extern void task_spawn_quickly(struct rt_task_t *task);
+extern struct rt_task_t *task_spawn(char *desc, uint32_t prio, void *attr, void * (*func)(void *), void *arg);
+extern struct rt_task_t *task_spawn_quickly(struct rt_task_t *task);
 
 extern void task_registry(struct rt_task_t *task);
 extern void task_deregistry(struct rt_task_t *task);
@@ -66,4 +73,14 @@ extern void task_run();
 
 extern void task_detail_foreach();
 
+/**
+* Pin tasks whose name matches pattern (fnmatch) to cpus ("0-3,8"),
+* and prefer node for their memory. cpus may be NULL when node is
+* given, the node's own cpus are used then. node < 0 means no node.
+*/
+extern int task_affinity_registry(const char *pattern, const char *cpus, int node);
+
+/** Load task-affinity entries from the yaml section of the loaded config. */
+extern int task_affinity_load(const char *section);
+
 #endif
@@ -29,7 +29,11 @@ struct timer_t{
     /** in ms */
     int64_t interval;
 
-    int64_t curr_ticks;
+    /** delay of the first shot after tmr_start, in ms */
+    int64_t delay;
+
+    /** absolute expiry in timer-wheel ticks (ms) */
+    uint64_t expires;
     
     enum {TMR_PERIODIC, TMR_ASHOT} type;
     
@@ -44,20 +48,39 @@ struct timer_t{
     int recycle;
     
     struct list_head list;
+
+    /** linked into a wheel slot (or the expired list) while started */
+    struct list_head entry;
+
+    /** uid lookup */
+    struct hlist_node hlist;
 };
 
+/** Resolution of the timer wheel. */
+#define TMR_TICK_MS     1
+
 extern void tmr_start(uint32_t uid);
 extern void tmr_stop(uint32_t uid);
 extern void tmr_registry(struct timer_t *this);
 extern void tmr_deregistry(struct timer_t *this);
 
 /**
-* routine: must be a reentrant function.
-* An unknown error ocurrs if a thread-safe function called as a routione.
+* routine: called from the timer thread, never from a signal handler.
+* It may call tmr_start/tmr_stop, but should not block for long since
+* all timers share one thread.
+* sec: period in seconds, the first shot comes one second after tmr_start.
 */
 extern uint32_t tmr_create(int module,
                 const char *desc, int type,
-                void (*routine)(uint32_t, int, char **), int argc, char **argv, int delay_ms);
+                void (*routine)(uint32_t, int, char **), int argc, char **argv, int sec);
+
+/**
+* Same as tmr_create, but with a millisecond period.
+* The first shot comes one period after tmr_start.
+*/
+extern uint32_t tmr_create_ms(int module,
+                const char *desc, int type,
+                void (*routine)(uint32_t, int, char **), int argc, char **argv, int ms);
 
 #endif
 #endif
\ No newline at end of file
@@ -12,11 +12,6 @@
 
 extern void rt_ethxx_reporter_init(int buckets);
 
-extern void report_lineup(const char __attribute__((__unused__))*path,
-                        size_t __attribute__((__unused__))ps,
-                        const char *file,
-                        size_t fs);
-
 static LIST_HEAD(packet_list);
 
 #if SPASR_BRANCH_EQUAL(BRANCH_A29)
@@ -99,6 +94,10 @@ static struct rt_ethxx_trapper ethxx_trapper = {
     .p_memp_prealloc_size = 409600,
     .r_memp_prealloc_size = 4096,
     .dispatch_size = 10240,
+    .record_batches = 256,
+    .record_flows = 1024,
+    .record_file_size = 64,
+    .record_file_time = 60,
     .packet_parser = &rt_ethxx_packet_parser,
 
     .flags = A_UNDO,
@@ -234,6 +233,22 @@ rte_config(struct rt_ethxx_trapper *rte)
 
         }
 
+        if(!STRCMP(this_node->name, "record-batches")){
+            rte->record_batches = integer_parser(this_node->val, 1, 1024);
+        }
+
+        if(!STRCMP(this_node->name, "record-flows")){
+            rte->record_flows = integer_parser(this_node->val, 1, 65536);
+        }
+
+        if(!STRCMP(this_node->name, "record-file-size")){
+            rte->record_file_size = integer_parser(this_node->val, 1, 4096);
+        }
+
+        if(!STRCMP(this_node->name, "record-file-time")){
+            rte->record_file_time = integer_parser(this_node->val, 1, 86400);
+        }
+
         if(!STRCMP(this_node->name, "warehouse")) {
             if (rte->flags & A_WRONLY){
                 if (!this_node->val){
@@ -314,8 +329,10 @@ copy_to_bucket(struct rt_packet_t *p,
                         const struct pcap_pkthdr *pkthdr)
 {
     if(p->buffer){
-        memset64(p->buffer, 0, p->buffer_size);
+        /** Only the bytes past the packet need clearing */
         memcpy64(p->buffer, packet, pkthdr->len);
+        if ((int)pkthdr->len < p->buffer_size)
+            memset64(p->buffer + pkthdr->len, 0, p->buffer_size - pkthdr->len);
         p->ready = 1;
         p->pkthdr.caplen = pkthdr->caplen;
         p->pkthdr.len = pkthdr->len;
@@ -342,52 +359,38 @@ static __rt_always_inline__ void dispatch_lineup(struct rt_ethxx_trapper *rte,
 	DISPATCH_EQ_ADD(1);
 }
 
-static __rt_always_inline__ void mkfname(const char *warehouse,
-                        void *intros,
-                        void __attribute__((__unused__))*pf_hdr,
-                        const void *phdr, int64_t rank,
-                        char *filepath,
-                        size_t path_size,
-                        size_t *size)
+/** Recorded packets of one flow share files named after this key */
+static __rt_always_inline__ void mkflow(void *intros,
+                        char *flow,
+                        size_t flow_size)
 {
-    size_t s;
-    int year, month, day, hour, min, sec;
     struct rt_packet_snapshot_t *intro = (struct rt_packet_snapshot_t *)intros;
-    struct pcap_pkthdr *pkthdr = (struct pcap_pkthdr *)phdr;
-
-    tmscanf_s (pkthdr->ts.tv_sec, &year, &month, &day, &hour, &min, &sec);
 
     if (intro->type == IPV4){
-        s = SNPRINTF(filepath, path_size - 1, "%s/%d_%d_%d_0x%08X_0x%08X_0x%04X_0x%04X_0x%02X_%02d.%02d.%04d-%02d:%02d:%02d_%ld.pcap",
-                 warehouse, intro->rid, intro->pid, intro->dir,
+        SNPRINTF(flow, flow_size - 1, "%d_%d_%d_0x%08X_0x%08X_0x%04X_0x%04X_0x%02X",
+                 intro->rid, intro->pid, intro->dir,
                  intro->ft.v4.src_ip, intro->ft.v4.dst_ip,
-                 intro->ft.v4.src_port, intro->ft.v4.dst_port, intro->ft.v4.protocol,
-                 month, day, year, hour, min, sec, rank);
+                 intro->ft.v4.src_port, intro->ft.v4.dst_port, intro->ft.v4.protocol);
     }else {
         if (intro->type == IPV6) {
-            s = SNPRINTF(filepath, path_size - 1, "%s/%d_%d_%d_0x%016lX%016lX_0x%016lX%016lX_0x%04X_0x%04X_0x%02X_%02d.%02d.%04d-%02d:%02d:%02d_%ld.pcap",
-                     warehouse, intro->rid, intro->pid, intro->dir,
+            SNPRINTF(flow, flow_size - 1, "%d_%d_%d_0x%016lX%016lX_0x%016lX%016lX_0x%04X_0x%04X_0x%02X",
+                     intro->rid, intro->pid, intro->dir,
                      intro->ft.v6.sip_upper, intro->ft.v6.sip_lower,
                      intro->ft.v6.dip_upper, intro->ft.v6.dip_lower,
                      intro->ft.v6.src_port, intro->ft.v6.dst_port,
-                     intro->ft.v6.protocol,
-                     month, day, year, hour, min, sec, rank);
+                     intro->ft.v6.protocol);
         }else{
-                s = SNPRINTF(filepath, path_size - 1, "%s/%d_%d_%d_%s_%02d.%02d.%04d-%02d:%02d:%02d_%ld.pcap",
-                        warehouse, intro->rid, intro->pid, intro->dir,
-                        "not_ip", month, day, year, hour, min, sec, rank);
+                SNPRINTF(flow, flow_size - 1, "%d_%d_%d_%s",
+                        intro->rid, intro->pid, intro->dir, "not_ip");
         }
     }
-
-    *size = s;
 }
 
 static __rt_always_inline__ void
 packet_further_proc(struct rt_ethxx_trapper *rte,
     struct rt_packet_t *p)
 {
-    char filepath[512] = {0};
-    size_t s = 0;
+    char flow[256] = {0};
 
     if(likely(p)){
 
@@ -399,15 +402,8 @@ packet_further_proc(struct rt_ethxx_trapper *rte,
 
         if((rte->flags & A_WRONLY) &&
                     rte->flush && !(p->intro.flags && PR_DROPONLY)){
-
-            mkfname(rte->warehouse, (void *)&p->intro, NULL,
-                                &p->pkthdr,
-                                random(), filepath, 512, &s);
-
-            rte->flush(filepath, &p->pkthdr, (uint8_t *)p->buffer, p->pkthdr.len);
-
-            report_lineup(NULL, 0, filepath, (int)s);
-
+            mkflow((void *)&p->intro, flow, sizeof(flow));
+            rte->flush(flow, &p->pkthdr, (uint8_t *)p->buffer, p->pkthdr.caplen);
         }
 
     }
@@ -428,17 +424,12 @@ ___thrdpool_feed(void *pv_val)
         SGProc(p);
 #else
 	struct rt_ethxx_trapper *rte = rte_default_trapper();
-	char filepath[512] = {0};
-	size_t s = 0;
-
-        mkfname(rte->warehouse, (void *)&p->intro, NULL,
-                            &p->pkthdr,
-                            random(), filepath, 512, &s);
+	char flow[256] = {0};
 
         if((rte->flags & A_WRONLY) &&
                     rte->flush && !(p->intro.flags && PR_DROPONLY)){
-            rte->flush(filepath, &p->pkthdr, (uint8_t *)p->buffer, p->pkthdr.len);
-            report_lineup(NULL, 0, filepath, (int)s);
+            mkflow((void *)&p->intro, flow, sizeof(flow));
+            rte->flush(flow, &p->pkthdr, (uint8_t *)p->buffer, p->pkthdr.caplen);
         }
 #endif
 
@@ -679,17 +670,12 @@ __rt_ethxx_proc(void *_p,
         SGProc(p);
 #else
 	struct rt_ethxx_trapper *rte = rte_default_trapper ();
-	char filepath[512] = {0};
-	size_t s = 0;
-
-        mkfname(rte->warehouse, (void *)&p->intro, NULL,
-                            &p->pkthdr,
-                            random(), filepath, 512, &s);
+	char flow[256] = {0};
 
         if((rte->flags & A_WRONLY) &&
                     rte->flush && !(p->intro.flags && PR_DROPONLY)){
-            rte->flush(filepath, &p->pkthdr, (uint8_t *)p->buffer, p->pkthdr.len);
-            report_lineup(NULL, 0, filepath, (int)s);
+            mkflow((void *)&p->intro, flow, sizeof(flow));
+            rte->flush(flow, &p->pkthdr, (uint8_t *)p->buffer, p->pkthdr.caplen);
         }
 #endif
 
@@ -727,6 +713,12 @@ static struct rt_task_t ethxxCaptor = {
     .recycle = FORBIDDEN,
 };
 
+/** Handle of the task which fills the packet pool, its node is valid once rte_open ran */
+struct rt_task_t *rte_dispatch_task ()
+{
+    return &ethxxCaptor;
+}
+
 static void *
 packet_alloc()
 {
@@ -772,6 +764,9 @@ static void do_perform_monitor(uint32_t __attribute__((__unused__)) uid,
     char tm[64] = {0}, tm_ymd[64] = {0};
     int64_t dispatcher_eq, dispatcher_dq, dispatcher_wr;
     int64_t reporter_eq, reporter_dq;
+    int64_t recorder_drop, recorder_files;
+    int recorder_flows;
+    struct rt_pool_stats_t pool_stats;
 
     //printf("inc = %d\n", inc);
 
@@ -792,6 +787,10 @@ static void do_perform_monitor(uint32_t __attribute__((__unused__)) uid,
     reporter_eq = REPORTER_EQ_ADD(0);
     reporter_dq = REPORTER_DQ_ADD(0);
 
+    recorder_drop = RECORDER_DROP_ADD(0);
+    recorder_files = RECORDER_FILE_ADD(0);
+    recorder_flows = rt_ethxx_pcap_recorder_flows();
+
     l += SNPRINTF(packet_bucket_gather + l, PERF_GATHER_SIZE - l,
         "\tDispatcher enqueue=%ld, dequeue=%ld, flush=%ld, remain=%ld\n", dispatcher_eq, dispatcher_dq,
         dispatcher_wr, (dispatcher_eq - dispatcher_dq));
@@ -800,6 +799,14 @@ static void do_perform_monitor(uint32_t __attribute__((__unused__)) uid,
         "\tReporter   enqueue=%ld, dequeue=%ld, remain=%ld\n", reporter_eq, reporter_dq,
         (reporter_eq - reporter_dq));
 
+    l += SNPRINTF(packet_bucket_gather + l, PERF_GATHER_SIZE - l,
+        "\tRecorder   flows=%d, files=%ld, dropped=%ld\n", recorder_flows, recorder_files, recorder_drop);
+
+    rt_pool_stats(rte->bucketpool, &pool_stats);
+    l += SNPRINTF(packet_bucket_gather + l, PERF_GATHER_SIZE - l,
+        "\tPacketPool hit=%lu, miss=%lu, spill=%lu, grow=%lu, cached=%d\n", pool_stats.hits,
+        pool_stats.misses, pool_stats.spills, pool_stats.grows, pool_stats.cached);
+
     /** %Y-%m-%d, 2016-05-14 */
     memcpy(tm_ymd, tm, 10);
     SNPRINTF(list_perf_dump, PERF_DUMP_SIZE, "echo \"%s\" >> %s/dispatcher-reporter-WQEs-%s", packet_bucket_gather,
@@ -829,6 +836,10 @@ void rte_preview (struct rt_ethxx_trapper *rte)
 
     printf("%30s:%60s\n", "The MacAddress", form_mac_str);
     printf("%30s:%60s\n", "The Warehouse", rte->warehouse);
+    printf("%30s:%60d\n", "The Record Batches", rte->record_batches);
+    printf("%30s:%60d\n", "The Record Flows", rte->record_flows);
+    printf("%30s:%60d\n", "The Record File Size(MB)", rte->record_file_size);
+    printf("%30s:%60d\n", "The Record File Time(s)", rte->record_file_time);
     printf("%30s:%60d\n", "The Filter", rte->filter);
     printf("%30s:%60s\n", "The Performence View", rte->perf_view_domain);
     printf("%30s:%60d\n", "The Performence View Interval", rte->perf_interval);
@@ -847,6 +858,7 @@ void rte_preview (struct rt_ethxx_trapper *rte)
 int rte_open (struct rt_ethxx_trapper *rte)
 {
 	int xret = -1;
+	int node;
 
 	rte_wqe_init (rte, MAX_WQES);
 	rte_check_and_mkdir (rte->warehouse);
@@ -858,11 +870,19 @@ int rte_open (struct rt_ethxx_trapper *rte)
 #if !SPASR_BRANCH_EQUAL(BRANCH_VRS)
 	    rt_ethxx_reporter_init((rte->r_memp_prealloc_size > 0) ?
 	                            rte->r_memp_prealloc_size : 4096);
+	    /** Closed files go to report_lineup, VRS runs without a reporter */
+	    if (rte->flags & A_WRONLY)
+	        rt_ethxx_pcap_recorder_init(rte->warehouse, rte->record_batches, rte->record_flows,
+	                            (int64_t)rte->record_file_size << 20, rte->record_file_time);
 #endif
+	    /** Packet buckets are filled by the dispatch task, keep them on its node */
+	    task_registry(&ethxxCaptor);
+	    node = rt_mempolicy_prefer(ethxxCaptor.node);
 	    rte->bucketpool = rt_pool_initialize((rte->p_memp_prealloc_size > 0) ?   \
 	                            rte->p_memp_prealloc_size : 4096,   \
 	                            packet_alloc, packet_free,    \
-	                            0);
+	                            RT_POOL_F_MAGAZINE);
+	    rt_mempolicy_restore(node);
 #ifdef THRDPOOL
 	    assert((rte->thrdpool = thpool_create(rte->thrds, rte->wqe_size, 0)) != NULL);
 	    fprintf(stderr, "Pool started with %d threads and "
@@ -880,7 +900,6 @@ int rte_open (struct rt_ethxx_trapper *rte)
 #if !SPASR_BRANCH_EQUAL(BRANCH_A29)
 	    atomic_set(&rt_ethxx_capture_signal, 1);
 #endif
-	    task_registry(&ethxxCaptor);
 
 #if SPASR_BRANCH_EQUAL(BRANCH_LOCAL)
 	    task_registry(&ethxxProc);
@@ -17,9 +17,85 @@ struct rt_ethxx_pcap_writer rte_writer = {
     .dispatcher_wr = ATOMIC_INIT(0),
     .reporter_eq = ATOMIC_INIT(0),
     .reporter_dq = ATOMIC_INIT(0),
+    .recorder_drop = ATOMIC_INIT(0),
+    .recorder_files = ATOMIC_INIT(0),
 };
 
-#define FNAME_LENGTH  256
+#define FNAME_LENGTH  512
+
+/** Records of a flow are appended to batches of this size, a batch is one write */
+#define PCAP_BATCH_SIZE     (64 << 10)
+/** A batch that is not full goes to disk after this long */
+#define PCAP_BATCH_LINGER   1000
+/** Slots of the flow cache, each with its own lock */
+#define PCAP_FLOW_SLOTS     1024
+#define PCAP_FLOW_KEY       160
+
+extern void report_lineup(const char __attribute__((__unused__))*path,
+                        size_t __attribute__((__unused__))ps,
+                        const char *file,
+                        size_t fs);
+
+struct pcap_flow_t;
+
+struct pcap_batch_t {
+    size_t      len;
+    int64_t     records;
+    /** rt_time_ms of its first record */
+    uint64_t    born;
+    struct pcap_flow_t *flow;
+    struct list_head list;
+    char        data[PCAP_BATCH_SIZE];
+};
+
+/** One recorded flow and its open pcap file */
+struct pcap_flow_t {
+    char        key[PCAP_FLOW_KEY];
+    uint32_t    hval;
+
+    /** Under the slot lock: batch being filled, batches on the ready list */
+    struct pcap_batch_t *cur;
+    int         queued;
+    struct hlist_node hlist;
+
+    /** Owned by the writer task */
+    FILE        *fp;
+    char        file[FNAME_LENGTH];
+    int64_t     written;
+    time_t      opened;
+    uint64_t    seq;
+};
+
+struct pcap_flow_slot_t {
+    rt_mutex    lock;
+    struct hlist_head head;
+};
+
+struct rt_ethxx_pcap_recorder {
+    char        warehouse[128];
+    int64_t     file_size;
+    int         file_time;
+    int         max_flows;
+    atomic_t    flows;
+
+    struct pcap_flow_slot_t slots[PCAP_FLOW_SLOTS];
+
+    /** Full batches waiting for the writer, empty ones */
+    rt_mutex    lock;
+    rt_cond     cond;
+    struct list_head ready, free;
+};
+
+static struct rt_ethxx_pcap_recorder rte_recorder = {
+    .file_size = 64 << 20,
+    .file_time = 60,
+    .max_flows = 1024,
+    .flows = ATOMIC_INIT(0),
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .ready = LIST_HEAD_INIT(rte_recorder.ready),
+    .free = LIST_HEAD_INIT(rte_recorder.free),
+};
 
 static __rt_always_inline__ void __attribute__((__unused__))
 rt_ethxx_pcap_filehdr(struct pcap_file_header *filehdr,
@@ -58,31 +134,314 @@ rt_ethxx_pkthdr_convert(const struct pcap_pkthdr *hdr,
     sf_hdr->len            =   hdr->len;
 }
 
-int rt_ethxx_pcap_flush(const char *fname, void *_pkthdr,
+static __rt_always_inline__ struct pcap_flow_slot_t *
+pcap_flow_slot(struct rt_ethxx_pcap_recorder *rec, uint32_t hval)
+{
+    return &rec->slots[hval & (PCAP_FLOW_SLOTS - 1)];
+}
+
+/** Slot locked. */
+static __rt_always_inline__ struct pcap_flow_t *
+pcap_flow_get(struct rt_ethxx_pcap_recorder *rec,
+                        struct pcap_flow_slot_t *slot,
+                        const char *key, uint32_t hval)
+{
+    struct pcap_flow_t *f;
+    struct hlist_node *pos;
+
+    hlist_for_each_entry(f, pos, &slot->head, hlist){
+        if (f->hval == hval && !STRCMP(f->key, key))
+            return f;
+    }
+
+    /** Every cached flow holds a file open */
+    if (atomic_read(&rec->flows) >= rec->max_flows)
+        return NULL;
+
+    f = (struct pcap_flow_t *)kmalloc(sizeof(struct pcap_flow_t), MPF_CLR, -1);
+    if (unlikely(!f))
+        return NULL;
+
+    SNPRINTF(f->key, PCAP_FLOW_KEY - 1, "%s", key);
+    f->hval = hval;
+    hlist_add_head(&f->hlist, &slot->head);
+    atomic_inc(&rec->flows);
+
+    return f;
+}
+
+/** Slot locked, hand the flow's batch to the writer. */
+static __rt_always_inline__ void
+pcap_flow_ready(struct rt_ethxx_pcap_recorder *rec,
+                        struct pcap_flow_t *f)
+{
+    rt_mutex_lock(&rec->lock);
+    list_add_tail(&f->cur->list, &rec->ready);
+    rt_cond_signal(&rec->cond);
+    rt_mutex_unlock(&rec->lock);
+
+    f->cur = NULL;
+    f->queued ++;
+}
+
+int rt_ethxx_pcap_flush(const char *flow, void *_pkthdr,
                         void *val, size_t __attribute__((__unused__))s)
 {
-    FILE *fp;
-    struct pcap_sf_pkthdr sf_hdr;
+    struct rt_ethxx_pcap_recorder *rec = &rte_recorder;
     struct pcap_pkthdr *pkthdr = (struct pcap_pkthdr *)_pkthdr;
-    
-    fp = fopen(fname, "a+");
-    if (likely (fp)) {
-        rt_ethxx_pkthdr_convert(pkthdr, &sf_hdr);
-        /* XXX we should check the return status */
-        (void)fwrite((void *)&pcap_filehdr, sizeof(pcap_filehdr), 1, fp);
-        (void)fwrite((void *)&sf_hdr, sizeof(struct pcap_sf_pkthdr), 1, fp);
-        (void)fwrite((void *)val, pkthdr->caplen, 1, fp);
-        fclose(fp);
-        DISPATCH_WR_ADD(1);
-        
-        return XSUCCESS;
+    struct pcap_sf_pkthdr sf_hdr;
+    struct pcap_flow_slot_t *slot;
+    struct pcap_flow_t *f;
+    struct pcap_batch_t *b;
+    size_t need = sizeof(struct pcap_sf_pkthdr) + pkthdr->caplen;
+    uint32_t hval;
+
+    if (unlikely(need > PCAP_BATCH_SIZE))
+        goto drop;
+
+    rt_ethxx_pkthdr_convert(pkthdr, &sf_hdr);
+    hval = hash_data((void *)flow, strlen(flow));
+    slot = pcap_flow_slot(rec, hval);
+
+    /** Only packets of flows sharing the slot wait for each other */
+    rt_mutex_lock(&slot->lock);
+    f = pcap_flow_get(rec, slot, flow, hval);
+    if (unlikely(!f))
+        goto unlock_drop;
+
+    b = f->cur;
+    if (b && b->len + need > PCAP_BATCH_SIZE) {
+        pcap_flow_ready(rec, f);
+        b = NULL;
     }
-    
-    rt_log_error(ERRNO_PCAP_ERROR, "%s", strerror(errno));
-    
+    if (!b) {
+        /** The writer is behind, never wait for it here */
+        rt_mutex_lock(&rec->lock);
+        if (!list_empty(&rec->free)) {
+            b = list_first_entry(&rec->free, struct pcap_batch_t, list);
+            list_del(&b->list);
+        }
+        rt_mutex_unlock(&rec->lock);
+        if (unlikely(!b))
+            goto unlock_drop;
+
+        b->len = 0;
+        b->records = 0;
+        b->born = rt_time_ms();
+        b->flow = f;
+        f->cur = b;
+    }
+    memcpy(b->data + b->len, &sf_hdr, sizeof(sf_hdr));
+    memcpy(b->data + b->len + sizeof(sf_hdr), val, pkthdr->caplen);
+    b->len += need;
+    b->records ++;
+    rt_mutex_unlock(&slot->lock);
+
+    return XSUCCESS;
+
+unlock_drop:
+    rt_mutex_unlock(&slot->lock);
+drop:
+    RECORDER_DROP_ADD(1);
+    return -1;
+}
+
+/** Close the flow's file and hand it to the reporter, writer task only. */
+static void rt_ethxx_pcap_rotate(struct pcap_flow_t *f)
+{
+    if (!f->fp)
+        return;
+
+    if (fclose(f->fp))
+        rt_log_error(ERRNO_PCAP_ERROR, "%s, %s", strerror(errno), f->file);
+    f->fp = NULL;
+
+    RECORDER_FILE_ADD(1);
+    report_lineup(NULL, 0, f->file, strlen(f->file));
+}
+
+/** A new file of the flow with its global header, writer task only. */
+static int rt_ethxx_pcap_open(struct rt_ethxx_pcap_recorder *rec,
+                        struct pcap_flow_t *f)
+{
+    struct tm tms;
+
+    f->opened = time(NULL);
+    localtime_r(&f->opened, &tms);
+    SNPRINTF(f->file, FNAME_LENGTH - 1, "%s/%s_%02d.%02d.%04d-%02d:%02d:%02d_%lu.pcap",
+                rec->warehouse, f->key, tms.tm_mon + 1, tms.tm_mday, tms.tm_year + 1900,
+                tms.tm_hour, tms.tm_min, tms.tm_sec, f->seq ++);
+
+    f->fp = fopen(f->file, "w");
+    if (unlikely(!f->fp)) {
+        rt_log_error(ERRNO_PCAP_ERROR, "%s, %s", strerror(errno), f->file);
+        return -1;
+    }
+    /** Batches are written whole, stdio would only copy them */
+    setvbuf(f->fp, NULL, _IONBF, 0);
+
+    (void)fwrite((void *)&pcap_filehdr, sizeof(pcap_filehdr), 1, f->fp);
+    f->written = sizeof(pcap_filehdr);
+
     return 0;
 }
 
+static void rt_ethxx_pcap_write(struct rt_ethxx_pcap_recorder *rec,
+                        struct pcap_batch_t *b)
+{
+    struct pcap_flow_t *f = b->flow;
+
+    if (!f->fp && rt_ethxx_pcap_open(rec, f) < 0) {
+        RECORDER_DROP_ADD(b->records);
+        return;
+    }
+
+    if (fwrite(b->data, b->len, 1, f->fp) != 1) {
+        rt_log_error(ERRNO_PCAP_ERROR, "%s, %s", strerror(errno), f->file);
+        RECORDER_DROP_ADD(b->records);
+        return;
+    }
+
+    f->written += b->len;
+    DISPATCH_WR_ADD(b->records);
+
+    if (f->written >= rec->file_size)
+        rt_ethxx_pcap_rotate(f);
+}
+
+/**
+* Writer task: push lingering batches, close files which are due, and drop
+* flows from the cache once their file is closed and nothing is queued.
+*/
+static void rt_ethxx_pcap_sweep(struct rt_ethxx_pcap_recorder *rec)
+{
+    struct pcap_flow_slot_t *slot;
+    struct pcap_flow_t *f;
+    struct hlist_node *pos, *n;
+    uint64_t now = rt_time_ms();
+    time_t sec = time(NULL);
+    int i;
+
+    for (i = 0; i < PCAP_FLOW_SLOTS; i ++) {
+        slot = &rec->slots[i];
+        if (hlist_empty(&slot->head))
+            continue;
+
+        rt_mutex_lock(&slot->lock);
+        hlist_for_each_entry_safe(f, pos, n, &slot->head, hlist){
+            /** Quiet flows still reach the disk */
+            if (f->cur && now - f->cur->born >= PCAP_BATCH_LINGER)
+                pcap_flow_ready(rec, f);
+
+            if (f->fp && sec - f->opened >= rec->file_time)
+                rt_ethxx_pcap_rotate(f);
+
+            if (!f->fp && !f->cur && !f->queued) {
+                hlist_del(&f->hlist);
+                atomic_dec(&rec->flows);
+                kfree(f);
+            }
+        }
+        rt_mutex_unlock(&slot->lock);
+    }
+}
+
+static void *
+rt_ethxx_pcap_recorder(void __attribute__((__unused__))*argvs)
+{
+    struct rt_ethxx_pcap_recorder *rec = &rte_recorder;
+    struct pcap_flow_slot_t *slot;
+    struct pcap_batch_t *b;
+    struct timespec ts;
+    uint64_t swept = rt_time_ms();
+
+    FOREVER {
+        rt_mutex_lock(&rec->lock);
+        if (list_empty(&rec->ready)) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            rt_cond_timedwait(&rec->cond, &rec->lock, &ts);
+        }
+        b = NULL;
+        if (!list_empty(&rec->ready)) {
+            b = list_first_entry(&rec->ready, struct pcap_batch_t, list);
+            list_del(&b->list);
+        }
+        rt_mutex_unlock(&rec->lock);
+
+        if (b) {
+            rt_ethxx_pcap_write(rec, b);
+
+            slot = pcap_flow_slot(rec, b->flow->hval);
+            rt_mutex_lock(&slot->lock);
+            b->flow->queued --;
+            rt_mutex_unlock(&slot->lock);
+
+            rt_mutex_lock(&rec->lock);
+            list_add_tail(&b->list, &rec->free);
+            rt_mutex_unlock(&rec->lock);
+        }
+
+        if (rt_time_ms() - swept >= PCAP_BATCH_LINGER) {
+            rt_ethxx_pcap_sweep(rec);
+            swept = rt_time_ms();
+        }
+    }
+
+    task_deregistry_id(pthread_self());
+    return NULL;
+}
+
+static struct rt_task_t rt_ethxx_pcap_recorder_task = {
+    .module = THIS,
+    .name = "The Pcap Recorder Task",
+    .core = INVALID_CORE,
+    .prio = KERNEL_SCHED,
+    .argvs = NULL,
+    .routine = rt_ethxx_pcap_recorder,
+    .recycle = FORBIDDEN,
+};
+
+void rt_ethxx_pcap_recorder_init(const char *warehouse,
+                        int batches, int flows, int64_t file_size, int file_time)
+{
+    struct rt_ethxx_pcap_recorder *rec = &rte_recorder;
+    struct pcap_batch_t *b;
+    int i;
+
+    SNPRINTF(rec->warehouse, sizeof(rec->warehouse) - 1, "%s", warehouse);
+    if (batches <= 0)
+        batches = 256;
+    if (flows > 0)
+        rec->max_flows = flows;
+    if (file_size > 0)
+        rec->file_size = file_size;
+    if (file_time > 0)
+        rec->file_time = file_time;
+
+    for (i = 0; i < PCAP_FLOW_SLOTS; i ++) {
+        rt_mutex_init(&rec->slots[i].lock, NULL);
+        INIT_HLIST_HEAD(&rec->slots[i].head);
+    }
+
+    for (i = 0; i < batches; i ++) {
+        b = (struct pcap_batch_t *)kmalloc(sizeof(struct pcap_batch_t), MPF_NOFLGS, -1);
+        if (unlikely(!b))
+            break;
+        list_add_tail(&b->list, &rec->free);
+    }
+
+    rt_log_notice("Pcap recorder: %d batches of %d KB, up to %d flows, files of %ld MB or %d s in %s",
+                i, PCAP_BATCH_SIZE >> 10, rec->max_flows, rec->file_size >> 20, rec->file_time, rec->warehouse);
+
+    task_registry(&rt_ethxx_pcap_recorder_task);
+}
+
+int rt_ethxx_pcap_recorder_flows()
+{
+    return atomic_read(&rte_recorder.flows);
+}
+
 void rt_ethxx_pcap_del_disk(const char *file,
                         int __attribute__((__unused__))flags)
 {
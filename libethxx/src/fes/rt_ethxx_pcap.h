@@ -50,6 +50,8 @@ struct rt_ethxx_pcap_writer{
     atomic64_t dispatcher_eq, dispatcher_dq;
     atomic64_t dispatcher_wr;
     atomic64_t reporter_eq, reporter_dq;
+    /** Records the recorder had no room for, files it closed */
+    atomic64_t recorder_drop, recorder_files;
     
 };
 
@@ -61,10 +63,35 @@ extern struct pcap_file_header pcap_filehdr;
 #define DISPATCH_DQ_ADD(n)  atomic64_add(&rte_writer.dispatcher_dq, n);
 #define REPORTER_EQ_ADD(n)  atomic64_add(&rte_writer.reporter_eq, n);
 #define REPORTER_DQ_ADD(n)  atomic64_add(&rte_writer.reporter_dq, n);
+#define RECORDER_DROP_ADD(n)  atomic64_add(&rte_writer.recorder_drop, n);
+#define RECORDER_FILE_ADD(n)  atomic64_add(&rte_writer.recorder_files, n);
 
-extern int rt_ethxx_pcap_flush(const char *fname, void *_pkthdr,
+/**
+ * @function rt_ethxx_pcap_flush
+ * @brief Queue one packet to the file of its flow, it is written later in a batch.
+ * @param flow      Flow key, the prefix of the flow's pcap file names.
+ * @param _pkthdr   struct pcap_pkthdr of the packet.
+ * @param val       caplen bytes of the packet.
+ * @return XSUCCESS, or -1 when the packet is dropped (no free batch, or the
+ *         flow cache is full).
+ */
+extern int rt_ethxx_pcap_flush(const char *flow, void *_pkthdr,
                         void *val, size_t __attribute__((__unused__))s);
 
+/**
+ * @function rt_ethxx_pcap_recorder_init
+ * @brief Start the task appending queued packets to per-flow pcap files in warehouse.
+ * @param batches   Batch buffers shared by all flows, packets are dropped once all are in use.
+ * @param flows     Flows (open files) kept in the cache at most.
+ * @param file_size A file is closed and reported at this many bytes ...
+ * @param file_time ... or this many seconds after it was opened.
+ */
+extern void rt_ethxx_pcap_recorder_init(const char *warehouse,
+                        int batches, int flows, int64_t file_size, int file_time);
+
+/** Flows currently in the recorder's cache */
+extern int rt_ethxx_pcap_recorder_flows();
+
 extern void rt_ethxx_pcap_del_disk(const char *file,
                         int __attribute__((__unused__))flags);
 
@@ -264,7 +264,7 @@ static void *__session_alloc()
 	memset64(p, 0, sizeof(struct call_session_t));
 	rt_mutex_init(&p->lock, NULL);
 	
-	p->stream[0].data = kmalloc((VOICE_LEN * 8 * stage_time[2]), MPF_CLR, -1);
+	p->stream[0].data = kmalloc((VOICE_LEN * 8 * stage_time[2]), MPF_NOFLGS, -1);
 	if (unlikely(!p->stream[0].data)) {
 		kfree(p);
 		p = NULL;
@@ -272,7 +272,7 @@ static void *__session_alloc()
 	}
 	memset64(p->stream[0].data, 0, (VOICE_LEN * 8 * stage_time[2]));
 	
-	p->stream[1].data = kmalloc((VOICE_LEN * 8 * stage_time[2]), MPF_CLR, -1);
+	p->stream[1].data = kmalloc((VOICE_LEN * 8 * stage_time[2]), MPF_NOFLGS, -1);
 	if (unlikely(!p->stream[1].data)) {
 		kfree(p->stream[0].data);
 		kfree(p);
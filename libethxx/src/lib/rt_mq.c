@@ -12,6 +12,8 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <sched.h>
+#include <time.h>
 
 #include "rt_common.h"
 #include "rt_sync.h"
@@ -47,11 +49,51 @@ struct rt_fifo_scb {
 	struct hlist_node hlist;
 } ;
 
+#define RT_FIFO_CACHELINE	64
+#define RT_FIFO_SPINS		1024
+#define RT_FIFO_YIELDS		16
+
+/** One slot of a bounded ring (Vyukov MPMC). */
+struct rt_fifo_cell {
+	volatile uint64_t seq;
+	message data;
+	int s;
+};
+
+/**
+* Bounded, preallocated MPMC ring.
+* Producers and consumers claim slots with a CAS on their own cursor,
+* a consumer only takes the mutex when it has to sleep.
+*/
+struct rt_fifo_ring {
+
+	uint64_t mask;
+
+	struct rt_fifo_cell *cells;
+
+	volatile uint64_t enq __attribute__((aligned(RT_FIFO_CACHELINE)));
+
+	volatile uint64_t deq __attribute__((aligned(RT_FIFO_CACHELINE)));
+
+	/** Consumers sleeping on cond, protected by mtx */
+	volatile int waiters __attribute__((aligned(RT_FIFO_CACHELINE)));
+	rt_mutex mtx;
+	rt_cond cond;
+
+	/** rejected by a full ring */
+	atomic64_t full;
+	/** consumer went to sleep */
+	atomic64_t sleeps;
+};
+
 struct rt_fifo_block {
 
 	/** Name of the queue */
 	char *desc;
 
+	/** NULL for the unbounded list queue */
+	struct rt_fifo_ring *ring;
+
 	rt_mutex fb_lock;
 	
 	/** */
@@ -181,12 +223,39 @@ rt_fifo_wakeup (struct rt_fifo_scb *scb)
 	rt_mutex_unlock(&scb->mtx);
 }
 
+/** n messages were queued at once */
+static __rt_always_inline__ void
+rt_fifo_wakeup_n (struct rt_fifo_scb *scb, int n)
+{
+	rt_mutex_lock(&scb->mtx);
+
+	scb->data_blk_factor += n;
+	if (n > 1)
+		rt_cond_broadcast(&scb->cond);
+	else
+		rt_cond_signal(&scb->cond);
+
+	rt_mutex_unlock(&scb->mtx);
+}
+
+/** n more messages were taken on a single wakeup, drop their counts too */
+static __rt_always_inline__ void
+rt_fifo_consume_n (struct rt_fifo_scb *scb, int n)
+{
+	rt_mutex_lock(&scb->mtx);
+
+	/** A count may not be posted yet for a message already taken */
+	scb->data_blk_factor -= MIN (n, scb->data_blk_factor);
+
+	rt_mutex_unlock(&scb->mtx);
+}
+
 static __rt_always_inline__ void
 rt_fifo_stupor (struct rt_fifo_scb *scb)
 {
 	rt_mutex_lock(&scb->mtx);
 	
-	if (scb->data_blk_factor == 0)
+	while (scb->data_blk_factor == 0)
 		rt_cond_wait(&scb->cond, &scb->mtx);
 
 	if (scb->data_blk_factor >= 1)
@@ -216,6 +285,171 @@ db_release (struct rt_fifo_data_block *db)
 	kfree (db);
 }
 
+static __rt_always_inline__ void
+rt_fifo_cpu_relax (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__ ("pause" ::: "memory");
+#else
+	__asm__ __volatile__ ("" ::: "memory");
+#endif
+}
+
+static struct rt_fifo_ring *
+rt_fifo_ring_alloc (int capacity)
+{
+	struct rt_fifo_ring *ring;
+	uint64_t size = 1, i;
+
+	while ((int64_t)size < capacity)
+		size <<= 1;
+
+	if (posix_memalign ((void **)&ring, RT_FIFO_CACHELINE, sizeof (struct rt_fifo_ring)))
+		return NULL;
+	memset (ring, 0, sizeof (struct rt_fifo_ring));
+
+	ring->cells = (struct rt_fifo_cell *)kmalloc (sizeof (struct rt_fifo_cell) * size, MPF_CLR, -1);
+	if (unlikely (!ring->cells)) {
+		free (ring);
+		return NULL;
+	}
+
+	for (i = 0; i < size; i ++)
+		ring->cells[i].seq = i;
+
+	ring->mask = size - 1;
+	rt_mutex_init (&ring->mtx, NULL);
+	rt_cond_init (&ring->cond, NULL);
+
+	return ring;
+}
+
+static __rt_always_inline__ int
+rt_fifo_ring_enqueue (struct rt_fifo_ring *ring, message msg, int s)
+{
+	struct rt_fifo_cell *cell;
+	uint64_t pos, seq;
+	int64_t dif;
+
+	pos = __atomic_load_n (&ring->enq, __ATOMIC_RELAXED);
+	FOREVER {
+		cell = &ring->cells[pos & ring->mask];
+		seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int64_t)seq - (int64_t)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n (&ring->enq, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n (&ring->enq, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->data = msg;
+	cell->s = s;
+	__atomic_store_n (&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static __rt_always_inline__ int
+rt_fifo_ring_dequeue (struct rt_fifo_ring *ring, message *msg, int *s)
+{
+	struct rt_fifo_cell *cell;
+	uint64_t pos, seq;
+	int64_t dif;
+
+	pos = __atomic_load_n (&ring->deq, __ATOMIC_RELAXED);
+	FOREVER {
+		cell = &ring->cells[pos & ring->mask];
+		seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int64_t)seq - (int64_t)(pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n (&ring->deq, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n (&ring->deq, __ATOMIC_RELAXED);
+		}
+	}
+
+	*msg = cell->data;
+	*s = cell->s;
+	__atomic_store_n (&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static __rt_always_inline__ int
+rt_fifo_ring_empty (struct rt_fifo_ring *ring)
+{
+	uint64_t pos = __atomic_load_n (&ring->deq, __ATOMIC_RELAXED);
+
+	return __atomic_load_n (&ring->cells[pos & ring->mask].seq,
+			__ATOMIC_ACQUIRE) != pos + 1;
+}
+
+/** Called by producers after publishing, wakes a sleeping consumer if any. */
+static __rt_always_inline__ void
+rt_fifo_ring_wakeup (struct rt_fifo_ring *ring, int n)
+{
+	__sync_synchronize ();
+	if (likely (!ring->waiters))
+		return;
+
+	rt_mutex_lock (&ring->mtx);
+	if (n > 1)
+		rt_cond_broadcast (&ring->cond);
+	else
+		rt_cond_signal (&ring->cond);
+	rt_mutex_unlock (&ring->mtx);
+}
+
+/** Adaptive wait: spin, then yield, then sleep until a producer wakes us. */
+static void
+rt_fifo_ring_stupor (struct rt_fifo_ring *ring)
+{
+	int i;
+
+	for (i = 0; i < RT_FIFO_SPINS; i ++) {
+		if (!rt_fifo_ring_empty (ring))
+			return;
+		rt_fifo_cpu_relax ();
+	}
+
+	for (i = 0; i < RT_FIFO_YIELDS; i ++) {
+		if (!rt_fifo_ring_empty (ring))
+			return;
+		sched_yield ();
+	}
+
+	rt_mutex_lock (&ring->mtx);
+	ring->waiters ++;
+	__sync_synchronize ();
+	if (rt_fifo_ring_empty (ring)) {
+		atomic64_inc (&ring->sleeps);
+		rt_cond_wait (&ring->cond, &ring->mtx);
+	}
+	ring->waiters --;
+	rt_mutex_unlock (&ring->mtx);
+}
+
+static __rt_always_inline__ struct rt_fifo_block *
+rt_fifo_lookup (MQ_ID qid)
+{
+	int idx = qid - 1;
+
+	/* If current queue is reaching to maxinum */
+	if (rt_mq_chk_id (idx) < 0)
+		return NULL;
+
+	return &FIFOs.fifos[idx];
+}
+
 mq_errno rt_fifo_push (MQ_ID qid, message msg, int s)
 {
 	struct rt_fifo_block *fb= NULL;
@@ -236,6 +470,17 @@ mq_errno rt_fifo_push (MQ_ID qid, message msg, int s)
 
 	fb = &fcb->fifos[idx];
 
+	if (fb->ring) {
+		if (unlikely (rt_fifo_ring_enqueue (fb->ring, msg, s) < 0)) {
+			atomic64_inc (&fb->ring->full);
+			xerror = MQ_FAILURE;
+			goto finish;
+		}
+		rt_fifo_ring_wakeup (fb->ring, 1);
+		xerror = MQ_SUCCESS;
+		goto finish;
+	}
+
 	db = db_new (msg, s);
 	if (likely (db)) {
 		rt_mutex_lock (&fb->fb_lock);
@@ -271,13 +516,25 @@ mq_errno rt_fifo_pop (MQ_ID qid, message *msg, int *s)
 
 	fb = &fcb->fifos[idx];
 
+	if (fb->ring) {
+		while (rt_fifo_ring_dequeue (fb->ring, msg, s) < 0)
+			rt_fifo_ring_stupor (fb->ring);
+		xerror = MQ_SUCCESS;
+		goto finish;
+	}
+
 	rt_fifo_stupor (fb->scb);
 
+	pos = NULL;
 	rt_mutex_lock (&fb->fb_lock);
 	list_for_each_entry_safe (pos, n, &fb->head, list) {
 		list_del (&pos->list);
 		break;
 	}
+	if (&pos->list == &fb->head)
+		pos = NULL;
+	if (pos)
+		fb->data_blks --;
 	rt_mutex_unlock (&fb->fb_lock);
 
 	if (!pos)
@@ -293,7 +550,110 @@ finish:
 	return xerror;
 }
 
-MQ_ID rt_fifo_create (const char *desc)
+/**
+* Push up to n messages, returns how many were queued.
+* The caller still owns msgs[ret..n-1].
+*/
+int rt_fifo_push_batch (MQ_ID qid, message *msgs, int *s, int n)
+{
+	struct rt_fifo_block *fb;
+	struct rt_fifo_data_block *db;
+	LIST_HEAD (batch);
+	int i;
+
+	if (unlikely (!msgs || !s || n <= 0))
+		return 0;
+
+	fb = rt_fifo_lookup (qid);
+	if (unlikely (!fb))
+		return 0;
+
+	if (fb->ring) {
+		for (i = 0; i < n; i ++) {
+			if (unlikely (rt_fifo_ring_enqueue (fb->ring, msgs[i], s[i]) < 0)) {
+				atomic64_add (&fb->ring->full, n - i);
+				break;
+			}
+		}
+		if (likely (i))
+			rt_fifo_ring_wakeup (fb->ring, i);
+		return i;
+	}
+
+	/** Blocks are allocated outside the lock, then linked in one go */
+	for (i = 0; i < n; i ++) {
+		db = db_new (msgs[i], s[i]);
+		if (unlikely (!db))
+			break;
+		list_add_tail (&db->list, &batch);
+	}
+
+	if (likely (i)) {
+		rt_mutex_lock (&fb->fb_lock);
+		list_splice_tail (&batch, &fb->head);
+		fb->data_blks += i;
+		rt_mutex_unlock (&fb->fb_lock);
+		rt_fifo_wakeup_n (fb->scb, i);
+	}
+
+	return i;
+}
+
+/**
+* Wait for at least one message and return up to n of them.
+*/
+int rt_fifo_pop_batch (MQ_ID qid, message *msgs, int *s, int n)
+{
+	struct rt_fifo_block *fb;
+	struct rt_fifo_data_block *pos, *next;
+	LIST_HEAD (batch);
+	int i = 0;
+
+	if (unlikely (!msgs || !s || n <= 0))
+		return 0;
+
+	fb = rt_fifo_lookup (qid);
+	if (unlikely (!fb))
+		return 0;
+
+	if (fb->ring) {
+		while (rt_fifo_ring_dequeue (fb->ring, &msgs[0], &s[0]) < 0)
+			rt_fifo_ring_stupor (fb->ring);
+		for (i = 1; i < n; i ++) {
+			if (rt_fifo_ring_dequeue (fb->ring, &msgs[i], &s[i]) < 0)
+				break;
+		}
+		return i;
+	}
+
+	rt_fifo_stupor (fb->scb);
+
+	/** Up to n blocks under one lock */
+	rt_mutex_lock (&fb->fb_lock);
+	list_for_each_entry_safe (pos, next, &fb->head, list) {
+		if (i == n)
+			break;
+		list_move_tail (&pos->list, &batch);
+		i ++;
+	}
+	fb->data_blks -= i;
+	rt_mutex_unlock (&fb->fb_lock);
+
+	if (i > 1)
+		rt_fifo_consume_n (fb->scb, i - 1);
+
+	i = 0;
+	list_for_each_entry_safe (pos, next, &batch, list) {
+		msgs[i] = pos->data;
+		s[i] = pos->s;
+		i ++;
+		db_release (pos);
+	}
+
+	return i;
+}
+
+static MQ_ID __rt_fifo_create (const char *desc, int capacity)
 {
 	struct rt_fifo_block *fb= NULL;
 	struct rt_fifo_ctrl_block *fcb = &FIFOs;
@@ -328,6 +688,15 @@ MQ_ID rt_fifo_create (const char *desc)
 	    goto finish;
 	}
 
+	if (capacity > 0) {
+		fb->ring = rt_fifo_ring_alloc (capacity);
+		if (unlikely (!fb->ring)) {
+			rt_log_error (ERRNO_MQ_NO_MEMORY,
+				"%s (capacity=%d)", desc, capacity);
+			goto finish;
+		}
+	}
+
 	id = fb->unique_id;
 	fcb->fifo_cursor ++;
 	
@@ -336,6 +705,24 @@ finish:
 	return id;
 }
 
+MQ_ID rt_fifo_create (const char *desc)
+{
+	return __rt_fifo_create (desc, 0);
+}
+
+/**
+* A queue of at most capacity (rounded up to a power of 2) messages,
+* all slots are allocated here. rt_fifo_push fails with MQ_FAILURE
+* when it is full.
+*/
+MQ_ID rt_fifo_create_bounded (const char *desc, int capacity)
+{
+	if (unlikely (capacity <= 0))
+		return MQ_ID_INVALID;
+
+	return __rt_fifo_create (desc, capacity);
+}
+
 int rt_fifo_destroy (MQ_ID qid)
 {
 	struct rt_fifo_block *fb= NULL;
@@ -359,6 +746,113 @@ finish:
 	return xerror;
 }
 
+struct rt_fifo_bench_arg {
+	MQ_ID id;
+	long msgs;
+	int batch;
+};
+
+static void *rt_fifo_bench_producer (void *param)
+{
+	struct rt_fifo_bench_arg *arg = (struct rt_fifo_bench_arg *)param;
+	message msgs[32];
+	int s[32];
+	long i;
+	int n, k, r;
+
+	for (i = 0; i < arg->msgs; i += n) {
+		n = MIN (arg->batch, arg->msgs - i);
+		for (k = 0; k < n; k ++) {
+			msgs[k] = (message)(i + k + 1);
+			s[k] = sizeof (long);
+		}
+		for (k = 0; k < n; ) {
+			r = rt_fifo_push_batch (arg->id, &msgs[k], &s[k], n - k);
+			if (!r)
+				sched_yield ();
+			k += r;
+		}
+	}
+
+	return NULL;
+}
+
+static void *rt_fifo_bench_consumer (void *param)
+{
+	struct rt_fifo_bench_arg *arg = (struct rt_fifo_bench_arg *)param;
+	message msgs[32];
+	int s[32];
+	long i;
+
+	for (i = 0; i < arg->msgs; )
+		i += rt_fifo_pop_batch (arg->id, msgs, s, MIN (arg->batch, arg->msgs - i));
+
+	return NULL;
+}
+
+static double rt_fifo_bench_run (MQ_ID id, int producers, int consumers,
+				long msgs, int batch)
+{
+	pthread_t tid[64];
+	struct rt_fifo_bench_arg parg, carg;
+	struct timespec t0, t1;
+	int i;
+
+	parg.id = carg.id = id;
+	parg.batch = carg.batch = batch;
+	parg.msgs = msgs / producers;
+	carg.msgs = parg.msgs * producers / consumers;
+
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < consumers; i ++)
+		pthread_create (&tid[i], NULL, rt_fifo_bench_consumer, &carg);
+	for (i = 0; i < producers; i ++)
+		pthread_create (&tid[consumers + i], NULL, rt_fifo_bench_producer, &parg);
+	for (i = 0; i < consumers + producers; i ++)
+		pthread_join (tid[i], NULL);
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+
+	return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/**
+* Microbenchmark: list queue vs bounded ring, single and batched.
+* producers * consumers must divide msgs evenly, at most 32 threads each.
+*/
+void rt_fifo_bench (int producers, int consumers, long msgs)
+{
+	struct rt_fifo_block *fb;
+	MQ_ID id;
+	double t;
+
+	producers = MIN (MAX (producers, 1), 32);
+	consumers = MIN (MAX (consumers, 1), 32);
+	msgs -= msgs % ((long)producers * consumers);
+
+	printf ("\r\nMQ bench: %d producer(s), %d consumer(s), %ld messages\n",
+		producers, consumers, msgs);
+
+	id = rt_fifo_create ("MQ Bench List");
+	t = rt_fifo_bench_run (id, producers, consumers, msgs, 1);
+	printf ("\t%-24s%12.0f msg/s\n", "list", msgs / t);
+
+	id = rt_fifo_create ("MQ Bench List Batch");
+	t = rt_fifo_bench_run (id, producers, consumers, msgs, 32);
+	printf ("\t%-24s%12.0f msg/s\n", "list, batch 32", msgs / t);
+
+	id = rt_fifo_create_bounded ("MQ Bench Ring", 4096);
+	t = rt_fifo_bench_run (id, producers, consumers, msgs, 1);
+	fb = rt_fifo_lookup (id);
+	printf ("\t%-24s%12.0f msg/s (full=%ld, sleeps=%ld)\n", "ring",
+		msgs / t, atomic64_add (&fb->ring->full, 0), atomic64_add (&fb->ring->sleeps, 0));
+
+	id = rt_fifo_create_bounded ("MQ Bench Ring Batch", 4096);
+	t = rt_fifo_bench_run (id, producers, consumers, msgs, 32);
+	fb = rt_fifo_lookup (id);
+	printf ("\t%-24s%12.0f msg/s (full=%ld, sleeps=%ld)\n", "ring, batch 32",
+		msgs / t, atomic64_add (&fb->ring->full, 0), atomic64_add (&fb->ring->sleeps, 0));
+}
+
 #if 0
 struct fifo_test {
 	MQ_ID id;
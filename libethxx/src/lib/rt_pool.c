@@ -80,15 +80,11 @@ finish:
     return bucket;
 }
 
-void rt_pool_bucket_push (struct rt_pool_t *pool,
+/** Must be called with the pool locked. */
+static __rt_always_inline__ void
+__rt_pool_bucket_push (struct rt_pool_t *pool,
                         struct rt_pool_bucket_t *bucket)
 {
-#ifdef DEBUG
-    BUG_ON(pool == NULL || bucket == NULL);
-#endif
-
-    QLOCK_LOCK(pool);
-
     if (pool->top != NULL) {
         bucket->next = pool->top;
         pool->top->prev = bucket;
@@ -102,19 +98,15 @@ void rt_pool_bucket_push (struct rt_pool_t *pool,
     if (pool->len > pool->dbg_maxlen)
         pool->dbg_maxlen = pool->len;
 #endif /* DBG_PERF */
-    QLOCK_UNLOCK(pool);
 }
 
-struct rt_pool_bucket_t *
-rt_pool_bucket_get (struct rt_pool_t *pool)
+/** Must be called with the pool locked. */
+static __rt_always_inline__ struct rt_pool_bucket_t *
+__rt_pool_bucket_get (struct rt_pool_t *pool)
 {
-    QLOCK_LOCK(pool);
-
     struct rt_pool_bucket_t *bucket = pool->bot;
-    if (unlikely(!bucket)) {
-        QLOCK_UNLOCK(pool);
+    if (unlikely(!bucket))
         return NULL;
-    }
 
     if (pool->bot->prev != NULL) {
         pool->bot = pool->bot->prev;
@@ -133,7 +125,111 @@ rt_pool_bucket_get (struct rt_pool_t *pool)
     bucket->next = NULL;
     bucket->prev = NULL;
 
+    return bucket;
+}
+
+/** Thread exit, hand the cached buckets back to the shared list. */
+static void
+rt_pool_magazine_release (void *arg)
+{
+    struct rt_pool_magazine_t *mag = (struct rt_pool_magazine_t *)arg;
+    struct rt_pool_t *pool = (struct rt_pool_t *)mag->pool;
+
+    QLOCK_LOCK(pool);
+    while (mag->n > 0)
+        __rt_pool_bucket_push(pool, mag->rounds[-- mag->n]);
+    pool->retired.hits += mag->hits;
+    pool->retired.misses += mag->misses;
+    pool->retired.spills += mag->spills;
+    list_del(&mag->list);
+    QLOCK_UNLOCK(pool);
+
+    kfree(mag);
+}
+
+static __rt_always_inline__ struct rt_pool_magazine_t *
+rt_pool_magazine (struct rt_pool_t *pool)
+{
+    struct rt_pool_magazine_t *mag;
+
+    if (!(pool->flags & RT_POOL_F_MAGAZINE))
+        return NULL;
+
+    mag = (struct rt_pool_magazine_t *)pthread_getspecific(pool->mag_key);
+    if (likely(mag))
+        return mag;
+
+    mag = (struct rt_pool_magazine_t *)pool_kmalloc(sizeof(struct rt_pool_magazine_t));
+    if (unlikely(!mag))
+        return NULL;
+
+    mag->pool = pool;
+    INIT_LIST_HEAD(&mag->list);
+    QLOCK_LOCK(pool);
+    list_add_tail(&mag->list, &pool->mag_list);
     QLOCK_UNLOCK(pool);
+    pthread_setspecific(pool->mag_key, mag);
+
+    return mag;
+}
+
+void rt_pool_bucket_push (struct rt_pool_t *pool,
+                        struct rt_pool_bucket_t *bucket)
+{
+    struct rt_pool_magazine_t *mag;
+
+#ifdef DEBUG
+    BUG_ON(pool == NULL || bucket == NULL);
+#endif
+
+    mag = rt_pool_magazine(pool);
+    if (likely(mag)) {
+        if (unlikely(mag->n == RT_POOL_MAG_SIZE)) {
+            /** Full, give half back in one go. */
+            QLOCK_LOCK(pool);
+            while (mag->n > RT_POOL_MAG_SIZE / 2)
+                __rt_pool_bucket_push(pool, mag->rounds[-- mag->n]);
+            QLOCK_UNLOCK(pool);
+            mag->spills ++;
+        }
+        bucket->next = bucket->prev = NULL;
+        mag->rounds[mag->n ++] = bucket;
+        return;
+    }
+
+    QLOCK_LOCK(pool);
+    __rt_pool_bucket_push(pool, bucket);
+    QLOCK_UNLOCK(pool);
+}
+
+struct rt_pool_bucket_t *
+rt_pool_bucket_get (struct rt_pool_t *pool)
+{
+    struct rt_pool_bucket_t *bucket;
+    struct rt_pool_magazine_t *mag;
+
+    mag = rt_pool_magazine(pool);
+    if (likely(mag)) {
+        if (likely(mag->n > 0)) {
+            mag->hits ++;
+            return mag->rounds[-- mag->n];
+        }
+
+        /** Empty, take half a magazine from the shared list in one go. */
+        mag->misses ++;
+        QLOCK_LOCK(pool);
+        while (mag->n < RT_POOL_MAG_SIZE / 2 &&
+                (bucket = __rt_pool_bucket_get(pool)) != NULL)
+            mag->rounds[mag->n ++] = bucket;
+        QLOCK_UNLOCK(pool);
+
+        return mag->n > 0 ? mag->rounds[-- mag->n] : NULL;
+    }
+
+    QLOCK_LOCK(pool);
+    bucket = __rt_pool_bucket_get(pool);
+    QLOCK_UNLOCK(pool);
+
     return bucket;
 }
 
@@ -164,6 +260,7 @@ rt_pool_bucket_get_new(struct rt_pool_t *pool,
 
         bucket = rt_pool_bucket_alloc(pool);
         if (likely(bucket)) {
+            __sync_add_and_fetch(&pool->grows, 1);
             goto finish;
         }
     }
@@ -179,7 +276,7 @@ struct rt_pool_t *
 rt_pool_initialize(int buckets,
     void *(*priv_alloc)(),
     void (*priv_free)(void *),
-    int __attribute__((__unused__))flags)
+    int flags)
 {
     int i = 0;
     struct rt_pool_t *pool;
@@ -194,12 +291,23 @@ rt_pool_initialize(int buckets,
 
     pool->priv_alloc = priv_alloc;
     pool->priv_free = priv_free;
+    pool->flags = flags;
+    INIT_LIST_HEAD(&pool->mag_list);
+
+    if ((pool->flags & RT_POOL_F_MAGAZINE) &&
+            pthread_key_create(&pool->mag_key, rt_pool_magazine_release)) {
+        rt_log_error(ERRNO_MEMBLK_ALLOC,
+                "pthread_key_create: %s", strerror(errno));
+        pool->flags &= ~RT_POOL_F_MAGAZINE;
+    }
 
     for (i = 0; i < buckets; i++) {
         struct rt_pool_bucket_t *b = rt_pool_bucket_alloc(pool);
         if (likely(b)) {
             pool->prealloc_size ++;
-            rt_pool_bucket_push(pool, b);
+            QLOCK_LOCK(pool);
+            __rt_pool_bucket_push(pool, b);
+            QLOCK_UNLOCK(pool);
             continue;
         }
         
@@ -212,11 +320,25 @@ finish:
     return pool;
 }
 
+/**
+* Every thread which ever used the pool must have stopped using it (or exited)
+* before this call, their magazines are freed here.
+*/
 void rt_pool_destroy(struct rt_pool_t *pool)
 {
     struct rt_pool_bucket_t *bucket;
+    struct rt_pool_magazine_t *mag, *p;
 
     if(likely(pool)){
+        if (pool->flags & RT_POOL_F_MAGAZINE) {
+            /** No destructor runs for this key from now on, so the
+                magazines left in the list are ours to reclaim. */
+            pthread_key_delete(pool->mag_key);
+            list_for_each_entry_safe(mag, p, &pool->mag_list, list)
+                rt_pool_magazine_release(mag);
+            pool->flags &= ~RT_POOL_F_MAGAZINE;
+        }
+
         bucket = rt_pool_bucket_get(pool);
         while(likely(bucket)){
             if(pool->priv_free){
@@ -224,16 +346,46 @@ void rt_pool_destroy(struct rt_pool_t *pool)
                     pool->priv_free(bucket->priv_data);
             }
             free(bucket);
+            bucket = rt_pool_bucket_get(pool);
         }
         free(pool);
     }
 }
 
+/** Counters are summed without stopping the owners, they are approximate. */
+void rt_pool_stats(struct rt_pool_t *pool, struct rt_pool_stats_t *stats)
+{
+    struct rt_pool_magazine_t *mag;
+
+    memset(stats, 0, sizeof(struct rt_pool_stats_t));
+    if(unlikely(!pool))
+        return;
+
+    stats->grows = pool->grows;
+    if (pool->flags & RT_POOL_F_MAGAZINE) {
+        QLOCK_LOCK(pool);
+        stats->hits = pool->retired.hits;
+        stats->misses = pool->retired.misses;
+        stats->spills = pool->retired.spills;
+        list_for_each_entry(mag, &pool->mag_list, list) {
+            stats->hits += mag->hits;
+            stats->misses += mag->misses;
+            stats->spills += mag->spills;
+            stats->cached += mag->n;
+            stats->magazines ++;
+        }
+        QLOCK_UNLOCK(pool);
+    }
+}
+
 int
 rt_pool_bucket_number (struct rt_pool_t *pool)
 {
+    struct rt_pool_stats_t stats;
+
     if(likely(pool)){
-	return (int)pool->len;
+        rt_pool_stats(pool, &stats);
+	return (int)pool->len + stats.cached;
     }
 
     return -1;
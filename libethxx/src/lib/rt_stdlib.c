@@ -1,23 +1,84 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include "rt_common.h"
 #include "rt_atomic.h"
 #include "rt_stdlib.h"
 
 static atomic64_t times;
 
+/** Kernel mempolicy modes, kept here to stay off libnuma. */
+#define MPOL_DEFAULT    0
+#define MPOL_PREFERRED  1
+
+#define MP_NODES_MAX    (sizeof(unsigned long) * 8)
+
+/** Node currently preferred by this thread, -1 if kernel default */
+static __thread int mp_node = -1;
+
+/**
+* Prefer node for pages this thread faults in from now on,
+* a negative node goes back to the kernel default policy.
+* Returns the previous preferred node for rt_mempolicy_restore.
+* Hosts without NUMA support quietly keep the default policy.
+*/
+int rt_mempolicy_prefer(int node)
+{
+    int prev = mp_node;
+    unsigned long mask;
+
+    if (node == prev)
+        return prev;
+
+    if (node < 0 || node >= (int)MP_NODES_MAX) {
+        syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+        mp_node = -1;
+        return prev;
+    }
+
+    mask = 1UL << node;
+    /** maxnode counts one past the last bit, the kernel drops the top one */
+    if (!syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, MP_NODES_MAX + 1))
+        mp_node = node;
+
+    return prev;
+}
+
+void rt_mempolicy_restore(int node)
+{
+    rt_mempolicy_prefer(node);
+}
+
+int rt_mempolicy_node()
+{
+    return mp_node;
+}
+
+/**
+* A node >= 0 places the allocation on that node. Policy only
+* applies at fault time, so the block is always touched before
+* the previous policy is restored.
+*/
 void *kmalloc(int s, 
                         int flags, 
-                        int __attribute__((__unused__)) node)
+                        int node)
 {
     void *p;
-    
+    int prev = -1;
+
+    if (node >= 0)
+        prev = rt_mempolicy_prefer(node);
+
     if(likely((p = malloc(s)) != NULL)){
-        if(flags & MPF_CLR)
+        if((flags & MPF_CLR) || node >= 0)
             memset(p, 0, s);
         atomic64_inc(&times);
     }
+
+    if (node >= 0)
+        rt_mempolicy_restore(prev);
     
     return p;
 }
@@ -1,48 +1,233 @@
 #include <stdint.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "rt_string.h"
+
+/**
+* Below RT_MEM_NT_THRESHOLD both primitives go to the platform
+* memcpy/memset, which already pick the widest vector unit at run time.
+* Above it, destination cache lines are written with non-temporal
+* stores, a session buffer or a cloned model list is not read back
+* soon enough to be worth evicting the working set for.
+*/
+#if defined(__SSE2__)
+
+#define MEM_STREAM_ALIGN    16
+#define MEM_STREAM_STEP     64
+
+/** dest aligned to 16, count a multiple of 64 */
+static void memcpy64_stream(void *dest, const void *src, size_t count)
+{
+    __m128i *d = (__m128i *)dest;
+    const __m128i *s = (const __m128i *)src;
+    __m128i x0, x1, x2, x3;
+
+    for (; count; count -= MEM_STREAM_STEP, d += 4, s += 4) {
+        _mm_prefetch((const char *)(s + 16), _MM_HINT_NTA);
+        x0 = _mm_loadu_si128(s + 0);
+        x1 = _mm_loadu_si128(s + 1);
+        x2 = _mm_loadu_si128(s + 2);
+        x3 = _mm_loadu_si128(s + 3);
+        _mm_stream_si128(d + 0, x0);
+        _mm_stream_si128(d + 1, x1);
+        _mm_stream_si128(d + 2, x2);
+        _mm_stream_si128(d + 3, x3);
+    }
+}
+
+static void memset64_stream(void *s, int c, size_t count)
+{
+    __m128i *d = (__m128i *)s;
+    __m128i v = _mm_set1_epi8((char)c);
+
+    for (; count; count -= MEM_STREAM_STEP, d += 4) {
+        _mm_stream_si128(d + 0, v);
+        _mm_stream_si128(d + 1, v);
+        _mm_stream_si128(d + 2, v);
+        _mm_stream_si128(d + 3, v);
+    }
+}
+#endif
 
 void *memcpy64(void *dest, const void *src, size_t count)
 {
-    uint64_t    *ls, *ld;
-    int tms, remain;
-    char *tmp = dest;
-    const char *s = src;
-    int dword_size = sizeof(uint64_t);
-    
-    tms = count / dword_size;
-    remain = count % dword_size;
-
-    ld = (uint64_t *)dest;
-    ls = (uint64_t *)src;
-    
-    while(tms --){
-        *ld++ = *ls++;
-        tmp += dword_size;
-        s += dword_size;
-    };
+#if defined(__SSE2__)
+    size_t head, body;
 
-    while (remain--){
-        *tmp++ = *s++;
+    if (count >= RT_MEM_NT_THRESHOLD) {
+        head = (MEM_STREAM_ALIGN - ((uintptr_t)dest & (MEM_STREAM_ALIGN - 1))) & (MEM_STREAM_ALIGN - 1);
+        body = (count - head) & ~(size_t)(MEM_STREAM_STEP - 1);
+
+        memcpy(dest, src, head);
+        memcpy64_stream((char *)dest + head, (const char *)src + head, body);
+        _mm_sfence();
+        memcpy((char *)dest + head + body, (const char *)src + head + body,
+            count - head - body);
+        return dest;
     }
-    
-    return dest;
+#endif
+    return memcpy(dest, src, count);
 }
 
-#include <stdio.h>
+/** Same semantics as memset, c is a byte and every byte is written. */
 void *memset64(void *s, int c, size_t count)
 {
-    uint64_t    *ld;
-    int tms;
-    int dword_size = sizeof(uint64_t);
-    uint64_t    v = c;
-    
-    tms = count / dword_size;
-    ld = (uint64_t *)s;
-    
-    while(tms --){
-        *ld++ = v;
-    };
+#if defined(__SSE2__)
+    size_t head, body;
 
-    return s;
+    if (count >= RT_MEM_NT_THRESHOLD) {
+        head = (MEM_STREAM_ALIGN - ((uintptr_t)s & (MEM_STREAM_ALIGN - 1))) & (MEM_STREAM_ALIGN - 1);
+        body = (count - head) & ~(size_t)(MEM_STREAM_STEP - 1);
+
+        memset(s, c, head);
+        memset64_stream((char *)s + head, c, body);
+        _mm_sfence();
+        memset((char *)s + head + body, c, count - head - body);
+        return s;
+    }
+#endif
+    return memset(s, c, count);
 }
 
+/**
+* Unaligned heads and odd tails around RT_MEM_NT_THRESHOLD must come out
+* exact and must not touch the byte past the end.
+* Returns 0 if memcpy64/memset64 agree with memcpy/memset, -1 otherwise.
+*/
+int rt_string_test(void)
+{
+    char *src, *dst;
+    size_t i, size, off, max = RT_MEM_NT_THRESHOLD + 128;
+
+    src = (char *)malloc(max);
+    dst = (char *)malloc(max);
+    if (!src || !dst) {
+        free(src);
+        free(dst);
+        return -1;
+    }
+
+    for (off = 0; off < 16; off ++) {
+        for (size = RT_MEM_NT_THRESHOLD - 3; size < RT_MEM_NT_THRESHOLD + 70; size += 7) {
+            for (i = 0; i < size; i ++)
+                src[off + i] = (char)(i * 131 + off);
+            memset(dst, 0x11, max);
+            memcpy64(dst + off, src + off, size);
+            if (memcmp(dst + off, src + off, size) || dst[off + size] != 0x11)
+                goto broken;
+            memset64(dst + off, 0xA5, size - 5);
+            for (i = 0; i < size - 5; i ++)
+                if ((unsigned char)dst[off + i] != 0xA5)
+                    goto broken;
+            if (dst[off + size - 5] != src[off + size - 5])
+                goto broken;
+        }
+    }
+
+    free(src);
+    free(dst);
+    return 0;
+
+broken:
+    printf("\r\nmemcpy64/memset64 mismatch (size %zu, offset %zu)\n",
+        size, off);
+    free(src);
+    free(dst);
+    return -1;
+}
+
+/** Destinations walk an arena bigger than the caches, like fresh session buffers do. */
+#define MEM_BENCH_ARENA     (64 << 20)
+
+static double memx_bench_run(int copy, int wide, char *arena, const char *src,
+            size_t size, long loops)
+{
+    struct timespec t0, t1;
+    size_t off = 0;
+    char *dst;
+    long i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < loops; i ++) {
+        dst = arena + off + 8;
+        off += (size + 63) & ~(size_t)63;
+        if (off + size + 64 > MEM_BENCH_ARENA)
+            off = 0;
+
+        if (copy) {
+            if (wide)
+                memcpy64(dst, src, size);
+            else
+                memcpy(dst, src, size);
+        } else {
+            if (wide)
+                memset64(dst, (int)i, size);
+            else
+                memset(dst, (int)i, size);
+        }
+        __asm__ __volatile__("" : : "r"(dst) : "memory");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/**
+* memcpy64/memset64 against memcpy/memset at the sizes the callers use:
+* voice payload appends, session and match entries, model list clones and
+* whole stage buffers. About bytes are moved per case.
+*/
+void rt_string_bench(long bytes)
+{
+    static const size_t sizes[] = {
+        160, 1024, 4096, 400000, 800000, 1024 * 8 * 180
+    };
+    static const char *copy_name[] = {"memcpy", "memcpy64"};
+    static const char *set_name[] = {"memset", "memset64"};
+    char *src, *dst;
+    size_t i, size, max = 0;
+    long loops;
+    int w;
+    double t;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i ++)
+        if (sizes[i] > max)
+            max = sizes[i];
+
+    src = (char *)malloc(max + 64);
+    dst = (char *)malloc(MEM_BENCH_ARENA);
+    if (!src || !dst) {
+        free(src);
+        free(dst);
+        return;
+    }
+
+    memset(src, 0x5A, max + 64);
+    memset(dst, 0, MEM_BENCH_ARENA);
+    printf("\r\nMemory bench: %ld bytes per case, non-temporal above %d\n",
+        bytes, RT_MEM_NT_THRESHOLD);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i ++) {
+        size = sizes[i];
+        loops = bytes / (long)size + 1;
+        for (w = 0; w < 2; w ++) {
+            t = memx_bench_run(1, w, dst, src, size, loops);
+            printf("\t%-10s%10zu%12.2f GB/s\n", copy_name[w], size,
+                (double)size * loops / t / 1e9);
+        }
+        for (w = 0; w < 2; w ++) {
+            t = memx_bench_run(0, w, dst, src, size, loops);
+            printf("\t%-10s%10zu%12.2f GB/s\n", set_name[w], size,
+                (double)size * loops / t / 1e9);
+        }
+    }
+
+    free(src);
+    free(dst);
+}
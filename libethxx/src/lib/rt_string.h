@@ -55,7 +55,13 @@
 
 #define clear_memory(addr, size) memset(addr, 0, size)
 
+/** Blocks this large are written around the cache */
+#define RT_MEM_NT_THRESHOLD     (256 << 10)
+
 extern void *memcpy64(void *dest, const void *src, size_t count);
 extern void *memset64(void *s, int c, size_t count);
+extern int rt_string_test(void);
+/** Timed memcpy64/memset64 against memcpy/memset at the callers' sizes. */
+extern void rt_string_bench(long bytes);
 
 #endif
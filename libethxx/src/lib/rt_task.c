@@ -11,6 +11,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sched.h>
+#include <fnmatch.h>
 
 #include "rt_task.h"
 #include "rt_sync.h"
@@ -18,6 +20,21 @@
 #include "rt_common.h"
 #include "rt_stdlib.h"
 #include "rt_string.h"
+#include "rt_util.h"
+#include "conf.h"
+
+struct rt_task_affinity_t {
+	/** fnmatch pattern of task names */
+	char pattern[TASK_NAME_SIZE + 1];
+
+	/** empty if only the node is set and it has no cpulist */
+	cpu_set_t cpus;
+
+	/** preferred memory node, -1 if none */
+	int node;
+
+	struct list_head	list;
+};
 
 #define	TASK_FLG_INITD		(1 << 0)
 struct rt_tasklist_t{
@@ -27,6 +44,9 @@ struct rt_tasklist_t{
 	/** Search with task desc */
 	struct hlist_head	hhead;
 
+	/** Affinity entries, first match wins */
+	struct list_head	affinity;
+
 	int flags;
 };
 
@@ -40,12 +60,35 @@ static __rt_always_inline__ void chk_init(struct rt_tasklist_t *tasklist)
 	if (!tasklist || (tasklist && !tasklist->flags)) {
 		INIT_LIST_HEAD(&tasklist->head);
 		INIT_HLIST_HEAD(&tasklist->hhead);
+		INIT_LIST_HEAD(&tasklist->affinity);
 		rt_mutex_init(&tasklist->lock, NULL);
 		tasklist->flags |= TASK_FLG_INITD;
 		rt_sync_init();
 	}
 }
 
+/** Must be called with the task list locked. */
+static struct rt_task_affinity_t *__task_affinity_lookup(struct rt_tasklist_t *tasklist,
+				const char *desc)
+{
+	struct rt_task_affinity_t *aff;
+
+	list_for_each_entry(aff, &tasklist->affinity, list){
+		if (!fnmatch(aff->pattern, desc, 0))
+			return aff;
+	}
+
+	return NULL;
+}
+
+/** Must be called with the task list locked. */
+static void __task_affinity_bind(struct rt_tasklist_t *tasklist, struct rt_task_t *task)
+{
+	struct rt_task_affinity_t *aff = __task_affinity_lookup(tasklist, task->name);
+
+	task->node = aff ? aff->node : -1;
+}
+
 void task_registry(struct rt_task_t *task)
 {
 	struct rt_tasklist_t *tasklist = &task_list;
@@ -53,6 +96,7 @@ void task_registry(struct rt_task_t *task)
 	chk_init(tasklist);
 	if(likely(task)){
 		rt_mutex_lock(&tasklist->lock);
+		__task_affinity_bind(tasklist, task);
 		list_add_tail(&task->list, &tasklist->head);
 		tasklist->count ++;
 		rt_mutex_unlock(&tasklist->lock);
@@ -131,9 +175,229 @@ struct rt_task_t  *task_query_id (rt_pthread pid)
 	return NULL;
 }
 
+/** "0-3,8" style list, as in /sys and taskset -c */
+static int cpulist_parse(const char *str, cpu_set_t *set)
+{
+	const char *p = str;
+	char *end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	while (*p) {
+		while (*p == ' ' || *p == ',' || *p == '\n')
+			p ++;
+		if (!*p)
+			break;
+
+		lo = strtol(p, &end, 10);
+		if (end == p || lo < 0)
+			return -1;
+		hi = lo;
+		p = end;
+		if (*p == '-') {
+			hi = strtol(++p, &end, 10);
+			if (end == p || hi < lo)
+				return -1;
+			p = end;
+		}
+		if (*p && *p != ',' && *p != ' ' && *p != '\n')
+			return -1;
+
+		for (; lo <= hi && lo < CPU_SETSIZE; lo ++)
+			CPU_SET(lo, set);
+	}
+
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+static void cpulist_format(cpu_set_t *set, char *buf, size_t size)
+{
+	int cpu, first = -1;
+	size_t l = 0;
+
+	buf[0] = 0;
+	for (cpu = 0; cpu <= CPU_SETSIZE && l < size; cpu ++) {
+		if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, set)) {
+			if (first < 0)
+				first = cpu;
+			continue;
+		}
+		if (first < 0)
+			continue;
+		if (cpu - 1 > first)
+			l += snprintf(buf + l, size - l, "%s%d-%d", l ? "," : "", first, cpu - 1);
+		else
+			l += snprintf(buf + l, size - l, "%s%d", l ? "," : "", first);
+		first = -1;
+	}
+}
+
+static int node_cpulist(int node, cpu_set_t *set)
+{
+	char path[128], buf[1024] = {0};
+	FILE *fp;
+
+	snprintf(path, sizeof(path) - 1, "/sys/devices/system/node/node%d/cpulist", node);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	if (!fgets(buf, sizeof(buf) - 1, fp)) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	return cpulist_parse(buf, set);
+}
+
+int task_affinity_registry(const char *pattern, const char *cpus, int node)
+{
+	struct rt_task_affinity_t *aff;
+	struct rt_task_t *task;
+	struct rt_tasklist_t *tasklist = &task_list;
+
+	if(unlikely(!pattern || ((!cpus || !*cpus) && node < 0))){
+		rt_log_error(ERRNO_INVALID_ARGU,
+			"Task affinity needs a name pattern and cpus or node");
+		return -1;
+	}
+
+	aff = (struct rt_task_affinity_t *)kmalloc(sizeof(struct rt_task_affinity_t), MPF_CLR, -1);
+	if(unlikely(!aff))
+		return -1;
+
+	snprintf(aff->pattern, TASK_NAME_SIZE, "%s", pattern);
+	aff->node = node;
+	INIT_LIST_HEAD(&aff->list);
+
+	if (cpus && *cpus) {
+		if (cpulist_parse(cpus, &aff->cpus)) {
+			rt_log_error(ERRNO_INVALID_ARGU,
+				"Invalid cpu list \"%s\" for task \"%s\"", cpus, pattern);
+			kfree(aff);
+			return -1;
+		}
+	} else if (node_cpulist(node, &aff->cpus)) {
+		/** Memory-only node, tasks keep floating across cpus */
+		rt_log_warning(ERRNO_INVALID_ARGU,
+			"No cpus on node %d, task \"%s\" gets memory placement only", node, pattern);
+		CPU_ZERO(&aff->cpus);
+	}
+
+	chk_init(tasklist);
+	rt_mutex_lock(&tasklist->lock);
+	list_add_tail(&aff->list, &tasklist->affinity);
+	/** Tasks registered before the config was loaded */
+	list_for_each_entry(task, &tasklist->head, list)
+		__task_affinity_bind(tasklist, task);
+	rt_mutex_unlock(&tasklist->lock);
+
+	return 0;
+}
+
+/**
+* task-affinity:
+*   - task: "SG Matcher*"
+*     cpus: 2-7
+*     node: 0
+*/
+int task_affinity_load(const char *section)
+{
+	ConfNode *base, *child;
+	const char *name, *cpus, *node;
+	int n = 0;
+
+	base = ConfGetNode((char *)section);
+	if (!base)
+		return 0;
+
+	TAILQ_FOREACH(child, &base->head, next){
+		name = ConfNodeLookupChildValue(child, "task");
+		cpus = ConfNodeLookupChildValue(child, "cpus");
+		node = ConfNodeLookupChildValue(child, "node");
+		if (!name)
+			continue;
+		if (!task_affinity_registry(name, cpus,
+				node ? integer_parser(node, 0, 63) : -1))
+			n ++;
+	}
+
+	return n;
+}
 
-/** Thread description should not be same with registered one. */
-void task_spawn(char __attribute__((__unused__))*desc, 
+static struct rt_task_affinity_t *task_affinity_lookup(const char *desc)
+{
+	struct rt_task_affinity_t *found;
+	struct rt_tasklist_t *tasklist = &task_list;
+
+	chk_init(tasklist);
+	rt_mutex_lock(&tasklist->lock);
+	found = __task_affinity_lookup(tasklist, desc);
+	rt_mutex_unlock(&tasklist->lock);
+
+	/** Entries are never released, safe to use unlocked. */
+	return found;
+}
+
+/**
+* Applied from inside the new thread, so the policy set by
+* rt_mempolicy_prefer covers everything the task allocates.
+* A configured entry wins over the static core field.
+*/
+static void task_placement(struct rt_task_t *task)
+{
+	struct rt_task_affinity_t *aff;
+	cpu_set_t set;
+	char cpus[TASK_PLACEMENT_SIZE / 2];
+	int xret, node;
+
+	CPU_ZERO(&set);
+	aff = task_affinity_lookup(task->name);
+	if (task->node >= 0)
+		rt_mempolicy_prefer(task->node);
+	if (aff) {
+		set = aff->cpus;
+	} else if (task->core != INVALID_CORE) {
+		CPU_SET(task->core, &set);
+	}
+
+	if (CPU_COUNT(&set)) {
+		xret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (xret)
+			rt_log_warning(ERRNO_THRD_CREATE,
+				"Task \"%s\" placement, %s", task->name, strerror(xret));
+	}
+
+	/** Report what the kernel actually gave us */
+	CPU_ZERO(&set);
+	pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+	cpulist_format(&set, cpus, sizeof(cpus));
+	node = rt_mempolicy_node();
+	if (node >= 0)
+		snprintf(task->placement, TASK_PLACEMENT_SIZE, "cpu %s, node %d", cpus, node);
+	else
+		snprintf(task->placement, TASK_PLACEMENT_SIZE, "cpu %s, node *", cpus);
+}
+
+/** Every task enters here, the task must not be touched once routine runs. */
+static void *task_trampoline(void *argvs)
+{
+	struct rt_task_t *task = (struct rt_task_t *)argvs;
+	void * (*routine)(void *) = task->routine;
+	void *arg = task->argvs;
+
+	task_placement(task);
+
+	return routine(arg);
+}
+
+/**
+* Thread description should not be same with registered one.
+* Returns the registered task, or NULL. A task with recycle ALLOWED
+* frees its handle when it deregisters itself.
+*/
+struct rt_task_t *task_spawn(char __attribute__((__unused__))*desc, 
 		uint32_t __attribute__((__unused__))prio, void __attribute__((__unused__))*attr,  void * (*func)(void *), void *arg)
 {
 	struct rt_task_t *task = NULL, *p;
@@ -142,7 +406,7 @@ void task_spawn(char __attribute__((__unused__))*desc,
 	if(unlikely(!desc)){
 		rt_log_error(ERRNO_INVALID_ARGU, 
 		    "Task description is null, task will not be created");
-		return;
+		return NULL;
 	}
 
 	chk_init(tasklist);
@@ -151,6 +415,8 @@ void task_spawn(char __attribute__((__unused__))*desc,
 		if(!STRCMP(desc, task->name)){
 			rt_log_warning(ERRNO_TASK_EXSIT, 
 				"The same task (%s, %ld)", task->name, task->pid);
+			rt_mutex_unlock(&tasklist->lock);
+			task = NULL;
 			goto finish;
 		}
 	}
@@ -164,15 +430,20 @@ void task_spawn(char __attribute__((__unused__))*desc,
 	}
 	
 	task->prio = prio;
+	task->core = INVALID_CORE;
 	task->attr = attr;
 	task->routine = func;
 	task->argvs = arg;
 	INIT_LIST_HEAD(&task->list);
 	INIT_HLIST_HEAD(&task->hlist);
 	memcpy(task->name, desc, strlen(desc));
+	/** The new thread places itself before it is registered */
+	rt_mutex_lock(&tasklist->lock);
+	__task_affinity_bind(tasklist, task);
+	rt_mutex_unlock(&tasklist->lock);
 
 	rt_unsync();
-	if (!pthread_create(&task->pid, task->attr, task->routine, task->argvs) &&
+	if (!pthread_create(&task->pid, task->attr, task_trampoline, task) &&
 	    		 (!pthread_detach(task->pid))) {
 		rt_sync();
 		goto registry;
@@ -181,18 +452,19 @@ void task_spawn(char __attribute__((__unused__))*desc,
 
 	rt_log_error(ERRNO_TASK_CREATE, 
 		"pthread_create or pthread_detach error");	
+	task = NULL;
 	goto finish;
 
 registry:
 	task_registry(task);
 
 finish:
-	return;
+	return task;
 }
 
-void task_spawn_quickly(struct rt_task_t *task)
+struct rt_task_t *task_spawn_quickly(struct rt_task_t *task)
 {
-	task_spawn(task->name, task->prio, task->attr, task->routine, task->argvs);
+	return task_spawn(task->name, task->prio, task->attr, task->routine, task->argvs);
 }
 
 
@@ -201,7 +473,8 @@ task_detail(struct rt_task_t *task,
                         int __attribute__((__unused__))flags)
 {
 	if(likely(task)){
-		printf("\t\"%64s\"%20ld\n", task->name, task->pid);
+		printf("\t\"%64s\"%20ld    %s\n", task->name, task->pid,
+			task->placement[0] ? task->placement : "-");
 	}
 }
 
@@ -227,7 +500,7 @@ void task_detail_foreach()
 	printf("\r\nTask(s) %d Preview\n", 
 			tasklist->count);
 
-	printf ("\t%64s%20s\n", "DESCRIPTION", "IDENTI");
+	printf ("\t%64s%20s    %s\n", "DESCRIPTION", "IDENTI", "PLACEMENT");
 		task_foreach_lineup(tasklist, 0, task_detail);
 	printf("\r\n\r\n");
 }
@@ -245,7 +518,7 @@ void task_run()
 			continue;
 		
 		rt_unsync();
-		if (pthread_create(&task->pid, task->attr, task->routine, task->argvs)){
+		if (pthread_create(&task->pid, task->attr, task_trampoline, task)){
 			rt_log_error(ERRNO_THRD_CREATE, 
 				"%s", strerror(errno));
 			goto finish;
@@ -11,8 +11,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
-#include <sys/time.h>
-#include <signal.h>
+#include <time.h>
+#include <sys/timerfd.h>
 
 #include "rt_common.h"
 #include "rt_sync.h"
@@ -25,15 +25,48 @@
 #include "rt_hash.h"
 
 #ifdef RT_TMR_ADVANCED
+
+/**
+* Timers live in a hierarchical timing wheel (the classic 5-level layout,
+* 256 + 4 * 64 slots, 1 tick = TMR_TICK_MS). Adding or cancelling a timer is
+* a list insert/delete in one slot. A dedicated thread sleeps on a timerfd
+* armed for the next busy tick, advances the wheel, and runs the due routines
+* without holding tmrlist_lock, so routines may do I/O or call tmr_start/tmr_stop.
+*/
+#define TVN_BITS    6
+#define TVR_BITS    8
+#define TVN_SIZE    (1 << TVN_BITS)
+#define TVR_SIZE    (1 << TVR_BITS)
+#define TVN_MASK    (TVN_SIZE - 1)
+#define TVR_MASK    (TVR_SIZE - 1)
+#define TV_LEVELS   4
+#define TMR_MAX_TICKS   ((uint64_t)0xffffffffUL)
+
+#define TMR_NEVER   ((uint64_t)-1)
+
+#define TMR_HASH_SIZE   64
+#define TMR_HASH_MASK   (TMR_HASH_SIZE - 1)
+
+struct tmr_wheel_t {
+    uint64_t    jiffies;
+    /** tick the timerfd is armed for */
+    uint64_t    next;
+    int         pending;
+    int         fd;
+    struct list_head tv1[TVR_SIZE];
+    struct list_head tvn[TV_LEVELS][TVN_SIZE];
+};
+
 static int init;
 static INIT_MUTEX(tmrlist_lock);
 static LIST_HEAD(tmrlist);
+static struct hlist_head tmr_hash[TMR_HASH_SIZE];
+static struct tmr_wheel_t tmr_wheel;
 
-static volatile atomic64_t  g_sys_cur_ticks = ATOMIC_INIT(0);
-
-#define tmr_precision  50000
-/** The macro is not Recommended when creating a timer with api tmr_create */
-#define tmr_internal_trans(sec) (((sec * 1000 * 1000)/(tmr_precision)))
+/** The timer whose routine is being executed (protected by tmrlist_lock) */
+static struct timer_t *tmr_running;
+static pthread_cond_t tmr_idle_cond = PTHREAD_COND_INITIALIZER;
+static rt_pthread tmr_thread;
 
 static void 
 tmr_default_routine(uint32_t uid, int __attribute__((__unused__))argc, 
@@ -45,6 +78,15 @@ tmr_default_routine(uint32_t uid, int __attribute__((__unused__))argc,
     printf ("default timer [%u, %d] routine has occured\n", uid, count[uid%2]);
 }
 
+static __rt_always_inline__ uint64_t
+tmr_clock_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TMR_TICK_MS;
+}
+
 static __rt_always_inline__ void *
 tmr_alloc()
 {
@@ -54,10 +96,13 @@ tmr_alloc()
     if(likely(t)){
         t->uid = TMR_INVALID;
         t->routine = tmr_default_routine;
-        t->interval = 3; //tmr_internal_trans(3);
+        t->interval = 3 * 1000;
+        t->delay = 1000;
         t->recycle = ALLOWED;
         t->type = TMR_ASHOT;
         t->status = TMR_STOPPED;
+        INIT_LIST_HEAD(&t->entry);
+        INIT_HLIST_NODE(&t->hlist);
     }
     return t;
 }
@@ -88,6 +133,176 @@ finish:
     return hval;
 }
 
+/** Arm the timerfd to fire once at tick, or disarm it. */
+static void
+tmr_wheel_arm(struct tmr_wheel_t *wheel, uint64_t tick)
+{
+    struct itimerspec its;
+    uint64_t ms = tick * TMR_TICK_MS;
+
+    memset(&its, 0, sizeof(its));
+    if (tick != TMR_NEVER){
+        its.it_value.tv_sec = ms / 1000;
+        its.it_value.tv_nsec = (ms % 1000) * 1000000;
+    }
+
+    wheel->next = tick;
+    if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        rt_log_error(ERRNO_TM, "timerfd_settime: %s", strerror(errno));
+}
+
+static void
+__tmr_wheel_insert(struct tmr_wheel_t *wheel, struct timer_t *t)
+{
+    uint64_t expires = t->expires;
+    int64_t idx = (int64_t)(expires - wheel->jiffies);
+    struct list_head *vec;
+    int i;
+
+    if (idx < 0){
+        /** Already due, run on the next tick. */
+        vec = wheel->tv1 + (wheel->jiffies & TVR_MASK);
+    } else if (idx < TVR_SIZE){
+        vec = wheel->tv1 + (expires & TVR_MASK);
+    } else {
+        if ((uint64_t)idx > TMR_MAX_TICKS){
+            idx = TMR_MAX_TICKS;
+            expires = wheel->jiffies + idx;
+        }
+        for (i = 0; i < TV_LEVELS - 1; i ++){
+            if (idx < (int64_t)1 << (TVR_BITS + (i + 1) * TVN_BITS))
+                break;
+        }
+        vec = wheel->tvn[i] + ((expires >> (TVR_BITS + i * TVN_BITS)) & TVN_MASK);
+    }
+
+    list_add_tail(&t->entry, vec);
+}
+
+/** Must be called with tmrlist_lock held. */
+static void
+tmr_wheel_add(struct tmr_wheel_t *wheel, struct timer_t *t)
+{
+    /** An idle wheel stops ticking, catch up before inserting. */
+    if (!wheel->pending)
+        wheel->jiffies = MAX(wheel->jiffies, tmr_clock_ms());
+
+    __tmr_wheel_insert(wheel, t);
+    wheel->pending ++;
+
+    if (t->expires < wheel->next)
+        tmr_wheel_arm(wheel, MAX(t->expires, wheel->jiffies));
+}
+
+/** Must be called with tmrlist_lock held. */
+static void
+tmr_wheel_del(struct tmr_wheel_t *wheel, struct timer_t *t)
+{
+    /** A stale wakeup is harmless, leave the timerfd armed. */
+    if (!list_empty(&t->entry)){
+        list_del_init(&t->entry);
+        wheel->pending --;
+    }
+}
+
+static int
+tmr_wheel_cascade(struct tmr_wheel_t *wheel, int level, int index)
+{
+    struct timer_t *t, *p;
+    LIST_HEAD(work);
+
+    list_splice_init(wheel->tvn[level] + index, &work);
+    list_for_each_entry_safe(t, p, &work, entry){
+        list_del_init(&t->entry);
+        __tmr_wheel_insert(wheel, t);
+    }
+
+    return index;
+}
+
+/**
+* The next tick worth waking up for: the first busy slot of tv1 in
+* this round, or the start of the next round where the upper levels cascade.
+*/
+static uint64_t
+tmr_wheel_next(struct tmr_wheel_t *wheel)
+{
+    int index = wheel->jiffies & TVR_MASK;
+    int i;
+
+    if (!wheel->pending)
+        return TMR_NEVER;
+
+    for (i = index; i < TVR_SIZE; i ++){
+        if (!list_empty(wheel->tv1 + i))
+            return wheel->jiffies + (i - index);
+    }
+
+    return wheel->jiffies + (TVR_SIZE - index);
+}
+
+#define TMR_INDEX(w, N) (((w)->jiffies >> (TVR_BITS + (N) * TVN_BITS)) & TVN_MASK)
+
+/**
+* Advance the wheel up to now and move every due timer onto expired.
+* They stay accounted in pending until tmr_expire takes them off.
+* Must be called with tmrlist_lock held.
+*/
+static void
+tmr_wheel_advance(struct tmr_wheel_t *wheel, uint64_t now,
+                struct list_head *expired)
+{
+    struct timer_t *t;
+    int index, i;
+
+    while (wheel->jiffies <= now && wheel->pending){
+        index = wheel->jiffies & TVR_MASK;
+        if (!index){
+            for (i = 0; i < TV_LEVELS; i ++){
+                if (tmr_wheel_cascade(wheel, i, TMR_INDEX(wheel, i)))
+                    break;
+            }
+        }
+        wheel->jiffies ++;
+        while (!list_empty(wheel->tv1 + index)){
+            t = list_first_entry(wheel->tv1 + index, struct timer_t, entry);
+            list_move_tail(&t->entry, expired);
+        }
+    }
+
+    /** Nothing pending, catch up without walking empty slots. */
+    if (wheel->jiffies <= now)
+        wheel->jiffies = now + 1;
+}
+
+/** Must be called with tmrlist_lock held. */
+static void
+tmr_schedule(struct timer_t *t, int64_t delay)
+{
+    tmr_wheel_del(&tmr_wheel, t);
+    t->expires = tmr_clock_ms() + (delay > 0 ? delay / TMR_TICK_MS : 0);
+    tmr_wheel_add(&tmr_wheel, t);
+}
+
+static __rt_always_inline__ struct hlist_head *
+tmr_hash_head(uint32_t uid)
+{
+    return &tmr_hash[uid & TMR_HASH_MASK];
+}
+
+static struct timer_t *
+tmr_lookup(uint32_t uid)
+{
+    struct timer_t *_this;
+    struct hlist_node *pos;
+
+    hlist_for_each_entry(_this, pos, tmr_hash_head(uid), hlist){
+        if (likely(uid == _this->uid))
+            return _this;
+    }
+
+    return NULL;
+}
 
 struct timer_t  *
 tmr_set(uint32_t uid,
@@ -96,13 +311,9 @@ tmr_set(uint32_t uid,
     struct timer_t *_this;
 
     rt_mutex_lock(&tmrlist_lock);
-    list_for_each_entry(_this, &tmrlist, list){
-        if (likely(uid == _this->uid)){
-            if(likely(proc))
-                proc(_this);
-            break;
-        }
-    }
+    _this = tmr_lookup(uid);
+    if(likely(_this && proc))
+        proc(_this);
     rt_mutex_unlock(&tmrlist_lock);
     
     return _this;
@@ -111,17 +322,29 @@ tmr_set(uint32_t uid,
 static void tmr_enable(struct timer_t *t)
 {
     t->status = TMR_STARTED;
+    tmr_schedule(t, t->delay);
 }
 
 static void tmr_disable(struct timer_t *t)
 {
     t->status = TMR_STOPPED;
+    tmr_wheel_del(&tmr_wheel, t);
 }
 
+/** Must be called with tmrlist_lock held. */
 static void tmr_delete(struct timer_t *t)
 {
     if(likely(t)){
+        /** Wait for its routine to return when called from other threads. */
+        while (tmr_running == t &&
+                !pthread_equal(pthread_self(), tmr_thread))
+            rt_cond_wait(&tmr_idle_cond, &tmrlist_lock);
+
+        tmr_wheel_del(&tmr_wheel, t);
         list_del(&t->list);
+        hlist_del_init(&t->hlist);
+        if (tmr_running == t)
+            tmr_running = NULL;
         tmr_free(t);
     }
 }
@@ -136,19 +359,113 @@ void tmr_stop(uint32_t uid)
     tmr_set(uid, tmr_disable);
 }
 
+static void
+tmr_expire(struct list_head *expired)
+{
+    struct timer_t *_this;
+
+    while (!list_empty(expired)){
+        _this = list_first_entry(expired, struct timer_t, entry);
+        tmr_wheel_del(&tmr_wheel, _this);
+        if (unlikely(_this->status != TMR_STARTED))
+            continue;
+
+        if (likely(TMR_ASHOT == _this->type))
+            _this->status = TMR_STOPPED;
+
+        tmr_running = _this;
+        rt_mutex_unlock(&tmrlist_lock);
+        _this->routine(_this->uid, _this->argc, _this->argv);
+        rt_mutex_lock(&tmrlist_lock);
+
+        /** Deleted by its own routine. */
+        if (tmr_running != _this)
+            continue;
+        tmr_running = NULL;
+        rt_cond_broadcast(&tmr_idle_cond);
+
+        /** Rescheduled or stopped by its routine. */
+        if (_this->status != TMR_STARTED ||
+                !list_empty(&_this->entry))
+            continue;
+
+        _this->expires += MAX(_this->interval / TMR_TICK_MS, 1);
+        if ((int64_t)(_this->expires - tmr_wheel.jiffies) < 0)
+            _this->expires = tmr_wheel.jiffies;
+        tmr_wheel_add(&tmr_wheel, _this);
+    }
+}
+
 static void *
 tmr_daemon(void __attribute__((__unused__))*pv_par )
 {
+    uint64_t ticks;
+    LIST_HEAD(expired);
+
+    tmr_thread = pthread_self();
     rt_log_debug("  T M R   S T A R T E D ...");    
 
     FOREVER{
-        sleep(86400);
+        if (read(tmr_wheel.fd, &ticks, sizeof(ticks)) < 0){
+            if (errno != EINTR && errno != EAGAIN)
+                rt_log_error(ERRNO_TM, "timerfd read: %s", strerror(errno));
+            continue;
+        }
+
+        rt_mutex_lock(&tmrlist_lock);
+        tmr_wheel_advance(&tmr_wheel, tmr_clock_ms(), &expired);
+        tmr_expire(&expired);
+        tmr_wheel_arm(&tmr_wheel, tmr_wheel_next(&tmr_wheel));
+        rt_mutex_unlock(&tmrlist_lock);
     }
     
     task_deregistry_id(pthread_self());
     return NULL;
 }
 
+static struct rt_task_t tmr_daemon_task =
+{
+    .module = THIS,
+    .name = "Advanced Timer Task",
+    .core = INVALID_CORE,
+    .prio = KERNEL_SCHED,
+    .argvs = NULL,
+    .routine = tmr_daemon,
+};
+
+/** Must be called with tmrlist_lock held. */
+static int
+tmr_init()
+{
+    int i, j;
+
+    if(likely(init))
+        return 0;
+
+    tmr_wheel.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tmr_wheel.fd < 0){
+        rt_log_error(ERRNO_TM, "timerfd_create: %s", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < TVR_SIZE; i ++)
+        INIT_LIST_HEAD(tmr_wheel.tv1 + i);
+    for (i = 0; i < TV_LEVELS; i ++)
+        for (j = 0; j < TVN_SIZE; j ++)
+            INIT_LIST_HEAD(tmr_wheel.tvn[i] + j);
+    for (i = 0; i < TMR_HASH_SIZE; i ++)
+        INIT_HLIST_HEAD(&tmr_hash[i]);
+
+    tmr_wheel.jiffies = tmr_clock_ms();
+    tmr_wheel.next = TMR_NEVER;
+    tmr_wheel.pending = 0;
+
+    task_spawn_quickly(&tmr_daemon_task);
+    init = 1;
+
+    return 0;
+}
+
 void tmr_registry(struct timer_t *this)
 {
     struct timer_t *_this = NULL;
@@ -157,6 +474,8 @@ void tmr_registry(struct timer_t *this)
         goto finish;
     
     rt_mutex_lock(&tmrlist_lock);
+    if(unlikely(tmr_init()))
+        goto err;
     
     list_for_each_entry(_this, &tmrlist, list){
         if ((likely(this->module == _this->module)) &&
@@ -170,7 +489,13 @@ void tmr_registry(struct timer_t *this)
 
     if(likely((int32_t)this->uid == TMR_INVALID)){
         this->uid = tmr_uid_alloc(this->module, this->desc, strlen(this->desc));
+        if (this->delay <= 0)
+            this->delay = this->interval;
+        INIT_LIST_HEAD(&this->entry);
         list_add(&this->list, &tmrlist);
+        hlist_add_head(&this->hlist, tmr_hash_head(this->uid));
+        if (this->status == TMR_STARTED)
+            tmr_schedule(this, this->delay);
     }
     
 err:
@@ -198,58 +523,11 @@ void tmr_deregistry(struct timer_t *this)
     rt_mutex_unlock(&tmrlist_lock);
 }
 
-static struct rt_task_t tmr_daemon_task =
-{
-    .module = THIS,
-    .name = "Advanced Timer Task",
-    .core = INVALID_CORE,
-    .prio = KERNEL_SCHED,
-    .argvs = NULL,
-    .routine = tmr_daemon,
-};
-
-static void tmr_handler()
-{
-    int64_t old_ticks = 0;
-    struct timer_t *_this = NULL;
-
-    old_ticks = atomic64_inc(&g_sys_cur_ticks);
-    rt_mutex_lock(&tmrlist_lock);
-        list_for_each_entry(_this, &tmrlist, list){
-            if (likely(_this->status == TMR_STARTED)){
-                if (likely(old_ticks >= _this->curr_ticks)) {
-                    _this->routine(_this->uid, _this->argc, _this->argv);
-                    if (likely(TMR_ASHOT == _this->type))
-                        _this->status= TMR_STOPPED;
-                    else
-                        _this->curr_ticks = old_ticks + _this->interval;
-                }
-            }
-        }
-        rt_mutex_unlock(&tmrlist_lock);
-        
-}
-
-static void realtimer_init()
-{
-    static struct itimerval tmr;
-    
-    signal(SIGALRM, (void *) tmr_handler);
-    tmr.it_interval.tv_sec = 1;
-    tmr.it_interval.tv_usec = 0;
-    tmr.it_value.tv_sec = 1;
-    tmr.it_value.tv_usec = 0;
-    setitimer(ITIMER_REAL, &tmr, NULL);
-    
-}
-
-/**
-* routine: must be a reentrant function.
-* An unknown error ocurrs if a thread-safe function called as a routione.
-*/
-uint32_t tmr_create(int module,
+static uint32_t
+__tmr_create(int module,
                 const char *desc, int type,
-                void (*routine)(uint32_t, int, char **), int argc, char **argv, int sec)
+                void (*routine)(uint32_t, int, char **), int argc, char **argv,
+                int64_t interval, int64_t delay)
 {
     struct timer_t *_this;
     uint32_t uid = TMR_INVALID;
@@ -261,6 +539,9 @@ uint32_t tmr_create(int module,
     }
 
     rt_mutex_lock(&tmrlist_lock);
+    if(unlikely(tmr_init()))
+        goto err;
+
     list_for_each_entry(_this, &tmrlist, list){
         if(likely(!STRCMP(desc, _this->desc))){
             rt_log_warning(ERRNO_TM_EXSIT, 
@@ -279,8 +560,8 @@ uint32_t tmr_create(int module,
     
     _this->module = module;
     _this->desc = strdup(desc);
-    _this->curr_ticks = 0;
-    _this->interval = sec;
+    _this->interval = interval;
+    _this->delay = delay;
     _this->routine = routine ? routine : tmr_default_routine;
     _this->type = type;
     _this->uid = uid = tmr_uid_alloc(_this->module, _this->desc, strlen(_this->desc));
@@ -290,13 +571,7 @@ uint32_t tmr_create(int module,
     _this->argv = argv;
 
     list_add_tail(&_this->list, &tmrlist);
-
-    if(likely(init == 0)){
-        task_spawn_quickly(&tmr_daemon_task);
-        init = 1;
-        //sleep(1);
-        realtimer_init();
-    }
+    hlist_add_head(&_this->hlist, tmr_hash_head(uid));
     
 err:
     rt_mutex_unlock(&tmrlist_lock);
@@ -304,6 +579,26 @@ finish:
     return uid;
 }
 
+/**
+* Keeps the behaviour of the former SIGALRM driven timer:
+* the first shot one second after start, then every sec seconds.
+*/
+uint32_t tmr_create(int module,
+                const char *desc, int type,
+                void (*routine)(uint32_t, int, char **), int argc, char **argv, int sec)
+{
+    return __tmr_create(module, desc, type, routine, argc, argv,
+                (int64_t)sec * 1000, 1000);
+}
+
+uint32_t tmr_create_ms(int module,
+                const char *desc, int type,
+                void (*routine)(uint32_t, int, char **), int argc, char **argv, int ms)
+{
+    return __tmr_create(module, desc, type, routine, argc, argv,
+                ms, ms);
+}
+
 static void 
 tmr_naughty_boy(uint32_t uid, int __attribute__((__unused__))argc, 
                 char __attribute__((__unused__))**argv)
@@ -341,8 +341,24 @@ extern void tmr_test0();
 extern void ceph_test();
 
 #if (SPASR_BRANCH_EQUAL(BRANCH_LOCAL))
-int main(int __attribute__((__unused__)) argc,
-    char __attribute__((__unused__))**argv)
+/** Equivalence checks and benchmarks of the library, "--selftest" runs them and exits */
+static int librecv_selftest(void)
+{
+    int xret = 0;
+
+    if (rt_string_test()) {
+        printf("rt_string_test: FAILED\n");
+        xret = -1;
+    } else
+        printf("rt_string_test: ok\n");
+
+    rt_string_bench(1L << 28);
+    rt_fifo_bench(4, 4, 4000000);
+
+    return xret;
+}
+
+int main(int argc, char **argv)
 {
 
 #define one_day 86400
@@ -353,6 +369,9 @@ int main(int __attribute__((__unused__)) argc,
     //ceph_test();
     //tmr_test0();
 
+    if (argc > 1 && !STRCMP(argv[1], "--selftest"))
+        return librecv_selftest() ? 1 : 0;
+
     librecv_init(argc, argv);
 
     sleep(1);
@@ -50,15 +50,115 @@ void rt_g711_release (struct g711_state_s *s)
 	kfree (s);
 }
 
+/** Every code and every 16-bit sample, filled once from spandsp */
+static struct {
+	int16_t	alaw_linear[256], ulaw_linear[256];
+	uint8_t	alaw_ulaw[256], ulaw_alaw[256];
+	uint8_t	linear_alaw[65536], linear_ulaw[65536];
+} g711_tables;
+
+static pthread_once_t g711_tables_once = PTHREAD_ONCE_INIT;
+
+static void g711_tables_build ()
+{
+	int i;
+
+	for (i = 0; i < 256; i ++) {
+		g711_tables.alaw_linear[i] = alaw_to_linear ((uint8_t)i);
+		g711_tables.ulaw_linear[i] = ulaw_to_linear ((uint8_t)i);
+		g711_tables.alaw_ulaw[i] = alaw_to_ulaw ((uint8_t)i);
+		g711_tables.ulaw_alaw[i] = ulaw_to_alaw ((uint8_t)i);
+	}
+
+	/** Indexed by the sample as unsigned */
+	for (i = 0; i < 65536; i ++) {
+		g711_tables.linear_alaw[i] = linear_to_alaw ((int16_t)i);
+		g711_tables.linear_ulaw[i] = linear_to_ulaw ((int16_t)i);
+	}
+}
+
+void rt_g711_decode_bulk (int mode, int16_t amp[],
+                                 const uint8_t g711_data[], size_t n)
+{
+	const int16_t *t;
+	size_t i = 0;
+
+	pthread_once (&g711_tables_once, g711_tables_build);
+	t = (mode == G711_ALAW) ? g711_tables.alaw_linear : g711_tables.ulaw_linear;
+
+	for (; i + 4 <= n; i += 4) {
+		amp[i] = t[g711_data[i]];
+		amp[i + 1] = t[g711_data[i + 1]];
+		amp[i + 2] = t[g711_data[i + 2]];
+		amp[i + 3] = t[g711_data[i + 3]];
+	}
+	for (; i < n; i ++)
+		amp[i] = t[g711_data[i]];
+}
+
+void rt_g711_encode_bulk (int mode, uint8_t g711_data[],
+                                 const int16_t amp[], size_t n)
+{
+	const uint8_t *t;
+	size_t i = 0;
+
+	pthread_once (&g711_tables_once, g711_tables_build);
+	t = (mode == G711_ALAW) ? g711_tables.linear_alaw : g711_tables.linear_ulaw;
+
+	for (; i + 4 <= n; i += 4) {
+		g711_data[i] = t[(uint16_t)amp[i]];
+		g711_data[i + 1] = t[(uint16_t)amp[i + 1]];
+		g711_data[i + 2] = t[(uint16_t)amp[i + 2]];
+		g711_data[i + 3] = t[(uint16_t)amp[i + 3]];
+	}
+	for (; i < n; i ++)
+		g711_data[i] = t[(uint16_t)amp[i]];
+}
+
+void rt_g711_transcode_bulk (int mode, uint8_t g711_out[],
+                                    const uint8_t g711_in[], size_t n)
+{
+	const uint8_t *t;
+	size_t i = 0;
+
+	pthread_once (&g711_tables_once, g711_tables_build);
+	t = (mode == G711_ALAW) ? g711_tables.alaw_ulaw : g711_tables.ulaw_alaw;
+
+	for (; i + 4 <= n; i += 4) {
+		g711_out[i] = t[g711_in[i]];
+		g711_out[i + 1] = t[g711_in[i + 1]];
+		g711_out[i + 2] = t[g711_in[i + 2]];
+		g711_out[i + 3] = t[g711_in[i + 3]];
+	}
+	for (; i < n; i ++)
+		g711_out[i] = t[g711_in[i]];
+}
+
+/** read () until s bytes or the end of file, short reads are retried */
+static ssize_t g711_read_full (int fd, void *buf, size_t s)
+{
+	ssize_t n, total = 0;
+
+	while ((size_t)total < s) {
+		n = read (fd, (char *)buf + total, s - total);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return total ? total : n;
+		total += n;
+	}
+
+	return total;
+}
+
 int rt_g711_converto_pcm (const char *alaw_file)
 {	
 	SNDFILE *handle;
-	int16_t amp[SAMPLES_PER_CHUNK];
-	uint8_t g711data[SAMPLES_PER_CHUNK];
+	int16_t *amp;
+	uint8_t *g711data;
 	char	dst[256] = {0};
-	int file, len2 = 0, len3 = 0;
+	int file, len2 = 0;
 	int outframes;
-	struct g711_state_s *g711;
 	
 	if ((file = open(alaw_file, O_RDONLY)) < 0) {
 		fprintf(stderr, "    Failed to open '%s'\n", alaw_file);
@@ -71,16 +171,22 @@ int rt_g711_converto_pcm (const char *alaw_file)
 		exit(2);
 	}
 
-	g711 = rt_g711_init (NULL, G711_ALAW);
-	for (;;) {
+	amp = (int16_t *)kmalloc (G711_BULK_SAMPLES * sizeof (int16_t), MPF_NOFLGS, -1);
+	g711data = (uint8_t *)kmalloc (G711_BULK_SAMPLES, MPF_NOFLGS, -1);
+	if (!amp || !g711data) {
+		fprintf(stderr, "    Out of memory converting '%s'\n", alaw_file);
+		exit(2);
+	}
+
+	for (;;) {
 		
-		len2 = read (file, g711data, SAMPLES_PER_CHUNK);
+		len2 = g711_read_full (file, g711data, G711_BULK_SAMPLES);
 		if (len2 <= 0)
 			break;
 
-		len3 = rt_g711_decode (g711, amp, g711data, len2);
-		outframes = sf_writef_short (handle, amp, len3);
-		if (outframes != len3) {
+		rt_g711_decode_bulk (G711_ALAW, amp, g711data, len2);
+		outframes = sf_writef_short (handle, amp, len2);
+		if (outframes != len2) {
 			fprintf(stderr, "    Error writing audio file\n");
 			exit(2);
 		}
@@ -93,20 +199,20 @@ int rt_g711_converto_pcm (const char *alaw_file)
 	}
 	 
 	close (file);
-	rt_g711_release (g711);
+	kfree (amp);
+	kfree (g711data);
 	
-	return 0;
+	return 0;
 }
 
 int rt_g711_converto_ulaw (const char * alaw_file)
 {	
 	SNDFILE *handle;
-	uint8_t g711_out[SAMPLES_PER_CHUNK];
-	uint8_t g711_in[SAMPLES_PER_CHUNK];
+	uint8_t *g711_out;
+	uint8_t *g711_in;
 	char	dst[256] = {0};
-	int file, len2 = 0, len3 = 0;
+	int file, len2 = 0;
 	int outframes;
-	struct g711_state_s *g711;
 	
 	if ((file = open(alaw_file, O_RDONLY)) < 0) {
 		fprintf(stderr, "    Failed to open '%s'\n", alaw_file);
@@ -119,17 +225,23 @@ int rt_g711_converto_ulaw (const char * alaw_file)
 		exit(2);
 	}
 
-	g711 = rt_g711_init (NULL, G711_ALAW);
-	for (;;) {
+	g711_in = (uint8_t *)kmalloc (G711_BULK_SAMPLES, MPF_NOFLGS, -1);
+	g711_out = (uint8_t *)kmalloc (G711_BULK_SAMPLES, MPF_NOFLGS, -1);
+	if (!g711_in || !g711_out) {
+		fprintf(stderr, "    Out of memory converting '%s'\n", alaw_file);
+		exit(2);
+	}
+
+	for (;;) {
 		
-		len2 = read (file, g711_in, SAMPLES_PER_CHUNK);
+		len2 = g711_read_full (file, g711_in, G711_BULK_SAMPLES);
 		if (len2 <= 0)
 			break;
 
-		len3 = rt_g711_transcode (g711, g711_out, g711_in, len2);
-		outframes = sf_write_raw (handle, g711_out, len3);
-		if (outframes != len3) {
-			fprintf(stderr, "    Error writing audio file, (%d, %d)\n", outframes, len3);
+		rt_g711_transcode_bulk (G711_ALAW, g711_out, g711_in, len2);
+		outframes = sf_write_raw (handle, g711_out, len2);
+		if (outframes != len2) {
+			fprintf(stderr, "    Error writing audio file, (%d, %d)\n", outframes, len2);
 			exit(2);
 		}
 
@@ -141,20 +253,20 @@ int rt_g711_converto_ulaw (const char * alaw_file)
 	}
 	 
 	close (file);
-
-	rt_g711_release (g711);
+	kfree (g711_in);
+	kfree (g711_out);
 	
-	return 0;
+	return 0;
 }
 
 int rt_g711_encode_xlaw (const char *pcm_file, int type)
 {	
 	SNDFILE *handle;
-	uint8_t g711_in[SAMPLES_PER_CHUNK], g711_out[SAMPLES_PER_CHUNK];
+	int16_t *g711_in;
+	uint8_t *g711_out;
 	char	dst[256] = {0};
 	int file, len2 = 0, len3 = 0;
 	int outframes;
-	struct g711_state_s *g711;
 	int mode = SF_FORMAT_WAV;
 	
 	if ((file = open(pcm_file, O_RDONLY)) < 0) {
@@ -176,14 +288,22 @@ int rt_g711_encode_xlaw (const char *pcm_file, int type)
 		exit(2);
 	}
 
-	g711 = rt_g711_init (NULL, type);
-	for (;;) {
+	g711_in = (int16_t *)kmalloc (G711_BULK_SAMPLES * sizeof (int16_t), MPF_NOFLGS, -1);
+	g711_out = (uint8_t *)kmalloc (G711_BULK_SAMPLES, MPF_NOFLGS, -1);
+	if (!g711_in || !g711_out) {
+		fprintf(stderr, "    Out of memory converting '%s'\n", pcm_file);
+		exit(2);
+	}
+
+	for (;;) {
 		
-		len2 = read (file, g711_in, SAMPLES_PER_CHUNK);
+		len2 = g711_read_full (file, g711_in, G711_BULK_SAMPLES * sizeof (int16_t));
 		if (len2 <= 0)
 			break;
 
-		len3 = rt_g711_encode (g711, g711_out, (short *)g711_in, len2/2);
+		/** An odd last byte is dropped, as ever */
+		len3 = len2 / 2;
+		rt_g711_encode_bulk (type, g711_out, g711_in, len3);
 		outframes = sf_write_raw (handle, g711_out, len3);
 		if (outframes != len3) {
 			fprintf(stderr, "    Error writing audio file\n");
@@ -198,9 +318,10 @@ int rt_g711_encode_xlaw (const char *pcm_file, int type)
 	}
 	 
 	close (file);
-	rt_g711_release (g711);
+	kfree (g711_in);
+	kfree (g711_out);
 	
-	return 0;
+	return 0;
 }
 
 
@@ -217,3 +338,125 @@ void G711_test ()
 	rt_g711_encode_xlaw (PCM_FILE, G711_ULAW);
 }
 
+
+#define	BENCH_ROUNDS		40
+
+static void g711_bench_log (const char *op, int mode, const char *path,
+				size_t n, uint64_t t1, uint64_t t2)
+{
+	double mb = (double)n * BENCH_ROUNDS / (1024 * 1024);
+
+	rt_log_notice ("G711 %s %s of %s, %zu KB x %d: spandsp %.1f MB/s, bulk %.1f MB/s",
+		mode == G711_ALAW ? "alaw" : "ulaw", op, path, n >> 10, BENCH_ROUNDS,
+		mb * 1000 / (t1 ? t1 : 1), mb * 1000 / (t2 ? t2 : 1));
+}
+
+/**
+* Bulk calls against spandsp a chunk at a time over the wavs of test_data
+* (svm/test_data), outputs must be the same. Each pass is run BENCH_ROUNDS
+* times and the throughput of both is logged. Returns the failures.
+*/
+int G711_bulk_test (const char *test_data)
+{
+	const char *files[] = {"alaw/alaw.wav", "pcm/pcm.wav", "YJ-Samples/ulaw_Stereo.wav", NULL};
+	struct g711_state_s *g711;
+	uint8_t *data, *x1, *x2;
+	int16_t *a1, *a2;
+	uint64_t begin, t1, t2;
+	char path[256];
+	size_t n, i, r;
+	struct stat st;
+	int fd, k, mode, errors = 0, checked = 0;
+
+	for (k = 0; files[k]; k ++) {
+		snprintf (path, sizeof (path), "%s/%s", test_data, files[k]);
+		if (stat (path, &st) < 0 || st.st_size < 2)
+			continue;
+		n = (size_t)st.st_size & ~1UL;
+
+		data = (uint8_t *)kmalloc (n, MPF_NOFLGS, -1);
+		x1 = (uint8_t *)kmalloc (n, MPF_NOFLGS, -1);
+		x2 = (uint8_t *)kmalloc (n, MPF_NOFLGS, -1);
+		a1 = (int16_t *)kmalloc (n * sizeof (int16_t), MPF_NOFLGS, -1);
+		a2 = (int16_t *)kmalloc (n * sizeof (int16_t), MPF_NOFLGS, -1);
+		fd = open (path, O_RDONLY);
+		if (!data || !x1 || !x2 || !a1 || !a2 || fd < 0 ||
+			g711_read_full (fd, data, n) != (ssize_t)n) {
+			errors ++;
+			goto next;
+		}
+
+		for (mode = G711_ALAW; mode <= G711_ULAW; mode ++) {
+			g711 = rt_g711_init (NULL, mode);
+
+			begin = rt_time_ms ();
+			for (r = 0; r < BENCH_ROUNDS; r ++)
+				for (i = 0; i < n; i += SAMPLES_PER_CHUNK)
+					rt_g711_decode (g711, a1 + i, data + i, (int)MIN (SAMPLES_PER_CHUNK, n - i));
+			t1 = rt_time_ms () - begin;
+			begin = rt_time_ms ();
+			for (r = 0; r < BENCH_ROUNDS; r ++)
+				rt_g711_decode_bulk (mode, a2, data, n);
+			t2 = rt_time_ms () - begin;
+			g711_bench_log ("decode", mode, path, n, t1, t2);
+			if (memcmp (a1, a2, n * sizeof (int16_t))) {
+				rt_log_error (ERRNO_FATAL, "G711 %s decode of %s differs",
+					mode == G711_ALAW ? "alaw" : "ulaw", path);
+				errors ++;
+			}
+
+			/** The file taken as samples */
+			begin = rt_time_ms ();
+			for (r = 0; r < BENCH_ROUNDS; r ++)
+				for (i = 0; i < n / 2; i += SAMPLES_PER_CHUNK)
+					rt_g711_encode (g711, x1 + i, (int16_t *)data + i, (int)MIN (SAMPLES_PER_CHUNK, n / 2 - i));
+			t1 = rt_time_ms () - begin;
+			begin = rt_time_ms ();
+			for (r = 0; r < BENCH_ROUNDS; r ++)
+				rt_g711_encode_bulk (mode, x2, (int16_t *)data, n / 2);
+			t2 = rt_time_ms () - begin;
+			g711_bench_log ("encode", mode, path, n, t1, t2);
+			if (memcmp (x1, x2, n / 2)) {
+				rt_log_error (ERRNO_FATAL, "G711 %s encode of %s differs",
+					mode == G711_ALAW ? "alaw" : "ulaw", path);
+				errors ++;
+			}
+
+			begin = rt_time_ms ();
+			for (r = 0; r < BENCH_ROUNDS; r ++)
+				for (i = 0; i < n; i += SAMPLES_PER_CHUNK)
+					rt_g711_transcode (g711, x1 + i, data + i, (int)MIN (SAMPLES_PER_CHUNK, n - i));
+			t1 = rt_time_ms () - begin;
+			begin = rt_time_ms ();
+			for (r = 0; r < BENCH_ROUNDS; r ++)
+				rt_g711_transcode_bulk (mode, x2, data, n);
+			t2 = rt_time_ms () - begin;
+			g711_bench_log ("transcode", mode, path, n, t1, t2);
+			if (memcmp (x1, x2, n)) {
+				rt_log_error (ERRNO_FATAL, "G711 %s transcode of %s differs",
+					mode == G711_ALAW ? "alaw" : "ulaw", path);
+				errors ++;
+			}
+
+			rt_g711_release (g711);
+		}
+		checked ++;
+
+next:
+		if (fd >= 0)
+			close (fd);
+		kfree (data);
+		kfree (x1);
+		kfree (x2);
+		kfree (a1);
+		kfree (a2);
+	}
+
+	/** Nothing found is a failure too, the path is wrong */
+	if (!checked) {
+		rt_log_error (ERRNO_FATAL, "G711: no test wavs under %s", test_data);
+		errors ++;
+	}
+
+	return errors;
+}
@@ -5,6 +5,9 @@
 
 #define SAMPLES_PER_CHUNK           160
 
+/** Samples the file helpers move per read and write */
+#define G711_BULK_SAMPLES           (64 * 1024)
+
 extern uint8_t rt_g711_alaw_to_ulaw (uint8_t alaw);
 
 extern uint8_t rt_g711_ulaw_to_alaw (uint8_t ulaw);
@@ -28,7 +31,29 @@ extern int rt_g711_transcode (struct g711_state_s *s,
                                  const uint8_t g711_in[],
                                  int g711_bytes);
 
+/**
+* Table driven conversions of n samples, buffer to buffer. mode is
+* G711_ALAW or G711_ULAW, for transcode it is the law of g711_in.
+* Results are those of spandsp, the tables are built from it on first use.
+*/
+extern void rt_g711_decode_bulk (int mode, int16_t amp[],
+                                 const uint8_t g711_data[], size_t n);
+
+extern void rt_g711_encode_bulk (int mode, uint8_t g711_data[],
+                                 const int16_t amp[], size_t n);
+
+extern void rt_g711_transcode_bulk (int mode, uint8_t g711_out[],
+                                    const uint8_t g711_in[], size_t n);
+
+extern int rt_g711_converto_pcm (const char *alaw_file);
+
+extern int rt_g711_converto_ulaw (const char *alaw_file);
+
+extern int rt_g711_encode_xlaw (const char *pcm_file, int type);
 
 extern void G711_test ();
 
+/** Bulk against chunked spandsp calls over svm/test_data, returns the failures. */
+extern int G711_bulk_test (const char *test_data);
+
 #endif
@@ -4,4 +4,8 @@
 char linear2alaw(short  audio_val)    /* 2's complement (16-bit range) */  ;
 char linear2ulaw(short audio_val) /* 2's complement (16-bit range) */  ;
 
+/** Whole buffers, prefer these to a loop over the single sample calls */
+void linear2alaw_buf (uint8_t *alaw, const short *pcm, size_t n);
+void linear2ulaw_buf (uint8_t *ulaw, const short *pcm, size_t n);
+
 #endif
@@ -1,63 +1,453 @@
 #include "sysdefs.h"
 #include "stdform.h"
 #include "G711.h"
+#include "mixer.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define	ALAW_LEFT_CHANNEL		"vt/6285627239968080371-up.wav"
-#define	ALAW_RIGHT_CHANNEL		"vt/6285627239968080371-down.wav"
+/** Samples a round of rt_mix_mono8 goes through linear */
+#define	MIX_LINEAR_SAMPLES	256
 
-void mixer_test ()
+void rt_mix_interleave8 (uint8_t *stereo, const uint8_t *left, const uint8_t *right, size_t n)
 {
-	
-	const char *lalaw = ALAW_LEFT_CHANNEL, *ralaw = ALAW_RIGHT_CHANNEL;
-	char mixfile[32] = "mix.wav", c;
-	struct stat s;
-	int l = 0, left = 0;
-	FILE *fpl, *fpr, *fpmix;
-	struct xlaw_head_t	xlaw_hdr;
-	
-	fpl = fopen (lalaw, "r");
-	fpr = fopen (ralaw, "r");
+	size_t i = 0;
 
-	fpmix = fopen (mixfile, "w+");
+#ifdef __SSE2__
+	__m128i l, r;
 
-	stat(lalaw, &s);
-	l += s.st_size;
+	for (; i + 16 <= n; i += 16) {
+		l = _mm_loadu_si128 ((const __m128i *)(left + i));
+		r = _mm_loadu_si128 ((const __m128i *)(right + i));
+		_mm_storeu_si128 ((__m128i *)(stereo + 2 * i), _mm_unpacklo_epi8 (l, r));
+		_mm_storeu_si128 ((__m128i *)(stereo + 2 * i + 16), _mm_unpackhi_epi8 (l, r));
+	}
+#endif
+
+	for (; i < n; i ++) {
+		stereo[2 * i] = left[i];
+		stereo[2 * i + 1] = right[i];
+	}
+}
 
-	stat(ralaw, &s);
-	l += s.st_size;
+void rt_mix_deinterleave8 (uint8_t *left, uint8_t *right, const uint8_t *stereo, size_t n)
+{
+	size_t i = 0;
 
-	alaw_head_init (&xlaw_hdr, l, 8000, 2, 8);
-	audio_head (mixfile, (void *)&xlaw_hdr);
+#ifdef __SSE2__
+	__m128i m = _mm_set1_epi16 (0x00ff), a, b;
 
-	fwrite (&xlaw_hdr, sizeof(xlaw_hdr), 1, fpmix);
-	while (1)  {
-		if (!left) {
-			if (1 == fread (&c, sizeof(char), 1, fpl)) {
-				fwrite (&c, sizeof(char), 1, fpmix);
-				left = 1;
-				continue;
-			}
+	for (; i + 16 <= n; i += 16) {
+		a = _mm_loadu_si128 ((const __m128i *)(stereo + 2 * i));
+		b = _mm_loadu_si128 ((const __m128i *)(stereo + 2 * i + 16));
+		/** Even bytes are left, odd ones right */
+		_mm_storeu_si128 ((__m128i *)(left + i),
+			_mm_packus_epi16 (_mm_and_si128 (a, m), _mm_and_si128 (b, m)));
+		_mm_storeu_si128 ((__m128i *)(right + i),
+			_mm_packus_epi16 (_mm_srli_epi16 (a, 8), _mm_srli_epi16 (b, 8)));
+	}
+#endif
 
-			break;
+	for (; i < n; i ++) {
+		left[i] = stereo[2 * i];
+		right[i] = stereo[2 * i + 1];
+	}
+}
+
+void rt_mix_interleave16 (int16_t *stereo, const int16_t *left, const int16_t *right, size_t n)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	__m128i l, r;
+
+	for (; i + 8 <= n; i += 8) {
+		l = _mm_loadu_si128 ((const __m128i *)(left + i));
+		r = _mm_loadu_si128 ((const __m128i *)(right + i));
+		_mm_storeu_si128 ((__m128i *)(stereo + 2 * i), _mm_unpacklo_epi16 (l, r));
+		_mm_storeu_si128 ((__m128i *)(stereo + 2 * i + 8), _mm_unpackhi_epi16 (l, r));
+	}
+#endif
+
+	for (; i < n; i ++) {
+		stereo[2 * i] = left[i];
+		stereo[2 * i + 1] = right[i];
+	}
+}
+
+void rt_mix_deinterleave16 (int16_t *left, int16_t *right, const int16_t *stereo, size_t n)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	__m128i a, b;
+
+	for (; i + 8 <= n; i += 8) {
+		a = _mm_loadu_si128 ((const __m128i *)(stereo + 2 * i));
+		b = _mm_loadu_si128 ((const __m128i *)(stereo + 2 * i + 8));
+		/** Sign extended halves of each pair, packing never saturates */
+		_mm_storeu_si128 ((__m128i *)(left + i),
+			_mm_packs_epi32 (_mm_srai_epi32 (_mm_slli_epi32 (a, 16), 16),
+					_mm_srai_epi32 (_mm_slli_epi32 (b, 16), 16)));
+		_mm_storeu_si128 ((__m128i *)(right + i),
+			_mm_packs_epi32 (_mm_srai_epi32 (a, 16), _mm_srai_epi32 (b, 16)));
+	}
+#endif
+
+	for (; i < n; i ++) {
+		left[i] = stereo[2 * i];
+		right[i] = stereo[2 * i + 1];
+	}
+}
+
+void rt_mix_mono16 (int16_t *out, const int16_t *a, const int16_t *b, size_t n)
+{
+	size_t i = 0;
+	int s;
+
+#ifdef __SSE2__
+	for (; i + 8 <= n; i += 8)
+		_mm_storeu_si128 ((__m128i *)(out + i),
+			_mm_adds_epi16 (_mm_loadu_si128 ((const __m128i *)(a + i)),
+					_mm_loadu_si128 ((const __m128i *)(b + i))));
+#endif
+
+	for (; i < n; i ++) {
+		s = a[i] + b[i];
+		out[i] = (int16_t)(s > INT16_MAX ? INT16_MAX : (s < INT16_MIN ? INT16_MIN : s));
+	}
+}
+
+void rt_mix_mono8 (int mode, uint8_t *out, const uint8_t *a, const uint8_t *b, size_t n)
+{
+	int16_t la[MIX_LINEAR_SAMPLES], lb[MIX_LINEAR_SAMPLES];
+	size_t i, c;
+
+	for (i = 0; i < n; i += c) {
+		c = MIN (n - i, MIX_LINEAR_SAMPLES);
+		rt_g711_decode_bulk (mode, la, a + i, c);
+		rt_g711_decode_bulk (mode, lb, b + i, c);
+		rt_mix_mono16 (la, la, lb, c);
+		rt_g711_encode_bulk (mode, out + i, la, c);
+	}
+}
+
+static __rt_always_inline__ uint8_t mix_idle_code (int mode)
+{
+	return (mode == G711_ALAW) ? G711_ALAW_IDLE_OCTET : G711_ULAW_IDLE_OCTET;
+}
+
+/** Wav header of mode for s bytes of data, RIFF sizes included */
+static void mix_head_write (FILE *fp, int mode, size_t s, int channels)
+{
+	struct xlaw_head_t hdr;
+
+	if (mode == G711_ALAW)
+		alaw_head_init (&hdr, s, SAMPLE_RATE, channels, 8);
+	else
+		ulaw_head_init (&hdr, s, SAMPLE_RATE, channels, 8);
+
+	rewind (fp);
+	fwrite (&hdr, sizeof (hdr), 1, fp);
+}
+
+/**
+* Read the next block of both legs, the shorter one padded with the
+* idle code. Returns the samples a leg, 0 when both are done.
+*/
+static size_t mix_legs_read (int mode, FILE *fpl, FILE *fpr, uint8_t *l, uint8_t *r)
+{
+	size_t nl, nr, n;
+
+	nl = fread (l, 1, MIX_BLOCK_SAMPLES, fpl);
+	nr = fread (r, 1, MIX_BLOCK_SAMPLES, fpr);
+	n = MAX (nl, nr);
+
+	memset (l + nl, mix_idle_code (mode), n - nl);
+	memset (r + nr, mix_idle_code (mode), n - nr);
+
+	return n;
+}
+
+static ssize_t mix_legs_file (int mode, const char *left, const char *right,
+				const char *out, int stereo)
+{
+	FILE *fpl = NULL, *fpr = NULL, *fpo = NULL;
+	uint8_t *l = NULL, *r = NULL, *o = NULL;
+	ssize_t total = -1;
+	size_t n, s, channels = stereo ? 2 : 1;
+
+	fpl = fopen (left, "r");
+	fpr = fopen (right, "r");
+	fpo = fopen (out, "w");
+	if (!fpl || !fpr || !fpo) {
+		rt_log_error (ERRNO_FATAL, "%s, %s %s %s", strerror (errno), left, right, out);
+		goto finish;
+	}
+
+	l = (uint8_t *)kmalloc (MIX_BLOCK_SAMPLES, MPF_NOFLGS, -1);
+	r = (uint8_t *)kmalloc (MIX_BLOCK_SAMPLES, MPF_NOFLGS, -1);
+	o = (uint8_t *)kmalloc (MIX_BLOCK_SAMPLES * channels, MPF_NOFLGS, -1);
+	if (!l || !r || !o)
+		goto finish;
+
+	/** Sizes are known at the end */
+	mix_head_write (fpo, mode, 0, (int)channels);
+
+	total = 0;
+	while ((n = mix_legs_read (mode, fpl, fpr, l, r)) > 0) {
+		if (stereo)
+			rt_mix_interleave8 (o, l, r, n);
+		else
+			rt_mix_mono8 (mode, o, l, r, n);
+
+		s = n * channels;
+		if (fwrite (o, 1, s, fpo) != s) {
+			total = -1;
+			goto finish;
 		}
+		total += n;
+	}
 
-		if (left) {
-			if (1 == fread (&c, sizeof(char), 1, fpr)) {
-				fwrite (&c, sizeof (char), 1, fpmix);
-				left = 0;
-				continue;
-			}
+	mix_head_write (fpo, mode, (size_t)total * channels, (int)channels);
 
-			break;
+finish:
+	if (fpl)
+		fclose (fpl);
+	if (fpr)
+		fclose (fpr);
+	if (fpo && fclose (fpo))
+		total = -1;
+	kfree (l);
+	kfree (r);
+	kfree (o);
+
+	return total;
+}
+
+ssize_t rt_mix_stereo_file (int mode, const char *left, const char *right, const char *out)
+{
+	return mix_legs_file (mode, left, right, out, 1);
+}
+
+ssize_t rt_mix_mono_file (int mode, const char *left, const char *right, const char *out)
+{
+	return mix_legs_file (mode, left, right, out, 0);
+}
+
+/**
+* Leave fp at the data chunk of a wav file, returns its bits per sample.
+* size is the bytes of the chunk, anything after it is not samples.
+*/
+static int mix_wav_data (FILE *fp, int *channels, uint32_t *size)
+{
+	struct riff_head_t riff;
+	uint32_t chunk[2];
+	struct pcm_head_t fmt;
+
+	if (fread (&riff, sizeof (riff), 1, fp) != 1 ||
+		riff.chunk_id != riff_str_hex || riff.form_type != wav_str_hex)
+		return -1;
+
+	*channels = 0;
+	while (fread (chunk, sizeof (chunk), 1, fp) == 1) {
+		if (chunk[0] == data_str_hex) {
+			*size = chunk[1];
+			return *channels ? fmt.bits_per_sample : -1;
+		}
+
+		if (chunk[0] == fmt_str_hex && chunk[1] >= 16) {
+			/** From fmt_tag on, as laid in pcm_head_t */
+			if (fread (&fmt.fmt_tag, 16, 1, fp) != 1)
+				return -1;
+			*channels = fmt.channels;
+			chunk[1] -= 16;
+		}
+
+		/** Chunks are word aligned */
+		if (fseek (fp, (long)(chunk[1] + (chunk[1] & 1)), SEEK_CUR))
+			return -1;
+	}
+
+	return -1;
+}
+
+ssize_t rt_mix_split_file (const char *stereo, const char *left, const char *right)
+{
+	FILE *fpi = NULL, *fpl = NULL, *fpr = NULL;
+	uint8_t *i = NULL, *l = NULL, *r = NULL;
+	ssize_t total = -1;
+	size_t n, bytes, frames;
+	uint32_t size;
+	int bits, channels;
+
+	fpi = fopen (stereo, "r");
+	fpl = fopen (left, "w");
+	fpr = fopen (right, "w");
+	if (!fpi || !fpl || !fpr) {
+		rt_log_error (ERRNO_FATAL, "%s, %s %s %s", strerror (errno), stereo, left, right);
+		goto finish;
+	}
+
+	bits = mix_wav_data (fpi, &channels, &size);
+	if ((bits != 8 && bits != 16) || channels != 2) {
+		rt_log_error (ERRNO_INVALID_VAL, "%s: not a 2 channel, 8 or 16 bit wav", stereo);
+		goto finish;
+	}
+	bytes = (size_t)bits / 8;
+
+	i = (uint8_t *)kmalloc (MIX_BLOCK_SAMPLES * 2 * bytes, MPF_NOFLGS, -1);
+	l = (uint8_t *)kmalloc (MIX_BLOCK_SAMPLES * bytes, MPF_NOFLGS, -1);
+	r = (uint8_t *)kmalloc (MIX_BLOCK_SAMPLES * bytes, MPF_NOFLGS, -1);
+	if (!i || !l || !r)
+		goto finish;
+
+	total = 0;
+	/** Up to the end of the data chunk, a trailing odd sample has no partner and is dropped */
+	frames = size / (2 * bytes);
+	while (frames > 0 && (n = fread (i, 2 * bytes, MIN (frames, MIX_BLOCK_SAMPLES), fpi)) > 0) {
+		frames -= n;
+		if (bits == 8)
+			rt_mix_deinterleave8 (l, r, i, n);
+		else
+			rt_mix_deinterleave16 ((int16_t *)l, (int16_t *)r, (const int16_t *)i, n);
+
+		if (fwrite (l, bytes, n, fpl) != n || fwrite (r, bytes, n, fpr) != n) {
+			total = -1;
+			goto finish;
 		}
+		total += n;
+	}
+
+finish:
+	if (fpi)
+		fclose (fpi);
+	if (fpl && fclose (fpl))
+		total = -1;
+	if (fpr && fclose (fpr))
+		total = -1;
+	kfree (i);
+	kfree (l);
+	kfree (r);
+
+	return total;
+}
+
+#define	MIX_TEST_LEFT		"/tmp/mixer_test.l"
+#define	MIX_TEST_RIGHT		"/tmp/mixer_test.r"
+#define	MIX_TEST_STEREO		"/tmp/mixer_test.wav"
+
+static void mix_test_leg (const char *file, uint8_t *leg, size_t n, unsigned int seed)
+{
+	FILE *fp;
+	size_t i;
+
+	for (i = 0; i < n; i ++)
+		leg[i] = (uint8_t)rand_r (&seed);
+
+	fp = fopen (file, "w");
+	if (fp) {
+		fwrite (leg, 1, n, fp);
+		fclose (fp);
 	}
-	
-	fclose (fpl);
-	fclose (fpr);
-	fclose (fpmix);
+}
 
-	stat (mixfile, &s);
-	printf ("Mix file size = %d\n", (int)s.st_size);
-	
+/** The leg split off again is the one built from, padded with the idle code up to n */
+static int mix_test_same (const char *file, const uint8_t *leg, size_t s, size_t n, uint8_t idle)
+{
+	FILE *fp;
+	size_t i;
+	int c, same = 1;
+
+	fp = fopen (file, "r");
+	if (!fp)
+		return 0;
+	for (i = 0; i < n && same; i ++) {
+		c = fgetc (fp);
+		same = (c == (i < s ? leg[i] : idle));
+	}
+	if (fgetc (fp) != EOF)
+		same = 0;
+	fclose (fp);
+
+	return same;
 }
 
+/**
+* Buffer routines against the plain per sample loop, then a stereo wav built
+* from two legs of different length, with a LIST chunk after its data, must
+* split back into both legs. Returns the checks that failed.
+*/
+int mixer_test ()
+{
+	const size_t nl = 100003, nr = 70001, nb = 1027;
+	uint8_t *l, *r, *s8, *l8, *r8;
+	int16_t *s16, *l16, *r16;
+	uint8_t list[16] = {'L', 'I', 'S', 'T', 8, 0, 0, 0, 'I', 'S', 'F', 'T', 'm', 'i', 'x', 0};
+	size_t i;
+	int errors = 0;
+	FILE *fp;
+
+	l = (uint8_t *)kmalloc (nl, MPF_NOFLGS, -1);
+	r = (uint8_t *)kmalloc (nl, MPF_NOFLGS, -1);
+	s8 = (uint8_t *)kmalloc (nb * 12, MPF_NOFLGS, -1);
+	if (!l || !r || !s8) {
+		errors ++;
+		goto finish;
+	}
+	l8 = s8 + 2 * nb;
+	r8 = l8 + nb;
+	s16 = (int16_t *)(r8 + nb);
+	l16 = s16 + 2 * nb;
+	r16 = l16 + nb;
+
+	mix_test_leg (MIX_TEST_LEFT, l, nl, 3);
+	mix_test_leg (MIX_TEST_RIGHT, r, nr, 5);
+
+	/** Odd n, the tail after the vector part is taken too */
+	rt_mix_interleave8 (s8, l, r, nb);
+	for (i = 0; i < nb; i ++)
+		if (s8[2 * i] != l[i] || s8[2 * i + 1] != r[i])
+			break;
+	rt_mix_deinterleave8 (l8, r8, s8, nb);
+	if (i < nb || memcmp (l8, l, nb) || memcmp (r8, r, nb)) {
+		rt_log_error (ERRNO_INVALID_VAL, "8-bit interleave round trip");
+		errors ++;
+	}
+
+	rt_mix_interleave16 (s16, (const int16_t *)l, (const int16_t *)r, nb);
+	for (i = 0; i < nb; i ++)
+		if (s16[2 * i] != ((const int16_t *)l)[i] || s16[2 * i + 1] != ((const int16_t *)r)[i])
+			break;
+	rt_mix_deinterleave16 (l16, r16, s16, nb);
+	if (i < nb || memcmp (l16, l, nb * 2) || memcmp (r16, r, nb * 2)) {
+		rt_log_error (ERRNO_INVALID_VAL, "16-bit interleave round trip");
+		errors ++;
+	}
+
+	if (rt_mix_stereo_file (G711_ALAW, MIX_TEST_LEFT, MIX_TEST_RIGHT, MIX_TEST_STEREO) != (ssize_t)nl) {
+		errors ++;
+		goto finish;
+	}
+
+	/** Chunks after the data are not samples */
+	fp = fopen (MIX_TEST_STEREO, "a");
+	if (!fp || fwrite (list, sizeof (list), 1, fp) != 1)
+		errors ++;
+	if (fp)
+		fclose (fp);
+
+	if (rt_mix_split_file (MIX_TEST_STEREO, MIX_TEST_LEFT ".split", MIX_TEST_RIGHT ".split") != (ssize_t)nl ||
+		!mix_test_same (MIX_TEST_LEFT ".split", l, nl, nl, mix_idle_code (G711_ALAW)) ||
+		!mix_test_same (MIX_TEST_RIGHT ".split", r, nr, nl, mix_idle_code (G711_ALAW))) {
+		rt_log_error (ERRNO_INVALID_VAL, "stereo build and split round trip");
+		errors ++;
+	}
+
+finish:
+	kfree (l);
+	kfree (r);
+	kfree (s8);
+
+	return errors;
+}
@@ -1,6 +1,36 @@
 #ifndef __MIXER_H__
 #define __MIXER_H__
 
+/** Samples a channel the file helpers move per read */
+#define	MIX_BLOCK_SAMPLES		(32 * 1024)
 
-#endif
+/**
+* Buffer routines, n is the samples of one channel and a stereo buffer
+* holds 2n of them, left first. 8-bit routines take G.711 codes as they are.
+*/
+extern void rt_mix_interleave8 (uint8_t *stereo, const uint8_t *left, const uint8_t *right, size_t n);
+extern void rt_mix_deinterleave8 (uint8_t *left, uint8_t *right, const uint8_t *stereo, size_t n);
+extern void rt_mix_interleave16 (int16_t *stereo, const int16_t *left, const int16_t *right, size_t n);
+extern void rt_mix_deinterleave16 (int16_t *left, int16_t *right, const int16_t *stereo, size_t n);
+
+/** out = a + b saturated, out may be a or b. */
+extern void rt_mix_mono16 (int16_t *out, const int16_t *a, const int16_t *b, size_t n);
+
+/** The same on G.711 codes of mode (G711_ALAW or G711_ULAW), mixed as linear. */
+extern void rt_mix_mono8 (int mode, uint8_t *out, const uint8_t *a, const uint8_t *b, size_t n);
+
+/**
+* File routines. Legs are raw G.711 of mode, the shorter one is padded
+* with the idle code. Outputs are wav files of mode.
+* Return the samples written a channel, -1 on error.
+*/
+extern ssize_t rt_mix_stereo_file (int mode, const char *left, const char *right, const char *out);
+extern ssize_t rt_mix_mono_file (int mode, const char *left, const char *right, const char *out);
 
+/** A stereo wav (8 or 16 bits) into two raw legs. */
+extern ssize_t rt_mix_split_file (const char *stereo, const char *left, const char *right);
+
+/** Buffer and file round trips, returns the checks that failed. */
+extern int mixer_test ();
+
+#endif
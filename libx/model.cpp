@@ -214,41 +214,62 @@ finish:
 }
 
 int WavToProbabilityAdvanced (const char* wav_file, void *model_list, float *sg_score, int *md_index, int is_alaw)
+{
+	int	xerror;
+	char 	featbuf[SG_FEAT_SIZE];
+
+	if (unlikely(!model_list))
+		return (-TIT_SPKID_ERROR_MODEL);
+
+	xerror = WavToFeature (wav_file, (void*)featbuf, is_alaw);
+	if (!xerror)
+		xerror = FeatureToProbability ((void*)featbuf, model_list, sg_score, md_index);
+
+	return xerror;
+}
+
+int WavToFeature (const char* wav_file, void *featbuf, int is_alaw)
 {
 	TIT_RET_CODE  xerror;
-	char 	featbuf[3202];
 	short  *b1, *b2;
-	int    s1, s2, mdlindex, nchl = 1;
+	int    s1, s2, nchl = 1;
 	bool result = false;
 	
 	xerror = TIT_SPKID_ERROR_MODEL;
 
-	struct modelist_t *mlist = (struct modelist_t *)model_list;
-	
-	if (unlikely(!mlist))
-		goto finish;
-	
 	if (is_alaw) {
 		result = CreateWavALaw (wav_file, nchl, b1, s1, b2, s2);
 		if (result)
-			xerror = TIT_SCR_Buf_CutSil_NoCluster_Index ((short*)b1, s1, (void*)featbuf, NULL);
+			xerror = TIT_SCR_Buf_CutSil_NoCluster_Index ((short*)b1, s1, featbuf, NULL);
 	} 
 
 	else {
 		result = CreateWav (wav_file, nchl, b1, s1, b2, s2);
 		if (result)
-			xerror = TIT_SCR_Buf_CutSil_Cluster_Index ((short*)b1, s1, (void*)featbuf, NULL);	/** same with vpm-1.0 */
-	}
-
-	if (xerror == TIT_SPKID_SUCCESS) {
-		xerror = TIT_SCR_Index_Match ((void*)featbuf, (void**)mlist->sg_data, sg_score, mlist->sg_cur_size, mdlindex);
-		*md_index = mdlindex;
+			xerror = TIT_SCR_Buf_CutSil_Cluster_Index ((short*)b1, s1, featbuf, NULL);	/** same with vpm-1.0 */
 	}
 
 	if (result)
 		kfree(b1);
 
-finish:
+	return (-xerror);
+}
+
+/** Matching only reads the feature and the models, any number of lists may be matched at once. */
+int FeatureToProbability (void *featbuf, void *model_list, float *sg_score, int *md_index)
+{
+	TIT_RET_CODE  xerror;
+	int    mdlindex;
+
+	struct modelist_t *mlist = (struct modelist_t *)model_list;
+
+	if (unlikely(!mlist))
+		return (-TIT_SPKID_ERROR_MODEL);
+
+	xerror = TIT_SCR_Index_Match (featbuf, (void**)mlist->sg_data, sg_score, mlist->sg_cur_size, mdlindex);
+	if (xerror == TIT_SPKID_SUCCESS)
+		*md_index = mdlindex;
+
 	return (-xerror);
 }
 
@@ -6,6 +6,7 @@
 #define	SG_INDEX_SIZE	1600
 #define	SG_DATA_SIZE    1608
 #define	SG_OWNR_SIZE	32
+#define	SG_FEAT_SIZE	3202	/** feature of a wav, see WavToFeature */
 
 
 #define ML_FLG_NEW			(1 << 0)	/** unused */
@@ -48,6 +49,8 @@ int   WavToModel (const char *wav_file, const char* mod_file, int *wlen1, int *w
 int   WavToModelMemory (const char *wav_file, uint8_t *mdl_cache, int *wlen1, int *wlen2, int is_alaw);
 int	WavToProbability (const char* wav_file, void *, int *md_index, int is_alaw);
 int WavToProbabilityAdvanced (const char* wav_file, void *, float *sg_score, int *md_index, int is_alaw);
+int	WavToFeature (const char* wav_file, void *featbuf, int is_alaw);
+int	FeatureToProbability (void *featbuf, void *, float *sg_score, int *md_index);
 int   VRSEngineInit (char *conf, char *path);
 extern struct modelist_t *default_modelist ();
 extern void default_modelist_set (struct modelist_t *__new);
@@ -84,6 +84,7 @@ extern struct xlaw_head_t	default_celp_head;
 
 extern void audio_head (const char *desc, void *xhead);
 extern void alaw_head_init (struct xlaw_head_t *ahead, size_t s, int sample_rate, int channels, int quant_bits);
+extern void ulaw_head_init (struct xlaw_head_t *ahead, size_t s, int sample_rate, int channels, int quant_bits);
 extern void pcm_head_init (struct pcm_head_t *ahead, size_t s, int sample_rate, int channels, int quant_bits);
 	
 #endif
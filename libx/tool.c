@@ -9,6 +9,8 @@ static struct rt_vrstool_t	default_engine_ops = {
 	.model_cvrto_cache_ops = WavToModelMemory,
 	.voice_recognition_ops = WavToProbability,
 	.voice_recognition_advanced_ops = WavToProbabilityAdvanced,
+	.voice_feature_ops = WavToFeature,
+	.voice_match_ops = FeatureToProbability,
 	.sg_batch_counter = ATOMIC_INIT (0),
 	.sg_batch = ATOMIC_INIT (0),
 	.sg_batch_size = ATOMIC_INIT (0),
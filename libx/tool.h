@@ -24,6 +24,9 @@ struct rt_vrstool_t {
 	int	(*model_cvrto_cache_ops) (const char *wav_file, uint8_t *mdl_cache, int *wlen1, int *wlen2, int is_alaw);
 	int	(*voice_recognition_ops) (const char* wav_file, void *mlist, int *md_index, int is_alaw);
 	int	(*voice_recognition_advanced_ops) (const char* wav_file, void *mlist, float *sg_score, int *md_index, int is_alaw);
+	/** The two halves of voice_recognition_advanced_ops, a feature can be matched against several lists */
+	int	(*voice_feature_ops) (const char* wav_file, void *featbuf, int is_alaw);
+	int	(*voice_match_ops) (void *featbuf, void *mlist, float *sg_score, int *md_index);
 	
 	atomic64_t	sg_batch,	sg_batch_counter,	sg_batch_size;
 	atomic64_t	categories, category_entries;
@@ -0,0 +1,354 @@
+#include "sysdefs.h"
+#include "vad.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+* Windows overlap, so sums are taken once per VAD_BLOCK bytes and every
+* window adds up the blocks it covers. A block divides both the window
+* and the step.
+*/
+#define VAD_BLOCK   32
+#define VAD_BLOCKS  (VAD_BUFFER_SIZE / VAD_BLOCK)
+#define VAD_WINDOW_BLOCKS   (FRAME_LEN / VAD_BLOCK)
+#define VAD_STEP_BLOCKS     (FRAME_OFFSET / VAD_BLOCK)
+
+#if (FRAME_LEN % VAD_BLOCK) || (FRAME_OFFSET % VAD_BLOCK)
+#error "VAD_BLOCK must divide FRAME_LEN and FRAME_OFFSET"
+#endif
+
+/** Reference kernels, the ones below must agree with them bit for bit */
+static int calc_frame_avg_energy(const unsigned char *frame, int frame_size)
+{
+    int i = 0;
+    int E_per = 0;
+    int E_sum = 0;
+
+    for (i = 0; i < frame_size; i++)
+    {
+        E_per = frame[i] & 0x7f;
+
+        E_sum += (E_per * E_per);
+    }
+
+    return E_sum / frame_size;
+}
+
+static inline int abs_e(int a, int b)
+{
+    return (a >= b) ? (a - b) : (b - a);
+}
+
+static int calc_frame_czr(const unsigned char *frame, int frame_size)
+{
+    int i = 0;
+    int sgn1 = 0, sgn2 = 0;
+    int rate = 0;
+
+    for (i = 1; i < frame_size; i++)
+    {
+        sgn1 = frame[i - 1] & 0x80;
+        sgn2 = frame[i] & 0x80;
+        if ((sgn1 != sgn2) && (abs_e(frame[i - 1] & 0x7f, frame[i] & 0x7f) >= 2))
+        {
+            rate += 1;
+        }
+    }
+    return rate;
+}
+
+/** Sum of (x & 0x7f)^2 over n bytes */
+static int vad_energy (const unsigned char *p, int n)
+{
+    int i = 0, sum = 0, x;
+
+#ifdef __SSE2__
+    __m128i m = _mm_set1_epi8 (0x7f), z = _mm_setzero_si128 (), acc = z, v, lo, hi;
+
+    for (; i + 16 <= n; i += 16) {
+        v = _mm_and_si128 (_mm_loadu_si128 ((const __m128i *)(p + i)), m);
+        lo = _mm_unpacklo_epi8 (v, z);
+        hi = _mm_unpackhi_epi8 (v, z);
+        /** A lane gains 4 * 127^2 a round, far from overflow within a buffer */
+        acc = _mm_add_epi32 (acc, _mm_madd_epi16 (lo, lo));
+        acc = _mm_add_epi32 (acc, _mm_madd_epi16 (hi, hi));
+    }
+    acc = _mm_add_epi32 (acc, _mm_shuffle_epi32 (acc, _MM_SHUFFLE (1, 0, 3, 2)));
+    acc = _mm_add_epi32 (acc, _mm_shuffle_epi32 (acc, _MM_SHUFFLE (2, 3, 0, 1)));
+    sum = _mm_cvtsi128_si32 (acc);
+#endif
+
+    for (; i < n; i ++) {
+        x = p[i] & 0x7f;
+        sum += x * x;
+    }
+
+    return sum;
+}
+
+/** Zero crossings of the pairs (p[i - 1], p[i]) for from <= i < to, from >= 1 */
+static int vad_czr (const unsigned char *p, int from, int to)
+{
+    int i = from, rate = 0;
+
+#ifdef __SSE2__
+    __m128i m = _mm_set1_epi8 (0x7f), one = _mm_set1_epi8 (1), z = _mm_setzero_si128 (),
+            acc = z, a, b, ma, mb, d, hit;
+
+    for (; i + 16 <= to; i += 16) {
+        a = _mm_loadu_si128 ((const __m128i *)(p + i - 1));
+        b = _mm_loadu_si128 ((const __m128i *)(p + i));
+        ma = _mm_and_si128 (a, m);
+        mb = _mm_and_si128 (b, m);
+        d = _mm_or_si128 (_mm_subs_epu8 (ma, mb), _mm_subs_epu8 (mb, ma));
+        /** Signs differ and magnitudes 2 apart, 0xff per hit */
+        hit = _mm_and_si128 (_mm_cmplt_epi8 (_mm_xor_si128 (a, b), z), _mm_cmpgt_epi8 (d, one));
+        acc = _mm_add_epi64 (acc, _mm_sad_epu8 (_mm_and_si128 (hit, one), z));
+    }
+    rate = _mm_cvtsi128_si32 (acc) + _mm_cvtsi128_si32 (_mm_unpackhi_epi64 (acc, acc));
+#endif
+
+    for (; i < to; i ++) {
+        if (((p[i - 1] ^ p[i]) & 0x80) && abs_e (p[i - 1] & 0x7f, p[i] & 0x7f) >= 2)
+            rate ++;
+    }
+
+    return rate;
+}
+
+static inline int frame_vad_smooth(struct vad_state_t *vad)
+{
+    if ((vad->last[0] ==  FRAME_VOICE)
+        || (vad->last[1] ==  FRAME_VOICE)
+        || (vad->last[2] ==  FRAME_VOICE))
+    {
+        return FRAME_SMOOTH_VOICE;
+    }
+
+    return FRAME_SILENCE;
+}
+
+static inline void update_vad_smooth(struct vad_state_t *vad, int frame_type)
+{
+    vad->last[2] = vad->last[1];
+    vad->last[1] = vad->last[0];
+    vad->last[0] = frame_type;
+}
+
+/** energy is the average energy of the window, czr its zero crossings */
+static int vad_judge_frame_type(struct vad_state_t *vad, int energy, int czr)
+{
+    int frame_type = FRAME_UNKNOW;
+
+    if (energy >= vad->gate)
+    {
+        /** 平均能量大于门限值，初步判断为静音帧，进行VAD平滑 */
+        frame_type = frame_vad_smooth(vad);
+        if (frame_type == FRAME_SILENCE)
+        {
+            /** 平滑结果仍为静音帧， 计算过零率 */
+            if (czr >= 3)
+            {
+                frame_type = FRAME_VOICE; //此时可能为FRAME_SMOOTH_VOICE，待验证后再决定是否调整
+            }
+        }
+    }
+    else
+    {
+        frame_type = FRAME_VOICE;
+    }
+
+    update_vad_smooth(vad, frame_type);
+
+    return frame_type;
+}
+
+/**
+* Judge every full window of buf (have <= VAD_BUFFER_SIZE) and return the
+* bytes they consumed. Block b keeps its energy and the crossings of the
+* pairs ending in it, so a window costs a few additions and drops the
+* pair entering it.
+*/
+static int vad_judge_windows (struct vad_state_t *vad, const unsigned char *buf, int have)
+{
+    int energy[VAD_BLOCKS], czr[VAD_BLOCKS];
+    int windows, blocks, b, k, e, z, p, frame_type;
+
+    if (have < FRAME_LEN)
+        return 0;
+
+    windows = (have - FRAME_LEN) / FRAME_OFFSET + 1;
+    blocks = (windows - 1) * VAD_STEP_BLOCKS + VAD_WINDOW_BLOCKS;
+
+    for (b = 0; b < blocks; b ++) {
+        p = b * VAD_BLOCK;
+        energy[b] = vad_energy (buf + p, VAD_BLOCK);
+        czr[b] = vad_czr (buf, p ? p : 1, p + VAD_BLOCK);
+    }
+
+    for (k = 0; k < windows * VAD_STEP_BLOCKS; k += VAD_STEP_BLOCKS) {
+        p = k * VAD_BLOCK;
+        e = z = 0;
+        for (b = k; b < k + VAD_WINDOW_BLOCKS; b ++) {
+            e += energy[b];
+            z += czr[b];
+        }
+        if (p)
+            z -= vad_czr (buf, p, p + 1);
+
+        frame_type = vad_judge_frame_type(vad, e / FRAME_LEN, z);
+        if (frame_type == FRAME_VOICE || frame_type == FRAME_SMOOTH_VOICE)
+            vad->valid += FRAME_OFFSET;
+    }
+
+    return windows * FRAME_OFFSET;
+}
+
+void vad_state_init (struct vad_state_t *vad, int gate)
+{
+    vad->gate = gate * gate;
+    vad->last[0] = vad->last[1] = vad->last[2] = FRAME_UNKNOW;
+    vad->valid = 0;
+}
+
+size_t vad_scan (struct vad_state_t *vad, const unsigned char *data, size_t n)
+{
+    size_t total = 0;
+    int p;
+
+    while (n >= FRAME_LEN) {
+        p = vad_judge_windows (vad, data, (int)MIN (n, (size_t)VAD_BUFFER_SIZE));
+        data += p;
+        n -= p;
+        total += p;
+    }
+
+    return total;
+}
+
+void vad_init (struct vad_t *vad, int gate)
+{
+    vad_state_init (&vad->st, gate);
+    vad->have = 0;
+}
+
+void vad_feed (struct vad_t *vad, const unsigned char *data, size_t n)
+{
+    int c, p;
+
+    while (n > 0) {
+        c = MIN ((size_t)(VAD_BUFFER_SIZE - vad->have), n);
+        memcpy (vad->buf + vad->have, data, c);
+        vad->have += c;
+        data += c;
+        n -= c;
+
+        /* 为实现平滑，采用滑动窗口，每次只偏移一个帧的2/5 */
+        p = (int)vad_scan (&vad->st, vad->buf, vad->have);
+
+        /** Less than a window left, it starts the next round */
+        vad->have -= p;
+        memmove (vad->buf, vad->buf + p, vad->have);
+    }
+}
+
+uint64_t vad_finish (struct vad_t *vad)
+{
+    int frame_type;
+
+    /** The last window is shorter and taken as a whole */
+    if (vad->have > 0) {
+        frame_type = vad_judge_frame_type(&vad->st,
+                        vad_energy (vad->buf, vad->have) / vad->have,
+                        vad_czr (vad->buf, 1, vad->have));
+        if (frame_type == FRAME_VOICE || frame_type == FRAME_SMOOTH_VOICE)
+            vad->st.valid += vad->have;
+        vad->have = 0;
+    }
+
+    return vad->st.valid;
+}
+
+/** Reference walk of one stream, windows judged one by one as before */
+static uint64_t vad_scan_scalar (const unsigned char *data, int n)
+{
+    struct vad_state_t vad;
+    int p, frame_type;
+
+    vad_state_init (&vad, VAD_ENERGY_GATE);
+    for (p = 0; n - p >= FRAME_LEN; p += FRAME_OFFSET) {
+        frame_type = vad_judge_frame_type(&vad, calc_frame_avg_energy(data + p, FRAME_LEN),
+                        calc_frame_czr(data + p, FRAME_LEN));
+        if (frame_type == FRAME_VOICE || frame_type == FRAME_SMOOTH_VOICE)
+            vad.valid += FRAME_OFFSET;
+    }
+    if (n - p > 0) {
+        frame_type = vad_judge_frame_type(&vad, calc_frame_avg_energy(data + p, n - p),
+                        calc_frame_czr(data + p, n - p));
+        if (frame_type == FRAME_VOICE || frame_type == FRAME_SMOOTH_VOICE)
+            vad.valid += (n - p);
+    }
+
+    return vad.valid;
+}
+
+/** Checks the kernels and the block walk against the reference, returns 0 on pass */
+int vad_test ()
+{
+    int s = 1 << 20, i, n, off, errors = 0;
+    struct vad_state_t st;
+    struct vad_t *vad;
+    unsigned char *a;
+
+    a = (unsigned char *) kmalloc (s, MPF_NOFLGS, -1);
+    vad = (struct vad_t *) kmalloc (sizeof (struct vad_t), MPF_NOFLGS, -1);
+    if (!a || !vad) {
+        errors = -1;
+        goto finish;
+    }
+
+    /** Quiet and loud stretches of a few hundred ms each */
+    srand (7);
+    for (i = 0; i < s; i ++)
+        a[i] = (unsigned char)(((i / 2400) % 3) ? (rand () & 0x80) | (0x40 + rand () % 0x40) :
+                        (rand () & 0xff));
+
+    for (off = 0; off < 64; off ++) {
+        for (n = 1; n <= FRAME_LEN; n ++) {
+            if (vad_energy (a + off, n) / n != calc_frame_avg_energy (a + off, n) ||
+                vad_czr (a + off, 1, n) != calc_frame_czr (a + off, n))
+                errors ++;
+        }
+    }
+
+    for (n = 0; n < 4 * VAD_BUFFER_SIZE; n += 1 + (n & 127)) {
+        vad_init (vad, VAD_ENERGY_GATE);
+        for (i = 0; i < n; i += 333)
+            vad_feed (vad, a + i, MIN (333, n - i));
+        if (vad_finish (vad) != vad_scan_scalar (a, n))
+            errors ++;
+
+        /** In place, as a buffer grows */
+        vad_state_init (&st, VAD_ENERGY_GATE);
+        for (off = 0, i = 0; i < n; i += 333)
+            off += (int)vad_scan (&st, a + off, MIN (i + 333, n) - off);
+        if (st.valid != vad_scan_scalar (a, off))
+            errors ++;
+    }
+
+    /** The whole buffer, fed the way recordings are read */
+    vad_init (vad, VAD_ENERGY_GATE);
+    for (i = 0; i < s; i += 4096)
+        vad_feed (vad, a + i, 4096);
+    if (vad_finish (vad) != vad_scan_scalar (a, s))
+        errors ++;
+
+    if (errors)
+        rt_log_error (ERRNO_FATAL, "vad: %d windows judged otherwise than the reference", errors);
+
+finish:
+    kfree (a);
+    kfree (vad);
+    return errors;
+}
@@ -0,0 +1,63 @@
+#ifndef __VAD_H__
+#define __VAD_H__
+
+/** A window of FRAME_LEN bytes slides FRAME_OFFSET bytes a step */
+#define FRAME_LEN    160
+
+#define FRAME_OFFSET (FRAME_LEN * 2 / 5)
+
+enum FRAME_TYPE
+{
+    FRAME_UNKNOW,
+    FRAME_VOICE,
+    FRAME_SMOOTH_VOICE,
+    FRAME_SILENCE
+};
+
+/** 能量门限值，当前先取0x52 */
+#define VAD_ENERGY_GATE     0x52
+
+/** Bytes buffered between two vad_feed calls, windows are judged in place */
+#define VAD_BUFFER_SIZE     4096
+
+/** Judging state of one a-law stream, whose bytes stay with the caller */
+struct vad_state_t {
+    /** Squared energy gate */
+    int         gate;
+    /** Types of the last three windows, newest first */
+    int         last[3];
+    /** Bytes judged as voice */
+    uint64_t    valid;
+};
+
+/**
+* Voice activity of one a-law stream. All state lives here, so any
+* number of streams may be judged at once on any threads.
+*/
+struct vad_t {
+    struct vad_state_t  st;
+    /** Bytes from the start of the next window on */
+    int         have;
+    unsigned char   buf[VAD_BUFFER_SIZE];
+};
+
+extern void vad_state_init (struct vad_state_t *vad, int gate);
+
+/**
+* Judge the full windows of data in place and return the bytes they
+* consumed. Call again from data + the result once more bytes follow.
+*/
+extern size_t vad_scan (struct vad_state_t *vad, const unsigned char *data, size_t n);
+
+extern void vad_init (struct vad_t *vad, int gate);
+
+/** Judge the next n bytes of the stream, in pieces of any size. */
+extern void vad_feed (struct vad_t *vad, const unsigned char *data, size_t n);
+
+/** Judge the last, shorter window and return the bytes of voice. */
+extern uint64_t vad_finish (struct vad_t *vad);
+
+/** Equivalence check, returns 0 on pass. */
+extern int vad_test ();
+
+#endif
@@ -17,7 +17,7 @@ static struct vpm_t vpm = {
 	.ip = "192.168.50.4",
 	.port = 2050,
 	
-	.web_sock = -1,
+	.web_listen = 0,
 	.web = "192.168.50.12",
 	.web_port = 2020,
 	.seq = ATOMIC_INIT(0),
@@ -27,6 +27,7 @@ static struct vpm_t vpm = {
 	.notify_mq	= MQ_ID_INVALID,
 	.mass_mq = MQ_ID_INVALID,
 	.regular_mq = MQ_ID_INVALID,
+	.cate_mq = MQ_ID_INVALID,
 	.flags = ATOMIC_INIT(0),
 };
 
@@ -114,11 +114,40 @@ struct vdu_t{
 	atomic_t  stop_times;
 };
 
+/** Broadcasts whose queue time is remembered for the ack lag, per VPW */
+#define	VPW_LAG_RING	64
+
 struct	vpw_clnt_t {
 	int	sock;
 	struct	list_head	list;
 	struct	vpm_t	*vpm;
-	MQ_ID	mq;		/** Unused. private message queue */
+	MQ_ID	mq;		/** Queue of the worker handling this VPW's requests */
+
+	/** "ip:port" of the peer, for logging */
+	char	peer[32];
+
+	/** TLV bytes read but not yet a whole frame */
+	char	*rbuf;
+	int	rsize;
+
+	/** Frames waiting for the socket to become writable */
+	struct	list_head	obuf;
+	size_t	obytes;
+
+	/** epoll events currently armed */
+	uint32_t	events;
+
+	/** set when the connection must be dropped */
+	int	dead;
+
+	/** Broadcast delivery. notified is also the seq of the last req_notify_sync,
+	    acked the last seq the VPW sent back. Times are in usec. */
+	uint64_t	notified, acked;
+	uint64_t	notify_us[VPW_LAG_RING];
+	uint64_t	lag_last, lag_max, lag_sum, lags;
+
+	/** VPW_CAP_* the VPW advertised, a sync is only sent with VPW_CAP_SYNC */
+	int	caps;
 };
 
 #define	VPM_FLGS_CONN_BIT	(0)
@@ -136,7 +165,8 @@ struct vpm_t {
 	/** used in VPM, 255.255.255.255 */
 	char			web[16];
 	uint16_t		web_port;
-	int			web_sock;
+	/** extra WEB clients connect here, 0 if none */
+	uint16_t		web_listen;
 	atomic64_t	seq;
 
 	/**	VPW <-> VPM */
@@ -144,7 +174,7 @@ struct vpm_t {
 	struct	list_head	clnt_socks_list;
 	int			clnt_socks;
 	rt_mutex		clnt_socks_lock;
-	MQ_ID		notify_mq, mass_mq, regular_mq, boost_mq, cdb_mq, target_mq;
+	MQ_ID		notify_mq, mass_mq, regular_mq, boost_mq, cdb_mq, target_mq, cate_mq, intake_mq;
 
 	/** used in VPW */
 	int		sock;
@@ -177,6 +207,8 @@ struct vpw_t{
 	atomic_t   score_threshold;
 	atomic_t   clue_layer_filter;
 	atomic_t   stage_time[3];
+	/** Percent of a stage that must be speech before it is matched, 0 for none */
+	atomic_t   stage_speech;
 	atomic_t   short_voice_enable;
 	struct cdr_t cdr;
 };
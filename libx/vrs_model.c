@@ -5,6 +5,16 @@
 
 INIT_MUTEX(modelist_lock);
 
+/** How wavs loaded into a model list become models, vpm puts its cache in front */
+static int (*sg_wav_to_model) (const char *wav_file, uint8_t *mdl_cache,
+			int *wlen1, int *wlen2, int is_alaw) = WavToModelMemory;
+
+void modelist_converter_set (int (*convert) (const char *wav_file, uint8_t *mdl_cache,
+			int *wlen1, int *wlen2, int is_alaw))
+{
+	sg_wav_to_model = convert ? convert : WavToModelMemory;
+}
+
 static __rt_always_inline__ int sg_abstract_owner (const char *string, char *sg_owner)
 {
 	/* model formate: "%lu-%d" when upload with CBP, massive formate : %callid  **/
@@ -127,7 +137,7 @@ int sg_load_model_memory (const char *root, const char *model, struct modelist_t
 
 	if (!xerror) {
         snprintf (path, 256 - 1, "%s/%s", root, model);
-        xerror = WavToModelMemory(path, list->sg_data[list->sg_cur_size], &wlen1, &wlen2, W_NOALAW);
+        xerror = sg_wav_to_model(path, list->sg_data[list->sg_cur_size], &wlen1, &wlen2, W_NOALAW);
         if (0 != xerror)
         {
             rt_log_error(ERRNO_FATAL, "WavToModelMemory(%s) error(%d)", path, xerror);
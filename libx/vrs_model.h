@@ -5,6 +5,8 @@
 
 int	WavToProbability (const char* wav_file, void *, int *md_index, int is_alaw);
 int WavToProbabilityAdvanced (const char* wav_file, void *, float *sg_score, int *md_index, int is_alaw);
+int	WavToFeature (const char* wav_file, void *featbuf, int is_alaw);
+int	FeatureToProbability (void *featbuf, void *, float *sg_score, int *md_index);
 int   WavToModelMemory (const char *wav_file, uint8_t *mdl_cache, int *wlen1, int *wlen2, int is_alaw);
 int   WavToModel (const char *wav_file, const char* mod_file, int *wlen1, int *wlen2, int is_alaw);
 int   ModelToDisk (const char *mfile, void *model, int msize);
@@ -34,6 +36,10 @@ extern struct modelist_t *modelist_create (int64_t sg_max_size);
 /** Destroy an existent Model List */
 extern void modelist_destroy (struct modelist_t *m);
 
+/** Replace WavToModelMemory for wavs loaded into model lists, NULL restores it. */
+extern void modelist_converter_set (int (*convert) (const char *wav_file, uint8_t *mdl_cache,
+			int *wlen1, int *wlen2, int is_alaw));
+
 /** Get model count for a specific directory. */
 extern int sg_get_max_models (char *model_realpath, time_t tt);
 
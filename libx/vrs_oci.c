@@ -198,10 +198,12 @@ void vrs_oci_conn_tmr (uint32_t __attribute__((__unused__))uid, int __attribute_
  创建人     : yuansheng
  备注      :
 ****************************************************************************/
+#define CDB_BATCH   32
+
 void *SGCDBWriter(void *param)
 {
-    int s = 0;
-    void *data = NULL;
+    int s[CDB_BATCH], n, i;
+    void *data[CDB_BATCH];
     char sql[512] = {0};
     struct vpm_t            *vpm;
     struct vrs_trapper_t    *rte;
@@ -214,7 +216,6 @@ void *SGCDBWriter(void *param)
 
     FOREVER
     {
-        data = NULL;
         st = oci_state;
         cn = oci_connection;
         if (!cn || !st)
@@ -222,33 +223,28 @@ void *SGCDBWriter(void *param)
             sleep(2);
             continue;
         }
-        /** Recv from internal queue */
-        rt_mq_recv (vpm->cdb_mq, &data, &s);
-        if (unlikely(!data))
-        {
-            continue;
-        }
+        /** Recv from internal queue, whatever is waiting up to CDB_BATCH */
+        n = rt_mq_recv_batch (vpm->cdb_mq, data, s, CDB_BATCH);
 
-        _this = (struct counter_upload_t *)data;
-        snprintf(sql, 512, "insert into hitcount (id,time,hitsession,totalsession,vpwid) values(seq_hitcount.nextval, \'%s\', %d, %d, %d)",
-                  _this->tm, _this->hitted_sum, _this->matched_sum, _this->vpw_id);
-        rt_log_debug ("go to do sql[%s]", sql);
-        //执行sql语句
-        if (!OCI_ExecuteStmt(st, sql))
+        for (i = 0; i < n; i ++)
         {
+            _this = (struct counter_upload_t *)data[i];
+            if (unlikely(!_this))
+                continue;
+            snprintf(sql, 512, "insert into hitcount (id,time,hitsession,totalsession,vpwid) values(seq_hitcount.nextval, \'%s\', %d, %d, %d)",
+                      _this->tm, _this->hitted_sum, _this->matched_sum, _this->vpw_id);
+            rt_log_debug ("go to do sql[%s]", sql);
+            //执行sql语句
+            if (!OCI_ExecuteStmt(st, sql))
                 err_handler (OCI_GetLastError());
-                goto memfree;
         }
-        
-        //提交
-        if (!OCI_Commit(cn))
-        {
-                err_handler (OCI_GetLastError());
-                goto memfree;
-        }
-memfree:
-        kfree(data);
-        data = NULL;
+
+        //提交, 一批一次
+        if (n > 0 && !OCI_Commit(cn))
+            err_handler (OCI_GetLastError());
+
+        for (i = 0; i < n; i ++)
+            kfree(data[i]);
     }
     task_deregistry_id (pthread_self ());
     return NULL;
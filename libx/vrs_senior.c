@@ -1258,6 +1258,42 @@ int senior_check_nfs_mount()
     return call_bash_check_status("mount | grep /vrs > /dev/null");
 }
 
+/****************************************************************************
+ 函数名称  : senior_notify_seq_to_req
+ 函数功能    : 将广播序号转换成tlv包(req_notify_sync或req_notify_ack)
+ 输入参数    : seq, 广播序号; type, 请求类型
+ 输出参数    : request, tlv请求包
+ 返回值     : tlv包的总长度
+ 备注      :
+****************************************************************************/
+int senior_notify_seq_to_req(uint64_t seq, vpm_vpw_req_e type, OUT struct tlv *request)
+{
+    TOPN_CHECK_POINTER(request);
+
+    snprintf(request->v, sizeof(request->v)-STR_OVER_CHAR_LEN, "%lu", seq);
+    request->t = type;
+    request->l = strlen(request->v) + STR_OVER_CHAR_LEN;
+    return request->l + TLV_FRAME_HEAD_LEN;
+}
+
+/****************************************************************************
+ 函数名称  : senior_req_to_notify_seq
+ 函数功能    : 从req_notify_sync/req_notify_ack中取出广播序号
+ 输入参数    : request, tlv请求包
+ 输出参数    : seq, 广播序号
+ 返回值     : -1错误;0正确
+ 备注      :
+****************************************************************************/
+int senior_req_to_notify_seq(IN struct tlv *request, OUT uint64_t *seq)
+{
+    TOPN_CHECK_POINTER(request);
+    TOPN_CHECK_POINTER(seq);
+
+    if (1 != sscanf(request->v, "%lu", seq))
+        return -1;
+    return 0;
+}
+
 
 
 
@@ -15,9 +15,15 @@ typedef enum {
     req_update_stat, // 更新统计信息，特指线索命中时候的话务量和命中数目
     req_update_topn, // vpm-->vpw
     req_topn_query,  // vpw --> vpm, vpw请求vpm此topn是否可入围全局topn
+    req_notify_sync, // vpm-->vpw, 跟在每个广播后面, 值为该连接上的广播序号
+    req_notify_ack,  // vpw-->vpm, 之前的广播都已处理, 原样回送sync的序号
+    req_notify_caps, // vpw-->vpm, 连接后第一个请求, 值为VPW_CAP_*位图, 老版本vpw不发
     req_max
 } vpm_vpw_req_e;
 
+/** req_notify_caps, what a VPW understands beyond the plain broadcasts */
+#define VPW_CAP_SYNC    (1 << 0)    /** req_notify_sync in, req_notify_ack out */
+
 typedef enum {
     threshold_accu = 101, /*  精准模式 */
     threshold_expl = 102, /*  搜寻模式 */
@@ -98,6 +104,8 @@ extern int senior_topn_table_init(void);
 extern void senior_save_topn_bucket_disc(uint32_t __attribute__((__unused__)) uid,
                   int __attribute__((__unused__))argc, char **argv);
 extern int senior_check_nfs_mount();
+extern int senior_notify_seq_to_req(uint64_t seq, vpm_vpw_req_e type, OUT struct tlv *request);
+extern int senior_req_to_notify_seq(IN struct tlv *request, OUT uint64_t *seq);
 
 #endif
 
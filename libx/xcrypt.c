@@ -0,0 +1,150 @@
+#include "sysdefs.h"
+#include "xcrypt.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void xcrypt_xor (void *data, size_t s)
+{
+	uint8_t	*p = (uint8_t *)data;
+	uint64_t	w, k64 = 0x0101010101010101ULL * XCRYPT_KEY;
+	size_t	i = 0;
+
+#ifdef __SSE2__
+	__m128i	k = _mm_set1_epi8 ((char)XCRYPT_KEY), a, b, c, d;
+
+	/** 64 bytes a round */
+	for (; i + 64 <= s; i += 64) {
+		a = _mm_loadu_si128 ((__m128i *)(p + i));
+		b = _mm_loadu_si128 ((__m128i *)(p + i + 16));
+		c = _mm_loadu_si128 ((__m128i *)(p + i + 32));
+		d = _mm_loadu_si128 ((__m128i *)(p + i + 48));
+		_mm_storeu_si128 ((__m128i *)(p + i), _mm_xor_si128 (a, k));
+		_mm_storeu_si128 ((__m128i *)(p + i + 16), _mm_xor_si128 (b, k));
+		_mm_storeu_si128 ((__m128i *)(p + i + 32), _mm_xor_si128 (c, k));
+		_mm_storeu_si128 ((__m128i *)(p + i + 48), _mm_xor_si128 (d, k));
+	}
+#endif
+
+	for (; i + 8 <= s; i += 8) {
+		memcpy (&w, p + i, 8);
+		w ^= k64;
+		memcpy (p + i, &w, 8);
+	}
+
+	for (; i < s; i ++)
+		p[i] ^= XCRYPT_KEY;
+}
+
+int xcrypt_open (struct xcrypt_stream_t *xs, const char *file)
+{
+	struct stat st;
+
+	memset (xs, 0, sizeof (*xs));
+
+	xs->fd = open (file, O_RDONLY);
+	if (xs->fd < 0) {
+		rt_log_notice ("%s: %s", file, strerror (errno));
+		return -1;
+	}
+
+	if (fstat (xs->fd, &st) < 0) {
+		rt_log_notice ("%s: %s", file, strerror (errno));
+		close (xs->fd);
+		xs->fd = -1;
+		return -1;
+	}
+	xs->size = st.st_size;
+
+	posix_fadvise (xs->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return 0;
+}
+
+ssize_t xcrypt_read (struct xcrypt_stream_t *xs, void *buf, size_t s)
+{
+	ssize_t	n;
+
+	do {
+		n = read (xs->fd, buf, s);
+	} while (n < 0 && errno == EINTR);
+
+	if (n <= 0)
+		return n;
+
+	xcrypt_xor (buf, (size_t)n);
+	xs->off += n;
+
+	return n;
+}
+
+void xcrypt_close (struct xcrypt_stream_t *xs)
+{
+	if (xs->fd >= 0)
+		close (xs->fd);
+	xs->fd = -1;
+}
+
+ssize_t xcrypt_file (const char *file, FILE *fp)
+{
+	struct xcrypt_stream_t xs;
+	ssize_t	n, total = 0;
+	char	*buf;
+
+	if (xcrypt_open (&xs, file) < 0)
+		return -1;
+
+	buf = (char *)kmalloc (XCRYPT_CHUNK, MPF_NOFLGS, -1);
+	if (unlikely (!buf)) {
+		xcrypt_close (&xs);
+		return -1;
+	}
+
+	while ((n = xcrypt_read (&xs, buf, XCRYPT_CHUNK)) > 0) {
+		if (fwrite (buf, 1, n, fp) != (size_t)n) {
+			n = -1;
+			break;
+		}
+		total += n;
+	}
+
+	kfree (buf);
+	xcrypt_close (&xs);
+
+	return n < 0 ? -1 : total;
+}
+
+/** Checks xcrypt_xor against the byte loop it replaced, returns 0 on pass */
+int xcrypt_test ()
+{
+	size_t	s = 1 << 20, i, off, n;
+	uint8_t	*a, *b;
+	int	errors = 0;
+
+	a = (uint8_t *)kmalloc (s + 64, MPF_NOFLGS, -1);
+	b = (uint8_t *)kmalloc (s + 64, MPF_NOFLGS, -1);
+	if (!a || !b) {
+		errors = -1;
+		goto finish;
+	}
+
+	for (i = 0; i < s + 64; i ++)
+		a[i] = b[i] = (uint8_t)(i * 131 + (i >> 7));
+
+	/** Unaligned heads and odd tails, short ones and one long run */
+	for (off = 0; off < 17; off ++) {
+		n = (off == 16) ? s : (off * 7 + off);
+		xcrypt_xor (a + off, n);
+		for (i = 0; i < n; i ++)
+			b[off + i] ^= XCRYPT_KEY;
+		if (memcmp (a, b, s + 64)) {
+			rt_log_error (ERRNO_FATAL, "xcrypt_xor differs at offset %zu, %zu bytes", off, n);
+			errors ++;
+		}
+	}
+
+finish:
+	kfree (a);
+	kfree (b);
+	return errors;
+}
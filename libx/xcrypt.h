@@ -0,0 +1,37 @@
+#ifndef __XCRYPT_H__
+#define __XCRYPT_H__
+
+/** Key SVM encrypts stored voice and fax recordings with */
+#define	XCRYPT_KEY		0x53
+
+/** Bytes read and decrypted at a time by xcrypt_file */
+#define	XCRYPT_CHUNK	(256 << 10)
+
+/** An encrypted recording read as plain data. */
+struct xcrypt_stream_t {
+	int		fd;
+	off_t	size, off;
+};
+
+/** Decrypt s bytes of data in place. */
+extern void xcrypt_xor (void *data, size_t s);
+
+/** Open an encrypted file for xcrypt_read, 0 on success. */
+extern int xcrypt_open (struct xcrypt_stream_t *xs, const char *file);
+
+/**
+* Read the next plain bytes of the file straight into the caller's buf,
+* no intermediate file or copy. Returns the bytes read, 0 at the end
+* of the file and -1 on error.
+*/
+extern ssize_t xcrypt_read (struct xcrypt_stream_t *xs, void *buf, size_t s);
+
+extern void xcrypt_close (struct xcrypt_stream_t *xs);
+
+/** Append the plain content of an encrypted file to fp, returns the bytes written or -1. */
+extern ssize_t xcrypt_file (const char *file, FILE *fp);
+
+/** Equivalence check, returns 0 on pass. */
+extern int xcrypt_test ();
+
+#endif
@@ -1,6 +1,7 @@
 #include "sysdefs.h"
 #include "fax_decode.h"
 #include "G711.h"
+#include "xcrypt.h"
 
 #define DISBIT1     0x01
 #define DISBIT2     0x02
@@ -38,6 +39,14 @@ static const struct
     {    0, 0, 0, 0}
 };
 
+/** Rates the receivers are set up with in fax_context_init */
+#define FAX_V17_RATE		14400
+#define FAX_V29_RATE		9600
+#define FAX_V27TER_RATE	4800
+
+/** Bytes fax_decode_xcrypt reads at a time, whole chunks of samples */
+#define FAX_XCRYPT_BLOCK	(G711_BULK_SAMPLES / SAMPLES_PER_CHUNK * SAMPLES_PER_CHUNK)
+
 int decode_test = FALSE;
 int rx_bits = 0;
 
@@ -51,6 +60,8 @@ static struct fax_context_t default_fax_context = {
 	.octets_per_ecm_frame = 256,
 	.error_correcting_mode = FALSE,
 	.current_fallback = 0,
+	.modem = FAX_NONE,
+	.bit_rate = 0,
 };
 
 static inline void decode_20digit_msg(const uint8_t *pkt, int len)
@@ -127,6 +138,68 @@ static inline void print_frame (struct fax_context_t *fctx, const char *io, cons
 	}
 }
 
+static inline int fax_modem_of (int modem_type)
+{
+	switch (modem_type) {
+		case T30_MODEM_V17:
+			return FAX_V17_RX;
+		case T30_MODEM_V29:
+			return FAX_V29_RX;
+		case T30_MODEM_V27TER:
+			return FAX_V27TER_RX;
+	}
+
+	return FAX_NONE;
+}
+
+/**
+* Feed only modem from now on, restarted at the negotiated rate. The
+* training that follows the DCS is then heard by the right receiver.
+*/
+static void fax_modem_select (struct fax_context_t *fctx, int modem, int bit_rate)
+{
+	if (fctx->all_modems)
+		return;
+
+	if (fctx->modem == modem && fctx->bit_rate == bit_rate)
+		return;
+
+	switch (modem) {
+		case FAX_V17_RX:
+			v17_rx_restart (fctx->v17, bit_rate, FALSE);
+			break;
+		case FAX_V29_RX:
+			v29_rx_restart (fctx->v29, bit_rate, FALSE);
+			break;
+		case FAX_V27TER_RX:
+			v27ter_rx_restart (fctx->v27ter, bit_rate, FALSE);
+			break;
+	}
+
+	rt_log_debug ("Image modem %d at %d bps", modem, bit_rate);
+	fctx->modem = modem;
+	fctx->bit_rate = bit_rate;
+}
+
+/** Back to every receiver at its initial rate, negotiation unknown */
+static void fax_modem_reset (struct fax_context_t *fctx)
+{
+	switch (fctx->modem) {
+		case FAX_V17_RX:
+			v17_rx_restart (fctx->v17, FAX_V17_RATE, FALSE);
+			break;
+		case FAX_V29_RX:
+			v29_rx_restart (fctx->v29, FAX_V29_RATE, FALSE);
+			break;
+		case FAX_V27TER_RX:
+			v27ter_rx_restart (fctx->v27ter, FAX_V27TER_RATE, FALSE);
+			break;
+	}
+
+	fctx->modem = FAX_NONE;
+	fctx->bit_rate = 0;
+}
+
 static int check_rx_dcs (struct fax_context_t *fctx, const uint8_t *msg, int len)
 {
 	static const int widths[3][4] =
@@ -175,8 +248,13 @@ static int check_rx_dcs (struct fax_context_t *fctx, const uint8_t *msg, int len
 
 	fprintf(stderr, "Selected compression %d\n", fctx->line_encoding);
 
-	if ((fctx->current_fallback = find_fallback_entry(dcs_frame[4] & (DISBIT6 | DISBIT5 | DISBIT4 | DISBIT3))) < 0)
+	if ((fctx->current_fallback = find_fallback_entry(dcs_frame[4] & (DISBIT6 | DISBIT5 | DISBIT4 | DISBIT3))) < 0) {
 		printf("Remote asked for a modem standard we do not support\n");
+		fax_modem_reset (fctx);
+	}
+	else
+		fax_modem_select (fctx, fax_modem_of (fallback_sequence[fctx->current_fallback].modem_type),
+			fallback_sequence[fctx->current_fallback].bit_rate);
 
 	fctx->error_correcting_mode = ((dcs_frame[6] & DISBIT3) != 0);
 
@@ -412,19 +490,12 @@ int fax_converto_alaw (const char *src, const char *alaw_file)
 {
 
 	struct xlaw_head_t ahead;
-	FILE	*fpin, *fpout;
-	char	c;
+	FILE	*fpout;
 	struct stat st;  
-	
-	fpin = fopen(src, "r");  
-	if (NULL == fpin)  {  
-		rt_log_notice ("%s: %s", src, strerror(errno));
-		return -1;  
-	}  
+	ssize_t	s;
 
 	if (stat(src, &st) != 0) {  
 		rt_log_notice ("%s: %s", src, strerror(errno));
-		fclose (fpin);
 		return -1;  
 	} 
 	
@@ -432,21 +503,16 @@ int fax_converto_alaw (const char *src, const char *alaw_file)
 	
 	fpout = fopen (alaw_file, "w+");
 	if (NULL == fpout)  {  
-		fclose (fpin);  
 		rt_log_notice ("%s: %s", alaw_file, strerror(errno));
 		return -1;
 	}
 	
 	fwrite (&ahead, sizeof (struct xlaw_head_t), 1, fpout);
-	while (1 == fread (&c, sizeof(char), 1, fpin))  {
-		c = c ^ 0x53;
-		fputc(c, fpout);
-	}
+	s = xcrypt_file (src, fpout);
 
-	fclose (fpin);
 	fclose (fpout);
 	
-	return 0;
+	return s < 0 ? -1 : 0;
 }
 
 int fax_context_init (struct fax_context_t *fctx)
@@ -467,10 +533,10 @@ int fax_context_init (struct fax_context_t *fctx)
 
 	hdlc_rx_init (&fctx->hdlcrx, FALSE, TRUE, 5, hdlc_accept, (void *)fctx);
 	fctx->fsk = fsk_rx_init		(NULL, &preset_fsk_specs[FSK_V21CH2], FSK_FRAME_MODE_SYNC, v21_put_bit, (void *)fctx);
-	fctx->v17 = v17_rx_init	(NULL, 14400, v17_put_bit, (void *)fctx);
-	fctx->v29 = v29_rx_init	(NULL, 9600, v29_put_bit, (void *)fctx);
+	fctx->v17 = v17_rx_init	(NULL, FAX_V17_RATE, v17_put_bit, (void *)fctx);
+	fctx->v29 = v29_rx_init	(NULL, FAX_V29_RATE, v29_put_bit, (void *)fctx);
 	//fctx->v29 = v29_rx_init	(NULL, 7200, v29_put_bit, NULL);
-	fctx->v27ter = v27ter_rx_init	(NULL, 4800, v27ter_put_bit, (void *)fctx);
+	fctx->v27ter = v27ter_rx_init	(NULL, FAX_V27TER_RATE, v27ter_put_bit, (void *)fctx);
 
 	fsk_rx_signal_cutoff	(fctx->fsk, -45.5);
 	v17_rx_signal_cutoff	(fctx->v17, -45.5);
@@ -529,6 +595,44 @@ SNDFILE *rt_sf_open (const char *alaw_file, int sfm)
 	return sfp;
 }
 
+/**
+* Feed s samples to V.21 and the image modem(s). Returns -1, with
+* fctx->timedout set, once the deadline of the decode has passed.
+*/
+static int fax_demodulate (struct fax_context_t *fctx, int16_t *amp, int s)
+{
+	if (fctx->deadline && rt_time_ms () > fctx->deadline) {
+		fctx->timedout = 1;
+		return -1;
+	}
+
+	/** V.21 carries the control frames, the DCS among them, at any time */
+	fsk_rx (fctx->fsk, amp, s);
+
+	fctx->chunks ++;
+	switch (fctx->modem) {
+		case FAX_V17_RX:
+			v17_rx (fctx->v17, amp, s);
+			fctx->narrowed ++;
+			break;
+		case FAX_V29_RX:
+			v29_rx (fctx->v29, amp, s);
+			fctx->narrowed ++;
+			break;
+		case FAX_V27TER_RX:
+			v27ter_rx (fctx->v27ter, amp, s);
+			fctx->narrowed ++;
+			break;
+		default:
+			v17_rx (fctx->v17, amp, s);
+			v29_rx (fctx->v29, amp, s);
+			v27ter_rx (fctx->v27ter, amp, s);
+			break;
+	}
+
+	return 0;
+}
+
 int fax_decode_alaw (struct fax_context_t *fctx, const char *file_real_path)
 {
 	char file_realpath [256] = {0};
@@ -539,36 +643,321 @@ int fax_decode_alaw (struct fax_context_t *fctx, const char *file_real_path)
 
 	memset(&info, 0, sizeof(info));
 		
+	fctx->timedout = 0;
+
 	sfp = rt_sf_open (file_real_path, SFM_READ);
+	if (unlikely (!sfp)) {
+		rt_log_notice ("Cannot open audio file(\"%s\")", file_real_path);
+		return -1;
+	}
 
 	sprintf(file_realpath, "%s.tif", file_real_path);
 	if (t4_rx_init (&fctx->t4_rx_state, file_realpath, T4_COMPRESSION_ITU_T4_2D) == NULL){
+		sf_close (sfp);
 		return -1;
 	}
 
+	/** A new call, nothing negotiated yet */
+	fax_modem_reset (fctx);
+	fctx->chunks = fctx->narrowed = 0;
+
 	FOREVER	{
 		s = sf_readf_short (sfp, amp, SAMPLES_PER_CHUNK);
 		if (s < SAMPLES_PER_CHUNK)
 			break;
 
-		fsk_rx (fctx->fsk, amp, s);
-		v17_rx (fctx->v17, amp, s);
-		v29_rx (fctx->v29, amp, s);
-		v27ter_rx (fctx->v27ter, amp, s);
+		if (fax_demodulate (fctx, amp, s) < 0)
+			break;
 	}
 	
 	t4_rx_release (&fctx->t4_rx_state);
+
+	rt_log_info ("Fax demodulation: %lu chunks, %lu on the negotiated modem only",
+		fctx->chunks, fctx->narrowed);
 	
 	if (sf_close(sfp)){
 		rt_log_notice ("Cannot close audio file(\"%s\")", file_realpath);
 		return -1;
 	}
 
+	if (fctx->timedout) {
+		rt_log_notice ("Fax decode timed out (\"%s\")", file_real_path);
+		return -1;
+	}
+
 	rt_log_info ("Fax decode %s (\"%s\")", rt_file_exsit (file_realpath) ? "success" : "failure", file_realpath);
 	
 	return 0;
 }
 
+int fax_decode_xcrypt (struct fax_context_t *fctx, const char *src, const char *alaw_file)
+{
+	struct xcrypt_stream_t xs;
+	struct xlaw_head_t ahead;
+	char	tif[256];
+	uint8_t	*data = NULL;
+	int16_t	*amp = NULL;
+	FILE	*fpout = NULL;
+	ssize_t	n = 0, i, c;
+	int	xret = -1;
+
+	fctx->timedout = 0;
+
+	if (xcrypt_open (&xs, src) < 0)
+		return -1;
+
+	data = (uint8_t *)kmalloc (FAX_XCRYPT_BLOCK, MPF_NOFLGS, -1);
+	amp = (int16_t *)kmalloc (FAX_XCRYPT_BLOCK * sizeof (int16_t), MPF_NOFLGS, -1);
+	if (unlikely (!data || !amp))
+		goto finish;
+
+	if (alaw_file) {
+		fpout = fopen (alaw_file, "w");
+		if (NULL == fpout)
+			rt_log_notice ("%s: %s", alaw_file, strerror(errno));
+		else {
+			alaw_head_init (&ahead, xs.size, 8000, 1, 8);
+			fwrite (&ahead, sizeof (struct xlaw_head_t), 1, fpout);
+		}
+	}
+
+	snprintf (tif, sizeof (tif), "%s.tif", src);
+	if (t4_rx_init (&fctx->t4_rx_state, tif, T4_COMPRESSION_ITU_T4_2D) == NULL)
+		goto finish;
+
+	/** A new call, nothing negotiated yet */
+	fax_modem_reset (fctx);
+	fctx->chunks = fctx->narrowed = 0;
+
+	while (!fctx->timedout && (n = xcrypt_read (&xs, data, FAX_XCRYPT_BLOCK)) > 0) {
+		if (fpout)
+			fwrite (data, 1, n, fpout);
+
+		rt_g711_decode_bulk (G711_ALAW, amp, data, n);
+		/** Whole chunks only, fax_decode_alaw stops at a short one too */
+		c = SAMPLES_PER_CHUNK;
+		for (i = 0; i + c <= n; i += c) {
+			if (fax_demodulate (fctx, amp + i, c) < 0)
+				break;
+		}
+		if (n % SAMPLES_PER_CHUNK)
+			break;
+	}
+
+	t4_rx_release (&fctx->t4_rx_state);
+
+	rt_log_info ("Fax demodulation: %lu chunks, %lu on the negotiated modem only",
+		fctx->chunks, fctx->narrowed);
+
+	if (n < 0)
+		rt_log_notice ("%s: %s", src, strerror(errno));
+	else if (fctx->timedout)
+		rt_log_notice ("Fax decode timed out (\"%s\")", src);
+	else {
+		rt_log_info ("Fax decode %s (\"%s\")", rt_file_exsit (tif) ? "success" : "failure", tif);
+		xret = 0;
+	}
+
+finish:
+	if (fpout)
+		fclose (fpout);
+	kfree (amp);
+	kfree (data);
+	xcrypt_close (&xs);
+
+	return xret;
+}
+
+/**
+* Pages of two TIFF files hold the same images. Other tags are not looked
+* at, t4_rx stamps every file with the time it was written.
+*/
+int fax_tiff_same (const char *x, const char *y)
+{
+	TIFF	*tx, *ty;
+	uint32_t	wx, wy, hx, hy;
+	tstrip_t	i, strips;
+	tsize_t	size, nx, ny;
+	uint8_t	*bx = NULL, *by = NULL;
+	int	same = 0, more;
+
+	tx = TIFFOpen (x, "r");
+	ty = TIFFOpen (y, "r");
+	if (!tx || !ty)
+		goto finish;
+
+	do {
+		if (!TIFFGetField (tx, TIFFTAG_IMAGEWIDTH, &wx) || !TIFFGetField (ty, TIFFTAG_IMAGEWIDTH, &wy) ||
+			!TIFFGetField (tx, TIFFTAG_IMAGELENGTH, &hx) || !TIFFGetField (ty, TIFFTAG_IMAGELENGTH, &hy) ||
+			wx != wy || hx != hy)
+			goto finish;
+
+		strips = TIFFNumberOfStrips (tx);
+		size = TIFFStripSize (tx);
+		if (strips != TIFFNumberOfStrips (ty) || size != TIFFStripSize (ty))
+			goto finish;
+
+		bx = (uint8_t *)kmalloc (size, MPF_NOFLGS, -1);
+		by = (uint8_t *)kmalloc (size, MPF_NOFLGS, -1);
+		if (!bx || !by)
+			goto finish;
+
+		/** Decoded rows, not the T.4 coding of them */
+		for (i = 0; i < strips; i ++) {
+			nx = TIFFReadEncodedStrip (tx, i, bx, size);
+			ny = TIFFReadEncodedStrip (ty, i, by, size);
+			if (nx < 0 || nx != ny || memcmp (bx, by, nx))
+				goto finish;
+		}
+		kfree (bx);
+		kfree (by);
+		bx = by = NULL;
+
+		more = TIFFReadDirectory (tx);
+		if (more != TIFFReadDirectory (ty))
+			goto finish;
+	} while (more);
+
+	same = 1;
+
+finish:
+	kfree (bx);
+	kfree (by);
+	if (tx)
+		TIFFClose (tx);
+	if (ty)
+		TIFFClose (ty);
+
+	return same;
+}
+
+/**
+* Encrypt the samples of a plain A-law WAV as SVM stores them, decode
+* both with fax_decode_alaw and fax_decode_xcrypt, the pages must match.
+* Returns 0 if they do, -1 if not or if the test could not run.
+*/
+int fax_xcrypt_test (const char *wav)
+{
+#define XTEST_WAV	"/tmp/fax_xcrypt_test.wav"
+#define XTEST_SRC	"/tmp/fax_xcrypt_test"
+	struct fax_context_t *fctx = NULL;
+	char	path[PATH_MAX];
+	uint8_t	*buf = NULL;
+	uint32_t	size;
+	FILE	*fp = NULL;
+	struct stat st;
+	size_t	off = 12;
+	int	xret = -1;
+
+	if (!realpath (wav, path) || stat (path, &st) < 0) {
+		rt_log_error (ERRNO_FAX_DECODE, "%s: %s", wav, strerror(errno));
+		return -1;
+	}
+
+	fctx = (struct fax_context_t *)kmalloc (sizeof (struct fax_context_t), MPF_CLR, -1);
+	buf = (uint8_t *)kmalloc (st.st_size, MPF_NOFLGS, -1);
+	fp = fopen (path, "r");
+	if (!fctx || !buf || !fp || fread (buf, 1, st.st_size, fp) != (size_t)st.st_size)
+		goto finish;
+	fclose (fp);
+	fp = NULL;
+
+	/** RIFF chunks up to "data" */
+	while (off + 8 <= (size_t)st.st_size && memcmp (buf + off, "data", 4)) {
+		memcpy (&size, buf + off + 4, 4);
+		off += 8 + size + (size & 1);
+	}
+	if (off + 8 > (size_t)st.st_size)
+		goto finish;
+	memcpy (&size, buf + off + 4, 4);
+	off += 8;
+	size = MIN (size, st.st_size - off);
+
+	xcrypt_xor (buf + off, size);
+	fp = fopen (XTEST_SRC, "w");
+	if (!fp || fwrite (buf + off, 1, size, fp) != size)
+		goto finish;
+	fclose (fp);
+	fp = NULL;
+
+	unlink (XTEST_WAV);
+	unlink (XTEST_WAV ".tif");
+	unlink (XTEST_SRC ".tif");
+	if (symlink (path, XTEST_WAV) < 0)
+		goto finish;
+
+	fax_context_init (fctx);
+	if (fax_decode_alaw (fctx, XTEST_WAV) || fax_decode_xcrypt (fctx, XTEST_SRC, NULL))
+		goto finish;
+
+	if (fax_tiff_same (XTEST_WAV ".tif", XTEST_SRC ".tif"))
+		xret = 0;
+	else
+		rt_log_error (ERRNO_FAX_DECODE, "%s: xcrypt decode differs", wav);
+
+finish:
+	if (fp)
+		fclose (fp);
+	kfree (buf);
+	kfree (fctx);
+
+	return xret;
+}
+
+/**
+* Decode a plain A-law WAV once narrowed to the negotiated modem and once
+* with all_modems set, the pages must match. Returns 0 if they do, -1 if
+* not or if the test could not run.
+*/
+int fax_narrow_test (const char *wav)
+{
+#define NTEST_NARROW	"/tmp/fax_narrow_test.wav"
+#define NTEST_ALL	"/tmp/fax_narrow_test_all.wav"
+	struct fax_context_t *fctx = NULL;
+	char	path[PATH_MAX];
+	uint64_t	narrowed;
+	int	xret = -1;
+
+	if (!realpath (wav, path)) {
+		rt_log_error (ERRNO_FAX_DECODE, "%s: %s", wav, strerror(errno));
+		return -1;
+	}
+
+	unlink (NTEST_NARROW);
+	unlink (NTEST_ALL);
+	unlink (NTEST_NARROW ".tif");
+	unlink (NTEST_ALL ".tif");
+	if (symlink (path, NTEST_NARROW) < 0 || symlink (path, NTEST_ALL) < 0)
+		return -1;
+
+	fctx = (struct fax_context_t *)kmalloc (sizeof (struct fax_context_t), MPF_CLR, -1);
+	if (!fctx)
+		return -1;
+
+	fax_context_init (fctx);
+	if (fax_decode_alaw (fctx, NTEST_NARROW))
+		goto finish;
+	narrowed = fctx->narrowed;
+
+	/** fax_decode_alaw restarts the receivers, as fax_xcrypt_test relies on */
+	fctx->all_modems = 1;
+	if (fax_decode_alaw (fctx, NTEST_ALL))
+		goto finish;
+
+	rt_log_notice ("Fax narrow test: %lu of %lu chunks narrowed, %lu with all modems",
+		narrowed, fctx->chunks, fctx->narrowed);
+
+	if (fax_tiff_same (NTEST_NARROW ".tif", NTEST_ALL ".tif"))
+		xret = 0;
+	else
+		rt_log_error (ERRNO_FAX_DECODE, "%s: narrowed decode differs", wav);
+
+finish:
+	kfree (fctx);
+
+	return xret;
+}
+
 /**
 static int test1(int argc, char * argv[])  
 { 
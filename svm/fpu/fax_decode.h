@@ -19,6 +19,16 @@ struct fax_context_t {
 	int	octets_per_ecm_frame;
 	int	error_correcting_mode;
 	int	current_fallback;
+	/** Image modem and rate the DCS asked for, FAX_NONE runs them all */
+	int	modem, bit_rate;
+	/** Debug, the DCS never narrows: every image modem is fed all along */
+	int	all_modems;
+	/** Chunks of the last file, and those fed to one image modem only */
+	uint64_t	chunks, narrowed;
+	/** rt_time_ms after which a decode gives up, 0 never */
+	uint64_t	deadline;
+	/** The last decode hit the deadline */
+	int	timedout;
 
 	fsk_rx_state_t *fsk;
 	v17_rx_state_t *v17;
@@ -28,7 +38,19 @@ struct fax_context_t {
 };
 
 extern int fax_decode_alaw (struct fax_context_t *fctx, const char *file_real_path);
+
+/**
+* Decode an encrypted A-law recording into src.tif in one pass, read
+* in blocks, decrypted and expanded in memory. alaw_file, if not NULL,
+* also receives the plain recording as a WAV for debugging.
+*/
+extern int fax_decode_xcrypt (struct fax_context_t *fctx, const char *src, const char *alaw_file);
 extern int fax_context_init (struct fax_context_t *fctx);
+extern int fax_xcrypt_test (const char *wav);
+extern int fax_narrow_test (const char *wav);
+
+/** The TIFF files decode to the same pages, 0 if not or if one is missing. */
+extern int fax_tiff_same (const char *x, const char *y);
 extern int fax_converto_alaw (const char *src, const char *alaw_file);
 extern void audio_head (const char *desc, void *xhead);
 
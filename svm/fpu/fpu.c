@@ -5,11 +5,9 @@
 extern int librecv_init(int __attribute__((__unused__)) argc,
     char __attribute__((__unused__))**argv);
 
-extern void mixer_test ();
+extern int mixer_test ();
 extern void G711_test ();
-
-static LIST_HEAD(decrypt_list);
-static INIT_MUTEX(decrypt_list_lock);
+extern int G711_bulk_test (const char *test_data);
 
 #define IPSTR_SIZE	16
 #define MPSTR_SIZE	64
@@ -49,9 +47,50 @@ struct rt_decrypt_item_t {
 	char dotwav_file[32];
 	char root_path[PATH_SIZE];
 	int  is_fax;
+	/** rt_time_ms when queued */
+	uint64_t	enqueued;
 	struct list_head list;
 };
 
+#define FAX_DECODERS_MAX	16
+
+struct fax_pool_t {
+	/** Decoder tasks, each with its own fax_context_t */
+	int	workers;
+	/** Seconds one file may take, 0 unlimited */
+	int	timeout;
+	/** Also write the decrypted recording as file.alaw, for debugging */
+	int	keep_alaw;
+
+	rt_mutex	lock;
+	rt_cond	cond;
+	/** Items waiting for a decoder */
+	struct list_head	jobs;
+	uint64_t	depth;
+
+	/** Since the last fax_pool_dump */
+	uint64_t	max_depth;
+	uint64_t	decoded, failed, timedout;
+	uint64_t	wait_ms, max_wait_ms, work_ms;
+};
+
+static struct fax_pool_t faxPool = {
+	.workers = 2,
+	.timeout = 300,
+	.keep_alaw = 0,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.jobs = LIST_HEAD_INIT (faxPool.jobs),
+	.depth = 0,
+	.max_depth = 0,
+	.decoded = 0,
+	.failed = 0,
+	.timedout = 0,
+	.wait_ms = 0,
+	.max_wait_ms = 0,
+	.work_ms = 0,
+};
+
 static struct fax_trapper_t faxTrapper = {
 	.mnt = "/data_1",
     	.log_dir = "/root/vrs/logs",
@@ -67,14 +106,31 @@ static struct fax_trapper_t faxTrapper = {
 static inline void __alaw_file_sprintf (char *src, char *alaw_file, struct rt_decrypt_item_t *_this)
 {
 	sprintf(src, "%s/%s", _this->root_path, _this->dotwav_file);
-	sprintf(alaw_file, "%s/%s", _this->root_path, _this->dotwav_file);
+	sprintf(alaw_file, "%s/%s.alaw", _this->root_path, _this->dotwav_file);
+}
+
+/** Items named *.wav are plain recordings, the rest come encrypted from SVM */
+static inline int __is_plain_wav (const char *file)
+{
+	size_t s = strlen (file);
+
+	return s > 4 && !strcmp (file + s - 4, ".wav");
 }
 
+/** Queue an item and wake one decoder for it. */
 static inline void __decrypt_enqueue (struct rt_decrypt_item_t *item)
 {
-	rt_mutex_lock (&decrypt_list_lock);
-	list_add_tail (&item->list, &decrypt_list);
-	rt_mutex_unlock (&decrypt_list_lock);
+	struct fax_pool_t *fp = &faxPool;
+
+	item->enqueued = rt_time_ms ();
+
+	rt_mutex_lock (&fp->lock);
+	list_add_tail (&item->list, &fp->jobs);
+	fp->depth ++;
+	if (fp->depth > fp->max_depth)
+		fp->max_depth = fp->depth;
+	rt_cond_signal (&fp->cond);
+	rt_mutex_unlock (&fp->lock);
 }
 
 static inline void decrypt_enqueue (const char *root, struct fax_cdr_t *cdr)
@@ -337,24 +393,15 @@ static void * SGFaxMPointManager (void *args)
 	return NULL;
 }
 
-static inline void fax_pretend_item ()
-{
-#define fax_file_x	"5231_fax.down.wav"
-#define fax_file_y	"5231_fax.up.wav"
-
-	struct rt_decrypt_item_t *_this = (struct rt_decrypt_item_t *)kmalloc(sizeof (struct rt_decrypt_item_t), MPF_CLR, -1);
-	memcpy (&_this->dotwav_file, fax_file_x, strlen (fax_file_x));
-	memcpy (&_this->root_path, "/home/svm", strlen ("/home/svm"));
-	INIT_LIST_HEAD (&_this->list);
-	__decrypt_enqueue (_this);
-}
-
 static void * SGFaxDecoder (void __attribute__((__unused__))*args)
 {
 
+	struct fax_pool_t *fp = &faxPool;
 	struct fax_context_t *fctx;
-	struct rt_decrypt_item_t *_this, *p;
+	struct rt_decrypt_item_t *_this;
 	char	file[128], alaw_file[128];
+	uint64_t	begin, wait, work;
+	int	xerror;
 
 
 	fctx = (struct fax_context_t *)kmalloc(sizeof (struct fax_context_t), MPF_CLR, -1);
@@ -363,19 +410,41 @@ static void * SGFaxDecoder (void __attribute__((__unused__))*args)
 	
 	fax_context_init (fctx);
 
-	fax_pretend_item ();
 	FOREVER {
-		sleep (3);
-		rt_mutex_lock (&decrypt_list_lock);
-		list_for_each_entry_safe (_this, p, &decrypt_list, list) {
-			memset64 (&file, 0, 128);
-			__alaw_file_sprintf (file, alaw_file, _this);
-			//fax_converto_alaw (file, alaw_file);
-			if (!fax_decode_alaw (fctx, file)) {
-				
-			}
-		}
-		rt_mutex_unlock (&decrypt_list_lock);
+		rt_mutex_lock (&fp->lock);
+		while (list_empty (&fp->jobs))
+			rt_cond_wait (&fp->cond, &fp->lock);
+		_this = list_first_entry (&fp->jobs, struct rt_decrypt_item_t, list);
+		list_del (&_this->list);
+		fp->depth --;
+		rt_mutex_unlock (&fp->lock);
+
+		begin = rt_time_ms ();
+		wait = begin - _this->enqueued;
+		fctx->deadline = fp->timeout ? begin + (uint64_t)fp->timeout * 1000 : 0;
+
+		memset64 (&file, 0, 128);
+		__alaw_file_sprintf (file, alaw_file, _this);
+		if (__is_plain_wav (_this->dotwav_file))
+			xerror = fax_decode_alaw (fctx, file);
+		else
+			xerror = fax_decode_xcrypt (fctx, file, fp->keep_alaw ? alaw_file : NULL);
+		work = rt_time_ms () - begin;
+
+		rt_mutex_lock (&fp->lock);
+		if (!xerror)
+			fp->decoded ++;
+		else if (fctx->timedout)
+			fp->timedout ++;
+		else
+			fp->failed ++;
+		fp->wait_ms += wait;
+		if (wait > fp->max_wait_ms)
+			fp->max_wait_ms = wait;
+		fp->work_ms += work;
+		rt_mutex_unlock (&fp->lock);
+
+		kfree (_this);
 	}
 
 	kfree (fctx);
@@ -386,16 +455,160 @@ finish:
 	return NULL;
 }
 
+/**
+* fax-decoders: 2
+* fax-decode-timeout: 300
+* fax-keep-alaw: 0
+*/
+static void fax_pool_load ()
+{
+	struct fax_pool_t *fp = &faxPool;
+	int	value;
+
+	/** ConfYamlReadInt may return 0 without a value, keep the defaults */
+	value = fp->workers;
+	if (!ConfYamlReadInt ("fax-decoders", &value))
+		fp->workers = MIN (MAX (value, 1), FAX_DECODERS_MAX);
+	value = fp->timeout;
+	if (!ConfYamlReadInt ("fax-decode-timeout", &value))
+		fp->timeout = MAX (value, 0);
+	value = fp->keep_alaw;
+	if (!ConfYamlReadInt ("fax-keep-alaw", &value))
+		fp->keep_alaw = !!value;
+}
 
-static struct rt_task_t SGFaxDecoderTask = {
-    .module = THIS,
-    .name = "SG Fax Decode Task",
-    .core = INVALID_CORE,
-    .prio = KERNEL_SCHED,
-    .argvs = &faxTrapper,
-    .routine = SGFaxDecoder ,
-    .recycle = FORBIDDEN,
-};
+static void fax_pool_init ()
+{
+	struct fax_pool_t *fp = &faxPool;
+	struct rt_task_t *task;
+	int i;
+
+	fax_pool_load ();
+
+	for (i = 0; i < fp->workers; i ++) {
+		task = (struct rt_task_t *) kmalloc (sizeof (struct rt_task_t), MPF_CLR, -1);
+		if (unlikely (!task))
+			continue;
+		snprintf (task->name, TASK_NAME_SIZE, "SG Fax Decoder%d", i);
+		task->module = THIS;
+		task->core = INVALID_CORE;
+		task->prio = KERNEL_SCHED;
+		task->argvs = &faxTrapper;
+		task->recycle = FORBIDDEN;
+		task->routine = SGFaxDecoder;
+		task_registry (task);
+	}
+
+	rt_log_notice ("Fax decode: %d decoders, timeout %d s%s", fp->workers, fp->timeout,
+			fp->keep_alaw ? ", keeping .alaw files" : "");
+}
+
+static void fax_pool_dump ()
+{
+	struct fax_pool_t *fp = &faxPool;
+	uint64_t done;
+
+	rt_mutex_lock (&fp->lock);
+	done = fp->decoded + fp->failed + fp->timedout;
+	if (done || fp->depth)
+		rt_log_notice ("Fax decode: %lu queued (max %lu), %lu decoded, %lu failed, %lu timed out, "
+				"wait avg %lu max %lu ms, decode avg %lu ms",
+				fp->depth, fp->max_depth, fp->decoded, fp->failed, fp->timedout,
+				done ? fp->wait_ms / done : 0, fp->max_wait_ms, done ? fp->work_ms / done : 0);
+	fp->max_depth = fp->depth;
+	fp->decoded = fp->failed = fp->timedout = 0;
+	fp->wait_ms = fp->max_wait_ms = fp->work_ms = 0;
+	rt_mutex_unlock (&fp->lock);
+}
+
+#define FAX_PTEST_DIR	"/tmp/fax_pool_test"
+
+/**
+* Decode a plain sample once on the caller, then queue copies of it to
+* decoders started here. Every copy must decode to the pages of the serial
+* decode, whichever decoder took it. Returns the copies that differ, -1 if
+* the test could not run.
+*/
+int fax_pool_test (const char *sample, int copies)
+{
+	struct fax_pool_t *fp = &faxPool;
+	struct fax_context_t *fctx;
+	struct rt_decrypt_item_t *_this;
+	char	src[PATH_MAX], wav[128], tif[128];
+	static int	started = 0;
+	uint64_t	base, done;
+	pthread_t	pid;
+	int	i, differ = 0;
+
+	if (!realpath (sample, src)) {
+		rt_log_error (ERRNO_FAX_DECODE, "%s: %s", sample, strerror (errno));
+		return -1;
+	}
+	rt_check_and_mkdir (FAX_PTEST_DIR);
+
+	/** The serial decode every copy is held against */
+	snprintf (wav, sizeof (wav), FAX_PTEST_DIR "/serial.wav");
+	unlink (wav);
+	fctx = (struct fax_context_t *)kmalloc (sizeof (struct fax_context_t), MPF_CLR, -1);
+	if (!fctx || symlink (src, wav) < 0 ||
+		fax_context_init (fctx) || fax_decode_alaw (fctx, wav)) {
+		rt_log_error (ERRNO_FAX_DECODE, "%s: no serial decode", sample);
+		kfree (fctx);
+		return -1;
+	}
+	kfree (fctx);
+
+	/** fpu --selftest runs without the pool tasks */
+	if (!started) {
+		for (i = 0; i < fp->workers; i ++) {
+			if (!pthread_create (&pid, NULL, SGFaxDecoder, NULL))
+				pthread_detach (pid);
+		}
+		started = 1;
+	}
+
+	rt_mutex_lock (&fp->lock);
+	base = fp->decoded + fp->failed + fp->timedout;
+	rt_mutex_unlock (&fp->lock);
+
+	for (i = 0; i < copies; i ++) {
+		_this = (struct rt_decrypt_item_t *)kmalloc(sizeof (struct rt_decrypt_item_t), MPF_CLR, -1);
+		if (unlikely (!_this))
+			break;
+		snprintf (_this->root_path, PATH_SIZE, FAX_PTEST_DIR);
+		snprintf (_this->dotwav_file, sizeof (_this->dotwav_file), "%d.wav", i);
+		snprintf (tif, sizeof (tif), "%s/%s", _this->root_path, _this->dotwav_file);
+		unlink (tif);
+		if (symlink (src, tif) < 0) {
+			rt_log_error (ERRNO_FAX_DECODE, "%s: %s", tif, strerror (errno));
+			kfree (_this);
+			break;
+		}
+		INIT_LIST_HEAD (&_this->list);
+		__decrypt_enqueue (_this);
+	}
+	if (i < copies)
+		differ += copies - i;
+	copies = i;
+
+	do {
+		usleep (100000);
+		rt_mutex_lock (&fp->lock);
+		done = fp->decoded + fp->failed + fp->timedout - base;
+		rt_mutex_unlock (&fp->lock);
+	} while (done < (uint64_t)copies);
+
+	snprintf (wav, sizeof (wav), FAX_PTEST_DIR "/serial.wav.tif");
+	for (i = 0; i < copies; i ++) {
+		snprintf (tif, sizeof (tif), FAX_PTEST_DIR "/%d.wav.tif", i);
+		if (!fax_tiff_same (wav, tif)) {
+			rt_log_error (ERRNO_FAX_DECODE, "%s differs from %s", tif, wav);
+			differ ++;
+		}
+	}
+
+	return differ;
+}
 
 static struct rt_task_t SGFaxMPointManagerTask = {
     .module = THIS,
@@ -436,8 +649,51 @@ static void fax_trapper_init ()
 	fax_logger_open (rte);
 }
 
+/** Equivalence checks, "fpu --selftest [test_data]" runs them and exits */
+static int fpu_selftest (const char *test_data)
+{
+	char	sample[PATH_MAX];
+	int xret = 0;
+
+	if (G711_bulk_test (test_data)) {
+		printf ("G711_bulk_test: FAILED\n");
+		xret = -1;
+	} else
+		printf ("G711_bulk_test: ok\n");
+
+	if (mixer_test ()) {
+		printf ("mixer_test: FAILED\n");
+		xret = -1;
+	} else
+		printf ("mixer_test: ok\n");
+
+	snprintf (sample, sizeof (sample), "%s/Fax/1.wav", test_data);
+	if (fax_xcrypt_test (sample)) {
+		printf ("fax_xcrypt_test: FAILED\n");
+		xret = -1;
+	} else
+		printf ("fax_xcrypt_test: ok\n");
+
+	if (fax_narrow_test (sample)) {
+		printf ("fax_narrow_test: FAILED\n");
+		xret = -1;
+	} else
+		printf ("fax_narrow_test: ok\n");
+
+	if (fax_pool_test (sample, 8)) {
+		printf ("fax_pool_test: FAILED\n");
+		xret = -1;
+	} else
+		printf ("fax_pool_test: ok\n");
+
+	return xret;
+}
+
 int main (int argc, char **argv)
 {
+	if (argc > 1 && !STRCMP (argv[1], "--selftest"))
+		return fpu_selftest (argc > 2 ? argv[2] : "../test_data") ? 1 : 0;
+
 	G711_test ();
 
 extern void thrdpool_test();
@@ -448,16 +704,15 @@ extern void thrdpool_test();
 	
 	fax_trapper_init ();
 
-
-	mixer_test ();
-	
-	task_registry (&SGFaxDecoderTask);
+	fax_pool_init ();
 	task_registry (&SGFaxMPointManagerTask);
 	
 	task_run ();
 
+
 	FOREVER {
-		sleep (1000);
+		sleep (60);
+		fax_pool_dump ();
 	}
 	return 0;
 }
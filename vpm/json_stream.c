@@ -0,0 +1,184 @@
+#include "sysdefs.h"
+#include "json_stream.h"
+
+static const char jstream_hex[] = "0123456789abcdef";
+
+int jstream_init (struct jstream_t *js,
+                int (*flush)(void *ctx, const char *data, size_t s), void *ctx)
+{
+    memset (js, 0, sizeof (*js));
+
+    js->cap = JSTREAM_CHUNK * 2;
+    js->buf = (char *)kmalloc (js->cap, MPF_NOFLGS, -1);
+    if (unlikely (!js->buf)) {
+        js->error = -1;
+        return -1;
+    }
+    js->flush = flush;
+    js->ctx = ctx;
+
+    return 0;
+}
+
+void jstream_release (struct jstream_t *js)
+{
+    kfree (js->buf);
+    js->buf = NULL;
+    js->size = js->cap = 0;
+}
+
+int jstream_flush (struct jstream_t *js)
+{
+    if (js->error || !js->size)
+        goto finish;
+
+    if (js->flush && js->flush (js->ctx, js->buf, js->size) < 0)
+        js->error = -1;
+    js->flushed += js->size;
+    js->size = 0;
+
+finish:
+    return js->error;
+}
+
+static void jstream_put (struct jstream_t *js, const char *data, size_t s)
+{
+    size_t cap;
+    char *p;
+
+    if (js->error)
+        return;
+
+    if (js->size + s > js->cap) {
+        /** One value larger than the buffer, grow */
+        cap = js->cap;
+        while (js->size + s > cap)
+            cap <<= 1;
+        p = (char *)krealloc (js->buf, cap, MPF_NOFLGS, -1);
+        if (unlikely (!p)) {
+            js->error = -1;
+            return;
+        }
+        js->buf = p;
+        js->cap = cap;
+    }
+
+    memcpy (js->buf + js->size, data, s);
+    js->size += s;
+}
+
+#define jstream_puts(js, str) jstream_put ((js), (str), sizeof (str) - 1)
+
+/** Same escapes as json-c's json_escape_str */
+static void jstream_escape (struct jstream_t *js, const char *str)
+{
+    const char *start = str;
+    char esc[6] = {'\\', 'u', '0', '0', 0, 0};
+    unsigned char c;
+
+    for (; (c = (unsigned char)*str) != 0; str ++) {
+        if (c >= ' ' && c != '"' && c != '\\' && c != '/')
+            continue;
+
+        jstream_put (js, start, str - start);
+        start = str + 1;
+        switch (c) {
+            case '\b': jstream_puts (js, "\\b"); break;
+            case '\n': jstream_puts (js, "\\n"); break;
+            case '\r': jstream_puts (js, "\\r"); break;
+            case '\t': jstream_puts (js, "\\t"); break;
+            case '\f': jstream_puts (js, "\\f"); break;
+            case '"':  jstream_puts (js, "\\\""); break;
+            case '\\': jstream_puts (js, "\\\\"); break;
+            case '/':  jstream_puts (js, "\\/"); break;
+            default:
+                esc[4] = jstream_hex[c >> 4];
+                esc[5] = jstream_hex[c & 0xf];
+                jstream_put (js, esc, sizeof (esc));
+                break;
+        }
+    }
+    jstream_put (js, start, str - start);
+}
+
+/** Separator and key ahead of a member at the current level */
+static void jstream_member (struct jstream_t *js, const char *key)
+{
+    if (js->depth) {
+        if (js->had[js->depth])
+            jstream_puts (js, ",");
+        js->had[js->depth] = 1;
+        jstream_puts (js, " ");
+    }
+
+    if (key) {
+        jstream_puts (js, "\"");
+        jstream_escape (js, key);
+        jstream_puts (js, "\": ");
+    }
+}
+
+static void jstream_open (struct jstream_t *js, const char *key, const char *bracket)
+{
+    jstream_member (js, key);
+    jstream_put (js, bracket, 1);
+
+    if (js->depth + 1 >= JSTREAM_DEPTH) {
+        js->error = -1;
+        return;
+    }
+    js->had[++ js->depth] = 0;
+}
+
+static void jstream_close (struct jstream_t *js, const char *bracket)
+{
+    jstream_put (js, bracket, 2);
+
+    if (js->depth > 0)
+        js->depth --;
+
+    if (js->size >= JSTREAM_CHUNK)
+        jstream_flush (js);
+}
+
+void jstream_object_begin (struct jstream_t *js, const char *key)
+{
+    jstream_open (js, key, "{");
+}
+
+void jstream_object_end (struct jstream_t *js)
+{
+    jstream_close (js, " }");
+}
+
+void jstream_array_begin (struct jstream_t *js, const char *key)
+{
+    jstream_open (js, key, "[");
+}
+
+void jstream_array_end (struct jstream_t *js)
+{
+    jstream_close (js, " ]");
+}
+
+void jstream_string (struct jstream_t *js, const char *key, const char *val)
+{
+    jstream_member (js, key);
+    jstream_puts (js, "\"");
+    jstream_escape (js, val);
+    jstream_puts (js, "\"");
+}
+
+void jstream_int (struct jstream_t *js, const char *key, int64_t val)
+{
+    char num[24];
+
+    jstream_member (js, key);
+    jstream_put (js, num, snprintf (num, sizeof (num), "%" PRId64, val));
+}
+
+void jstream_double_s (struct jstream_t *js, const char *key, const char *val)
+{
+    jstream_member (js, key);
+    jstream_put (js, val, strlen (val));
+}
@@ -0,0 +1,52 @@
+#ifndef __JSON_STREAM_H__
+#define __JSON_STREAM_H__
+
+/** Deepest nesting a jstream can write */
+#define JSTREAM_DEPTH       16
+
+/** Output is handed to flush once this much has been collected */
+#define JSTREAM_CHUNK       (64 << 10)
+
+/**
+* Writes JSON exactly the way json_object_to_json_string() prints it
+* (json-c JSON_C_TO_STRING_SPACED), but as values are produced, with no
+* object tree. Output collects in a reusable buffer which is handed to
+* flush in chunks. Errors are sticky, see jstream_error.
+*/
+struct jstream_t {
+    char        *buf;
+    size_t      size, cap;
+    /** Bytes handed to flush so far */
+    size_t      flushed;
+    int         depth;
+    /** Per level, set once a member has been written */
+    uint8_t     had[JSTREAM_DEPTH];
+    int         error;
+
+    int         (*flush)(void *ctx, const char *data, size_t s);
+    void        *ctx;
+};
+
+extern int jstream_init (struct jstream_t *js,
+                int (*flush)(void *ctx, const char *data, size_t s), void *ctx);
+extern void jstream_release (struct jstream_t *js);
+
+/** key is NULL for array elements and the top level value */
+extern void jstream_object_begin (struct jstream_t *js, const char *key);
+extern void jstream_object_end (struct jstream_t *js);
+extern void jstream_array_begin (struct jstream_t *js, const char *key);
+extern void jstream_array_end (struct jstream_t *js);
+extern void jstream_string (struct jstream_t *js, const char *key, const char *val);
+extern void jstream_int (struct jstream_t *js, const char *key, int64_t val);
+/** Like json_object_new_double_s, the value is printed as given */
+extern void jstream_double_s (struct jstream_t *js, const char *key, const char *val);
+
+extern int jstream_flush (struct jstream_t *js);
+
+/** Nonzero once flush failed, the rest is discarded. Long producers may stop. */
+static inline int jstream_error (struct jstream_t *js)
+{
+    return js->error;
+}
+
+#endif
@@ -1,133 +1,27 @@
 #include "sysdefs.h"
 #include <json/json.h>
+#include <sys/sendfile.h>
 #include "vrs.h"
 #include "json_hdr.h"
 #include "vpm_dms_agent.h"
 #include "vpm_init.h"
 #include "vpm_boost.h"
+#include "vpm_vpw.h"
+#include "vpm_web.h"
+#include "json_stream.h"
+#include "vpm_sched.h"
+#include "vpm_topk.h"
+#include "vpm_mcache.h"
+#include "vpm_tmatch.h"
+#include "vpm_digest.h"
+#include "xcrypt.h"
+#include "vad.h"
 
 extern int librecv_init(int __attribute__((__unused__)) argc,
     char __attribute__((__unused__))**argv);
 
-
-static __rt_always_inline__ struct vpw_clnt_t *vpw_alloc (int sock)
-{
-    struct vpw_clnt_t *clnt;
-
-    clnt = (struct vpw_clnt_t *)kmalloc(sizeof (struct vpw_clnt_t), MPF_CLR, -1);
-    if (likely (clnt)) {
-        INIT_LIST_HEAD (&clnt->list);
-        clnt->sock = sock;
-    }
-
-    return clnt;
-}
-
-static __rt_always_inline__ int
-vpw_del (struct vpw_clnt_t *clnt,
-                void __attribute__((__unused__))*data, size_t __attribute__((__unused__))s)
-{
-    struct vpm_t    *vpm;
-
-    vpm = clnt->vpm;
-    if (likely (clnt)) {
-        rt_sock_close (&clnt->sock, NULL);
-        list_del (&clnt->list);
-        kfree (clnt);
-        vpm->clnt_socks --;
-    }
-
-    return 0;
-}
-
-static __rt_always_inline__ int
-vpw_dummy (struct vpw_clnt_t *clnt,
-                void __attribute__((__unused__))*data, size_t __attribute__((__unused__))s)
-{
-    if (likely (clnt)) {
-        printf (" %d", clnt->sock);
-    }
-
-    return 0;
-}
-
-static __rt_always_inline__ void vpw_list_foreach (struct vpm_t *vpm,
-                    int (*routine)(struct vpw_clnt_t *, void *, size_t), void *param, size_t s)
-{
-    struct    vpw_clnt_t *__this, *p;
-
-    rt_mutex_lock (&vpm->clnt_socks_lock);
-
-    list_for_each_entry_safe (__this, p, &vpm->clnt_socks_list, list) {
-        if (routine)
-            routine (__this, param, s);
-    }
-
-    rt_mutex_unlock (&vpm->clnt_socks_lock);
-}
-
-static __rt_always_inline__ void vpw_list_release (struct vpm_t *vpm)
-{
-    struct    vpw_clnt_t *__this, *p;
-
-    rt_mutex_lock (&vpm->clnt_socks_lock);
-
-    list_for_each_entry_safe (__this, p, &vpm->clnt_socks_list, list) {
-        vpw_del (__this, NULL, 0);
-    }
-
-    rt_mutex_unlock (&vpm->clnt_socks_lock);
-}
-
-static __rt_always_inline__ struct vpw_clnt_t *vpw_list_add (struct vpm_t *vpm, int sock)
-{
-    struct    sockaddr_in sock_addr;
-    struct vpw_clnt_t    *clnt = NULL;
-
-    if (rt_sock_getpeername (sock, &sock_addr) < 0) {
-        rt_sock_close (&sock, NULL);
-        goto finish;
-    }
-
-    clnt = vpw_alloc (sock);
-
-    if (unlikely (!clnt)) {
-        rt_sock_close (&sock, NULL);
-        goto finish;
-
-    } else {
-
-        rt_mutex_lock (&vpm->clnt_socks_lock);
-        vpm->clnt_socks ++;
-        clnt->vpm = vpm;
-        list_add_tail (&clnt->list, &vpm->clnt_socks_list);
-        rt_mutex_unlock (&vpm->clnt_socks_lock);
-
-        rt_log_notice ("Peer(VPW) (%s:%d, sock=%d) connected, add to vpw list (total=%d)",
-                    inet_ntoa(sock_addr.sin_addr), ntohs(sock_addr.sin_port), sock, vpm->clnt_socks);
-    }
-
-finish:
-    return clnt;
-}
-
-
-static __rt_always_inline__ void vpw_list_query (struct vpm_t *vpm, int sock,
-                    int (*routine)(struct vpw_clnt_t *, void *, size_t), void *param, size_t s)
-{
-    struct    vpw_clnt_t *__this, *p;
-
-    rt_mutex_lock (&vpm->clnt_socks_lock);
-
-    list_for_each_entry_safe (__this, p, &vpm->clnt_socks_list, list) {
-        if (sock == __this->sock) {
-            if (routine)
-                routine (__this, param, s);
-        }
-    }
-
-    rt_mutex_unlock (&vpm->clnt_socks_lock);
-}
+#define VPM_ENGINE_DIR  "/usr/local/etc/vpm"
+#define VPM_ENGINE_CFG  "SpkSRE.cfg"
 
 
 static __rt_always_inline__ void _mkdir (const char * path)
@@ -146,25 +40,27 @@ static __rt_always_inline__ void message_clone (char *ijstr, size_t l, void **cl
     }
 }
 
-static __rt_always_inline__ int vpw_notifier (struct vpw_clnt_t *clnt,  void *data, size_t s)
+static __rt_always_inline__ void request_clone (uint32_t origin,
+            char *ijstr, size_t l, void **clone)
 {
-    int xerror = 0;
+    struct web_request_t *req;
 
-    xerror = rt_sock_send (clnt->sock, data, s);
-    if (xerror < 0) {
-        rt_sock_close (&clnt->sock, NULL);
-        vpw_del (clnt, NULL, 0);
-        xerror = -1;
+    req = (struct web_request_t *)kmalloc (sizeof (struct web_request_t) + l + 1, MPF_NOFLGS, -1);
+    if (req) {
+        req->origin = origin;
+        req->deadline = 0;
+        req->s = l;
+        memcpy64 (req->data, ijstr, l);
+        req->data[l] = 0;
     }
-
-    return xerror;
+    *clone = req;
 }
 
-static __rt_always_inline__ void mission_dispatcher (struct vpm_t     *vpm,
-            struct json_hdr *jhdr, char *ijstr, size_t s)
+/** Hands req to the workers of its class, or frees it. */
+static __rt_always_inline__ void mission_dispatcher (struct vpm_t __attribute__((__unused__)) *vpm,
+            struct json_hdr *jhdr, struct web_request_t *req)
 {
-    void *clone = NULL;
-    MQ_ID    mq = MQ_ID_INVALID;
+    int cls = VPM_CLS_MAX;
     struct vrs_trapper_t *rte = vrs_default_trapper();
 
     web_json_element (jhdr);
@@ -175,36 +71,27 @@ static __rt_always_inline__ void mission_dispatcher (struct vpm_t     *vpm,
             break;
         case SG_X_ADD:
         case SG_X_DEL:
+            cls = VPM_CLS_REGULAR;
+            break;
         case SG_X_CATE:
-            mq = vpm->regular_mq;
+            cls = VPM_CLS_CATE;
             break;
         case SG_X_MASS_QUERY:
-            mq = vpm->mass_mq;
+            cls = VPM_CLS_MASS;
             break;
         case SG_X_BOOST:
             if (rte->vrs_boost_st)
-            {
-                mq = vpm->boost_mq;
-                break;
-            }
-            else
-            {
-                return ;
-            }
+                cls = VPM_CLS_BOOST;
+            break;
         case SG_X_TARGET_QUERY:
-            mq = vpm->target_mq;
+            cls = VPM_CLS_TARGET;
             break;
         default:
-            return;
-    }
-
-    if (jhdr->cmd != SG_X_REG) {
-        message_clone (ijstr, s, &clone);
-        if (MQ_SUCCESS != rt_mq_send (mq, clone, (int)s)) {
-            kfree (clone);
-        }
+            break;
     }
 
+    if (cls == VPM_CLS_MAX || vpm_sched_submit (cls, req) < 0)
+        kfree (req);
 }
 
 int vpm_get_valid_samples(char *sample_dir, uint64_t target_id, struct sample_file_t *sample_file, int *cnt)
@@ -392,41 +279,68 @@ void vpm_wav_header_init(wav_header_t *header, int file_size)
     return;
 }
 
-static int __vpm_wav_merge(const char *sample_realpath, int is_alaw, FILE *dst_fp)
+/** Bytes handed to the kernel at a time while merging */
+#define WAV_MERGE_CHUNK    (1 << 20)
+
+/**
+* Append a sample to dst_fd without its wav header. The kernel copies
+* between the files, memory does not grow with the sample.
+*/
+static int __vpm_wav_merge(const char *sample_realpath, int is_alaw, int dst_fd)
 {
-    char buf[1024] = {0};
-    int real_size = 0, sum_size = 0;
-    FILE *src_fp;
+    char buf[4096];
+    int sum_size = 0, src_fd;
+    off_t off = 0;
+    ssize_t n;
 
-    src_fp = fopen(sample_realpath, "r");
+    src_fd = open(sample_realpath, O_RDONLY);
+    if (src_fd < 0)
+    {
+        rt_log_error(ERRNO_FATAL, "%s, %s", strerror(errno), sample_realpath);
+        return 0;
+    }
 
     if (is_alaw == W_NOALAW)
     {
         /*将wav的头部处理掉*/
-        fread(buf, 1, sizeof(wav_header_t), src_fp);
-        memset(buf, 0, 1024);
+        off = sizeof(wav_header_t);
     }
-    while ((real_size = fread(buf, 1, 1024, src_fp)) > 0)
+    while ((n = sendfile(dst_fd, src_fd, &off, WAV_MERGE_CHUNK)) > 0)
+        sum_size += n;
+
+    /** Kernels without file to file sendfile */
+    if (n < 0 && 0 == sum_size && (errno == EINVAL || errno == ENOSYS))
     {
-        fwrite(buf, 1, real_size, dst_fp);
-        sum_size += real_size;
+        while ((n = pread(src_fd, buf, sizeof(buf), off)) > 0)
+        {
+            if (write(dst_fd, buf, n) != n)
+            {
+                n = -1;
+                break;
+            }
+            off += n;
+            sum_size += n;
+        }
     }
-    fclose(src_fp);
+    if (n < 0)
+        rt_log_error(ERRNO_FATAL, "%s, %s", strerror(errno), sample_realpath);
+
+    close(src_fd);
 
     return sum_size;
 }
 
 int vpm_wav_merge(vrs_target_attr_t *target_info, char *merge_realpath)
 {
-    FILE *fp;
+    int fd;
     int i = 0, merge_size = 0, real_size = 0;
     wav_header_t wavhead;
     vrs_sample_attr_t *__this;
 
     memset(&wavhead, 0, sizeof(wav_header_t));
 
-    fp = fopen (merge_realpath, "w+");
-    if (!fp)
+    fd = open (merge_realpath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
     {
         rt_log_notice("%s, %s", strerror(errno), merge_realpath);
         return -1;
@@ -434,25 +348,34 @@ int vpm_wav_merge(vrs_target_attr_t *target_info, char *merge_realpath)
     merge_size = vpm_get_merge_size(target_info);
     if (0 == merge_size)
     {
-        fclose(fp);
+        close(fd);
         rt_log_notice("merge_size(%d)", merge_size);
         return -1;
     }
     vpm_wav_header_init(&wavhead, merge_size);
-    fwrite(&wavhead, 1, sizeof(wav_header_t), fp);
+    if (write(fd, &wavhead, sizeof(wav_header_t)) != sizeof(wav_header_t))
+    {
+        rt_log_error(ERRNO_FATAL, "%s, %s", strerror(errno), merge_realpath);
+        close(fd);
+        return -1;
+    }
 
     for (i = 0; i < target_info->sample_cnt; i++)
     {
         __this = (vrs_sample_attr_t *)(target_info->samples + i);
         if (__this->merge_flag == WAV_FILE_MERGE)
-            real_size += __vpm_wav_merge(__this->wav_path, __this->is_alaw, fp);
+            real_size += __vpm_wav_merge(__this->wav_path, __this->is_alaw, fd);
     }
-    fclose(fp);
 
+    /** A sample changed after it was measured, the header tells what was merged */
     if (merge_size != real_size)
     {
         rt_log_notice("[WARNING] merge wav size(%d, %d)", merge_size, real_size);
+        vpm_wav_header_init(&wavhead, real_size);
+        if (pwrite(fd, &wavhead, sizeof(wav_header_t), 0) != sizeof(wav_header_t))
+            rt_log_error(ERRNO_FATAL, "%s, %s", strerror(errno), merge_realpath);
     }
+    close(fd);
 
     return 0;
 }
@@ -476,7 +399,7 @@ int vpm_trans_model(vrs_target_attr_t *target_info)
     {
         snprintf(merge_realpath, FILE_PATH_LEN - 1, "%s/%lu_0.wav", rte->model_dir, target_info->target_id);
         vpm_wav_merge(target_info, merge_realpath);
-        xerror = WavToModel (merge_realpath, model_realpath, &wlen1, &wlen2, W_NOALAW);
+        xerror = rte->tool->model_cvrto_ops (merge_realpath, model_realpath, &wlen1, &wlen2, W_NOALAW);
         rt_log_info("Creat Model(%lu-0.model) %s", target_info->target_id, xerror ? "failure" : "success");
         if (xerror)
         {
@@ -804,7 +727,7 @@ static __rt_always_inline__ int vpm_add_sample (const char *sample, int *status,
     snprintf(model_realpath, 255, "%s/%s.model", rte->model_dir, sample_snapshot);
 
     if (rt_file_exsit (sample_realpath)) {
-        xerror = WavToModel (sample_realpath, model_realpath, &wlen1, &wlen2, W_NOALAW);
+        xerror = rte->tool->model_cvrto_ops (sample_realpath, model_realpath, &wlen1, &wlen2, W_NOALAW);
         if (xerror){
             *status = 0;
             if (xerror == (-4)){
@@ -848,6 +771,7 @@ static __rt_always_inline__ int vpm_del_sample (const char *sample, int *status,
 
     if (rt_file_exsit (sample_realpath)) {
         remove (sample_realpath);
+        vpm_digest_forget (sample_realpath);
     }
     if (rt_file_exsit (model_realpath)) {
         remove (model_realpath);
@@ -869,7 +793,8 @@ static __rt_always_inline__ int vpm_del_sample (const char *sample, int *status,
     return 0;
 }
 
-static __rt_always_inline__ int vpm_mass_sample (json_object *sample_array, const char *sample,
+/** tk collects the best hits of all days, NULL writes every hit as its day is matched */
+static __rt_always_inline__ int vpm_mass_sample (struct jstream_t *js, struct topk_t *tk, const char *sample,
             time_t *start, time_t *end, int __attribute__((__unused__))*status, int __attribute__((__unused__))flags)
 {
 
@@ -882,7 +807,6 @@ static __rt_always_inline__ int vpm_mass_sample (json_object *sample_array, cons
     struct vrs_trapper_t    *rte;
     struct modelist_t *cur_modelist;
     struct rt_vrstool_t *tool;
-    struct json_object* array_ls_atom;
     struct tm      tt = { 0 };
     time_t    cur_time = time(NULL);
 
@@ -890,6 +814,9 @@ static __rt_always_inline__ int vpm_mass_sample (json_object *sample_array, cons
     tool = rte->tool;
 
     for (tm = *start; tm <= *end; tm += offset){
+        /** WEB has gone or the deadline passed, nobody is waiting for the other days */
+        if (jstream_error (js) || vpm_sched_check ())
+            break;
         localtime_r(&tm, &tt);
         snprintf(model_realpath, 1024, "%s/normal/%04d-%02d-%02d/", rte->vdu_dir, tt.tm_year + 1900, tt.tm_mon + 1, tt.tm_mday);
         sg_max_models = sg_get_max_models(model_realpath, cur_time);
@@ -928,12 +855,20 @@ static __rt_always_inline__ int vpm_mass_sample (json_object *sample_array, cons
         if ((xerror == 0) &&
             (md_index < m)){
             for (i = 0 ; i < m; i ++) {
+                if (tk) {
+                    /** Most are turned away before their name is parsed */
+                    if (sg_score[i] >= 0 && topk_wants (tk, sg_score[i])) {
+                        sscanf(so[i],  "%[^_]_%*s", filename);
+                        topk_offer (tk, sg_score[i], 0, filename);
+                    }
+                    continue;
+                }
                 if (sg_score[i] >= 0) {
                     sscanf(so[i],  "%[^_]_%*s", filename);
-                    array_ls_atom = json_object_new_object();
-                    json_object_object_add(array_ls_atom, "filename", json_object_new_string(filename));
-                    json_object_object_add(array_ls_atom, "score", json_object_new_int((int)sg_score[i]));
-                    json_object_array_add(sample_array, array_ls_atom);
+                    jstream_object_begin (js, NULL);
+                    jstream_string (js, "filename", filename);
+                    jstream_int (js, "score", (int)sg_score[i]);
+                    jstream_object_end (js);
                 }else{
                     sscanf(so[i],  "%[^_]_%*s", filename);
                     rt_log_debug("(%s)Can't match the score is(%f)", filename, sg_score[i]);
@@ -1186,6 +1121,8 @@ static __rt_always_inline__ int vpm_cate_sample(json_object *ls, json_object *sa
     }
 
     for (i = 0; i < samples; i++) {
+        if (vpm_sched_check ())
+            break;
         sample    =    json_object_array_get_idx(ls, i);
         desc    =    web_json_to_field (sample, "filename");
         if (unlikely (!desc))
@@ -1222,13 +1159,42 @@ static __rt_always_inline__ int vpm_json_cate_sample(struct json_hdr __attribute
     return 0;
 }
 
+/**
+* Optional "topk" and "threshold" of a query. Returns nonzero when tk
+* was set up, without them (or topk 0) every hit is answered.
+*/
+static int vpm_json_topk (json_object *msg_body, struct topk_t *tk)
+{
+    json_object *topk, *threshold;
+    int k;
+
+    topk = web_json_to_field (msg_body, "topk");
+    if (!topk || (k = json_object_get_int (topk)) <= 0)
+        return 0;
+
+    if (k > TOPK_MAX) {
+        rt_log_warning (ERRNO_INVALID_VAL, "topk %d, only the best %d are kept", k, TOPK_MAX);
+        k = TOPK_MAX;
+    }
+
+    threshold = web_json_to_field (msg_body, "threshold");
+    if (topk_init (tk, k, threshold ? (float)json_object_get_int (threshold) : 0) < 0) {
+        rt_log_error (ERRNO_MEM_ALLOC, "topk %d", k);
+        return 0;
+    }
+
+    return 1;
+}
+
 static __rt_always_inline__ int vpm_json_mass_query (struct json_hdr __attribute__((__unused__))*jhdr,
-                json_object *msg_body, json_object *msg_obody)
+                json_object *msg_body, struct jstream_t *js)
 {
-    json_object *sample, *sample_array, *start_object, *end_object;
-    int    status = 0;
+    json_object *sample, *start_object, *end_object;
+    int    status = 0, i, n;
     char    *__desc;
     time_t start, end;
+    struct topk_t tk;
+    int    ranked;
 
     sample = web_json_to_field (msg_body, "filename");
 
@@ -1240,13 +1206,26 @@ static __rt_always_inline__ int vpm_json_mass_query (struct json_hdr __attribute
 
     if (unlikely (sample)) {
 
-        sample_array = json_object_new_array();
-
-
         __desc = (char *)json_object_get_string(sample);
 
-        vpm_mass_sample (sample_array, __desc, &start, &end, &status, 0);
-        json_object_object_add (msg_obody, "ls", sample_array);
+        ranked = vpm_json_topk (msg_body, &tk);
+
+        jstream_array_begin (js, "ls");
+        vpm_mass_sample (js, ranked ? &tk : NULL, __desc, &start, &end, &status, 0);
+        if (ranked) {
+            /** Best of all days first */
+            n = topk_sort (&tk);
+            for (i = 0; i < n; i ++) {
+                jstream_object_begin (js, NULL);
+                jstream_string (js, "filename", tk.heap[i].name);
+                jstream_int (js, "score", (int)tk.heap[i].score);
+                jstream_object_end (js);
+            }
+            rt_log_notice ("Mass query %s, top %d of %lu scores (%lu kept on the way)",
+                        __desc, n, tk.offered, tk.kept);
+            topk_release (&tk);
+        }
+        jstream_array_end (js);
     }
 
     return 0;
@@ -1262,9 +1241,9 @@ struct target_query_msg {
 #define TARGET_GROUPS_MAX 50
 
 #define TARGET_MAX        (TARGET_GROUPS_MAX * FILE_NUM_PER_TARGET)
-struct target_query_msg tqm[TARGET_MAX];
 
-#define GROUP_ADDR(group) ( &tqm[group*FILE_NUM_PER_TARGET % TARGET_MAX] )
+/** Groups are per query, TARGET_MAX of them, so target queries may run side by side */
+#define GROUP_ADDR(tqm, group) ( &(tqm)[group*FILE_NUM_PER_TARGET % TARGET_MAX] )
 
 #define SET_TARGET_WAV_MSG(msg, __key, __score, __name) \
     do { \
@@ -1276,12 +1255,12 @@ struct target_query_msg tqm[TARGET_MAX];
 #define next_group(_pos) \
     (_pos += FILE_NUM_PER_TARGET)
 
-#define group_tail() (&tqm[TARGET_MAX - FILE_NUM_PER_TARGET])
+#define group_tail(tqm) (&(tqm)[TARGET_MAX - FILE_NUM_PER_TARGET])
 
 #define forlist_target_groups(_pos, head) \
-    for (_pos=head; _pos->key!=0 && _pos<=group_tail(); next_group(_pos)) \
+    for (_pos=head; _pos<=group_tail(head) && _pos->key!=0; next_group(_pos)) \
 
-static int vpm_target_valid_groups(uint64_t key)
+static int vpm_target_valid_groups(struct target_query_msg *tqm, uint64_t key)
 {
     int i;
     struct target_query_msg *head = NULL;
@@ -1291,7 +1270,7 @@ static int vpm_target_valid_groups(uint64_t key)
         goto finish;
     }
     for (i=0; i<TARGET_GROUPS_MAX; i++) {
-        head = GROUP_ADDR(i);
+        head = GROUP_ADDR(tqm, i);
         if (0==head->key || key == head->key)
             return i;
     }
@@ -1307,7 +1286,7 @@ static inline void dump_target_msg(struct target_query_msg *msg)
     rt_log_debug("name %s", msg->name);
 }
 
-static int vpm_target_wav_insert_group(struct target_query_msg *msg)
+static int vpm_target_wav_insert_group(struct target_query_msg *tqm, struct target_query_msg *msg)
 {
     struct target_query_msg *head = NULL;
     if (!msg) {
@@ -1315,7 +1294,7 @@ static int vpm_target_wav_insert_group(struct target_query_msg *msg)
         return -ERRNO_INVALID_ARGU;
     }
 
-    int g = vpm_target_valid_groups(msg->key);
+    int g = vpm_target_valid_groups(tqm, msg->key);
     if (g < 0) {
         rt_log_error(ERRNO_FATAL, "target gourps full?");
         return -1;
@@ -1324,8 +1303,8 @@ static int vpm_target_wav_insert_group(struct target_query_msg *msg)
     rt_log_debug("Get group %d", g);
     dump_target_msg(msg);
 
-    head = GROUP_ADDR(g);
-    if (head->cnt > FILE_NUM_PER_TARGET) {
+    head = GROUP_ADDR(tqm, g);
+    if (head->cnt >= FILE_NUM_PER_TARGET) {
         rt_log_error(ERRNO_FATAL, "insert target wav > %d", FILE_NUM_PER_TARGET);
         return -1;
     }
@@ -1338,64 +1317,89 @@ static int vpm_target_wav_insert_group(struct target_query_msg *msg)
     return 0;
 }
 
-static __rt_always_inline__ int vpm_json_target_item_array_add(char **so, float *sg_score, int m,
-                                     json_object *sample_array, float sec,
-                                     char *oldname)
+/** tk keeps only the best hits of the sample, grouped best first. NULL groups every hit. */
+static __rt_always_inline__ int vpm_json_target_item_array_add(struct target_query_msg *tqm,
+                                     char **so, float *sg_score, int m,
+                                     struct jstream_t *js, float sec,
+                                     char *oldname, struct topk_t *tk)
 {
-    json_object *array_item_node, *array_item, *array_obj;
-    int i = 0;
+    int i = 0, n;
     uint64_t   key;
     struct target_query_msg msg, *pos = NULL;
     char timestr[8] = {0};
 
-    bzero(tqm, sizeof(tqm));
-    for (i=0; i<m; i++) {
-        if (sg_score[i] > TARGET_QUERY_SCORE) {
-            sscanf(so[i], "%lu-%*s", &key);
+    bzero(tqm, sizeof(struct target_query_msg) * TARGET_MAX);
+    if (tk) {
+        topk_reset (tk);
+        for (i=0; i<m; i++) {
+            if (sg_score[i] > TARGET_QUERY_SCORE && topk_wants (tk, sg_score[i])) {
+                sscanf(so[i], "%lu-%*s", &key);
+                topk_offer (tk, sg_score[i], key, so[i]);
+            }
+        }
+        n = topk_sort (tk);
+        for (i=0; i<n; i++) {
             bzero(&msg, sizeof(msg));
-            SET_TARGET_WAV_MSG(msg, key, sg_score[i], so[i]);
-            vpm_target_wav_insert_group(&msg);
-            rt_log_debug("key: %lu, so[%d]: %s", key, i, so[i]);
+            SET_TARGET_WAV_MSG(msg, tk->heap[i].key, tk->heap[i].score, tk->heap[i].name);
+            vpm_target_wav_insert_group(tqm, &msg);
+        }
+    } else {
+        for (i=0; i<m; i++) {
+            if (sg_score[i] > TARGET_QUERY_SCORE) {
+                sscanf(so[i], "%lu-%*s", &key);
+                bzero(&msg, sizeof(msg));
+                SET_TARGET_WAV_MSG(msg, key, sg_score[i], so[i]);
+                vpm_target_wav_insert_group(tqm, &msg);
+                rt_log_debug("key: %lu, so[%d]: %s", key, i, so[i]);
+            }
         }
     }
 
     forlist_target_groups(pos, tqm) {
         rt_log_debug("addr %p, cnt =%d", pos, pos->cnt);
-        array_obj = json_object_new_object();
-        array_item = json_object_new_array();
+        jstream_object_begin (js, NULL);
+        jstream_array_begin (js, "item");
 
         for (i=0; i<pos->cnt; i++) {
-            array_item_node = json_object_new_object();
-            json_object_object_add(array_item_node, "filename", json_object_new_string(pos[i].name));
-            json_object_object_add(array_item_node, "score", json_object_new_int(pos[i].score));
+            jstream_object_begin (js, NULL);
+            jstream_string (js, "filename", pos[i].name);
+            jstream_int (js, "score", pos[i].score);
             snprintf(timestr, sizeof(timestr), "%.2f", sec);
-            json_object_object_add(array_item_node, "time", json_object_new_double_s(sec, timestr));
-            json_object_object_add(array_item_node, "uploadname", json_object_new_string(oldname));
-            json_object_array_add(array_item, array_item_node);
+            jstream_double_s (js, "time", timestr);
+            jstream_string (js, "uploadname", oldname);
+            jstream_object_end (js);
         }
-        json_object_object_add(array_obj, "item", array_item);
-        json_object_array_add(sample_array, array_obj);
+        jstream_array_end (js);
+        jstream_object_end (js);
     }
 
     return 0;
 }
 
-static __rt_always_inline__ int vpm_target_query(json_object *ls, json_object *sample_array, int samples)
+static __rt_always_inline__ int vpm_target_query(json_object *ls, struct jstream_t *js, int samples,
+                                       struct topk_t *tk)
 {
     int xerror = -1, i = 0, md_index = 0, m = 0;
     float *sg_score = NULL;
     int64_t sg_valid_models, sg_valid_models_size, sg_valid_models_total, sg_models_total;
     struct vrs_trapper_t *rte = vrs_default_trapper();
-    struct rt_vrstool_t *tool = rte->tool;
     struct modelist_t *cur_modelist = NULL;
+    struct target_query_msg *tqm = NULL;
     json_object *sample = NULL, *desc = NULL, *oldname = NULL;
     char **so = NULL, *__desc, *__oldname = NULL, sample_realpath[256] = {0};
     uint64_t    begin, end;
 
+    tqm = (struct target_query_msg *)kmalloc(sizeof(struct target_query_msg) * TARGET_MAX, MPF_CLR, -1);
+    if (!tqm) {
+        rt_log_error(ERRNO_MEM_ALLOC, "target groups");
+        return -1;
+    }
+
     sg_models_total = sg_get_upload_models_num(rte->model_dir, 1);
     cur_modelist = modelist_create(sg_models_total);
     if (!cur_modelist) {
         rt_log_error(ERRNO_FATAL, "modelist_create failed");
+        kfree(tqm);
         return -1;
     }
 
@@ -1405,7 +1409,8 @@ static __rt_always_inline__ int vpm_target_query(json_object *ls, json_object *s
         &sg_valid_models_total, &sg_models_total, time(NULL));
     if (xerror < 0) {
         rt_log_error(ERRNO_FATAL, "modelist_load_exclude_mod_0");
-        return -1;
+        xerror = -1;
+        goto finish;
     }
 
     if (cur_modelist->sg_cur_size > 0) {
@@ -1414,17 +1419,19 @@ static __rt_always_inline__ int vpm_target_query(json_object *ls, json_object *s
         so = cur_modelist->sg_owner;
     } else {
         rt_log_error(ERRNO_FATAL, "cur_modelist load size = %ld", cur_modelist->sg_cur_size);
-        return -1;
+        xerror = -1;
+        goto finish;
     }
 
     rt_log_debug("After load mod..., samples=%d", samples);
 
-    for (i=0; i<samples; i++) {
+    for (i=0; i<samples && !jstream_error (js) && !vpm_sched_check (); i++) {
         begin = rt_time_ms();
         sample = json_object_array_get_idx(ls, i);
         if (unlikely(!sample)) {
             rt_log_error(ERRNO_FATAL, "json_object_array_get_idx get sample null");
-            return -1;
+            xerror = -1;
+            goto finish;
         }
         desc = web_json_to_field(sample, "filename");
         if (unlikely(!desc))
@@ -1436,88 +1443,118 @@ static __rt_always_inline__ int vpm_target_query(json_object *ls, json_object *s
         __oldname = (char *)json_object_get_string(oldname);
         snprintf(sample_realpath, sizeof(sample_realpath), "%s/%s", rte->targetmatch_dir, __desc);
         rt_log_debug("before match...");
-        xerror = tool->voice_recognition_advanced_ops(sample_realpath, cur_modelist,
+        /** Large target sets are matched on the target match workers */
+        xerror = vpm_tmatch_score(sample_realpath, cur_modelist,
             sg_score, &md_index, W_ALAW);
         if ((0 == xerror) && (md_index < m)) {
             rt_log_notice("max score %f", sg_score[md_index]);
             end = rt_time_ms();
-            vpm_json_target_item_array_add(so, sg_score, m, sample_array, (double)(end - begin) / 1000, __oldname);
+            vpm_json_target_item_array_add(tqm, so, sg_score, m, js, (double)(end - begin) / 1000, __oldname, tk);
         } else {
             rt_log_error(ERRNO_FATAL, "voice_recognition_advanced_ops error, ret = %d, md_index = %d m = %d\n",
                 xerror, md_index, m);
         }
     }
+
+finish:
     modelist_destroy (cur_modelist);
+    kfree(tqm);
 
     return xerror;
 }
 
 static __rt_always_inline__ int vpm_json_target_query(struct json_hdr __attribute__((__unused__))*jhdr,
-                                       json_object *msg_body, json_object *msg_obody)
+                                       json_object *msg_body, struct jstream_t *js)
 {
-    json_object *ls, *sample_array;
+    json_object *ls;
     int samples = 0;
+    struct topk_t tk;
+    int ranked;
 
     ls = web_json_to_field(msg_body, "ls");
     samples = json_object_array_length(ls);
+    ranked = vpm_json_topk (msg_body, &tk);
 
-    sample_array = json_object_new_array();
-    vpm_target_query(ls, sample_array, samples);
-    json_object_object_add(msg_obody, "ls", sample_array);
+    jstream_array_begin (js, "ls");
+    vpm_target_query(ls, js, samples, ranked ? &tk : NULL);
+    jstream_array_end (js);
+
+    if (ranked)
+        topk_release (&tk);
 
     return 0;
 }
 
-static void *SGTargetMatch (void *param)
+static int vpm_jstream_flush (void *ctx, const char *data, size_t s)
 {
-    const char *jstr = NULL;
-    struct    vpm_t    *vpm;
-    struct    vrs_trapper_t    *rte;
-    message    data = NULL;
-    int    s = 0;
-    struct json_hdr jhdr;
-    json_object *head, *injson,*msg_i_body, *msg_o_body;
+    return web_stream_write ((struct web_stream_t *)ctx, data, s);
+}
 
-    rte = (struct vrs_trapper_t    *)param;
-    vpm = rte->vpm;
+/**
+* Start a streamed reply, same bytes web_json_head_add and
+* json_object_to_json_string would give: { "head": { ... }, "msg": {
+*/
+static int vpm_jstream_open (struct jstream_t *js, struct web_stream_t *ws,
+                uint32_t origin, struct json_hdr *jhdr)
+{
+    if (jstream_init (js, vpm_jstream_flush, ws) < 0)
+        return -1;
+    web_stream_open (ws, origin);
 
-    FOREVER {
-       data = NULL;
-       /** Recv from internal queue */
-       rt_mq_recv (vpm->target_mq, &data, &s);
-       if (likely (data)) {
-            rt_log_info ("%s", (char *)data);
+    jstream_object_begin (js, NULL);
+    jstream_object_begin (js, "head");
+    jstream_int (js, "version", jhdr->ver);
+    jstream_int (js, "direct", 1);
+    jstream_int (js, "cmd", jhdr->cmd);
+    jstream_int (js, "no", jhdr->seq);
+    jstream_object_end (js);
+    jstream_object_begin (js, "msg");
 
-            memset(&jhdr, 0, sizeof(struct json_hdr));
-            web_json_parser (data, &jhdr, &injson);
+    return 0;
+}
 
-            msg_i_body = web_json_to_field (injson, "msg");
-            msg_o_body = json_object_new_object();
-            head = json_object_new_object();
+static void vpm_jstream_close (struct jstream_t *js, struct web_stream_t *ws,
+                struct json_hdr *jhdr)
+{
+    jstream_object_end (js);
+    jstream_object_end (js);
+    jstream_flush (js);
 
-            if (SG_X_TARGET_QUERY == jhdr.cmd) {
-                vpm_json_target_query(&jhdr, msg_i_body, msg_o_body);
-            } else {
-                rt_log_error(ERRNO_FATAL, "cmd = %d", jhdr.cmd);
-            }
+    rt_log_notice ("OUTBOUND.stream(cmd=%d, no=%u, %zu bytes)%s",
+                jhdr->cmd, jhdr->seq, js->flushed, jstream_error (js) ? ", WEB gone" : "");
 
-            web_json_head_add (head, &jhdr, msg_o_body);
-            jstr = json_object_to_json_string (head);
-            json_send (vpm->web_sock, jstr, strlen(jstr), web_json_data_rebuild);
+    jstream_release (js);
+    web_stream_close (ws);
+}
 
-            json_object_put (injson);
-            json_object_put (msg_o_body);
-            json_object_put (head);
-            kfree (data);
-       }
-    }
+static void SGTargetMatch (struct web_request_t *req)
+{
+    struct web_stream_t ws;
+    struct jstream_t js;
+    struct json_hdr jhdr;
+    json_object *injson,*msg_i_body;
 
-    task_deregistry_id (pthread_self());
+    rt_log_info ("%s", req->data);
 
-    return NULL;
+    memset(&jhdr, 0, sizeof(struct json_hdr));
+    web_json_parser (req->data, &jhdr, &injson);
+
+    msg_i_body = web_json_to_field (injson, "msg");
+
+    /** Groups go out as they are matched */
+    if (!vpm_jstream_open (&js, &ws, req->origin, &jhdr)) {
+        if (SG_X_TARGET_QUERY == jhdr.cmd) {
+            vpm_json_target_query(&jhdr, msg_i_body, &js);
+        } else {
+            rt_log_error(ERRNO_FATAL, "cmd = %d", jhdr.cmd);
+        }
+        vpm_jstream_close (&js, &ws, &jhdr);
+    }
+
+    json_object_put (injson);
 }
 
-static __rt_always_inline__ int  vpm_json_register(int web_sock, uint64_t no)
+static __rt_always_inline__ int  vpm_json_register(uint32_t origin, uint64_t no)
 {
     char *regstr;
     struct json_hdr jhdr;
@@ -1535,7 +1572,8 @@ static __rt_always_inline__ int  vpm_json_register(int web_sock, uint64_t no)
     web_json_head_add (object, &jhdr, msg);
 
     regstr = (char *)json_object_to_json_string(object);
-    json_send (web_sock, regstr, strlen(regstr), web_json_data_rebuild);
+    web_reply (origin, regstr, strlen(regstr));
+    web_json_tokener_parse ("OUTBOUND", regstr);
 
     json_object_put (object);
     json_object_put (msg);
@@ -1566,7 +1604,7 @@ static __rt_always_inline__ void vpm_check_env (struct vrs_trapper_t *rte)
         rt_log_notice ("*** Basic Configuration of VPM(%d) ", vpm->id);
         rt_log_notice ("*** VRS BOOST is %s", rte->vrs_boost_st ? "ON" : "OFF");
         rt_log_notice ("        TOPX is %s(%d)", rte->topx_switch ? "ON" : "OFF", rte->topx_num);
-        rt_log_notice ("        MQ: (Notifier=%lu, Regular=%lu, Category=%lu, Target=%lu)", vpm->notify_mq, vpm->regular_mq, vpm->mass_mq, vpm->target_mq);
+        rt_log_notice ("        MQ: (Notifier=%lu, Regular=%lu, Category=%lu, Target=%lu, Cate=%lu)", vpm->notify_mq, vpm->regular_mq, vpm->mass_mq, vpm->target_mq, vpm->cate_mq);
         rt_log_notice ("        VPM<-->VPW: (%s:%d)", vpm->ip, vpm->port);
         rt_log_notice ("        VPM<-->WEB: (%s:%d)", vpm->web, vpm->web_port);
 
@@ -1756,136 +1794,65 @@ static void vpm_handle_msg(struct tlv *msg)
     return ;
 }
 
-static void *
-vpwTask (void *args)
+/**
+* One request cut out of a WEB connection by the web agent.
+* Runs on the epoll loop, so it is only copied here, WebIntake parses it.
+*/
+static void web_request_dispatch (uint32_t origin, char *request, size_t s)
 {
-    struct sockaddr_in sock_addr;
-    char buffer[1024] = {0};
-    int xerror = 0, tmo, sz = 0;
-    struct vpm_t    *vpm;
-    struct vpw_clnt_t *clnt;
-    struct tlv request   = {0};
-    struct rt_task_t *cur_task = task_query_id (pthread_self());
+    struct vpm_t    *vpm = vrs_default_trapper()->vpm;
+    void *clone = NULL;
 
-    clnt = (struct vpw_clnt_t *)args;
+    request_clone (origin, request, s, &clone);
+    if (!clone)
+        return;
+    if (MQ_SUCCESS != rt_mq_send (vpm->intake_mq, clone, (int)s))
+        kfree (clone);
+}
 
-    if (!clnt || clnt->sock <= 0 ||
-        rt_sock_getpeername(clnt->sock, &sock_addr) < 0){
-        return NULL;
-    }
+/** Parses what web_request_dispatch queued and routes it to its class */
+static void *WebIntake (void *param)
+{
+    struct    vpm_t    *vpm;
+    struct    vrs_trapper_t    *rte;
+    struct web_request_t *req;
+    struct json_hdr hdr;
+    json_object *injson, *deadline;
+    message    data = NULL;
+    int    s = 0;
 
-    if (likely(cur_task))
-        rt_log_notice (
-            "Task (\"%s\", thread_id=%ld) starting ...",
-                cur_task->name, cur_task->pid);
+    rte = (struct vrs_trapper_t    *)param;
+    vpm = rte->vpm;
 
-    vpm = clnt->vpm;
     FOREVER {
-        xerror = is_sock_ready (clnt->sock, 30 * 1000000, &tmo);
-        if (xerror == 0 && tmo == 1)
+        data = NULL;
+        rt_mq_recv (vpm->intake_mq, &data, &s);
+        if (unlikely (!data))
             continue;
-        if (xerror < 0)
-            break;
-
-        memset(buffer, 0, sizeof(buffer));
-        sz = rt_sock_recv (clnt->sock, buffer, 1024);
-        if (sz <=0) {
-            rt_log_warning(ERRNO_SG,
-                    "Peer(VPW) (%s:%d, sock=%d, rsize=%d), %s",
-                        inet_ntoa(sock_addr.sin_addr), ntohs(sock_addr.sin_port), clnt->sock, sz,
-                        (sz == 0) ? "Connection closed" : strerror (errno));
 
-            break;
-        }
+        req = (struct web_request_t *)data;
+        memset (&hdr, 0, sizeof (struct json_hdr));
+        web_json_parser (req->data, &hdr, &injson);
+        /** Optional, seconds the sender will wait for the answer */
+        deadline = web_json_to_field (web_json_to_field (injson, "head"), "deadline");
+        req->deadline = json_object_is_type (deadline, json_type_int) ?
+                    json_object_get_int (deadline) : 0;
+        json_object_put (injson);
 
-        rt_log_debug("get request!");
-        if (sz > 0) {
-            /** 当前vpw发送到vpm的消息，只有一个tlv结构 */
-            xerror = senior_parse_tlv(buffer, sz, &request);
-            if (0 == xerror)
-            {
-                rt_log_debug("parse tlv from vpw ok");
-                vpm_handle_msg(&request);
-            }
-        }
+        mission_dispatcher (vpm, &hdr, req);
     }
 
-    vpw_list_query (vpm, clnt->sock, vpw_del, NULL, 0);
-
-    if (likely(cur_task))
-        rt_log_notice (
-            "Task (\"%s\", thread_id=%ld) destroy ...",
-                cur_task->name, cur_task->pid);
-
     task_deregistry_id (pthread_self());
 
     return NULL;
 }
 
-
-void *WebAgent (void *args /** Config from vpm.yaml */)
+/** Connected to WEB, register first */
+static void web_greet (uint32_t origin)
 {
-#define    MSG_SIZE    4096
-    struct vrs_trapper_t *rte;
-    char request[MSG_SIZE] = {0};
-    struct vpm_t    *vpm;
-    int    rsize = 0, xerror, tmo;
-    struct json_hdr hdr;
-    json_object *injson;
-
-    rte = (struct vrs_trapper_t *)args;
-    vpm = rte->vpm;
-
-    FOREVER {
-        do {
-            atomic64_inc(&vpm->seq);
-            vpm->web_sock = (rt_clnt_sock (0, vpm->web, vpm->web_port, AF_INET));
-            if (vpm->web_sock > 0)
-                break;
-            rt_log_notice ("Connecting to WEB (%s:%d, sock=%d): %s",
-                        vpm->web, vpm->web_port, vpm->web_sock, "failure");
-            sleep (3);
-
-        } while (vpm->web_sock < 0);
-
-
-        rt_log_notice ("Connecting to WEB  (%s:%d, sock=%d): %s",
-                        vpm->web, vpm->web_port, vpm->web_sock, "success");
-        vpm_json_register (vpm->web_sock, atomic64_read(&vpm->seq));
-
-        do {
-
-            xerror = is_sock_ready (vpm->web_sock, 60 * 1000000, &tmo);
-            if (xerror == 0 && tmo == 1)
-                continue;
-            if (xerror < 0) {
-                rt_log_error (ERRNO_SG, "Select (%s:%d, sock=%d): %s",
-                    vpm->ip, vpm->port, vpm->web_sock, strerror(errno));
-                rt_sock_close (&vpm->sock, NULL);
-                break;
-            }
-
-            memset(request, 0, MSG_SIZE);
-            rsize = rt_sock_recv (vpm->web_sock, request, MSG_SIZE);
-            if (rsize <= 0) {
-                rt_log_error (ERRNO_SG,
-                    "Peer(WEB) (%s:%d, sock=%d, rsize=%d), %s",
-                            vpm->ip, vpm->port, vpm->web_sock, rsize,
-                            (rsize == 0) ? "Connection closed" : strerror (errno));
-                rt_sock_close (&vpm->web_sock, NULL);
-                break;
-
-            }
-
-            web_json_parser (request, &hdr, &injson);
-            mission_dispatcher (vpm, &hdr, request, rsize);
-
-        }while (vpm->web_sock > 0);
-    }
-
-    task_deregistry_id(pthread_self());
+    struct vpm_t    *vpm = vrs_default_trapper()->vpm;
 
-    return NULL;
+    vpm_json_register (origin, atomic64_read(&vpm->seq));
 }
 
 static void *VpwNotifier (void *param)
@@ -1903,7 +1870,7 @@ static void *VpwNotifier (void *param)
         /** Recv from internal queue */
         rt_mq_recv (vpm->notify_mq, &data, &s);
         if (likely (data)) {
-            vpw_list_foreach (vpm, vpw_notifier, data, (size_t)s);
+            vpw_broadcast (vpm, data, (size_t)s);
             kfree (data);
         }
 
@@ -1915,195 +1882,85 @@ static void *VpwNotifier (void *param)
 }
 
 
-static void *VpwManager (void *param)
+static void VpmMassCategorier (struct web_request_t *req)
 {
-    int sock, xerror = 0, tmo = 0;
-    struct    vpm_t    *vpm;
-    struct    vrs_trapper_t    *rte;
-    char    desc[32] = {0};
-
-    rte = (struct vrs_trapper_t    *)param;
-    vpm = rte->vpm;
-
-    INIT_LIST_HEAD (&vpm->clnt_socks_list);
-
-    FOREVER {
-
-        do {
-            vpm->serv_sock = rt_serv_sock (0, vpm->port, AF_INET);
-            if (vpm->serv_sock > 0) {
-                break;
-            }
-            rt_log_notice ("Listen (port=%d, sock=%d), %s",
-                        vpm->port, vpm->serv_sock, "failure");
-            sleep (3);
-        } while (vpm->serv_sock < 0);
-
-        rt_log_notice ("Ready to Listen (port=%d, sock=%d)",
-                        vpm->port, vpm->serv_sock);
-
-        do {
-
-            xerror = is_sock_ready (vpm->serv_sock, 30 * 1000000, &tmo);
-            if (xerror == 0 && tmo == 1)
-                continue;
-            if (xerror < 0) {
-                /** clear clnt list here */
-                vpw_list_release (vpm);
-                rt_sock_close (&vpm->serv_sock, NULL);
-                break;
-            }
-
-            sock = rt_serv_accept (0, vpm->serv_sock);
-            if (sock <= 0) {
-                rt_log_error(ERRNO_SOCK_ACCEPT, "%s\n", strerror(errno));
-                continue;
-            }
-            struct vpw_clnt_t *clnt;
-            clnt = vpw_list_add (vpm, sock);
-            if (likely(clnt)) {
-                sprintf (desc, "vpw%d Task", clnt->sock);
-                task_spawn(desc, 0, NULL, vpwTask, clnt);
-                task_detail_foreach ();
-            }
-        } while (vpm->serv_sock > 0);
-    }
-
-    task_deregistry_id (pthread_self());
-
-    return NULL;
-}
-
-static void *VpmMassCategorier (void *param)
-{
-    const char *jstr = NULL;
-    struct    vpm_t    *vpm;
-    struct    vrs_trapper_t    *rte;
-    message    data = NULL;
-    int    s = 0;
-    int send_data_len1 = 0 ,send_data_len = 0 ,send_len = 0;
-    char *send_data = NULL, *send_data1 = NULL;
+    struct web_stream_t ws;
+    struct jstream_t js;
     struct json_hdr jhdr;
-    json_object *head, *injson,*msg_i_body, *msg_o_body;
+    json_object *injson,*msg_i_body;
 
-    rte = (struct vrs_trapper_t    *)param;
-    vpm = rte->vpm;
+    rt_log_info ("%s", req->data);
 
-    FOREVER {
-        data = NULL;
-        /** Recv from internal queue */
-        rt_mq_recv (vpm->mass_mq, &data, &s);
-        if (likely (data)) {
-            rt_log_info ("%s", (char *)data);
-
-            web_json_parser (data, &jhdr, &injson);
-            msg_i_body = web_json_to_field (injson, "msg");
-
-            msg_o_body = json_object_new_object();
-            head = json_object_new_object();
-            switch (jhdr.cmd) {
-                case SG_X_MASS_QUERY:
-                    vpm_json_mass_query (&jhdr, msg_i_body, msg_o_body);
-                    web_json_head_add (head, &jhdr, msg_o_body);
-                    break;
-                default:
-                    break;
-            }
-            jstr = json_object_to_json_string (head);
-            send_data_len = strlen(jstr);
-            send_data = (char*)malloc((send_data_len / 1024 + 1) * 1024);
-            send_data1 = send_data;
-            bzero(send_data, ((send_data_len / 1024 + 1) * 1024));
-            snprintf(send_data, ((send_data_len / 1024 + 1) * 1024), "%s\n", jstr);
-            send_data_len1 = strlen(send_data);
-            while(send_data_len1 > 0){
-                send_len = rt_sock_send (vpm->web_sock, send_data,send_data_len1);
-                send_data = send_data +send_len;
-                send_data_len1 -= send_len;
-            }
+    web_json_parser (req->data, &jhdr, &injson);
+    msg_i_body = web_json_to_field (injson, "msg");
 
-            web_json_tokener_parse ("OUTBOUND", jstr);
-            jstr = NULL;
-            json_object_put (injson);
-            json_object_put (msg_o_body);
-            //json_object_put (msg_i_body);
-            json_object_put (head);
-            kfree (data);
-            kfree(send_data1);
-        }
+    switch (jhdr.cmd) {
+        case SG_X_MASS_QUERY:
+            /** Hits of each day go out as that day is matched */
+            if (!vpm_jstream_open (&js, &ws, req->origin, &jhdr)) {
+                vpm_json_mass_query (&jhdr, msg_i_body, &js);
+                vpm_jstream_close (&js, &ws, &jhdr);
+            }
+            break;
+        default:
+            /** What an empty head object prints */
+            web_reply (req->origin, "{ }", 3);
+            break;
     }
 
-    task_deregistry_id (pthread_self());
-
-    return NULL;
+    json_object_put (injson);
 }
 
-static void *SGRegularyPT (void *param)
+static void SGRegularyPT (struct web_request_t *req)
 {
 
     const char *jstr = NULL;
-    struct    vpm_t    *vpm;
     struct    vrs_trapper_t    *rte;
-    message    data = NULL;
-    int    s = 0;
     struct json_hdr jhdr;
     json_object *head, *injson,*msg_i_body, *msg_o_body;
 
-    rte = (struct vrs_trapper_t    *)param;
-    vpm = rte->vpm;
-
-    FOREVER {
-        data = NULL;
-        /** Recv from internal queue */
-        rt_mq_recv (vpm->regular_mq, &data, &s);
-        if (likely (data)) {
+    rte = vrs_default_trapper ();
 
-            rt_log_info ("%s", (char *)data);
+    rt_log_info ("%s", req->data);
 
-            web_json_parser (data, &jhdr, &injson);
-            msg_i_body = web_json_to_field (injson, "msg");
+    web_json_parser (req->data, &jhdr, &injson);
+    msg_i_body = web_json_to_field (injson, "msg");
 
-            msg_o_body = json_object_new_object();
-                head = json_object_new_object();
+    msg_o_body = json_object_new_object();
+    head = json_object_new_object();
 
-            switch (jhdr.cmd) {
-                case SG_X_ADD:
-                    if (rte->vrs_boost_st) {
-                        boost_vpm_json_add_sample(&jhdr, msg_i_body, msg_o_body);
-                    }
-                    else {
-                        vpm_json_add_sample (&jhdr, msg_i_body, msg_o_body);
-                    }
-                    break;
-                case SG_X_DEL:
-                    if (rte->vrs_boost_st) {
-                        boost_vpm_json_del_sample(&jhdr, msg_i_body, msg_o_body);
-                    }
-                    else {
-                        vpm_json_del_sample (&jhdr, msg_i_body, msg_o_body);
-                    }
-                    break;
-                case SG_X_CATE:
-                    vpm_json_cate_sample(&jhdr, msg_i_body, msg_o_body);
-                    break;
-                default:
-                    break;
+    switch (jhdr.cmd) {
+        case SG_X_ADD:
+            if (rte->vrs_boost_st) {
+                boost_vpm_json_add_sample(&jhdr, msg_i_body, msg_o_body);
             }
-
-            web_json_head_add (head, &jhdr, msg_o_body);
-            jstr = json_object_to_json_string (head);
-            json_send (vpm->web_sock, jstr, strlen(jstr), web_json_data_rebuild);
-
-            json_object_put (injson);
-            json_object_put (msg_o_body);
-            json_object_put (head);
-            kfree (data);
-        }
+            else {
+                vpm_json_add_sample (&jhdr, msg_i_body, msg_o_body);
+            }
+            break;
+        case SG_X_DEL:
+            if (rte->vrs_boost_st) {
+                boost_vpm_json_del_sample(&jhdr, msg_i_body, msg_o_body);
+            }
+            else {
+                vpm_json_del_sample (&jhdr, msg_i_body, msg_o_body);
+            }
+            break;
+        case SG_X_CATE:
+            vpm_json_cate_sample(&jhdr, msg_i_body, msg_o_body);
+            break;
+        default:
+            break;
     }
 
-    task_deregistry_id (pthread_self());
+    web_json_head_add (head, &jhdr, msg_o_body);
+    jstr = json_object_to_json_string (head);
+    web_reply (req->origin, jstr, strlen(jstr));
+    web_json_tokener_parse ("OUTBOUND", jstr);
 
-    return NULL;
+    json_object_put (injson);
+    json_object_put (msg_o_body);
+    json_object_put (head);
 }
 
 
@@ -2117,27 +1974,22 @@ static void SGVpmTmrScanner(uint32_t __attribute__((__unused__)) uid,
     rte = (struct vrs_trapper_t *)argv;
 
     rt_logging_reinit_file (rte->log_dir);
+
+    vpm_sched_dump ();
+    vpm_mcache_dump ();
+    vpm_tmatch_dump ();
+    vpm_digest_sync ();
 }
 
 
-static struct rt_task_t SGVpwManagerTask =
+static struct rt_task_t SGWebIntakeTask =
 {
     .module = THIS,
-    .name = "VPW Management Task",
+    .name = "Web Intake Task",
     .core = INVALID_CORE,
     .prio = KERNEL_SCHED,
     .argvs = &vrsTrapper,
-    .routine = VpwManager,
-};
-
-static struct rt_task_t SGWebAgentTask =
-{
-    .module = THIS,
-    .name = "Web Agent Task",
-    .core = INVALID_CORE,
-    .prio = KERNEL_SCHED,
-    .argvs = &vrsTrapper,
-    .routine = WebAgent,
+    .routine = WebIntake,
 };
 
 static struct rt_task_t SGVpwNotifierTask =
@@ -2150,36 +2002,6 @@ static struct rt_task_t SGVpwNotifierTask =
     .routine = VpwNotifier,
 };
 
-static struct rt_task_t SGMassCategoryTask =
-{
-    .module = THIS,
-    .name = "SG Massive Gategory Task",
-    .core = INVALID_CORE,
-    .prio = KERNEL_SCHED,
-    .argvs = &vrsTrapper,
-    .routine = VpmMassCategorier,
-};
-
-static struct rt_task_t SGRegularTask =
-{
-    .module = THIS,
-    .name = "SG Regular Task",
-    .core = INVALID_CORE,
-    .prio = KERNEL_SCHED,
-    .argvs = &vrsTrapper,
-    .routine = SGRegularyPT,
-};
-
-static struct rt_task_t SGTargetMatchTask =
-{
-    .module = THIS,
-    .name = "SG Target Match task",
-    .core = INVALID_CORE,
-    .prio = KERNEL_SCHED,
-    .argvs = &vrsTrapper,
-    .routine = SGTargetMatch,
-};
-
 static void vpm_argv_parser(char **argv, struct vpm_t *vpm)
 {
     int i;
@@ -2217,6 +2039,11 @@ static void __engine_init_tool ()
 
     memcpy (tool, engine_default_ops(), sizeof (struct rt_vrstool_t));
 
+    /** Samples seen before are not extracted again */
+    tool->model_cvrto_ops = mcache_wav_to_model_file;
+    tool->model_cvrto_cache_ops = mcache_wav_to_model;
+    modelist_converter_set (tool->model_cvrto_cache_ops);
+
     vrs_trapper_set_tool (tool);
 }
 
@@ -2236,6 +2063,9 @@ vpm_trapper_init(struct vrs_trapper_t *rte)
         __sg_check_and_mkdir(rte->vdu_dir);
         __sg_check_and_mkdir(rte->targetmatch_dir);
 
+        vpm_mcache_init (VPM_ENGINE_DIR "/" VPM_ENGINE_CFG);
+        vpm_digest_init (rte->sample_dir);
+
         rte->perform_tmr = tmr_create (SG,
                 "Performence Monitor for VPM", TMR_PERIODIC,
                 SGVpmTmrScanner, 1, (char **)rte, 30);
@@ -2258,8 +2088,12 @@ vpm_trapper_init(struct vrs_trapper_t *rte)
             vpm->regular_mq    =    rt_mq_create ("VPM Regular Queue");
             vpm->mass_mq    =    rt_mq_create ("VPM Massive Query Queue");
             vpm->boost_mq   =   rt_mq_create ("VPM Boost Queue");
-            vpm->cdb_mq     =   rt_mq_create ("VPM DB Queue");
+            /** Hit counters, a full ring drops the newest like a failed insert */
+            vpm->cdb_mq     =   rt_mq_create_bounded ("VPM DB Queue", 4096);
             vpm->target_mq  =   rt_mq_create ("VPM Target Queue");
+            vpm->cate_mq    =   rt_mq_create ("VPM Category Queue");
+            vpm->intake_mq  =   rt_mq_create ("VPM Web Intake Queue");
+            vpm_sched_init (vpm);
         }
     }
 }
@@ -2277,12 +2111,15 @@ void vpm_init (int __attribute__((__unused__)) argc,
     /** rte init */
     vpm_trapper_init (rte);
 
-    task_registry (&SGMassCategoryTask);
-    task_registry (&SGRegularTask);
-    task_registry (&SGVpwManagerTask);
-    task_registry (&SGWebAgentTask);
+    vpm_sched_register (VPM_CLS_MASS, VpmMassCategorier);
+    vpm_sched_register (VPM_CLS_REGULAR, SGRegularyPT);
+    vpm_sched_register (VPM_CLS_CATE, SGRegularyPT);
+    vpm_vpw_init (rte->vpm, vpm_handle_msg, VPW_WORKERS_DEFAULT);
+    task_registry (&SGWebIntakeTask);
+    vpm_web_init (rte->vpm, web_request_dispatch, web_greet);
     task_registry (&SGVpwNotifierTask);
-    task_registry (&SGTargetMatchTask);
+    vpm_tmatch_init ();
+    vpm_sched_register (VPM_CLS_TARGET, SGTargetMatch);
 
 }
 
@@ -2294,13 +2131,59 @@ void vpm_startup (struct vrs_trapper_t *rte)
 
     vpm_check_env (rte);
 
-    rte->tool->engine_init ("SpkSRE.cfg", "/usr/local/etc/vpm");
+    rte->tool->engine_init (VPM_ENGINE_CFG, VPM_ENGINE_DIR);
+}
+
+/**
+* Equivalence checks, "vpm --selftest [pcm wav ...]" runs them and exits.
+* The target match check needs the engine and the wavs to build models of.
+*/
+static int vpm_selftest (int nwavs, const char **wavs)
+{
+    struct rt_vrstool_t *tool = engine_default_ops ();
+    int xret = 0;
+
+    if (vpm_web_test (4, 2000)) {
+        printf ("vpm_web_test: FAILED\n");
+        xret = -1;
+    } else
+        printf ("vpm_web_test: ok\n");
+
+    if (xcrypt_test ()) {
+        printf ("xcrypt_test: FAILED\n");
+        xret = -1;
+    } else
+        printf ("xcrypt_test: ok\n");
+
+    if (vad_test ()) {
+        printf ("vad_test: FAILED\n");
+        xret = -1;
+    } else
+        printf ("vad_test: ok\n");
+
+    if (nwavs <= 0)
+        printf ("vpm_tmatch_test: skipped, no wavs given\n");
+    else if (tool->engine_init ((char *)VPM_ENGINE_CFG, (char *)VPM_ENGINE_DIR))
+        printf ("vpm_tmatch_test: skipped, no engine in %s\n", VPM_ENGINE_DIR);
+    else {
+        vrs_trapper_set_tool (tool);
+        if (vpm_tmatch_test (wavs, nwavs, 4 * TMATCH_SLICE_MIN + 17)) {
+            printf ("vpm_tmatch_test: FAILED\n");
+            xret = -1;
+        } else
+            printf ("vpm_tmatch_test: ok\n");
+    }
+
+    return xret;
 }
 
 int main (int argc, char **argv)
 {
     struct vrs_trapper_t *rte;
 
+    if (argc > 1 && !STRCMP (argv[1], "--selftest"))
+        return vpm_selftest (argc - 2, (const char **)(argv + 2)) ? 1 : 0;
+
     librecv_init (argc, argv);
 
     rte  = vrs_default_trapper();
@@ -5,6 +5,12 @@
 #include "vpm_dms_agent.h"
 #include "vpm_init.h"
 #include "vpm_boost.h"
+#include "vpm_web.h"
+#include "vpm_sched.h"
+#include "vpm_mcache.h"
+#include "vpm_digest.h"
+#include "xcrypt.h"
+#include "vad.h"
 #include "conf.h"
 #include "conf-yaml-loader.h"
 #include "apr_md5.h"
@@ -27,26 +33,11 @@ void json_sample_redunant(char *pathname, json_object *arr)
     json_object_array_add(arr, obj);
 }
 
+/** Stored samples are answered from the digest index, see vpm_digest.c */
 static int md5sum (char *file, unsigned char digest[])
 {
-    apr_md5_ctx_t context;
-
-    char readline[1024] ={0};
-    FILE *fp = NULL;
-
-    apr_md5_init(&context);
-
-    fp = fopen(file, "r");
-    if (likely (fp)) {
-        while (fgets(readline, sizeof(readline), fp)) {
-            apr_md5_update(&context, readline, strlen(readline));
-            memset (readline, 0, sizeof(readline));
-        }
-
-        fclose (fp);
-    }
-
-    apr_md5_final(digest, &context);
+    if (vpm_digest_get (file, digest) < 0)
+        memset (digest, 0, 16);
 
     return 0;
 }
@@ -133,6 +124,7 @@ check_redundant_target_wav(uint64_t tid, json_object *arr)
         for (j=i+1; j<wavs; j++) {
             if (!memcmp(digest[i], digest[j], APR_MD5_DIGESTSIZE)) {
                 remove(wavlist[j]);
+                vpm_digest_forget(wavlist[j]);
                 rt_log_notice("get file \"%s\" and \"%s\" md5 same, remove %s",
                         wavlist[i], wavlist[j], wavlist[j]);
                 json_sample_redunant(wavlist[j], arr);
@@ -218,6 +210,7 @@ check_current_file_redundant(uint64_t tid, char *wavname, json_object *arr)
         if  (i != id) {
             if (!memcmp(digest[id], digest[i], APR_MD5_DIGESTSIZE)) {
                 remove(wavname);
+                vpm_digest_forget(wavname);
                 json_sample_redunant(wavname, arr);
                 rt_log_notice("file %s and update file %s md5sum same, remove it",
                         wavlist[i], wavname);
@@ -383,6 +376,11 @@ int vpm_cate_target_samples(vrs_target_attr_t *target_info)
 
     for (i=0; i<target_info->sample_cnt; i++)
     {
+        if (vpm_sched_check ())
+        {
+            xret = -1;
+            break;
+        }
         __this = (vrs_sample_attr_t *)(target_info->samples + i);
         xret = tool->voice_recognition_advanced_ops(__this->wav_path, modelist,
                             sg_score, &md_index, W_ALAW);
@@ -578,199 +576,57 @@ finish:
     return status;
 }
 
-static int g_last_three_frame[3] = {FRAME_UNKNOW, FRAME_UNKNOW, FRAME_UNKNOW};
-
-/** 能量门限值，当前先取0x52 */
-static int g_energy_gate = 0x52;
-
-static inline int get_energy_gate()
-{
-    return (g_energy_gate *g_energy_gate);
-}
-
-static inline int set_energy_gate(int val)
-{
-    return g_energy_gate = val;
-}
-
-
-static int calc_frame_avg_energy(unsigned char *frame, int frame_size)
-{
-    int i = 0;
-    int E_per = 0;
-    int E_sum = 0;
-    int E_avg = 0;
-
-    for (i = 0; i < frame_size; i++)
-    {
-        E_per = frame[i] & 0x7f;
-
-        E_sum += (E_per * E_per);
-    }
-    E_avg = E_sum / frame_size;
-
-    return E_avg;
-}
-
-static inline int abs_e(int a, int b)
-{
-    if (a >= b)
-    {
-        return (a - b);
-    }
-    else
-    {
-        return (b - a);
-    }
-}
-
-static int calc_frame_czr(unsigned char *frame, int frame_size)
-{
-    int i = 0;
-    int sgn1 = 0, sgn2 = 0;
-    int rate = 0;
-
-    for (i = 1; i < frame_size; i++)
-    {
-        sgn1 = frame[i - 1] & 0x80;
-        sgn2 = frame[i] & 0x80;
-        if ((sgn1 != sgn2) && (abs_e(frame[i - 1] & 0x7f, frame[i] & 0x7f) >= 2))
-        {
-            rate += 1;
-        }
-    }
-    return rate;
-}
-
-static inline int frame_vad_smooth()
-{
-    if ((g_last_three_frame[0] ==  FRAME_VOICE)
-        || (g_last_three_frame[1] ==  FRAME_VOICE)
-        || (g_last_three_frame[2] ==  FRAME_VOICE))
-    {
-        return FRAME_SMOOTH_VOICE;
-    }
-    else
-    {
-        return FRAME_SILENCE;
-    }
-}
-
-static inline void update_vad_smooth(int frame_type)
-{
-    g_last_three_frame[2] = g_last_three_frame[1];
-    g_last_three_frame[1] = g_last_three_frame[0];
-    g_last_three_frame[0] = frame_type;
-}
-
-static inline void init_vad_smooth()
-{
-    g_last_three_frame[2] = FRAME_UNKNOW;
-    g_last_three_frame[1] = FRAME_UNKNOW;
-    g_last_three_frame[0] = FRAME_UNKNOW;
-}
-
-static int vpm_judge_frame_type(unsigned char *frame, int frame_size)
-{
-    int czr = 0;
-    int energy_avg = 0;
-    int frame_type = FRAME_UNKNOW;
-
-    energy_avg = calc_frame_avg_energy(frame, frame_size);
-    if (energy_avg >= get_energy_gate())
-    {
-        /** 平均能量大于门限值，初步判断为静音帧，进行VAD平滑 */
-        frame_type = frame_vad_smooth();
-        if (frame_type == FRAME_SILENCE)
-        {
-            /** 平滑结果仍为静音帧， 计算过零率 */
-            czr = calc_frame_czr(frame, frame_size);
-            if (czr >= 3)
-            {
-                frame_type = FRAME_VOICE; //此时可能为FRAME_SMOOTH_VOICE，待验证后再决定是否调整
-            }
-        }
-    }
-    else
-    {
-        frame_type = FRAME_VOICE;
-    }
-
-    //printf("frame_type = %d \n", frame_type);
-    update_vad_smooth(frame_type);
-
-    return frame_type;
-}
-
 static int vpm_get_wav_valid_len(char *fullpath)
 {
     int  valid_voice_len = -1;
-    int  file_size = 0, real_size = 0, valid_size = 0;
-    int  frame_size = 0, frame_offset = FRAME_OFFSET, frame_type = FRAME_UNKNOW;
-    unsigned char *buf= NULL, *p = NULL;
-    FILE *fp = NULL;
+    int  fd = -1;
+    ssize_t real_size = 0;
+    off_t skip = sizeof(wav_header_t);
+    unsigned char buf[VAD_BUFFER_SIZE];
+    struct vad_t *vad = NULL;
     struct stat statbuf;
 
-    if (stat(fullpath, &statbuf) < 0)
-    {
-        rt_log_error(ERRNO_FATAL, "%s : %s", fullpath, strerror(errno));
-        goto finish;
-    }
-    file_size = statbuf.st_size;
-    buf = (unsigned char *)kmalloc(file_size, MPF_CLR, -1);
-    if (!buf)
+    fd = open(fullpath, O_RDONLY);
+    if (fd < 0 || fstat(fd, &statbuf) < 0)
     {
         rt_log_error(ERRNO_FATAL, "%s : %s", fullpath, strerror(errno));
         goto finish;
     }
-    fp = fopen(fullpath, "rb");
-    if (!fp)
+    vad = (struct vad_t *)kmalloc(sizeof(struct vad_t), MPF_NOFLGS, -1);
+    if (!vad)
     {
         rt_log_error(ERRNO_FATAL, "%s : %s", fullpath, strerror(errno));
         goto finish;
     }
+    vad_init(vad, VAD_ENERGY_GATE);
 
-    real_size = fread(buf, 1, file_size, fp);
-    if (real_size != file_size)
+    /* 处理wav文件头, 数据边读边判断, 内存不随文件增长 */
+    while ((real_size = read(fd, buf, sizeof(buf))) > 0)
     {
-        rt_log_error(ERRNO_FATAL, "fread invalid(%d)", real_size);
-        goto finish;
+        if (skip >= real_size)
+        {
+            skip -= real_size;
+            continue;
+        }
+        vad_feed(vad, buf + skip, real_size - skip);
+        skip = 0;
     }
-    /* 处理wav文件头 */
-    p = (unsigned char *)(buf + sizeof(wav_header_t));
-    real_size -= sizeof(wav_header_t);
-    while (real_size > 0)
+    if (real_size < 0)
     {
-        frame_size = (real_size >= FRAME_LEN ? FRAME_LEN : real_size);
-        frame_type = vpm_judge_frame_type(p, frame_size);
-
-        /* 为实现平滑，采用滑动窗口，每次只偏移一个帧的2/5 */
-        frame_offset = (frame_size == FRAME_LEN ? FRAME_OFFSET : frame_size);
-
-        if (frame_type == FRAME_VOICE || frame_type == FRAME_SMOOTH_VOICE)
-            valid_size += frame_offset;
-
-        real_size -= frame_offset;
-        p = (unsigned char *)(p + frame_offset);
+        rt_log_error(ERRNO_FATAL, "%s : %s", fullpath, strerror(errno));
+        goto finish;
     }
 
     /** 计算有效语音长度，WAV_AVG_BYTES_PERSEC这个值应该读取wav的头部获取，这里先直接用宏 */
-    valid_voice_len = valid_size / WAV_AVG_BYTES_PERSEC;
-
-    rt_log_notice("wav(%s)[%d sec ==> %d sec]", fullpath, (file_size/WAV_AVG_BYTES_PERSEC), valid_voice_len);
+    valid_voice_len = (int)(vad_finish(vad) / WAV_AVG_BYTES_PERSEC);
 
-    /** 每次都要初始化VAD平滑记录 */
-    init_vad_smooth();
+    rt_log_notice("wav(%s)[%d sec ==> %d sec]", fullpath, (int)(statbuf.st_size/WAV_AVG_BYTES_PERSEC), valid_voice_len);
 
 finish:
-    if (buf)
-    {
-        kfree(buf);
-        buf = NULL;
-    }
-    if (fp)
+    kfree(vad);
+    if (fd >= 0)
     {
-        fclose(fp);
+        close(fd);
     }
 
     return valid_voice_len;
@@ -939,28 +795,6 @@ static int vpm_get_sample_path(uint64_t callid, int dir, char *wav_realpath)
     return XSUCCESS;
 }
 
-/****************************************************************************
- 函数名称  : vpm_decrypt_wave_data
- 函数功能    : 对wav数据内容解密
- 输入参数    : 1、data    2、data_len
- 输出参数    :
- 返回值     : 返回0
- 创建人     : yuansheng
- 备注      :
-****************************************************************************/
-static int vpm_decrypt_wav_data(char *data, int data_len)
-{
-    int i;
-
-    /*解密方式与SVM的加密方式保持一致*/
-    for (i = 0; i < data_len; i++) {
-        data[i] = data[i] ^ 0x53;
-    }
-
-    return 0;
-}
-
-
 /****************************************************************************
  函数名称  : vpm_write_decrypt_wav
  函数功能    : 读取样本文件内容，解密后写入待匹配的wav文件中
@@ -972,9 +806,7 @@ static int vpm_decrypt_wav_data(char *data, int data_len)
 ****************************************************************************/
 static int vpm_write_decrypt_wav(const char *sample_realpath, FILE *dst_fp)
 {
-    char buf[1024] = {0};
     int file_size = 0, real_size = 0;
-    FILE *src_fp;
     struct stat statbuf;
     wav_header_t wavhead;
 
@@ -988,14 +820,10 @@ static int vpm_write_decrypt_wav(const char *sample_realpath, FILE *dst_fp)
 
     if (file_size)
     {
-        src_fp = fopen(sample_realpath, "r");
-        while ((real_size = fread(buf, 1, 1024, src_fp)) > 0)
-        {
-            vpm_decrypt_wav_data(buf, real_size);
-            fwrite(buf, 1, real_size, dst_fp);
+        /*解密方式与SVM的加密方式保持一致*/
+        real_size = (int)xcrypt_file(sample_realpath, dst_fp);
+        if (real_size > 0)
             file_size -= real_size;
-        }
-        fclose(src_fp);
     }
     if (file_size != 0)
     {
@@ -1324,6 +1152,9 @@ static int vpm_load_hit_model(int max_model_num, char *vdu_dir,
     __this = records->next;
     while (__this != NULL)
     {
+        /** Records are still released once the job is cancelled */
+        if (vpm_sched_check ())
+            goto recordfree;
         call_time = (__this->callid >> 32) & 0xffffffff;
 
         tms = localtime_r(&call_time, &tm_buf);
@@ -1506,6 +1337,12 @@ static int vpm_json_boost_filter(json_object *msg_body, json_object *msg_obody)
         goto finish;
     }
 
+    if (vpm_sched_check ())
+    {
+        ret = -1;
+        goto finish;
+    }
+
     /**6、根据clueid和objectid去查找case数据库，将历史命中的callid和dir找到*/
     hit_num = vpm_get_hit_records(clue_id, object_id, &records);
     if (hit_num == 0)
@@ -1541,7 +1378,7 @@ static int vpm_json_boost_filter(json_object *msg_body, json_object *msg_obody)
     sample_array = json_object_new_array();
 
     /**9、开始进行匹配*/
-    if (likely (cur_modelist) && cur_modelist->sg_cur_size > 0)
+    if (likely (cur_modelist) && cur_modelist->sg_cur_size > 0 && !vpm_sched_check ())
     {
         sg_score = cur_modelist->sg_score;
         m = cur_modelist->sg_cur_size;
@@ -1572,88 +1409,42 @@ finish:
 
 /****************************************************************************
  函数名称  : SGBooster
- 函数功能    : 注册的线程回调函数，接收处理消息队列boost_mq的消息
- 输入参数    : 指针param
+ 函数功能    : boost类的处理函数，由调度器的worker从boost_mq取出请求后调用
+ 输入参数    : req WEB请求
  输出参数    : 无
- 返回值     : 正常情况下不会退出
+ 返回值     : 无
  创建人     : yuansheng
  备注      :
 ****************************************************************************/
-void *SGBooster(void *param)
+void SGBooster(struct web_request_t *req)
 {
     const char    *jstr = NULL;
-    int s = 0;
-    int send_data_len1 = 0 ,send_data_len = 0 ,send_len = 0;
-    char *send_data = NULL, *send_data1 = NULL;
-    struct vpm_t            *vpm;
-    struct vrs_trapper_t    *rte;
     struct json_hdr         jhdr;
-    message                 data = NULL;
     json_object   *head, *injson, *msg_i_body, *msg_o_body;
 
-    rte = (struct vrs_trapper_t *)param;
-    vpm = rte->vpm;
-
-    FOREVER {
-        data = NULL;
-        /** Recv from internal queue */
-        rt_mq_recv (vpm->boost_mq, &data, &s);
-        if (unlikely(!data))
-        {
-            continue;
-        }
-
-        rt_log_info ("%s", (char *)data);
-        web_json_parser (data, &jhdr, &injson);
-        msg_i_body = web_json_to_field (injson, "msg");
-        msg_o_body = json_object_new_object();
-        head = json_object_new_object();
-        switch (jhdr.cmd) {
-            case SG_X_BOOST:
-                vpm_json_boost_filter (msg_i_body, msg_o_body);
-                web_json_head_add (head, &jhdr, msg_o_body);
-                break;
-            default:
-                break;
-        }
-        jstr = json_object_to_json_string (head);
-        send_data_len = strlen(jstr);
-        send_data = (char *)malloc((send_data_len / 1024 + 1) * 1024);
-        send_data1 = send_data;
-        bzero(send_data, ((send_data_len / 1024 + 1) * 1024));
-        snprintf(send_data, ((send_data_len / 1024 + 1) * 1024), "%s\n", jstr);
-        send_data_len1 = strlen(send_data);
-        while(send_data_len1 > 0)
-        {
-            send_len = rt_sock_send (vpm->web_sock, send_data, send_data_len1);
-            send_data = send_data +send_len;
-            send_data_len1 -= send_len;
-        }
-
-        web_json_tokener_parse ("OUTBOUND", jstr);
-        jstr = NULL;
-        json_object_put (injson);
-        json_object_put (msg_o_body);
-        json_object_put (head);
-        kfree (data);
-        kfree(send_data1);
+    rt_log_info ("%s", req->data);
+    web_json_parser (req->data, &jhdr, &injson);
+    msg_i_body = web_json_to_field (injson, "msg");
+    msg_o_body = json_object_new_object();
+    head = json_object_new_object();
+    switch (jhdr.cmd) {
+        case SG_X_BOOST:
+            vpm_json_boost_filter (msg_i_body, msg_o_body);
+            web_json_head_add (head, &jhdr, msg_o_body);
+            break;
+        default:
+            break;
     }
+    jstr = json_object_to_json_string (head);
+    web_reply (req->origin, jstr, strlen(jstr));
 
-    task_deregistry_id (pthread_self());
-
-    return NULL;
+    web_json_tokener_parse ("OUTBOUND", jstr);
+    jstr = NULL;
+    json_object_put (injson);
+    json_object_put (msg_o_body);
+    json_object_put (head);
 }
 
-static struct rt_task_t SGBoostTask =
-{
-    .module = THIS,
-    .name = "SG Booster Task",
-    .core = INVALID_CORE,
-    .prio = KERNEL_SCHED,
-    .argvs = &vrsTrapper,
-    .routine = SGBooster,
-};
-
 static struct rt_task_t SGCDBTask =
 {
     .module = THIS,
@@ -1892,7 +1683,7 @@ int vpm_boost_init()
     tmr_start(tmr_create(1, "CaseDB Connection TMR",
                 TMR_PERIODIC, vrs_oci_conn_tmr, 1, (char **)&(booster->caseDB), 15));
 
-    task_registry (&SGBoostTask);
+    vpm_sched_register (VPM_CLS_BOOST, SGBooster);
     task_registry (&SGCDBTask);
 
     return 0;
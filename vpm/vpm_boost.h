@@ -127,17 +127,6 @@ enum {
 
 #define WAV_AVG_BYTES_PERSEC    8000
 
-#define FRAME_LEN    160
-
-#define FRAME_OFFSET (FRAME_LEN * 2 / 5)
-
-enum FRAME_TYPE
-{
-    FRAME_UNKNOW,
-    FRAME_VOICE,
-    FRAME_SMOOTH_VOICE,
-    FRAME_SILENCE
-};
 
 
 //------------------------------------------------------------------------------------
@@ -0,0 +1,295 @@
+#include "sysdefs.h"
+#include "vpm_mcache.h"
+#include "vpm_digest.h"
+
+#define DIGEST_MAGIC        0x44474931  /** "DGI1" */
+#define DIGEST_BUCKETS      4096
+/** Longest file name indexed, longer ones are digested every time */
+#define DIGEST_NAME_SIZE    64
+#define DIGEST_PATH_SIZE    256
+
+/** One record of the index file, and of the index in memory */
+struct digest_rec_t {
+    unsigned char   digest[16];
+    uint64_t    ino;
+    int64_t     size;
+    int64_t     mtime_sec, mtime_nsec;
+    char        name[DIGEST_NAME_SIZE];
+};
+
+struct digest_entry_t {
+    struct digest_rec_t rec;
+    struct hlist_node   hlist;
+};
+
+struct digest_hdr_t {
+    uint32_t    magic;
+    uint32_t    rec_size;
+    uint64_t    count;
+};
+
+struct digest_index_t {
+    char        dir[DIGEST_PATH_SIZE];
+    char        file[DIGEST_PATH_SIZE + 16];
+    int         open;
+    /** Changed since the last vpm_digest_sync */
+    int         dirty;
+
+    rt_mutex    lock;
+    struct hlist_head   buckets[DIGEST_BUCKETS];
+    uint64_t    entries;
+
+    /** Since the last sync */
+    uint64_t    hits, misses;
+};
+
+static struct digest_index_t digest_index = {
+    .open = 0,
+    .dirty = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .entries = 0,
+    .hits = 0,
+    .misses = 0,
+};
+
+static __rt_always_inline__ struct hlist_head *digest_bucket (struct digest_index_t *di,
+                const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    /** FNV-1a */
+    for (; *name; name ++)
+        h = (h ^ (uint8_t)*name) * 16777619u;
+
+    return &di->buckets[h % DIGEST_BUCKETS];
+}
+
+/** Call with the lock held. */
+static struct digest_entry_t *digest_lookup (struct digest_index_t *di, const char *name)
+{
+    struct digest_entry_t *e;
+    struct hlist_node *pos;
+
+    hlist_for_each_entry (e, pos, digest_bucket (di, name), hlist) {
+        if (!strcmp (e->rec.name, name))
+            return e;
+    }
+
+    return NULL;
+}
+
+/** Call with the lock held. */
+static struct digest_entry_t *digest_insert (struct digest_index_t *di,
+                const struct digest_rec_t *rec)
+{
+    struct digest_entry_t *e;
+
+    e = digest_lookup (di, rec->name);
+    if (!e) {
+        e = (struct digest_entry_t *)kmalloc (sizeof (struct digest_entry_t), MPF_CLR, -1);
+        if (unlikely (!e))
+            return NULL;
+        hlist_add_head (&e->hlist, digest_bucket (di, rec->name));
+        di->entries ++;
+    }
+    memcpy (&e->rec, rec, sizeof (*rec));
+
+    return e;
+}
+
+static __rt_always_inline__ int digest_fresh (const struct digest_rec_t *rec,
+                const struct stat *st)
+{
+    return rec->ino == (uint64_t)st->st_ino && rec->size == (int64_t)st->st_size &&
+        rec->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+        rec->mtime_nsec == (int64_t)st->st_mtim.tv_nsec;
+}
+
+/** Name of path inside the indexed directory, NULL for a file elsewhere */
+static const char *digest_name (struct digest_index_t *di, const char *path)
+{
+    size_t s = strlen (di->dir);
+    const char *name;
+
+    if (!di->open || strncmp (path, di->dir, s))
+        return NULL;
+
+    /**
+    * Paths are joined from the configured sample_dir, which may end in '/'
+    * ("dir//name"), while di->dir has it trimmed. Only the root keeps one.
+    */
+    name = path + s;
+    if (*name != '/' && (!s || di->dir[s - 1] != '/'))
+        return NULL;
+    while (*name == '/')
+        name ++;
+    if (!*name || strchr (name, '/') || strlen (name) >= DIGEST_NAME_SIZE)
+        return NULL;
+
+    return name;
+}
+
+int vpm_digest_init (const char *dir)
+{
+    struct digest_index_t *di = &digest_index;
+    struct digest_hdr_t hdr;
+    struct digest_rec_t rec;
+    char path[DIGEST_PATH_SIZE + DIGEST_NAME_SIZE];
+    struct stat st;
+    uint64_t i, dropped = 0;
+    FILE *fp;
+
+    snprintf (di->dir, sizeof (di->dir), "%s", dir);
+    /** The index must not land inside the directory */
+    for (i = strlen (di->dir); i > 1 && di->dir[i - 1] == '/'; i --)
+        di->dir[i - 1] = 0;
+    snprintf (di->file, sizeof (di->file), "%s%s", di->dir, DIGEST_INDEX_SUFFIX);
+    di->open = 1;
+
+    fp = fopen (di->file, "r");
+    if (!fp)
+        goto finish;
+
+    if (fread (&hdr, sizeof (hdr), 1, fp) != 1 ||
+        hdr.magic != DIGEST_MAGIC || hdr.rec_size != sizeof (rec)) {
+        rt_log_warning (ERRNO_INVALID_VAL, "Digest index: %s unknown, starting over", di->file);
+        fclose (fp);
+        goto finish;
+    }
+
+    rt_mutex_lock (&di->lock);
+    for (i = 0; i < hdr.count && fread (&rec, sizeof (rec), 1, fp) == 1; i ++) {
+        rec.name[DIGEST_NAME_SIZE - 1] = 0;
+        snprintf (path, sizeof (path), "%s/%s", di->dir, rec.name);
+        /** Removed while we were down */
+        if (stat (path, &st) < 0) {
+            dropped ++;
+            continue;
+        }
+        digest_insert (di, &rec);
+    }
+    di->dirty = !!dropped;
+    rt_mutex_unlock (&di->lock);
+    fclose (fp);
+
+finish:
+    rt_log_notice ("Digest index: %s, %lu files (%lu gone)", di->file, di->entries, dropped);
+    return 0;
+}
+
+int vpm_digest_get (const char *path, unsigned char digest[16])
+{
+    struct digest_index_t *di = &digest_index;
+    struct digest_entry_t *e;
+    struct digest_rec_t rec;
+    const char *name;
+    struct stat st;
+
+    name = digest_name (di, path);
+    if (!name)
+        return vpm_md5_file (path, digest);
+
+    if (stat (path, &st) < 0)
+        return -1;
+
+    rt_mutex_lock (&di->lock);
+    e = digest_lookup (di, name);
+    if (e && digest_fresh (&e->rec, &st)) {
+        memcpy (digest, e->rec.digest, 16);
+        di->hits ++;
+        rt_mutex_unlock (&di->lock);
+        return 0;
+    }
+    di->misses ++;
+    rt_mutex_unlock (&di->lock);
+
+    if (vpm_md5_file (path, digest) < 0)
+        return -1;
+
+    memset (&rec, 0, sizeof (rec));
+    memcpy (rec.digest, digest, 16);
+    rec.ino = (uint64_t)st.st_ino;
+    rec.size = (int64_t)st.st_size;
+    rec.mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    rec.mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+    snprintf (rec.name, sizeof (rec.name), "%s", name);
+
+    rt_mutex_lock (&di->lock);
+    digest_insert (di, &rec);
+    di->dirty = 1;
+    rt_mutex_unlock (&di->lock);
+
+    return 0;
+}
+
+void vpm_digest_forget (const char *path)
+{
+    struct digest_index_t *di = &digest_index;
+    struct digest_entry_t *e;
+    const char *name;
+
+    name = digest_name (di, path);
+    if (!name)
+        return;
+
+    rt_mutex_lock (&di->lock);
+    e = digest_lookup (di, name);
+    if (e) {
+        hlist_del (&e->hlist);
+        kfree (e);
+        di->entries --;
+        di->dirty = 1;
+    }
+    rt_mutex_unlock (&di->lock);
+}
+
+/** Written aside and renamed, a crash leaves the previous index */
+void vpm_digest_sync ()
+{
+    struct digest_index_t *di = &digest_index;
+    struct digest_hdr_t hdr = {DIGEST_MAGIC, sizeof (struct digest_rec_t), 0};
+    struct digest_entry_t *e;
+    struct hlist_node *pos;
+    char tmp[DIGEST_PATH_SIZE + 32];
+    int i, xret = 0;
+    FILE *fp;
+
+    rt_mutex_lock (&di->lock);
+    if (!di->open || !di->dirty)
+        goto finish;
+
+    snprintf (tmp, sizeof (tmp), "%s.tmp", di->file);
+    fp = fopen (tmp, "w");
+    if (unlikely (!fp)) {
+        rt_log_error (ERRNO_FATAL, "%s, %s", strerror (errno), tmp);
+        goto finish;
+    }
+
+    hdr.count = di->entries;
+    if (fwrite (&hdr, sizeof (hdr), 1, fp) != 1)
+        xret = -1;
+    for (i = 0; i < DIGEST_BUCKETS && !xret; i ++) {
+        hlist_for_each_entry (e, pos, &di->buckets[i], hlist) {
+            if (fwrite (&e->rec, sizeof (e->rec), 1, fp) != 1) {
+                xret = -1;
+                break;
+            }
+        }
+    }
+    if (fclose (fp))
+        xret = -1;
+
+    if (xret || rename (tmp, di->file)) {
+        rt_log_error (ERRNO_FATAL, "%s, %s", strerror (errno), di->file);
+        unlink (tmp);
+        goto finish;
+    }
+
+    di->dirty = 0;
+    rt_log_notice ("Digest index: %lu files, hits=%lu, misses=%lu",
+                di->entries, di->hits, di->misses);
+    di->hits = di->misses = 0;
+
+finish:
+    rt_mutex_unlock (&di->lock);
+}
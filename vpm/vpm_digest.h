@@ -0,0 +1,26 @@
+#ifndef __VPM_DIGEST_H__
+#define __VPM_DIGEST_H__
+
+/** Index file of a directory, kept beside it so directory scans never see it */
+#define DIGEST_INDEX_SUFFIX ".digest"
+
+/**
+* Open the digest index of dir (dir DIGEST_INDEX_SUFFIX) and drop the
+* entries whose files are gone. A missing or damaged index starts empty.
+*/
+extern int vpm_digest_init (const char *dir);
+
+/**
+* md5 of a file in the indexed directory. The file is read only when
+* the index has no entry for it or its inode, size or mtime changed.
+* Returns 0 on success.
+*/
+extern int vpm_digest_get (const char *path, unsigned char digest[16]);
+
+/** Call when a file of the directory is removed. */
+extern void vpm_digest_forget (const char *path);
+
+/** Write the index back if it changed. */
+extern void vpm_digest_sync ();
+
+#endif
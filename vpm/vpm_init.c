@@ -3,13 +3,16 @@
 #include "conf_yaml_loader.h"
 #include "vrs.h"
 #include "vrs_senior.h"
+#include "vpm_sched.h"
+#include "vpm_mcache.h"
+#include "vpm_tmatch.h"
 
 static int load_vrsweb_conf ()
 {
     ConfNode *base = NULL, *subchild = NULL;
     int xret = 0;
     char * ip = NULL;
-    uint16_t port = 0;
+    uint16_t port = 0, listen = 0;
     struct vpm_t *_this = vrs_default_trapper()->vpm;
 
     base = ConfGetNode("vrsweb");
@@ -25,8 +28,14 @@ static int load_vrsweb_conf ()
 
         if(!STRCMP(subchild->name, "port"))
             port = integer_parser(subchild->val, 0, 65535);
+
+        if(!STRCMP(subchild->name, "listen"))
+            listen = integer_parser(subchild->val, 0, 65535);
     }
 
+    /** Picked up by the web agent at startup */
+    _this->web_listen = listen;
+
     if (port != _this->web_port ||
         strncmp (ip, _this->web, strlen (ip))) {
         memset (_this->web, 0, strlen (_this->web));
@@ -309,6 +318,21 @@ int load_private_vpm_config(int reload)
 
     load_private_log_conf ();
     load_vrsweb_conf();
+
+    /** placement only applies when threads start */
+    if (!reload)
+        task_affinity_load ("task-affinity");
+
+    /** workers are sized by the class limits when they start */
+    if (!reload)
+        vpm_sched_load ("scheduler");
+
+    /** the cache is opened once, with these */
+    if (!reload)
+        vpm_mcache_load ("model-cache");
+
+    if (!reload)
+        vpm_tmatch_load ("target-match");
 finish:
     return xret;
 }
@@ -0,0 +1,466 @@
+#include "sysdefs.h"
+#include "conf.h"
+#include "vrs.h"
+#include "vrs_model.h"
+#include "apr_md5.h"
+#include "vpm_mcache.h"
+
+#define MCACHE_MAGIC        0x4d444c31  /** "MDL1" */
+#define MCACHE_BUCKETS      4096
+
+/** What an entry file holds ahead of the model */
+struct mcache_hdr_t {
+    uint32_t    magic;
+    int32_t     wlen1, wlen2;
+    int32_t     size;
+};
+
+struct mcache_entry_t {
+    unsigned char   digest[16];
+    int             is_alaw;
+    struct hlist_node   hlist;
+    /** Least recently used first */
+    struct list_head    list;
+};
+
+struct mcache_t {
+    char        dir[256];
+    /** Bytes kept on disk before the least used go, 0 turns the cache off */
+    uint64_t    max_bytes;
+    char        engine[64];
+
+    /** dir/engine tag, set once the cache is open */
+    char        root[320];
+    int         open;
+
+    rt_mutex    lock;
+    struct hlist_head   buckets[MCACHE_BUCKETS];
+    struct list_head    lru;
+    uint64_t    entries;
+
+    atomic64_t  hits, misses, stores, evictions;
+};
+
+static struct mcache_t mcache = {
+    .dir = MCACHE_DIR_DEFAULT,
+    .max_bytes = (uint64_t)MCACHE_SIZE_DEFAULT << 20,
+    .engine = "",
+    .open = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .lru = LIST_HEAD_INIT (mcache.lru),
+    .hits = ATOMIC_INIT (0),
+    .misses = ATOMIC_INIT (0),
+    .stores = ATOMIC_INIT (0),
+    .evictions = ATOMIC_INIT (0),
+};
+
+/** Bytes one entry takes on disk */
+#define MCACHE_ENTRY_SIZE   (sizeof (struct mcache_hdr_t) + SG_DATA_SIZE)
+
+int vpm_md5_file (const char *file, unsigned char digest[16])
+{
+    apr_md5_ctx_t context;
+    char buf[64 << 10];
+    size_t s;
+    FILE *fp;
+
+    fp = fopen (file, "r");
+    if (unlikely (!fp))
+        return -1;
+
+    apr_md5_init (&context);
+    while ((s = fread (buf, 1, sizeof (buf), fp)) > 0)
+        apr_md5_update (&context, buf, s);
+    fclose (fp);
+
+    apr_md5_final (digest, &context);
+
+    return 0;
+}
+
+/**
+* model-cache:
+*   dir: /vrs/modelcache
+*   size: 256
+*   engine: "spk-2.1"
+*/
+void vpm_mcache_load (const char *section)
+{
+    struct mcache_t *mc = &mcache;
+    ConfNode *base;
+    const char *val;
+    int v;
+
+    base = ConfGetNode ((char *)section);
+    if (!base)
+        return;
+
+    val = ConfNodeLookupChildValue (base, "dir");
+    if (val && *val)
+        snprintf (mc->dir, sizeof (mc->dir), "%s", val);
+
+    val = ConfNodeLookupChildValue (base, "size");
+    if (val && (v = integer_parser (val, 0, 1 << 20)) >= 0)
+        mc->max_bytes = (uint64_t)v << 20;
+
+    val = ConfNodeLookupChildValue (base, "engine");
+    if (val)
+        snprintf (mc->engine, sizeof (mc->engine), "%s", val);
+}
+
+static __rt_always_inline__ void mcache_hex (const unsigned char *d, int n, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < n; i ++) {
+        out[2 * i] = hex[d[i] >> 4];
+        out[2 * i + 1] = hex[d[i] & 0xf];
+    }
+    out[2 * n] = 0;
+}
+
+static __rt_always_inline__ int mcache_unhex (const char *s, unsigned char *d, int n)
+{
+    unsigned int b;
+    int i;
+
+    for (i = 0; i < n; i ++) {
+        if (!isxdigit ((int)s[2 * i]) || !isxdigit ((int)s[2 * i + 1]) ||
+            sscanf (s + 2 * i, "%2x", &b) != 1)
+            return -1;
+        d[i] = (unsigned char)b;
+    }
+
+    return 0;
+}
+
+/** root/ab/abcdef...-alaw.model */
+static __rt_always_inline__ void mcache_path (struct mcache_t *mc,
+                const unsigned char *digest, int is_alaw, char *path, size_t size)
+{
+    char hex[33];
+
+    mcache_hex (digest, 16, hex);
+    snprintf (path, size, "%s/%.2s/%s-%d.model", mc->root, hex, hex, is_alaw);
+}
+
+static __rt_always_inline__ struct hlist_head *mcache_bucket (struct mcache_t *mc,
+                const unsigned char *digest)
+{
+    uint32_t h;
+
+    memcpy (&h, digest, sizeof (h));
+    return &mc->buckets[h % MCACHE_BUCKETS];
+}
+
+/** Call with the lock held. */
+static struct mcache_entry_t *mcache_lookup (struct mcache_t *mc,
+                const unsigned char *digest, int is_alaw)
+{
+    struct mcache_entry_t *e;
+    struct hlist_node *pos;
+
+    hlist_for_each_entry (e, pos, mcache_bucket (mc, digest), hlist) {
+        if (e->is_alaw == is_alaw && !memcmp (e->digest, digest, 16))
+            return e;
+    }
+
+    return NULL;
+}
+
+/** Drop the least used entries until there is room for one more. Call with the lock held. */
+static void mcache_evict (struct mcache_t *mc)
+{
+    struct mcache_entry_t *e;
+    char path[512];
+
+    while (!list_empty (&mc->lru) &&
+        (mc->entries + 1) * MCACHE_ENTRY_SIZE > mc->max_bytes) {
+        e = list_first_entry (&mc->lru, struct mcache_entry_t, list);
+        mcache_path (mc, e->digest, e->is_alaw, path, sizeof (path));
+        unlink (path);
+        list_del (&e->list);
+        hlist_del (&e->hlist);
+        kfree (e);
+        mc->entries --;
+        atomic64_inc (&mc->evictions);
+    }
+}
+
+/** Call with the lock held. */
+static struct mcache_entry_t *mcache_insert (struct mcache_t *mc,
+                const unsigned char *digest, int is_alaw)
+{
+    struct mcache_entry_t *e;
+
+    e = mcache_lookup (mc, digest, is_alaw);
+    if (e) {
+        list_move_tail (&e->list, &mc->lru);
+        return e;
+    }
+
+    mcache_evict (mc);
+
+    e = (struct mcache_entry_t *)kmalloc (sizeof (struct mcache_entry_t), MPF_CLR, -1);
+    if (unlikely (!e))
+        return NULL;
+    memcpy (e->digest, digest, 16);
+    e->is_alaw = is_alaw;
+    hlist_add_head (&e->hlist, mcache_bucket (mc, digest));
+    list_add_tail (&e->list, &mc->lru);
+    mc->entries ++;
+
+    return e;
+}
+
+struct mcache_found_t {
+    unsigned char   digest[16];
+    int             is_alaw;
+    time_t          mtime;
+};
+
+static int mcache_found_cmp (const void *a, const void *b)
+{
+    const struct mcache_found_t *x = a, *y = b;
+
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/** Index what an earlier run left, oldest use first by file mtime */
+static void mcache_scan (struct mcache_t *mc)
+{
+    struct mcache_found_t *found = NULL, *p;
+    size_t n = 0, cap = 0, i;
+    char sub[512], path[800];
+    struct dirent *ent;
+    struct stat st;
+    DIR *dir;
+    int b, is_alaw;
+
+    for (b = 0; b < 256; b ++) {
+        snprintf (sub, sizeof (sub), "%s/%02x", mc->root, b);
+        dir = opendir (sub);
+        if (!dir)
+            continue;
+
+        while ((ent = readdir (dir)) != NULL) {
+            if (n == cap) {
+                p = (struct mcache_found_t *)krealloc (found,
+                            (cap ? cap * 2 : 1024) * sizeof (*found), MPF_NOFLGS, -1);
+                if (unlikely (!p)) {
+                    /** Not indexed, evicted by nobody but still valid */
+                    closedir (dir);
+                    goto index;
+                }
+                found = p;
+                cap = cap ? cap * 2 : 1024;
+            }
+            snprintf (path, sizeof (path), "%s/%s", sub, ent->d_name);
+            /** Left by a store that never finished */
+            if (strstr (ent->d_name, ".model.")) {
+                unlink (path);
+                continue;
+            }
+            if (strlen (ent->d_name) != 32 + 8 ||
+                mcache_unhex (ent->d_name, found[n].digest, 16) < 0 ||
+                sscanf (ent->d_name + 32, "-%d.model", &is_alaw) != 1)
+                continue;
+            if (stat (path, &st) < 0 || st.st_size != (off_t)MCACHE_ENTRY_SIZE) {
+                unlink (path);
+                continue;
+            }
+            found[n].is_alaw = is_alaw;
+            found[n].mtime = st.st_mtime;
+            n ++;
+        }
+        closedir (dir);
+    }
+
+index:
+    qsort (found, n, sizeof (*found), mcache_found_cmp);
+
+    rt_mutex_lock (&mc->lock);
+    for (i = 0; i < n; i ++)
+        mcache_insert (mc, found[i].digest, found[i].is_alaw);
+    rt_mutex_unlock (&mc->lock);
+
+    kfree (found);
+}
+
+int vpm_mcache_init (const char *engine_cfg)
+{
+    struct mcache_t *mc = &mcache;
+    unsigned char digest[16], tag[16];
+    char hex[33], path[512];
+    apr_md5_ctx_t context;
+    struct dirent *ent;
+    DIR *dir;
+    int i;
+
+    if (!mc->max_bytes) {
+        rt_log_notice ("Model cache: off");
+        return 0;
+    }
+
+    for (i = 0; i < MCACHE_BUCKETS; i ++)
+        INIT_HLIST_HEAD (&mc->buckets[i]);
+
+    /** Engine tag, what models depend on besides the wav */
+    apr_md5_init (&context);
+    if (engine_cfg && !vpm_md5_file (engine_cfg, digest))
+        apr_md5_update (&context, digest, sizeof (digest));
+    apr_md5_update (&context, mc->engine, strlen (mc->engine));
+    snprintf (hex, sizeof (hex), "%d", SG_DATA_SIZE);
+    apr_md5_update (&context, hex, strlen (hex));
+    apr_md5_final (tag, &context);
+    mcache_hex (tag, 4, hex);
+
+    /** Models of other engines are never read again */
+    dir = opendir (mc->dir);
+    if (dir) {
+        while ((ent = readdir (dir)) != NULL) {
+            if (strlen (ent->d_name) == 8 && strcmp (ent->d_name, hex) &&
+                strspn (ent->d_name, "0123456789abcdef") == 8) {
+                snprintf (path, sizeof (path), "%s/%s", mc->dir, ent->d_name);
+                rt_log_notice ("Model cache: dropping %s of an earlier engine", path);
+                rt_remove_dir (path);
+            }
+        }
+        closedir (dir);
+    }
+
+    snprintf (mc->root, sizeof (mc->root), "%s/%s", mc->dir, hex);
+    for (i = 0; i < 256; i ++) {
+        snprintf (path, sizeof (path), "%s/%02x", mc->root, i);
+        rt_check_and_mkdir (path);
+    }
+    if (!rt_dir_exsit (mc->root)) {
+        rt_log_error (ERRNO_FATAL, "Model cache: can not create %s, off", mc->root);
+        return -1;
+    }
+
+    mcache_scan (mc);
+    mc->open = 1;
+
+    rt_log_notice ("Model cache: %s, %lu models, %lu MB at most",
+                mc->root, mc->entries, mc->max_bytes >> 20);
+
+    return 0;
+}
+
+static int mcache_read (const char *path, uint8_t *mdl_cache, int *wlen1, int *wlen2)
+{
+    struct mcache_hdr_t hdr;
+    int xret = -1;
+    FILE *fp;
+
+    fp = fopen (path, "r");
+    if (unlikely (!fp))
+        return -1;
+
+    if (fread (&hdr, sizeof (hdr), 1, fp) == 1 &&
+        hdr.magic == MCACHE_MAGIC && hdr.size == SG_DATA_SIZE &&
+        fread (mdl_cache, 1, SG_DATA_SIZE, fp) == SG_DATA_SIZE) {
+        *wlen1 = hdr.wlen1;
+        *wlen2 = hdr.wlen2;
+        xret = 0;
+    }
+    fclose (fp);
+
+    return xret;
+}
+
+/** Written aside and renamed, readers never see half an entry */
+static int mcache_write (const char *path, const uint8_t *mdl_cache, int wlen1, int wlen2)
+{
+    struct mcache_hdr_t hdr = {MCACHE_MAGIC, wlen1, wlen2, SG_DATA_SIZE};
+    char tmp[600];
+    int xret = -1;
+    FILE *fp;
+
+    snprintf (tmp, sizeof (tmp), "%s.%lu", path, (unsigned long)pthread_self ());
+    fp = fopen (tmp, "w");
+    if (unlikely (!fp))
+        return -1;
+
+    if (fwrite (&hdr, sizeof (hdr), 1, fp) == 1 &&
+        fwrite (mdl_cache, 1, SG_DATA_SIZE, fp) == SG_DATA_SIZE)
+        xret = 0;
+    if (fclose (fp))
+        xret = -1;
+
+    if (xret == 0 && rename (tmp, path) == 0)
+        return 0;
+
+    unlink (tmp);
+    return -1;
+}
+
+int mcache_wav_to_model (const char *wav_file, uint8_t *mdl_cache,
+                int *wlen1, int *wlen2, int is_alaw)
+{
+    struct mcache_t *mc = &mcache;
+    unsigned char digest[16];
+    char path[512];
+    int xerror, known;
+
+    if (!mc->open || vpm_md5_file (wav_file, digest) < 0)
+        return WavToModelMemory (wav_file, mdl_cache, wlen1, wlen2, is_alaw);
+
+    mcache_path (mc, digest, is_alaw, path, sizeof (path));
+
+    rt_mutex_lock (&mc->lock);
+    known = (mcache_lookup (mc, digest, is_alaw) != NULL);
+    rt_mutex_unlock (&mc->lock);
+
+    if (known && !mcache_read (path, mdl_cache, wlen1, wlen2)) {
+        rt_mutex_lock (&mc->lock);
+        mcache_insert (mc, digest, is_alaw);
+        rt_mutex_unlock (&mc->lock);
+        /** Keeps the use order across restarts */
+        utimes (path, NULL);
+        atomic64_inc (&mc->hits);
+        return 0;
+    }
+
+    atomic64_inc (&mc->misses);
+    xerror = WavToModelMemory (wav_file, mdl_cache, wlen1, wlen2, is_alaw);
+    if (xerror)
+        return xerror;
+
+    if (mcache_write (path, mdl_cache, *wlen1, *wlen2) == 0) {
+        rt_mutex_lock (&mc->lock);
+        mcache_insert (mc, digest, is_alaw);
+        rt_mutex_unlock (&mc->lock);
+        atomic64_inc (&mc->stores);
+    }
+
+    return 0;
+}
+
+int mcache_wav_to_model_file (const char *wav_file, const char *mod_file,
+                int *wlen1, int *wlen2, int is_alaw)
+{
+    uint8_t mdl_cache[SG_DATA_SIZE] = {0};
+    int xerror;
+
+    xerror = mcache_wav_to_model (wav_file, mdl_cache, wlen1, wlen2, is_alaw);
+    if (!xerror)
+        xerror = ModelToDisk (mod_file, (void *)mdl_cache, SG_DATA_SIZE);
+
+    /** Signed like WavToModel */
+    return (-xerror);
+}
+
+void vpm_mcache_dump ()
+{
+    struct mcache_t *mc = &mcache;
+
+    if (!mc->open)
+        return;
+
+    rt_log_notice ("Model cache: %lu models, hits=%ld, misses=%ld, stores=%ld, evictions=%ld",
+                mc->entries, atomic64_read (&mc->hits), atomic64_read (&mc->misses),
+                atomic64_read (&mc->stores), atomic64_read (&mc->evictions));
+}
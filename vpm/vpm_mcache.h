@@ -0,0 +1,32 @@
+#ifndef __VPM_MCACHE_H__
+#define __VPM_MCACHE_H__
+
+/** Where converted models are kept unless vpm.yaml says otherwise */
+#define MCACHE_DIR_DEFAULT      "/vrs/modelcache"
+#define MCACHE_SIZE_DEFAULT     256     /** MB */
+
+/** md5 of a whole file, 0 on success */
+extern int vpm_md5_file (const char *file, unsigned char digest[16]);
+
+/** Load the model-cache section of vpm.yaml. */
+extern void vpm_mcache_load (const char *section);
+
+/**
+* Open the cache and index what is on disk. Entries are kept per engine,
+* engine_cfg (its configuration file) is digested into the engine tag
+* so a changed engine never reads models the old one made.
+*/
+extern int vpm_mcache_init (const char *engine_cfg);
+
+/**
+* Same as WavToModelMemory/WavToModel, but a wav whose content was
+* converted before is answered from the cache without extraction.
+*/
+extern int mcache_wav_to_model (const char *wav_file, uint8_t *mdl_cache,
+                int *wlen1, int *wlen2, int is_alaw);
+extern int mcache_wav_to_model_file (const char *wav_file, const char *mod_file,
+                int *wlen1, int *wlen2, int is_alaw);
+
+extern void vpm_mcache_dump ();
+
+#endif
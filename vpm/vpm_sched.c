@@ -0,0 +1,370 @@
+#include "sysdefs.h"
+#include "conf.h"
+#include "vrs.h"
+#include "vpm_web.h"
+#include "vpm_tmatch.h"
+#include "vpm_sched.h"
+
+struct vpm_sched_t {
+    rt_mutex    lock;
+    rt_cond     cond;
+    /** Jobs of all classes running at once */
+    int         slots;
+    int         running;
+    struct vpm_class_t  classes[VPM_CLS_MAX];
+};
+
+/**
+* Registrations and deletions first. Target and category queries are
+* interactive, mass queries and boost analysis may run for days and
+* give way to everything else at their check points.
+*/
+static struct vpm_sched_t vpm_sched = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .slots = 0,
+    .running = 0,
+    .classes = {
+        [VPM_CLS_REGULAR] = {
+            .name = "regular", .task = "SG Regular Task",
+            .prio = 40, .limit = 1, .deadline = 0,
+            .reentrant = 0, .cancellable = 0,
+        },
+        [VPM_CLS_TARGET] = {
+            .name = "target", .task = "SG Target Match task",
+            .prio = 30, .limit = 2, .deadline = 0,
+            /** Groups are per query, models are matched on the shared target match workers */
+            .reentrant = 1, .cancellable = 1,
+        },
+        [VPM_CLS_CATE] = {
+            .name = "cate", .task = "SG Category Task",
+            .prio = 20, .limit = 1, .deadline = 0,
+            .reentrant = 1, .cancellable = 1,
+        },
+        [VPM_CLS_MASS] = {
+            .name = "mass", .task = "SG Massive Gategory Task",
+            .prio = 10, .limit = 1, .deadline = 0,
+            .reentrant = 1, .cancellable = 1,
+        },
+        [VPM_CLS_BOOST] = {
+            .name = "boost", .task = "SG Booster Task",
+            .prio = 10, .limit = 1, .deadline = 0,
+            /** Works in per target temporary directories */
+            .reentrant = 0, .cancellable = 1,
+        },
+    },
+};
+
+/** Job the calling worker is running */
+static __thread struct vpm_job_t *sched_job;
+
+static __rt_always_inline__ uint64_t sched_now_us ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+* scheduler:
+*   slots: 4
+*
+* slots defaults to the cpus the target match workers leave, at most one
+* less than the class limits add up to, so classes do compete for slots
+* and priorities take effect.
+*   mass:
+*     priority: 10
+*     limit: 2
+*     deadline: 86400
+*/
+void vpm_sched_load (const char *section)
+{
+    struct vpm_sched_t *sc = &vpm_sched;
+    struct vpm_class_t *cls;
+    ConfNode *base, *child;
+    const char *val;
+    int i, v;
+
+    base = ConfGetNode ((char *)section);
+    if (!base)
+        return;
+
+    val = ConfNodeLookupChildValue (base, "slots");
+    if (val && (v = integer_parser (val, 1, 1024)) > 0)
+        sc->slots = v;
+
+    for (i = 0; i < VPM_CLS_MAX; i ++) {
+        cls = &sc->classes[i];
+        child = ConfNodeLookupChild (base, cls->name);
+        if (!child)
+            continue;
+
+        val = ConfNodeLookupChildValue (child, "priority");
+        if (val && (v = integer_parser (val, 0, 100)) >= 0)
+            cls->prio = v;
+        val = ConfNodeLookupChildValue (child, "limit");
+        if (val && (v = integer_parser (val, 1, 64)) > 0)
+            cls->limit = v;
+        val = ConfNodeLookupChildValue (child, "deadline");
+        if (val && (v = integer_parser (val, 0, INT_MAX)) >= 0)
+            cls->deadline = v;
+    }
+}
+
+void vpm_sched_init (struct vpm_t *vpm)
+{
+    struct vpm_sched_t *sc = &vpm_sched;
+    struct vpm_class_t *cls;
+    long cpus;
+    int i, limits = 0;
+
+    sc->classes[VPM_CLS_REGULAR].mq = vpm->regular_mq;
+    sc->classes[VPM_CLS_TARGET].mq  = vpm->target_mq;
+    sc->classes[VPM_CLS_CATE].mq    = vpm->cate_mq;
+    sc->classes[VPM_CLS_MASS].mq    = vpm->mass_mq;
+    sc->classes[VPM_CLS_BOOST].mq   = vpm->boost_mq;
+
+    for (i = 0; i < VPM_CLS_MAX; i ++) {
+        cls = &sc->classes[i];
+        if (!cls->reentrant && cls->limit > 1) {
+            rt_log_warning (ERRNO_INVALID_VAL,
+                "Scheduler: %s jobs can not run side by side, limit %d ignored", cls->name, cls->limit);
+            cls->limit = 1;
+        }
+        limits += cls->limit;
+        rt_log_notice ("Scheduler: %-8s priority=%d, limit=%d, deadline=%ds",
+                cls->name, cls->prio, cls->limit, cls->deadline);
+    }
+
+    if (!sc->slots) {
+        cpus = sysconf (_SC_NPROCESSORS_ONLN);
+        if (cpus <= 0)
+            cpus = 1;
+        sc->slots = (int)MIN (cpus - vpm_tmatch_workers (), limits - 1);
+        if (sc->slots < 1)
+            sc->slots = 1;
+    }
+    rt_log_notice ("Scheduler: %d slots (limits %d)", sc->slots, limits);
+}
+
+/**
+* A job may take a slot when its class is under its limit, a slot
+* is free and no class with a higher priority is waiting for one.
+* Call with the lock held.
+*/
+static int sched_may_run (struct vpm_sched_t *sc, struct vpm_class_t *cls)
+{
+    struct vpm_class_t *c;
+
+    if (cls->running >= cls->limit || sc->running >= sc->slots)
+        return 0;
+
+    for (c = &sc->classes[0]; c < &sc->classes[VPM_CLS_MAX]; c ++) {
+        if (c->prio > cls->prio && c->waiting && c->running < c->limit)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void sched_acquire (struct vpm_sched_t *sc, struct vpm_class_t *cls)
+{
+    cls->waiting ++;
+    while (!sched_may_run (sc, cls))
+        rt_cond_wait (&sc->cond, &sc->lock);
+    cls->waiting --;
+    cls->running ++;
+    sc->running ++;
+}
+
+static void sched_release (struct vpm_sched_t *sc, struct vpm_class_t *cls)
+{
+    cls->running --;
+    sc->running --;
+    rt_cond_broadcast (&sc->cond);
+}
+
+/** Someone with a higher priority waits for a slot only we can free */
+static int sched_preempted (struct vpm_sched_t *sc, struct vpm_class_t *cls)
+{
+    struct vpm_class_t *c;
+
+    if (sc->running < sc->slots)
+        return 0;
+
+    for (c = &sc->classes[0]; c < &sc->classes[VPM_CLS_MAX]; c ++) {
+        if (c->prio > cls->prio && c->waiting && c->running < c->limit)
+            return 1;
+    }
+
+    return 0;
+}
+
+int vpm_sched_check ()
+{
+    struct vpm_sched_t *sc = &vpm_sched;
+    struct vpm_job_t *job = sched_job;
+    struct vpm_class_t *cls;
+    uint64_t now;
+    int epoch;
+
+    if (!job)
+        return 0;
+
+    cls = &sc->classes[job->cls];
+
+    /** Unlocked peek, nobody can be kept waiting by us while slots are free */
+    if (*(volatile int *)&sc->running >= sc->slots) {
+        rt_mutex_lock (&sc->lock);
+        if (sched_preempted (sc, cls)) {
+            now = sched_now_us ();
+            sched_release (sc, cls);
+            sched_acquire (sc, cls);
+            job->yielded += sched_now_us () - now;
+            cls->yields ++;
+        }
+        rt_mutex_unlock (&sc->lock);
+    }
+
+    if (!cls->cancellable || job->cancelled)
+        return job->cancelled;
+
+    if (job->deadline && sched_now_us () > job->deadline)
+        job->cancelled = VPM_JOB_EXPIRED;
+    else if ((epoch = web_origin_epoch ()) != job->epoch) {
+        /** Some connection closed since the last look, was it ours */
+        if (!web_origin_alive (job->origin))
+            job->cancelled = VPM_JOB_ORPHANED;
+        job->epoch = epoch;
+    }
+
+    if (job->cancelled)
+        rt_log_notice ("Scheduler: %s job from WEB(%u) %s after %lums", cls->name, job->origin,
+                job->cancelled == VPM_JOB_EXPIRED ? "past its deadline" : "orphaned",
+                (sched_now_us () - job->queued) / 1000);
+
+    return job->cancelled;
+}
+
+int vpm_sched_submit (int cls, struct web_request_t *req)
+{
+    req->queued = sched_now_us ();
+
+    if (MQ_SUCCESS != rt_mq_send (vpm_sched.classes[cls].mq, req, (int)req->s))
+        return -1;
+
+    return 0;
+}
+
+static void sched_run (struct vpm_sched_t *sc, struct vpm_class_t *cls,
+                struct web_request_t *req)
+{
+    struct vpm_job_t job;
+    uint64_t wait, run;
+    int deadline;
+
+    memset (&job, 0, sizeof (job));
+    job.cls = (int)(cls - sc->classes);
+    job.origin = req->origin;
+    job.queued = req->queued;
+    /** Not seen yet, the first check point looks the origin up */
+    job.epoch = web_origin_epoch () - 1;
+    deadline = req->deadline ? req->deadline : cls->deadline;
+    if (deadline)
+        job.deadline = req->queued + (uint64_t)deadline * 1000000;
+
+    rt_mutex_lock (&sc->lock);
+    sched_acquire (sc, cls);
+    rt_mutex_unlock (&sc->lock);
+
+    job.started = sched_now_us ();
+    sched_job = &job;
+    cls->handler (req);
+    sched_job = NULL;
+
+    run = sched_now_us () - job.started - job.yielded;
+    wait = job.started - job.queued + job.yielded;
+
+    rt_mutex_lock (&sc->lock);
+    sched_release (sc, cls);
+    cls->jobs ++;
+    cls->cancelled += !!job.cancelled;
+    cls->wait_us += wait;
+    cls->run_us += run;
+    if (wait > cls->wait_max)
+        cls->wait_max = wait;
+    if (run > cls->run_max)
+        cls->run_max = run;
+    rt_mutex_unlock (&sc->lock);
+}
+
+static void *VpmSchedWorker (void *param)
+{
+    struct vpm_sched_t *sc = &vpm_sched;
+    struct vpm_class_t *cls = (struct vpm_class_t *)param;
+    message data = NULL;
+    int s = 0;
+
+    FOREVER {
+        data = NULL;
+        /** Recv from internal queue */
+        rt_mq_recv (cls->mq, &data, &s);
+        if (likely (data)) {
+            sched_run (sc, cls, (struct web_request_t *)data);
+            kfree (data);
+        }
+    }
+
+    task_deregistry_id (pthread_self());
+
+    return NULL;
+}
+
+void vpm_sched_register (int cls, void (*handler)(struct web_request_t *req))
+{
+    struct vpm_class_t *c = &vpm_sched.classes[cls];
+    struct rt_task_t *task;
+    int i;
+
+    c->handler = handler;
+
+    for (i = 0; i < c->limit; i ++) {
+        task = (struct rt_task_t *) kmalloc (sizeof (struct rt_task_t), MPF_CLR, -1);
+        if (unlikely (!task))
+            continue;
+        if (i)
+            snprintf (task->name, TASK_NAME_SIZE, "%s%d", c->task, i);
+        else
+            snprintf (task->name, TASK_NAME_SIZE, "%s", c->task);
+        task->module = THIS;
+        task->core = INVALID_CORE;
+        task->prio = KERNEL_SCHED;
+        task->argvs = (void *)c;
+        task->recycle = ALLOWED;
+        task->routine = VpmSchedWorker;
+        task_registry (task);
+    }
+}
+
+void vpm_sched_dump ()
+{
+    struct vpm_sched_t *sc = &vpm_sched;
+    struct vpm_class_t *cls;
+    int i;
+
+    rt_mutex_lock (&sc->lock);
+    for (i = 0; i < VPM_CLS_MAX; i ++) {
+        cls = &sc->classes[i];
+        if (!cls->jobs && !cls->running && !cls->waiting)
+            continue;
+        rt_log_notice ("Scheduler: %-8s jobs=%lu (cancelled=%lu, yields=%lu), running=%d, waiting=%d, "
+                "wait avg/max=%lu/%lums, run avg/max=%lu/%lums",
+                cls->name, cls->jobs, cls->cancelled, cls->yields, cls->running, cls->waiting,
+                cls->jobs ? cls->wait_us / cls->jobs / 1000 : 0, cls->wait_max / 1000,
+                cls->jobs ? cls->run_us / cls->jobs / 1000 : 0, cls->run_max / 1000);
+        cls->jobs = cls->cancelled = cls->yields = 0;
+        cls->wait_us = cls->wait_max = cls->run_us = cls->run_max = 0;
+    }
+    rt_mutex_unlock (&sc->lock);
+}
@@ -0,0 +1,79 @@
+#ifndef __VPM_SCHED_H__
+#define __VPM_SCHED_H__
+
+struct web_request_t;
+
+/**
+* Classes WEB requests run in. Each has its own queue and workers,
+* all of them share the run slots handed out by priority.
+*/
+enum {
+    VPM_CLS_REGULAR,        /** add/del samples, must reach VPWs quickly */
+    VPM_CLS_TARGET,
+    VPM_CLS_CATE,
+    VPM_CLS_MASS,
+    VPM_CLS_BOOST,
+    VPM_CLS_MAX,
+};
+
+/** Ways a job ends early, see vpm_sched_check */
+#define VPM_JOB_EXPIRED     1
+#define VPM_JOB_ORPHANED    2
+
+struct vpm_job_t {
+    int         cls;
+    uint32_t    origin;
+    /** Microseconds, CLOCK_MONOTONIC */
+    uint64_t    queued, started, deadline;
+    /** Time given back to higher classes at check points */
+    uint64_t    yielded;
+    int         cancelled;
+    /** web_origin_epoch the origin was last seen alive at */
+    int         epoch;
+};
+
+struct vpm_class_t {
+    const char  *name;
+    const char  *task;
+    MQ_ID       mq;
+    /** Larger runs first */
+    int         prio;
+    /** Jobs of this class running at once */
+    int         limit;
+    /** Seconds a job may take from its arrival, 0 is unlimited */
+    int         deadline;
+    /** Handler may run on several workers at once */
+    int         reentrant;
+    /** Check points may end the job early */
+    int         cancellable;
+    void        (*handler)(struct web_request_t *req);
+
+    int         running, waiting;
+
+    /** Since the last vpm_sched_dump */
+    uint64_t    jobs, cancelled, yields;
+    uint64_t    wait_us, wait_max, run_us, run_max;
+};
+
+/** Load the scheduler section of vpm.yaml, call before vpm_sched_init. */
+extern void vpm_sched_load (const char *section);
+
+extern void vpm_sched_init (struct vpm_t *vpm);
+
+/** Start the workers of cls, each takes requests off its queue and runs handler. */
+extern void vpm_sched_register (int cls, void (*handler)(struct web_request_t *req));
+
+/** Queue a request, it is freed by the worker. */
+extern int vpm_sched_submit (int cls, struct web_request_t *req);
+
+/**
+* Cancellation point for long loops. Gives the slot to a higher class
+* waiting for one, and returns nonzero (VPM_JOB_*) once the running job
+* is past its deadline or its WEB connection has gone away, the caller
+* should stop then. Returns 0 outside scheduled jobs.
+*/
+extern int vpm_sched_check ();
+
+extern void vpm_sched_dump ();
+
+#endif
@@ -0,0 +1,373 @@
+#include "sysdefs.h"
+#include "conf.h"
+#include "vrs.h"
+#include "vrs_model.h"
+#include "vpm_tmatch.h"
+
+/** One vpm_tmatch_score call, lives on the caller's stack */
+struct tmatch_job_t {
+    struct rt_vrstool_t *tool;
+    void        *feat;
+    struct modelist_t   *mlist;
+    float       *sg_score;
+    /** Models in list, and the first one no slice has claimed yet */
+    int64_t     models, next;
+    int64_t     slice;
+    /** Slices not matched yet */
+    int         pending;
+    int         xerror;
+    rt_cond     done;
+    /** In tmatch_pool.jobs while slices are left */
+    struct list_head    list;
+};
+
+struct tmatch_pool_t {
+    /** 0 matches every list on the caller */
+    int         workers;
+    /** 0 splits a list evenly between the workers and the caller */
+    int64_t     slice;
+
+    rt_mutex    lock;
+    rt_cond     cond;
+    /** Jobs with slices left, a worker serves the head and sends it to the tail */
+    struct list_head    jobs;
+
+    /** Since the last vpm_tmatch_dump */
+    uint64_t    queries, slices, helped;
+};
+
+static struct tmatch_pool_t tmatch_pool = {
+    .workers = -1,
+    .slice = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .jobs = LIST_HEAD_INIT (tmatch_pool.jobs),
+    .queries = 0,
+    .slices = 0,
+    .helped = 0,
+};
+
+/**
+* target-match:
+*   workers: 4
+*   slice: 0
+*/
+void vpm_tmatch_load (const char *section)
+{
+    struct tmatch_pool_t *tp = &tmatch_pool;
+    ConfNode *base;
+    const char *val;
+    int v;
+
+    base = ConfGetNode ((char *)section);
+    if (!base)
+        return;
+
+    val = ConfNodeLookupChildValue (base, "workers");
+    if (val && (v = integer_parser (val, 0, MAX_INWORK_CORES)) >= 0)
+        tp->workers = v;
+    val = ConfNodeLookupChildValue (base, "slice");
+    if (val && (v = integer_parser (val, 0, SG_MODEL_THRESHOLD)) >= 0)
+        tp->slice = (v && v < TMATCH_SLICE_MIN) ? TMATCH_SLICE_MIN : v;
+}
+
+/** Take the next slice of job, call with the lock held. */
+static __rt_always_inline__ int64_t tmatch_claim (struct tmatch_pool_t *tp,
+                struct tmatch_job_t *job, int64_t *n)
+{
+    int64_t from = job->next;
+
+    *n = job->models - from;
+    if (*n > job->slice)
+        *n = job->slice;
+    job->next += *n;
+
+    if (job->next >= job->models)
+        list_del_init (&job->list);
+    else
+        list_move_tail (&job->list, &tp->jobs);
+
+    return from;
+}
+
+/** Call with the lock held, the job may be gone once the lock is dropped. */
+static __rt_always_inline__ void tmatch_done (struct tmatch_job_t *job, int xerror)
+{
+    if (xerror && !job->xerror)
+        job->xerror = xerror;
+    if (-- job->pending == 0)
+        rt_cond_broadcast (&job->done);
+}
+
+/** Match models [from, from + n) of the job, no lock held. */
+static int tmatch_slice (struct tmatch_job_t *job, int64_t from, int64_t n)
+{
+    struct modelist_t view;
+    int md_index;
+
+    view.sg_cur_size = view.sg_max_size = n;
+    view.sg_data = job->mlist->sg_data + from;
+    view.sg_owner = job->mlist->sg_owner + from;
+    view.sg_score = job->sg_score + from;
+    view.flags = job->mlist->flags;
+
+    return job->tool->voice_match_ops (job->feat, &view, view.sg_score, &md_index);
+}
+
+static void *VpmTargetMatcher (void __attribute__((__unused__)) *param)
+{
+    struct tmatch_pool_t *tp = &tmatch_pool;
+    struct tmatch_job_t *job;
+    int64_t from, n;
+    int xerror;
+
+    FOREVER {
+        rt_mutex_lock (&tp->lock);
+        while (list_empty (&tp->jobs))
+            rt_cond_wait (&tp->cond, &tp->lock);
+        job = list_first_entry (&tp->jobs, struct tmatch_job_t, list);
+        from = tmatch_claim (tp, job, &n);
+        tp->helped ++;
+        rt_mutex_unlock (&tp->lock);
+
+        xerror = tmatch_slice (job, from, n);
+
+        rt_mutex_lock (&tp->lock);
+        tmatch_done (job, xerror);
+        rt_mutex_unlock (&tp->lock);
+    }
+
+    task_deregistry_id (pthread_self());
+
+    return NULL;
+}
+
+int vpm_tmatch_workers ()
+{
+    struct tmatch_pool_t *tp = &tmatch_pool;
+    long cpus;
+
+    /** Half the cpus, the scheduler's job slots get the rest */
+    if (tp->workers < 0) {
+        cpus = sysconf (_SC_NPROCESSORS_ONLN);
+        tp->workers = (cpus > 1) ? (int)MIN (cpus / 2, MAX_INWORK_CORES) : 0;
+    }
+
+    return tp->workers;
+}
+
+void vpm_tmatch_init ()
+{
+    struct tmatch_pool_t *tp = &tmatch_pool;
+    struct rt_task_t *task;
+    int i;
+
+    vpm_tmatch_workers ();
+
+    for (i = 0; i < tp->workers; i ++) {
+        task = (struct rt_task_t *) kmalloc (sizeof (struct rt_task_t), MPF_CLR, -1);
+        if (unlikely (!task))
+            continue;
+        snprintf (task->name, TASK_NAME_SIZE, "SG Target Matcher%d", i);
+        task->module = THIS;
+        task->core = INVALID_CORE;
+        task->prio = KERNEL_SCHED;
+        task->recycle = ALLOWED;
+        task->routine = VpmTargetMatcher;
+        task_registry (task);
+    }
+
+    if (tp->slice)
+        rt_log_notice ("Target match: %d workers, %ld models a slice", tp->workers, tp->slice);
+    else
+        rt_log_notice ("Target match: %d workers, lists split %d ways", tp->workers, tp->workers + 1);
+}
+
+/** Models a slice of a list of models, 0 if the caller matches it alone */
+static __rt_always_inline__ int64_t tmatch_slice_size (struct tmatch_pool_t *tp, int64_t models)
+{
+    int64_t slice = tp->slice;
+
+    if (tp->workers <= 0)
+        return 0;
+
+    if (!slice) {
+        slice = (models + tp->workers) / (tp->workers + 1);
+        if (slice < TMATCH_SLICE_MIN)
+            slice = TMATCH_SLICE_MIN;
+    }
+
+    return (models > slice) ? slice : 0;
+}
+
+/** Match feat against list slice by slice, the caller works its own job too. */
+static int tmatch_match (struct tmatch_pool_t *tp, struct rt_vrstool_t *tool, void *feat,
+                struct modelist_t *list, float *sg_score, int *md_index, int64_t slice)
+{
+    struct tmatch_job_t job;
+    int64_t from, n, i, best;
+    int xerror;
+
+    memset (&job, 0, sizeof (job));
+    job.tool = tool;
+    job.feat = feat;
+    job.mlist = list;
+    job.sg_score = sg_score;
+    job.models = list->sg_cur_size;
+    job.slice = slice;
+    job.pending = (int)((job.models + slice - 1) / slice);
+    rt_cond_init (&job.done, NULL);
+
+    rt_mutex_lock (&tp->lock);
+    tp->queries ++;
+    tp->slices += job.pending;
+    list_add_tail (&job.list, &tp->jobs);
+    rt_cond_broadcast (&tp->cond);
+
+    /** The caller works its own job, so it ends even with every worker busy */
+    while (job.next < job.models) {
+        from = tmatch_claim (tp, &job, &n);
+        rt_mutex_unlock (&tp->lock);
+        xerror = tmatch_slice (&job, from, n);
+        rt_mutex_lock (&tp->lock);
+        tmatch_done (&job, xerror);
+    }
+    while (job.pending)
+        rt_cond_wait (&job.done, &tp->lock);
+    rt_mutex_unlock (&tp->lock);
+
+    rt_cond_destroy (&job.done);
+
+    if (job.xerror)
+        return job.xerror;
+
+    for (best = 0, i = 1; i < job.models; i ++) {
+        if (sg_score[i] > sg_score[best])
+            best = i;
+    }
+    *md_index = (int)best;
+
+    return 0;
+}
+
+int vpm_tmatch_score (const char *wav_file, struct modelist_t *list,
+                float *sg_score, int *md_index, int is_alaw)
+{
+    struct tmatch_pool_t *tp = &tmatch_pool;
+    struct rt_vrstool_t *tool = vrs_default_trapper()->tool;
+    char feat[SG_FEAT_SIZE];
+    int64_t slice;
+    int xerror;
+
+    xerror = tool->voice_feature_ops (wav_file, (void *)feat, is_alaw);
+    if (xerror)
+        return xerror;
+
+    /** Nothing to share */
+    slice = tmatch_slice_size (tp, list->sg_cur_size);
+    if (!slice)
+        return tool->voice_match_ops ((void *)feat, list, sg_score, md_index);
+
+    return tmatch_match (tp, tool, (void *)feat, list, sg_score, md_index, slice);
+}
+
+void vpm_tmatch_dump ()
+{
+    struct tmatch_pool_t *tp = &tmatch_pool;
+
+    rt_mutex_lock (&tp->lock);
+    if (tp->queries)
+        rt_log_notice ("Target match: %lu shared queries, %lu slices (%lu by workers)",
+                tp->queries, tp->slices, tp->helped);
+    tp->queries = tp->slices = tp->helped = 0;
+    rt_mutex_unlock (&tp->lock);
+}
+
+/**
+* Match the first of wavs (pcm) against models models made of wavs in
+* turn, once in a single voice_match_ops call and once in slices on
+* workers started here. Scores must be the same, md_index the first
+* best of them (models repeat, the engine may pick another of a tie).
+* Needs the engine, returns 0 on pass.
+*/
+int vpm_tmatch_test (const char **wavs, int nwavs, int64_t models)
+{
+    struct tmatch_pool_t *tp = &tmatch_pool;
+    struct rt_vrstool_t *tool = vrs_default_trapper()->tool;
+    struct modelist_t list;
+    static int started = 0;
+    char feat[SG_FEAT_SIZE];
+    uint8_t *mdls = NULL;
+    float *s1 = NULL, *s2 = NULL;
+    int i, w1, w2, md1 = -1, md2 = -1, xret = -1;
+    int64_t m, best, slice = tp->slice, slices[] = {TMATCH_SLICE_MIN, 0};
+    pthread_t pid;
+
+    memset (&list, 0, sizeof (list));
+    mdls = (uint8_t *) kmalloc (nwavs * SG_DATA_SIZE, MPF_CLR, -1);
+    list.sg_data = (uint8_t **) kmalloc (models * sizeof (uint8_t *), MPF_CLR, -1);
+    list.sg_owner = (char **) kmalloc (models * sizeof (char *), MPF_CLR, -1);
+    s1 = (float *) kmalloc (models * sizeof (float), MPF_CLR, -1);
+    s2 = (float *) kmalloc (models * sizeof (float), MPF_CLR, -1);
+    if (!mdls || !list.sg_data || !list.sg_owner || !s1 || !s2)
+        goto finish;
+
+    for (i = 0; i < nwavs; i ++) {
+        if (tool->model_cvrto_cache_ops (wavs[i], mdls + i * SG_DATA_SIZE, &w1, &w2, 0)) {
+            printf ("vpm_tmatch_test: can not model %s\n", wavs[i]);
+            goto finish;
+        }
+    }
+    for (m = 0; m < models; m ++)
+        list.sg_data[m] = mdls + (m % nwavs) * SG_DATA_SIZE;
+    list.sg_cur_size = list.sg_max_size = models;
+    list.sg_score = s1;
+
+    if (tool->voice_feature_ops (wavs[0], (void *)feat, 0) ||
+            tool->voice_match_ops ((void *)feat, &list, s1, &md1))
+        goto finish;
+    for (best = 0, m = 1; m < models; m ++) {
+        if (s1[m] > s1[best])
+            best = m;
+    }
+
+    if (!started) {
+        if (vpm_tmatch_workers () <= 0)
+            tp->workers = 2;
+        for (i = 0; i < tp->workers; i ++) {
+            if (!pthread_create (&pid, NULL, VpmTargetMatcher, NULL))
+                pthread_detach (pid);
+        }
+        started = 1;
+    }
+
+    /** The smallest slices, then the split the pool makes by default */
+    for (i = 0; i < (int)(sizeof (slices) / sizeof (slices[0])); i ++) {
+        memset (s2, 0, models * sizeof (float));
+        tp->slice = slices[i];
+        if (!tmatch_slice_size (tp, models)) {
+            printf ("vpm_tmatch_test: %ld models are not sliced\n", models);
+            goto finish;
+        }
+        if (tmatch_match (tp, tool, (void *)feat, &list, s2, &md2, tmatch_slice_size (tp, models)))
+            goto finish;
+        if (md2 != best || memcmp (s1, s2, models * sizeof (float))) {
+            for (m = 0; m < models && s1[m] == s2[m]; m ++)
+                ;
+            printf ("vpm_tmatch_test: slice %ld, md_index %ld/%d (engine %d), score[%ld] %f/%f\n",
+                    tmatch_slice_size (tp, models), best, md2, md1, m,
+                    m < models ? s1[m] : 0, m < models ? s2[m] : 0);
+            goto finish;
+        }
+    }
+    xret = 0;
+
+finish:
+    tp->slice = slice;
+    kfree (mdls);
+    kfree (list.sg_data);
+    kfree (list.sg_owner);
+    kfree (s1);
+    kfree (s2);
+    return xret;
+}
@@ -0,0 +1,31 @@
+#ifndef __VPM_TMATCH_H__
+#define __VPM_TMATCH_H__
+
+/** Fewest models a worker is given at a time, smaller lists are matched on the caller */
+#define TMATCH_SLICE_MIN    256
+
+/** Load the target-match section of vpm.yaml. */
+extern void vpm_tmatch_load (const char *section);
+
+/** Match workers there are, or will be once vpm_tmatch_init has run. */
+extern int vpm_tmatch_workers ();
+
+/** Start the match workers, none when the section asks for 0. */
+extern void vpm_tmatch_init ();
+
+/**
+* Same as voice_recognition_advanced_ops. The wav is extracted once and
+* the models of list are matched slice by slice on the match workers,
+* the caller matches too. list is only read, each slice writes its own
+* part of sg_score. md_index is the first best score, whatever the order
+* slices were matched in. Concurrent calls share the workers in turn.
+*/
+extern int vpm_tmatch_score (const char *wav_file, struct modelist_t *list,
+                float *sg_score, int *md_index, int is_alaw);
+
+extern void vpm_tmatch_dump ();
+
+/** Sliced and unsliced scores of the same list agree, returns 0 on pass. */
+extern int vpm_tmatch_test (const char **wavs, int nwavs, int64_t models);
+
+#endif
@@ -0,0 +1,96 @@
+#include "sysdefs.h"
+#include "vpm_topk.h"
+
+int topk_init (struct topk_t *tk, int k, float threshold)
+{
+    memset (tk, 0, sizeof (*tk));
+
+    if (k <= 0 || k > TOPK_MAX)
+        return -1;
+
+    tk->heap = (struct topk_item_t *)kmalloc (sizeof (struct topk_item_t) * k, MPF_NOFLGS, -1);
+    if (unlikely (!tk->heap))
+        return -1;
+    tk->k = k;
+    tk->threshold = threshold;
+
+    return 0;
+}
+
+void topk_release (struct topk_t *tk)
+{
+    kfree (tk->heap);
+    tk->heap = NULL;
+    tk->k = tk->n = 0;
+}
+
+/** Is a worse than b, the heap keeps the worst at the top */
+static __rt_always_inline__ int topk_worse (struct topk_item_t *a, struct topk_item_t *b)
+{
+    return a->score < b->score;
+}
+
+static void topk_sift_down (struct topk_item_t *heap, int n, int i)
+{
+    struct topk_item_t tmp;
+    int c;
+
+    for (; (c = 2 * i + 1) < n; i = c) {
+        if (c + 1 < n && topk_worse (&heap[c + 1], &heap[c]))
+            c ++;
+        if (!topk_worse (&heap[c], &heap[i]))
+            break;
+        tmp = heap[i];
+        heap[i] = heap[c];
+        heap[c] = tmp;
+    }
+}
+
+static void topk_sift_up (struct topk_item_t *heap, int i)
+{
+    struct topk_item_t tmp;
+    int p;
+
+    for (; i > 0; i = p) {
+        p = (i - 1) / 2;
+        if (!topk_worse (&heap[i], &heap[p]))
+            break;
+        tmp = heap[i];
+        heap[i] = heap[p];
+        heap[p] = tmp;
+    }
+}
+
+void topk_offer (struct topk_t *tk, float score, uint64_t key, const char *name)
+{
+    struct topk_item_t *it;
+    int full = (tk->n == tk->k);
+
+    tk->kept ++;
+    /** Full, the worst one makes room */
+    it = full ? &tk->heap[0] : &tk->heap[tk->n ++];
+    it->score = score;
+    it->key = key;
+    snprintf (it->name, TOPK_NAME_SIZE, "%s", name);
+
+    if (full)
+        topk_sift_down (tk->heap, tk->n, 0);
+    else
+        topk_sift_up (tk->heap, tk->n - 1);
+}
+
+int topk_sort (struct topk_t *tk)
+{
+    struct topk_item_t tmp;
+    int i;
+
+    /** Heap sort, the worst goes to the end each round */
+    for (i = tk->n - 1; i > 0; i --) {
+        tmp = tk->heap[0];
+        tk->heap[0] = tk->heap[i];
+        tk->heap[i] = tmp;
+        topk_sift_down (tk->heap, i, 0);
+    }
+
+    return tk->n;
+}
@@ -0,0 +1,52 @@
+#ifndef __VPM_TOPK_H__
+#define __VPM_TOPK_H__
+
+/** Longest name kept with a candidate, longer ones are cut */
+#define TOPK_NAME_SIZE      64
+
+/** Largest K a request may ask for */
+#define TOPK_MAX            10000
+
+struct topk_item_t {
+    float       score;
+    uint64_t    key;
+    char        name[TOPK_NAME_SIZE];
+};
+
+/**
+* Keeps the best k scores at or above threshold in a min-heap, whatever
+* the number offered. Once full, an equal score does not displace a kept one.
+*/
+struct topk_t {
+    int         k, n;
+    float       threshold;
+    /** Offered and kept, for the log */
+    uint64_t    offered, kept;
+    struct topk_item_t  *heap;
+};
+
+extern int topk_init (struct topk_t *tk, int k, float threshold);
+extern void topk_release (struct topk_t *tk);
+
+/** Whether score would be kept, lets callers skip formatting a name. */
+static inline int topk_wants (struct topk_t *tk, float score)
+{
+    tk->offered ++;
+    if (score < tk->threshold)
+        return 0;
+    return tk->n < tk->k || score > tk->heap[0].score;
+}
+
+/** Start over for the next round, k and threshold are kept. */
+static inline void topk_reset (struct topk_t *tk)
+{
+    tk->n = 0;
+}
+
+/** Call after topk_wants said yes. */
+extern void topk_offer (struct topk_t *tk, float score, uint64_t key, const char *name);
+
+/** Sort the kept candidates best first, returns how many. Ends offering. */
+extern int topk_sort (struct topk_t *tk);
+
+#endif
@@ -0,0 +1,670 @@
+#include "sysdefs.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "vrs.h"
+#include "vrs_senior.h"
+#include "vpm_vpw.h"
+
+/**
+* VPW connections are served by one epoll loop ("VPW Management Task").
+* Sockets are nonblocking, requests are cut out of a per connection
+* reassembly buffer by TLV length, and handed to a few worker tasks.
+* Broadcasts are queued per connection and written by the loop as the
+* sockets accept them, so a stalled VPW never holds the others up.
+*
+* A VPW that advertised VPW_CAP_SYNC (req_notify_caps, sent on connect)
+* gets every broadcast followed by a req_notify_sync carrying its sequence
+* number on that connection. The VPW sends it back as req_notify_ack once
+* everything before it has been applied, so each VPW's delivery and lag
+* is known without holding anything up. Older VPWs never advertise it and
+* keep getting the broadcasts alone, one TLV each.
+*/
+
+#define VPW_EVENTS          64
+#define VPW_TLV_MAX         (int)(TLV_FRAME_HEAD_LEN + sizeof (((struct tlv *)0)->v) - STR_OVER_CHAR_LEN)
+#define VPW_RBUF_SIZE       (VPW_TLV_MAX * 2)
+/** req_notify_sync appended to each broadcast, "%lu" of the seq */
+#define VPW_SYNC_MAX        (TLV_FRAME_HEAD_LEN + 21)
+
+/** Delivery of every VPW is logged this often */
+#define VPW_LAG_DUMP_SEC    60
+
+/** vpw_clnt_t.dead */
+#define VPW_DEAD_OVERFLOW   1
+#define VPW_DEAD_SEND       2
+#define VPW_DEAD_CLOSED     3
+
+struct vpw_frame_t {
+    struct list_head    list;
+    size_t  s, off;
+    char    data[0];
+};
+
+struct vpw_manager_t {
+    /** epoll instance */
+    int efd;
+    /** eventfd, kicks the loop when frames are queued */
+    int wfd;
+
+    /** Parsed requests, a queue per worker. A VPW always uses the same
+        one so its TLVs are handled one at a time and in order */
+    MQ_ID   req_mq[VPW_WORKERS_MAX];
+    void    (*handler)(struct tlv *);
+    int     workers;
+};
+
+static struct vpw_manager_t vpw_manager = {
+    .efd = -1,
+    .wfd = -1,
+    .handler = NULL,
+    .workers = VPW_WORKERS_DEFAULT,
+};
+
+/** epoll tags for the listening socket and the eventfd */
+static int vpw_listen_tag, vpw_wakeup_tag;
+
+static __rt_always_inline__ uint64_t vpw_now_us ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static __rt_always_inline__ int vpw_sock_nonblock (int sock)
+{
+    int flags = fcntl (sock, F_GETFL, 0);
+
+    if (flags < 0)
+        return -1;
+
+    return fcntl (sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+static __rt_always_inline__ int vpw_events_arm (struct vpw_clnt_t *clnt, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if (clnt->events == events)
+        return 0;
+
+    ev.events = events;
+    ev.data.ptr = clnt;
+    clnt->events = events;
+
+    return epoll_ctl (vpw_manager.efd, EPOLL_CTL_MOD, clnt->sock, &ev);
+}
+
+static __rt_always_inline__ void vpw_frames_release (struct vpw_clnt_t *clnt)
+{
+    struct vpw_frame_t *f, *p;
+
+    list_for_each_entry_safe (f, p, &clnt->obuf, list) {
+        list_del (&f->list);
+        kfree (f);
+    }
+    clnt->obytes = 0;
+}
+
+static struct vpw_clnt_t *vpw_clnt_add (struct vpm_t *vpm, int sock)
+{
+    struct sockaddr_in sock_addr;
+    struct vpw_clnt_t *clnt = NULL;
+    struct epoll_event ev;
+    int one = 1;
+
+    if (rt_sock_getpeername (sock, &sock_addr) < 0 ||
+        vpw_sock_nonblock (sock) < 0)
+        goto err;
+
+    setsockopt (sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+    clnt = (struct vpw_clnt_t *)kmalloc (sizeof (struct vpw_clnt_t), MPF_CLR, -1);
+    if (unlikely (!clnt))
+        goto err;
+
+    clnt->rbuf = (char *)kmalloc (VPW_RBUF_SIZE, MPF_NOFLGS, -1);
+    if (unlikely (!clnt->rbuf))
+        goto err;
+
+    INIT_LIST_HEAD (&clnt->list);
+    INIT_LIST_HEAD (&clnt->obuf);
+    clnt->sock = sock;
+    clnt->vpm = vpm;
+    clnt->mq = vpw_manager.req_mq[sock % vpw_manager.workers];
+    clnt->events = EPOLLIN;
+    snprintf (clnt->peer, sizeof (clnt->peer) - 1, "%s:%d",
+                inet_ntoa (sock_addr.sin_addr), ntohs (sock_addr.sin_port));
+
+    ev.events = clnt->events;
+    ev.data.ptr = clnt;
+    if (epoll_ctl (vpw_manager.efd, EPOLL_CTL_ADD, sock, &ev) < 0)
+        goto err;
+
+    rt_mutex_lock (&vpm->clnt_socks_lock);
+    vpm->clnt_socks ++;
+    list_add_tail (&clnt->list, &vpm->clnt_socks_list);
+    rt_mutex_unlock (&vpm->clnt_socks_lock);
+
+    rt_log_notice ("Peer(VPW) (%s, sock=%d) connected, add to vpw list (total=%d)",
+                clnt->peer, sock, vpm->clnt_socks);
+
+    return clnt;
+
+err:
+    if (clnt) {
+        kfree (clnt->rbuf);
+        kfree (clnt);
+    }
+    rt_sock_close (&sock, NULL);
+    return NULL;
+}
+
+/**
+* Unlink a connection and close its socket. The memory goes to zombies,
+* events of the current epoll batch may still point to it.
+*/
+static void vpw_clnt_del (struct vpw_clnt_t *clnt, struct list_head *zombies,
+                const char *reason)
+{
+    struct vpm_t *vpm = clnt->vpm;
+
+    rt_mutex_lock (&vpm->clnt_socks_lock);
+    list_del (&clnt->list);
+    vpm->clnt_socks --;
+    vpw_frames_release (clnt);
+    clnt->dead = VPW_DEAD_CLOSED;
+    rt_mutex_unlock (&vpm->clnt_socks_lock);
+
+    rt_log_warning (ERRNO_SG, "Peer(VPW) (%s, sock=%d), %s (total=%d)",
+                clnt->peer, clnt->sock, reason, vpm->clnt_socks);
+
+    epoll_ctl (vpw_manager.efd, EPOLL_CTL_DEL, clnt->sock, NULL);
+    rt_sock_close (&clnt->sock, NULL);
+    list_add_tail (&clnt->list, zombies);
+}
+
+static void vpw_zombies_release (struct list_head *zombies)
+{
+    struct vpw_clnt_t *clnt, *p;
+
+    list_for_each_entry_safe (clnt, p, zombies, list) {
+        list_del (&clnt->list);
+        kfree (clnt->rbuf);
+        kfree (clnt);
+    }
+}
+
+static void vpw_list_release (struct vpm_t *vpm, struct list_head *zombies)
+{
+    struct vpw_clnt_t *clnt, *p;
+
+    list_for_each_entry_safe (clnt, p, &vpm->clnt_socks_list, list)
+        vpw_clnt_del (clnt, zombies, "Listener closed");
+}
+
+/** A VPW has applied every broadcast up to seq. */
+static void vpw_clnt_ack (struct vpw_clnt_t *clnt, struct tlv *ack)
+{
+    struct vpm_t *vpm = clnt->vpm;
+    uint64_t seq, lag;
+
+    if (senior_req_to_notify_seq (ack, &seq) < 0)
+        return;
+
+    rt_mutex_lock (&vpm->clnt_socks_lock);
+    if (seq > clnt->acked && seq <= clnt->notified) {
+        clnt->acked = seq;
+        /** Queue time is gone if the VPW fell more than a ring behind */
+        if (clnt->notified - seq < VPW_LAG_RING) {
+            lag = vpw_now_us () - clnt->notify_us[seq % VPW_LAG_RING];
+            clnt->lag_last = lag;
+            clnt->lag_sum += lag;
+            clnt->lags ++;
+            if (lag > clnt->lag_max)
+                clnt->lag_max = lag;
+        }
+    }
+    rt_mutex_unlock (&vpm->clnt_socks_lock);
+}
+
+/** A VPW told what it understands, see VPW_CAP_*. */
+static void vpw_clnt_caps (struct vpw_clnt_t *clnt, struct tlv *caps)
+{
+    struct vpm_t *vpm = clnt->vpm;
+    uint64_t v;
+
+    if (senior_req_to_notify_seq (caps, &v) < 0)
+        return;
+
+    rt_mutex_lock (&vpm->clnt_socks_lock);
+    clnt->caps = (int)v;
+    rt_mutex_unlock (&vpm->clnt_socks_lock);
+
+    rt_log_notice ("Peer(VPW) (%s): caps 0x%x", clnt->peer, clnt->caps);
+}
+
+/**
+* Log broadcast delivery of every VPW: acked/sent, pending bytes, ack lag
+* (last, avg, max) and how long the oldest unacked broadcast has waited.
+*/
+void vpw_lag_dump (struct vpm_t *vpm)
+{
+    struct vpw_clnt_t *clnt;
+    uint64_t now = vpw_now_us (), oldest;
+
+    rt_mutex_lock (&vpm->clnt_socks_lock);
+    list_for_each_entry (clnt, &vpm->clnt_socks_list, list) {
+        oldest = 0;
+        if (clnt->notified > clnt->acked &&
+            clnt->notified - clnt->acked <= VPW_LAG_RING)
+            oldest = now - clnt->notify_us[(clnt->acked + 1) % VPW_LAG_RING];
+        if (!(clnt->caps & VPW_CAP_SYNC)) {
+            rt_log_notice ("Peer(VPW) (%s): no acks (old VPW), queued %lu bytes",
+                    clnt->peer, clnt->obytes);
+            continue;
+        }
+        rt_log_notice ("Peer(VPW) (%s): acked %lu/%lu, queued %lu bytes, "
+                    "lag(ms) last %.1f avg %.1f max %.1f, unacked for %.1f",
+                    clnt->peer, clnt->acked, clnt->notified, clnt->obytes,
+                    clnt->lag_last / 1000.0,
+                    clnt->lags ? clnt->lag_sum / 1000.0 / clnt->lags : 0.0,
+                    clnt->lag_max / 1000.0, oldest / 1000.0);
+    }
+    rt_mutex_unlock (&vpm->clnt_socks_lock);
+}
+
+/**
+* Cut whole TLV frames out of the reassembly buffer.
+* Returns -1 if the stream can not be framed any more.
+*/
+static int vpw_clnt_frames (struct vpw_clnt_t *clnt)
+{
+    struct tlv *request;
+    int off = 0, l;
+
+    while (clnt->rsize - off >= TLV_FRAME_HEAD_LEN) {
+        l = TLV_VAL_LEN (clnt->rbuf + off);
+        if (TLV_FRAME_HEAD_LEN + l > VPW_TLV_MAX)
+            return -1;
+        if (clnt->rsize - off < TLV_FRAME_HEAD_LEN + l)
+            break;
+
+        request = (struct tlv *)kmalloc (sizeof (struct tlv), MPF_CLR, -1);
+        if (likely (request)) {
+            /** Bad types are logged and skipped, framing is still intact. */
+            if (senior_parse_tlv (clnt->rbuf + off, TLV_FRAME_HEAD_LEN + l, request)) {
+                kfree (request);
+            } else if (request->t == req_notify_ack) {
+                /** Acks are the loop's business, no worker needed */
+                vpw_clnt_ack (clnt, request);
+                kfree (request);
+            } else if (request->t == req_notify_caps) {
+                vpw_clnt_caps (clnt, request);
+                kfree (request);
+            } else if (MQ_SUCCESS != rt_mq_send (clnt->mq, request, sizeof (struct tlv))) {
+                kfree (request);
+            }
+        }
+        off += TLV_FRAME_HEAD_LEN + l;
+    }
+
+    if (off) {
+        clnt->rsize -= off;
+        memmove (clnt->rbuf, clnt->rbuf + off, clnt->rsize);
+    }
+
+    return 0;
+}
+
+/** Returns -1 when the connection should be dropped. */
+static int vpw_clnt_read (struct vpw_clnt_t *clnt, const char **reason)
+{
+    ssize_t sz;
+
+    FOREVER {
+        sz = recv (clnt->sock, clnt->rbuf + clnt->rsize, VPW_RBUF_SIZE - clnt->rsize, 0);
+        if (sz == 0) {
+            *reason = "Connection closed";
+            return -1;
+        }
+        if (sz < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            *reason = strerror (errno);
+            return -1;
+        }
+
+        clnt->rsize += sz;
+        if (vpw_clnt_frames (clnt) < 0) {
+            *reason = "Bad TLV length";
+            return -1;
+        }
+    }
+}
+
+/**
+* Write queued frames until the socket would block.
+* Call with clnt_socks_lock held. Returns 1 if frames are left,
+* 0 if the queue is empty and -1 on error.
+*/
+static int vpw_clnt_flush (struct vpw_clnt_t *clnt)
+{
+    struct vpw_frame_t *f;
+    ssize_t sz;
+
+    while (!list_empty (&clnt->obuf)) {
+        f = list_first_entry (&clnt->obuf, struct vpw_frame_t, list);
+        sz = send (clnt->sock, f->data + f->off, f->s - f->off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sz < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            return -1;
+        }
+
+        f->off += sz;
+        clnt->obytes -= sz;
+        if (f->off == f->s) {
+            list_del (&f->list);
+            kfree (f);
+        }
+    }
+
+    return 0;
+}
+
+/**
+* Flush every connection with pending frames, after a broadcast kick.
+* Only the loop unlinks connections, so the list can be walked again
+* unlocked to drop the ones marked dead.
+*/
+static void vpw_list_flush (struct vpm_t *vpm, struct list_head *zombies)
+{
+    struct vpw_clnt_t *clnt, *p;
+    int xret;
+
+    rt_mutex_lock (&vpm->clnt_socks_lock);
+    list_for_each_entry (clnt, &vpm->clnt_socks_list, list) {
+        if (clnt->dead || list_empty (&clnt->obuf))
+            continue;
+        xret = vpw_clnt_flush (clnt);
+        if (xret < 0)
+            clnt->dead = VPW_DEAD_SEND;
+        else
+            vpw_events_arm (clnt, xret ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+    }
+    rt_mutex_unlock (&vpm->clnt_socks_lock);
+
+    list_for_each_entry_safe (clnt, p, &vpm->clnt_socks_list, list) {
+        if (clnt->dead)
+            vpw_clnt_del (clnt, zombies, (clnt->dead == VPW_DEAD_OVERFLOW) ?
+                            "Send queue overflow" : "Send failure");
+    }
+}
+
+static void vpw_clnt_event (struct vpw_clnt_t *clnt, uint32_t events,
+                struct list_head *zombies)
+{
+    struct vpm_t *vpm = clnt->vpm;
+    const char *reason = NULL;
+    int xret;
+
+    if (clnt->dead)
+        return;
+
+    if (events & EPOLLIN) {
+        if (vpw_clnt_read (clnt, &reason) < 0) {
+            vpw_clnt_del (clnt, zombies, reason);
+            return;
+        }
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        vpw_clnt_del (clnt, zombies, "Connection reset");
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        rt_mutex_lock (&vpm->clnt_socks_lock);
+        xret = vpw_clnt_flush (clnt);
+        if (xret >= 0)
+            vpw_events_arm (clnt, xret ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+        rt_mutex_unlock (&vpm->clnt_socks_lock);
+        if (xret < 0)
+            vpw_clnt_del (clnt, zombies, "Send failure");
+    }
+}
+
+static void vpw_listen_event (struct vpm_t *vpm)
+{
+    int sock;
+
+    FOREVER {
+        sock = accept (vpm->serv_sock, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                rt_log_error (ERRNO_SOCK_ACCEPT, "%s", strerror (errno));
+            return;
+        }
+        vpw_clnt_add (vpm, sock);
+    }
+}
+
+/**
+* Queue data to every connected VPW, followed by a req_notify_sync for
+* those with VPW_CAP_SYNC, and kick the loop. Connections with more than VPW_OBUF_MAX bytes
+* pending are dropped. Returns the number of VPWs the data was queued to.
+*/
+int vpw_broadcast (struct vpm_t *vpm, void *data, size_t s)
+{
+    struct vpw_clnt_t *clnt;
+    struct vpw_frame_t *f;
+    struct tlv sync;
+    uint64_t one = 1, now = vpw_now_us ();
+    int n = 0, l;
+
+    rt_mutex_lock (&vpm->clnt_socks_lock);
+    list_for_each_entry (clnt, &vpm->clnt_socks_list, list) {
+        if (clnt->dead)
+            continue;
+        if (clnt->obytes + s + VPW_SYNC_MAX > VPW_OBUF_MAX) {
+            clnt->dead = VPW_DEAD_OVERFLOW;
+            continue;
+        }
+        f = (struct vpw_frame_t *)kmalloc (sizeof (struct vpw_frame_t) + s + VPW_SYNC_MAX, MPF_NOFLGS, -1);
+        if (unlikely (!f))
+            continue;
+        memcpy (f->data, data, s);
+        f->s = s;
+        f->off = 0;
+        if (clnt->caps & VPW_CAP_SYNC) {
+            l = senior_notify_seq_to_req (clnt->notified + 1, req_notify_sync, &sync);
+            pack_request_buf (f->data + s, &sync);
+            f->s += l;
+            clnt->notified ++;
+            clnt->notify_us[clnt->notified % VPW_LAG_RING] = now;
+        }
+        list_add_tail (&f->list, &clnt->obuf);
+        clnt->obytes += f->s;
+        n ++;
+    }
+    rt_mutex_unlock (&vpm->clnt_socks_lock);
+
+    if (write (vpw_manager.wfd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+        rt_log_error (ERRNO_FATAL, "VPW wakeup, %s", strerror (errno));
+
+    return n;
+}
+
+static int vpw_listen (struct vpm_t *vpm)
+{
+    struct epoll_event ev;
+
+    do {
+        vpm->serv_sock = rt_serv_sock (0, vpm->port, AF_INET);
+        if (vpm->serv_sock > 0) {
+            break;
+        }
+        rt_log_notice ("Listen (port=%d, sock=%d), %s",
+                    vpm->port, vpm->serv_sock, "failure");
+        sleep (3);
+    } while (vpm->serv_sock < 0);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &vpw_listen_tag;
+    if (vpw_sock_nonblock (vpm->serv_sock) < 0 ||
+        epoll_ctl (vpw_manager.efd, EPOLL_CTL_ADD, vpm->serv_sock, &ev) < 0) {
+        rt_log_error (ERRNO_SG, "Listen (port=%d, sock=%d), %s",
+                    vpm->port, vpm->serv_sock, strerror (errno));
+        rt_sock_close (&vpm->serv_sock, NULL);
+        return -1;
+    }
+
+    rt_log_notice ("Ready to Listen (port=%d, sock=%d)",
+                    vpm->port, vpm->serv_sock);
+
+    return 0;
+}
+
+static void *VpwManager (void *param)
+{
+    struct    vpm_t    *vpm;
+    struct    vrs_trapper_t    *rte;
+    struct    epoll_event ev[VPW_EVENTS];
+    uint64_t  kicks;
+    time_t    dumped = time (NULL);
+    LIST_HEAD (zombies);
+    int n, i;
+
+    rte = (struct vrs_trapper_t    *)param;
+    vpm = rte->vpm;
+
+    ev[0].events = EPOLLIN;
+    ev[0].data.ptr = &vpw_wakeup_tag;
+    if (epoll_ctl (vpw_manager.efd, EPOLL_CTL_ADD, vpw_manager.wfd, &ev[0]) < 0) {
+        rt_log_error (ERRNO_FATAL, "VPW wakeup, %s", strerror (errno));
+        goto finish;
+    }
+
+    FOREVER {
+
+        if (vpw_listen (vpm) < 0) {
+            sleep (3);
+            continue;
+        }
+
+        while (vpm->serv_sock > 0) {
+
+            n = epoll_wait (vpw_manager.efd, ev, VPW_EVENTS, VPW_LAG_DUMP_SEC * 1000);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                rt_log_error (ERRNO_SG, "Epoll (port=%d, sock=%d): %s",
+                    vpm->port, vpm->serv_sock, strerror (errno));
+                /** clear clnt list here */
+                vpw_list_release (vpm, &zombies);
+                epoll_ctl (vpw_manager.efd, EPOLL_CTL_DEL, vpm->serv_sock, NULL);
+                rt_sock_close (&vpm->serv_sock, NULL);
+                break;
+            }
+
+            for (i = 0; i < n; i ++) {
+                if (ev[i].data.ptr == &vpw_listen_tag) {
+                    vpw_listen_event (vpm);
+                } else if (ev[i].data.ptr == &vpw_wakeup_tag) {
+                    if (read (vpw_manager.wfd, &kicks, sizeof (kicks)) > 0)
+                        vpw_list_flush (vpm, &zombies);
+                } else {
+                    vpw_clnt_event ((struct vpw_clnt_t *)ev[i].data.ptr, ev[i].events, &zombies);
+                }
+            }
+
+            vpw_zombies_release (&zombies);
+
+            if (time (NULL) - dumped >= VPW_LAG_DUMP_SEC) {
+                dumped = time (NULL);
+                vpw_lag_dump (vpm);
+            }
+        }
+
+        vpw_zombies_release (&zombies);
+    }
+
+finish:
+    task_deregistry_id (pthread_self());
+
+    return NULL;
+}
+
+static void *VpwWorker (void *param)
+{
+    struct vpw_manager_t *vm = &vpw_manager;
+    MQ_ID   mq = *(MQ_ID *)param;
+    message    data = NULL;
+    int    s = 0;
+
+    FOREVER {
+        data = NULL;
+        rt_mq_recv (mq, &data, &s);
+        if (likely (data)) {
+            rt_log_debug ("parse tlv from vpw ok");
+            if (likely (vm->handler))
+                vm->handler ((struct tlv *)data);
+            kfree (data);
+        }
+    }
+
+    task_deregistry_id (pthread_self());
+
+    return NULL;
+}
+
+static struct rt_task_t SGVpwManagerTask =
+{
+    .module = THIS,
+    .name = "VPW Management Task",
+    .core = INVALID_CORE,
+    .prio = KERNEL_SCHED,
+    .argvs = &vrsTrapper,
+    .routine = VpwManager,
+};
+
+void vpm_vpw_init (struct vpm_t *vpm, void (*handler)(struct tlv *), int workers)
+{
+    struct vpw_manager_t *vm = &vpw_manager;
+    struct rt_task_t *task;
+    int i;
+
+    INIT_LIST_HEAD (&vpm->clnt_socks_list);
+
+    vm->handler = handler;
+    vm->workers = (workers > 0) ? MIN (workers, VPW_WORKERS_MAX) : VPW_WORKERS_DEFAULT;
+    for (i = 0; i < vm->workers; i ++)
+        vm->req_mq[i] = rt_mq_create ("VPM VPW Request Queue");
+    vm->efd = epoll_create1 (EPOLL_CLOEXEC);
+    vm->wfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (vm->efd < 0 || vm->wfd < 0) {
+        rt_log_error (ERRNO_FATAL, "VPW event loop, %s", strerror (errno));
+        return;
+    }
+
+    task_registry (&SGVpwManagerTask);
+
+    for (i = 0; i < vm->workers; i ++) {
+        task = (struct rt_task_t *) kmalloc (sizeof (struct rt_task_t), MPF_CLR, -1);
+        if (unlikely (!task))
+            continue;
+        sprintf (task->name, "VPW Request Worker%d Task", i);
+        task->module = THIS;
+        task->core = INVALID_CORE;
+        task->prio = KERNEL_SCHED;
+        task->argvs = (void *)&vm->req_mq[i];
+        task->recycle = ALLOWED;
+        task->routine = VpwWorker;
+        task_registry (task);
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef __VPM_VPW_H__
+#define __VPM_VPW_H__
+
+/** Tasks taking parsed VPW requests off the event loop, each VPW is served
+    by one of them so its requests keep their order */
+#define VPW_WORKERS_DEFAULT     2
+#define VPW_WORKERS_MAX         16
+
+/** Bytes queued to one VPW before it is considered dead and dropped */
+#define VPW_OBUF_MAX            (4 << 20)
+
+extern void vpm_vpw_init (struct vpm_t *vpm, void (*handler)(struct tlv *), int workers);
+
+extern int vpw_broadcast (struct vpm_t *vpm, void *data, size_t s);
+
+extern void vpw_lag_dump (struct vpm_t *vpm);
+
+#endif
@@ -0,0 +1,1163 @@
+#include "sysdefs.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "vrs.h"
+#include "vpm_web.h"
+
+/**
+* WEB connections are served by one epoll loop ("Web Agent Task").
+* The connection vpm dials to vrsweb is kept (and redialed) by the loop,
+* more WEB clients may connect to vrsweb.listen if configured.
+*
+* WEB sends bare JSON objects, so requests are cut out of a per connection
+* reassembly buffer at JSON boundaries (brace depth outside of strings).
+* The scanner resumes where the last read stopped, a request split over
+* many reads or many requests in one read are both handled, and pipelined
+* requests are dispatched in order. Replies are queued on the connection
+* the request came from and written by the loop.
+*/
+
+#define WEB_EVENTS          32
+#define WEB_RBUF_INIT       4096
+#define WEB_REDIAL_SEC      3
+
+/** web_conn_t.dead */
+#define WEB_DEAD_OVERFLOW   1
+#define WEB_DEAD_SEND       2
+
+struct web_frame_t {
+    struct list_head    list;
+    size_t  s, off;
+    char    data[0];
+};
+
+struct web_conn_t {
+    struct list_head    list;
+    struct web_agent_t  *wa;
+
+    uint32_t    id;
+    int         sock;
+    /** Dialed by vpm to vrsweb rather than accepted */
+    int         dialed;
+    /** Nonblocking connect still in progress */
+    int         connecting;
+    char        peer[32];
+
+    /** Reassembly buffer, always one byte spare for the terminator */
+    char        *rbuf;
+    size_t      rsize, rcap;
+
+    /** JSON boundary scanner, resumes at scan */
+    size_t      scan;
+    int         depth, instr, esc;
+
+    struct list_head    obuf;
+    size_t      obytes;
+    uint32_t    events;
+    int         dead;
+
+    /** Token of the web_stream_t writing to obuf, 0 if none.
+        Replies queued meanwhile wait in held. */
+    uint32_t    stream;
+    struct list_head    held;
+    size_t      hbytes;
+};
+
+struct web_agent_t {
+    const char  *desc;
+
+    /** epoll instance */
+    int         efd;
+    /** eventfd, kicks the loop when replies are queued */
+    int         wfd;
+    /** Listening socket for extra WEB clients, -1 if none */
+    int         lsock;
+    uint16_t    lport;
+
+    /** NULL if nothing is to be dialed */
+    struct vpm_t    *vpm;
+    struct web_conn_t   *dial;
+    time_t      redial;
+
+    /** conns and their obufs */
+    rt_mutex    lock;
+    struct list_head    conns;
+    int         nconns;
+    uint32_t    ids;
+    /** Bumped on every close, see web_origin_epoch */
+    atomic_t    closes;
+
+    void    (*dispatch)(uint32_t origin, char *request, size_t s);
+    void    (*greet)(uint32_t origin);
+
+    /** Loop private */
+    uint64_t    requests, bytes;
+    volatile int    stop;
+};
+
+static struct web_agent_t web_agent = {
+    .desc = "WEB",
+    .efd = -1,
+    .wfd = -1,
+    .lsock = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .conns = LIST_HEAD_INIT (web_agent.conns),
+    .closes = ATOMIC_INIT (0),
+};
+
+/** epoll tags for the listening socket and the eventfd */
+static int web_listen_tag, web_wakeup_tag;
+
+static __rt_always_inline__ int web_sock_nonblock (int sock)
+{
+    int flags = fcntl (sock, F_GETFL, 0);
+
+    if (flags < 0)
+        return -1;
+
+    return fcntl (sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+static __rt_always_inline__ int web_events_arm (struct web_conn_t *conn, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if (conn->events == events)
+        return 0;
+
+    ev.events = events;
+    ev.data.ptr = conn;
+    conn->events = events;
+
+    return epoll_ctl (conn->wa->efd, EPOLL_CTL_MOD, conn->sock, &ev);
+}
+
+static __rt_always_inline__ void web_frames_release (struct web_conn_t *conn)
+{
+    struct web_frame_t *f, *p;
+
+    list_for_each_entry_safe (f, p, &conn->obuf, list) {
+        list_del (&f->list);
+        kfree (f);
+    }
+    list_for_each_entry_safe (f, p, &conn->held, list) {
+        list_del (&f->list);
+        kfree (f);
+    }
+    conn->obytes = conn->hbytes = 0;
+}
+
+static struct web_conn_t *web_conn_add (struct web_agent_t *wa, int sock,
+                const char *peer, int dialed, int connecting)
+{
+    struct web_conn_t *conn = NULL;
+    struct epoll_event ev;
+    int one = 1;
+
+    if (web_sock_nonblock (sock) < 0)
+        goto err;
+
+    setsockopt (sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+    conn = (struct web_conn_t *)kmalloc (sizeof (struct web_conn_t), MPF_CLR, -1);
+    if (unlikely (!conn))
+        goto err;
+
+    conn->rcap = WEB_RBUF_INIT;
+    conn->rbuf = (char *)kmalloc (conn->rcap, MPF_NOFLGS, -1);
+    if (unlikely (!conn->rbuf))
+        goto err;
+
+    INIT_LIST_HEAD (&conn->list);
+    INIT_LIST_HEAD (&conn->obuf);
+    INIT_LIST_HEAD (&conn->held);
+    conn->wa = wa;
+    conn->sock = sock;
+    conn->dialed = dialed;
+    conn->connecting = connecting;
+    conn->events = connecting ? EPOLLOUT : EPOLLIN;
+    strncpy (conn->peer, peer, sizeof (conn->peer) - 1);
+
+    ev.events = conn->events;
+    ev.data.ptr = conn;
+    if (epoll_ctl (wa->efd, EPOLL_CTL_ADD, sock, &ev) < 0)
+        goto err;
+
+    rt_mutex_lock (&wa->lock);
+    /** 0 stands for the dialed connection in web_reply, never hand it out */
+    if (!++ wa->ids)
+        ++ wa->ids;
+    conn->id = wa->ids;
+    wa->nconns ++;
+    list_add_tail (&conn->list, &wa->conns);
+    rt_mutex_unlock (&wa->lock);
+
+    if (dialed)
+        wa->dial = conn;
+
+    return conn;
+
+err:
+    if (conn) {
+        kfree (conn->rbuf);
+        kfree (conn);
+    }
+    rt_sock_close (&sock, NULL);
+    return NULL;
+}
+
+/**
+* Unlink a connection and close its socket. The memory goes to zombies,
+* events of the current epoll batch may still point to it.
+*/
+static void web_conn_del (struct web_conn_t *conn, struct list_head *zombies,
+                const char *reason)
+{
+    struct web_agent_t *wa = conn->wa;
+
+    rt_mutex_lock (&wa->lock);
+    list_del (&conn->list);
+    wa->nconns --;
+    web_frames_release (conn);
+    conn->dead = WEB_DEAD_SEND;
+    atomic_inc (&wa->closes);
+    rt_mutex_unlock (&wa->lock);
+
+    if (wa->dial == conn) {
+        wa->dial = NULL;
+        wa->redial = time (NULL) + WEB_REDIAL_SEC;
+    }
+
+    rt_log_warning (ERRNO_SG, "Peer(%s) (%s, sock=%d), %s (total=%d)",
+                wa->desc, conn->peer, conn->sock, reason, wa->nconns);
+
+    epoll_ctl (wa->efd, EPOLL_CTL_DEL, conn->sock, NULL);
+    rt_sock_close (&conn->sock, NULL);
+    list_add_tail (&conn->list, zombies);
+}
+
+static void web_zombies_release (struct list_head *zombies)
+{
+    struct web_conn_t *conn, *p;
+
+    list_for_each_entry_safe (conn, p, zombies, list) {
+        list_del (&conn->list);
+        kfree (conn->rbuf);
+        kfree (conn);
+    }
+}
+
+/**
+* Cut complete JSON values out of the reassembly buffer and dispatch them.
+* Whitespace between values (WEB ends each with '\n') is skipped.
+* Returns -1 if the stream is not a sequence of JSON objects or arrays.
+*/
+static int web_conn_frames (struct web_conn_t *conn)
+{
+    struct web_agent_t *wa = conn->wa;
+    char *p = conn->rbuf, c, save;
+    size_t i, start = 0;
+
+    for (i = conn->scan; i < conn->rsize; i ++) {
+        c = p[i];
+
+        if (conn->instr) {
+            if (conn->esc)
+                conn->esc = 0;
+            else if (c == '\\')
+                conn->esc = 1;
+            else if (c == '"')
+                conn->instr = 0;
+            continue;
+        }
+
+        switch (c) {
+            case '{':
+            case '[':
+                conn->depth ++;
+                break;
+            case '}':
+            case ']':
+                if (!conn->depth)
+                    return -1;
+                if (-- conn->depth)
+                    break;
+                /** A whole request in [start, i], terminate it in place */
+                save = p[i + 1];
+                p[i + 1] = 0;
+                wa->requests ++;
+                wa->bytes += i + 1 - start;
+                if (likely (wa->dispatch))
+                    wa->dispatch (conn->id, p + start, i + 1 - start);
+                p[i + 1] = save;
+                start = i + 1;
+                break;
+            case '"':
+                if (!conn->depth)
+                    return -1;
+                conn->instr = 1;
+                break;
+            default:
+                if (conn->depth)
+                    break;
+                if (!isspace ((unsigned char)c) && c != 0)
+                    return -1;
+                start = i + 1;
+                break;
+        }
+    }
+
+    if (start) {
+        conn->rsize -= start;
+        memmove (p, p + start, conn->rsize);
+    }
+    conn->scan = conn->rsize;
+
+    return 0;
+}
+
+/** Make room for one more read, keeping a spare byte. */
+static int web_conn_room (struct web_conn_t *conn)
+{
+    size_t cap = conn->rcap;
+    char *p;
+
+    /** Give back what a large request grew, once it is done */
+    if (!conn->rsize && cap > WEB_RBUF_INIT * 16)
+        cap = WEB_RBUF_INIT;
+
+    while (cap - conn->rsize < WEB_RBUF_INIT / 2 + 1)
+        cap <<= 1;
+
+    if (cap == conn->rcap)
+        return 0;
+
+    if (cap > WEB_REQ_MAX + WEB_RBUF_INIT)
+        return -1;
+
+    p = (char *)krealloc (conn->rbuf, cap, MPF_NOFLGS, -1);
+    if (unlikely (!p))
+        return -1;
+
+    conn->rbuf = p;
+    conn->rcap = cap;
+
+    return 0;
+}
+
+/** Returns -1 when the connection should be dropped. */
+static int web_conn_read (struct web_conn_t *conn, const char **reason)
+{
+    ssize_t sz;
+
+    FOREVER {
+        if (web_conn_room (conn) < 0) {
+            *reason = "Request too large";
+            return -1;
+        }
+
+        sz = recv (conn->sock, conn->rbuf + conn->rsize, conn->rcap - conn->rsize - 1, 0);
+        if (sz == 0) {
+            *reason = "Connection closed";
+            return -1;
+        }
+        if (sz < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            *reason = strerror (errno);
+            return -1;
+        }
+
+        conn->rsize += sz;
+        if (web_conn_frames (conn) < 0) {
+            *reason = "Bad JSON framing";
+            return -1;
+        }
+    }
+}
+
+/**
+* Write queued replies until the socket would block.
+* Call with the agent lock held. Returns 1 if replies are left,
+* 0 if the queue is empty and -1 on error.
+*/
+static int web_conn_flush (struct web_conn_t *conn)
+{
+    struct web_frame_t *f;
+    ssize_t sz;
+
+    while (!list_empty (&conn->obuf)) {
+        f = list_first_entry (&conn->obuf, struct web_frame_t, list);
+        sz = send (conn->sock, f->data + f->off, f->s - f->off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sz < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            return -1;
+        }
+
+        f->off += sz;
+        conn->obytes -= sz;
+        if (f->off == f->s) {
+            list_del (&f->list);
+            kfree (f);
+        }
+    }
+
+    return 0;
+}
+
+/** Flush every connection with pending replies, after a kick. */
+static void web_list_flush (struct web_agent_t *wa, struct list_head *zombies)
+{
+    struct web_conn_t *conn, *p;
+    int xret;
+
+    rt_mutex_lock (&wa->lock);
+    list_for_each_entry (conn, &wa->conns, list) {
+        if (conn->dead || conn->connecting || list_empty (&conn->obuf))
+            continue;
+        xret = web_conn_flush (conn);
+        if (xret < 0)
+            conn->dead = WEB_DEAD_SEND;
+        else
+            web_events_arm (conn, xret ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+    }
+    rt_mutex_unlock (&wa->lock);
+
+    /** Only the loop unlinks connections, walk again unlocked to drop the dead */
+    list_for_each_entry_safe (conn, p, &wa->conns, list) {
+        if (conn->dead)
+            web_conn_del (conn, zombies, (conn->dead == WEB_DEAD_OVERFLOW) ?
+                            "Send queue overflow" : "Send failure");
+    }
+}
+
+static void web_conn_connected (struct web_conn_t *conn, struct list_head *zombies)
+{
+    struct web_agent_t *wa = conn->wa;
+    int xerror = 0;
+    socklen_t l = sizeof (xerror);
+
+    if (getsockopt (conn->sock, SOL_SOCKET, SO_ERROR, &xerror, &l) < 0)
+        xerror = errno;
+    if (xerror) {
+        rt_log_notice ("Connecting to %s (%s, sock=%d): %s",
+                    wa->desc, conn->peer, conn->sock, strerror (xerror));
+        web_conn_del (conn, zombies, "Connect failure");
+        return;
+    }
+
+    rt_log_notice ("Connecting to %s (%s, sock=%d): %s",
+                    wa->desc, conn->peer, conn->sock, "success");
+
+    conn->connecting = 0;
+    if (wa->greet)
+        wa->greet (conn->id);
+}
+
+static void web_conn_event (struct web_conn_t *conn, uint32_t events,
+                struct list_head *zombies)
+{
+    struct web_agent_t *wa = conn->wa;
+    const char *reason = NULL;
+    int xret;
+
+    if (conn->dead)
+        return;
+
+    if (conn->connecting) {
+        web_conn_connected (conn, zombies);
+        if (conn->dead)
+            return;
+        /** greet queued a frame, fall through to write it */
+        events = EPOLLOUT;
+    }
+
+    if (events & EPOLLIN) {
+        if (web_conn_read (conn, &reason) < 0) {
+            web_conn_del (conn, zombies, reason);
+            return;
+        }
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        web_conn_del (conn, zombies, "Connection reset");
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        rt_mutex_lock (&wa->lock);
+        xret = web_conn_flush (conn);
+        if (xret >= 0)
+            web_events_arm (conn, xret ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+        rt_mutex_unlock (&wa->lock);
+        if (xret < 0)
+            web_conn_del (conn, zombies, "Send failure");
+    }
+}
+
+static void web_listen_event (struct web_agent_t *wa)
+{
+    struct sockaddr_in sock_addr;
+    struct web_conn_t *conn;
+    char peer[32] = {0};
+    int sock;
+
+    FOREVER {
+        sock = accept (wa->lsock, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                rt_log_error (ERRNO_SOCK_ACCEPT, "%s", strerror (errno));
+            return;
+        }
+
+        if (rt_sock_getpeername (sock, &sock_addr) < 0) {
+            rt_sock_close (&sock, NULL);
+            continue;
+        }
+        snprintf (peer, sizeof (peer) - 1, "%s:%d",
+                    inet_ntoa (sock_addr.sin_addr), ntohs (sock_addr.sin_port));
+
+        conn = web_conn_add (wa, sock, peer, 0, 0);
+        if (conn)
+            rt_log_notice ("Peer(%s) (%s, sock=%d) connected (total=%d)",
+                    wa->desc, peer, sock, wa->nconns);
+    }
+}
+
+/** Start a nonblocking connect to vrsweb, the loop sees it complete. */
+static void web_dial (struct web_agent_t *wa)
+{
+    struct vpm_t *vpm = wa->vpm;
+    struct sockaddr_in sock_addr;
+    char peer[32] = {0};
+    int sock;
+
+    if (!vpm || wa->dial || time (NULL) < wa->redial)
+        return;
+
+    wa->redial = time (NULL) + WEB_REDIAL_SEC;
+    atomic64_inc (&vpm->seq);
+
+    snprintf (peer, sizeof (peer) - 1, "%s:%d", vpm->web, vpm->web_port);
+
+    memset (&sock_addr, 0, sizeof (sock_addr));
+    sock_addr.sin_family = AF_INET;
+    sock_addr.sin_port = htons (vpm->web_port);
+    if (!inet_aton (vpm->web, &sock_addr.sin_addr)) {
+        rt_log_notice ("Connecting to %s (%s): %s", wa->desc, peer, "bad address");
+        return;
+    }
+
+    sock = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        rt_log_error (ERRNO_SG, "Connecting to %s (%s): %s", wa->desc, peer, strerror (errno));
+        return;
+    }
+
+    if (connect (sock, (struct sockaddr *)&sock_addr, sizeof (sock_addr)) < 0 &&
+        errno != EINPROGRESS) {
+        rt_log_notice ("Connecting to %s (%s, sock=%d): %s",
+                    wa->desc, peer, sock, strerror (errno));
+        rt_sock_close (&sock, NULL);
+        return;
+    }
+
+    web_conn_add (wa, sock, peer, 1, 1);
+}
+
+static int web_listen (struct web_agent_t *wa)
+{
+    struct epoll_event ev;
+
+    wa->lsock = rt_serv_sock (0, wa->lport, AF_INET);
+    if (wa->lsock < 0) {
+        rt_log_notice ("Listen (port=%d, sock=%d), %s",
+                    wa->lport, wa->lsock, "failure");
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &web_listen_tag;
+    if (web_sock_nonblock (wa->lsock) < 0 ||
+        epoll_ctl (wa->efd, EPOLL_CTL_ADD, wa->lsock, &ev) < 0) {
+        rt_log_error (ERRNO_SG, "Listen (port=%d, sock=%d), %s",
+                    wa->lport, wa->lsock, strerror (errno));
+        rt_sock_close (&wa->lsock, NULL);
+        return -1;
+    }
+
+    rt_log_notice ("Ready to Listen %s (port=%d, sock=%d)",
+                    wa->desc, wa->lport, wa->lsock);
+
+    return 0;
+}
+
+static int web_agent_open (struct web_agent_t *wa)
+{
+    struct epoll_event ev;
+
+    wa->efd = epoll_create1 (EPOLL_CLOEXEC);
+    wa->wfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wa->efd < 0 || wa->wfd < 0)
+        goto err;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &web_wakeup_tag;
+    if (epoll_ctl (wa->efd, EPOLL_CTL_ADD, wa->wfd, &ev) < 0)
+        goto err;
+
+    return 0;
+
+err:
+    rt_log_error (ERRNO_FATAL, "%s event loop, %s", wa->desc, strerror (errno));
+    return -1;
+}
+
+static void web_agent_close (struct web_agent_t *wa)
+{
+    struct web_conn_t *conn, *p;
+    LIST_HEAD (zombies);
+
+    list_for_each_entry_safe (conn, p, &wa->conns, list)
+        web_conn_del (conn, &zombies, "Agent closed");
+    web_zombies_release (&zombies);
+
+    rt_sock_close (&wa->lsock, NULL);
+    if (wa->wfd >= 0)
+        close (wa->wfd);
+    if (wa->efd >= 0)
+        close (wa->efd);
+    wa->wfd = wa->efd = -1;
+}
+
+static void web_agent_loop (struct web_agent_t *wa)
+{
+    struct epoll_event ev[WEB_EVENTS];
+    uint64_t kicks;
+    LIST_HEAD (zombies);
+    int n, i;
+
+    while (!wa->stop) {
+
+        if (wa->lport && wa->lsock < 0)
+            web_listen (wa);
+        web_dial (wa);
+
+        n = epoll_wait (wa->efd, ev, WEB_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            rt_log_error (ERRNO_SG, "Epoll (%s): %s", wa->desc, strerror (errno));
+            sleep (1);
+            continue;
+        }
+
+        for (i = 0; i < n; i ++) {
+            if (ev[i].data.ptr == &web_listen_tag) {
+                web_listen_event (wa);
+            } else if (ev[i].data.ptr == &web_wakeup_tag) {
+                if (read (wa->wfd, &kicks, sizeof (kicks)) > 0)
+                    web_list_flush (wa, &zombies);
+            } else {
+                web_conn_event ((struct web_conn_t *)ev[i].data.ptr, ev[i].events, &zombies);
+            }
+        }
+
+        web_zombies_release (&zombies);
+    }
+}
+
+/** What ends a reply on the wire, as web_json_data_rebuild did: '\n' and '\0' */
+#define WEB_TERM_SIZE   2
+
+static __rt_always_inline__ struct web_frame_t *web_frame_alloc (const char *data, size_t s,
+                int terminate)
+{
+    struct web_frame_t *f;
+    size_t t = terminate ? WEB_TERM_SIZE : 0;
+
+    f = (struct web_frame_t *)kmalloc (sizeof (struct web_frame_t) + s + t, MPF_NOFLGS, -1);
+    if (unlikely (!f))
+        return NULL;
+    f->s = s + t;
+    f->off = 0;
+    memcpy (f->data, data, s);
+    /** Java will not get data without '\n' */
+    if (terminate) {
+        f->data[s] = '\n';
+        f->data[s + 1] = 0;
+    }
+
+    return f;
+}
+
+/** Call with the agent lock held. */
+static __rt_always_inline__ struct web_conn_t *web_conn_find (struct web_agent_t *wa,
+                uint32_t origin)
+{
+    struct web_conn_t *conn;
+
+    list_for_each_entry (conn, &wa->conns, list) {
+        if (origin ? (conn->id == origin) : conn->dialed)
+            return conn->dead ? NULL : conn;
+    }
+
+    return NULL;
+}
+
+static __rt_always_inline__ void web_agent_kick (struct web_agent_t *wa)
+{
+    uint64_t one = 1;
+
+    if (write (wa->wfd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+        rt_log_error (ERRNO_FATAL, "%s wakeup, %s", wa->desc, strerror (errno));
+}
+
+/**
+* Move frames to a connection. They go out at once if the connection is
+* free or token owns it, and are held back while another stream owns it.
+* frames is left empty on success. Call with the agent lock held.
+*/
+static int web_conn_queue (struct web_conn_t *conn, uint32_t token,
+                struct list_head *frames, size_t bytes)
+{
+    if (conn->obytes + conn->hbytes + bytes > WEB_OBUF_MAX) {
+        conn->dead = WEB_DEAD_OVERFLOW;
+        return -1;
+    }
+
+    if (conn->stream && conn->stream != token) {
+        list_splice_tail_init (frames, &conn->held);
+        conn->hbytes += bytes;
+    } else {
+        list_splice_tail_init (frames, &conn->obuf);
+        conn->obytes += bytes;
+    }
+
+    return 0;
+}
+
+static __rt_always_inline__ void web_frames_free (struct list_head *frames)
+{
+    struct web_frame_t *f, *p;
+
+    list_for_each_entry_safe (f, p, frames, list) {
+        list_del (&f->list);
+        kfree (f);
+    }
+}
+
+static int web_agent_reply (struct web_agent_t *wa, uint32_t origin,
+                const char *data, size_t s)
+{
+    struct web_conn_t *conn;
+    struct web_frame_t *f;
+    LIST_HEAD (frames);
+    int xret = -1;
+
+    f = web_frame_alloc (data, s, 1);
+    if (unlikely (!f))
+        return -1;
+    list_add_tail (&f->list, &frames);
+
+    rt_mutex_lock (&wa->lock);
+    conn = web_conn_find (wa, origin);
+    if (conn)
+        xret = web_conn_queue (conn, 0, &frames, f->s);
+    rt_mutex_unlock (&wa->lock);
+
+    if (xret < 0) {
+        rt_log_warning (ERRNO_SG, "Reply to %s (origin=%u) dropped, connection gone",
+                    wa->desc, origin);
+        web_frames_free (&frames);
+    }
+
+    web_agent_kick (wa);
+
+    return xret;
+}
+
+/**
+* Queue a reply ('\n' and '\0' are appended) to the WEB connection a request came from,
+* origin 0 is the connection vpm dialed. Returns -1 if it has gone away.
+*/
+int web_reply (uint32_t origin, const char *data, size_t s)
+{
+    return web_agent_reply (&web_agent, origin, data, s);
+}
+
+int web_origin_alive (uint32_t origin)
+{
+    struct web_agent_t *wa = &web_agent;
+    int alive;
+
+    rt_mutex_lock (&wa->lock);
+    alive = (web_conn_find (wa, origin) != NULL);
+    rt_mutex_unlock (&wa->lock);
+
+    return alive;
+}
+
+int web_origin_epoch ()
+{
+    return atomic_read (&web_agent.closes);
+}
+
+/**
+* Start a reply that is written in pieces. The stream owns the connection's
+* output until web_stream_close, other replies wait behind it. If another
+* stream owns it already, this one is kept back and queued whole on close.
+*/
+int web_stream_open (struct web_stream_t *ws, uint32_t origin)
+{
+    static atomic_t tokens = ATOMIC_INIT(0);
+    struct web_agent_t *wa = &web_agent;
+    struct web_conn_t *conn;
+
+    memset (ws, 0, sizeof (*ws));
+    INIT_LIST_HEAD (&ws->pending);
+    ws->origin = origin;
+    do {
+        ws->token = (uint32_t)atomic_inc (&tokens);
+    } while (!ws->token);
+
+    rt_mutex_lock (&wa->lock);
+    conn = web_conn_find (wa, origin);
+    if (!conn)
+        ws->error = -1;
+    else if (!conn->stream)
+        conn->stream = ws->token, ws->direct = 1;
+    rt_mutex_unlock (&wa->lock);
+
+    return ws->error;
+}
+
+static int web_stream_queue (struct web_stream_t *ws, struct web_frame_t *f)
+{
+    struct web_agent_t *wa = &web_agent;
+    struct web_conn_t *conn;
+    LIST_HEAD (frames);
+
+    list_add_tail (&f->list, &frames);
+
+    if (!ws->direct) {
+        list_splice_tail_init (&frames, &ws->pending);
+        ws->bytes += f->s;
+        return 0;
+    }
+
+    rt_mutex_lock (&wa->lock);
+    conn = web_conn_find (wa, ws->origin);
+    if (!conn || web_conn_queue (conn, ws->token, &frames, f->s) < 0)
+        ws->error = -1;
+    rt_mutex_unlock (&wa->lock);
+
+    if (ws->error)
+        web_frames_free (&frames);
+    else
+        web_agent_kick (wa);
+
+    return ws->error;
+}
+
+/** Returns -1 once the connection is gone, the producer may give up. */
+int web_stream_write (struct web_stream_t *ws, const char *data, size_t s)
+{
+    struct web_frame_t *f;
+
+    if (ws->error)
+        return -1;
+
+    f = web_frame_alloc (data, s, 0);
+    if (unlikely (!f))
+        return (ws->error = -1);
+
+    return web_stream_queue (ws, f);
+}
+
+/** End the reply with '\n' '\0' and hand the connection back. */
+int web_stream_close (struct web_stream_t *ws)
+{
+    struct web_agent_t *wa = &web_agent;
+    struct web_conn_t *conn;
+    struct web_frame_t *f = NULL;
+
+    if (!ws->error) {
+        f = web_frame_alloc ("\n", 0, 1);
+        if (f)
+            list_add_tail (&f->list, &ws->pending), ws->bytes += f->s;
+        else
+            ws->error = -1;
+    }
+
+    rt_mutex_lock (&wa->lock);
+    conn = web_conn_find (wa, ws->origin);
+    if (conn && !ws->error &&
+        web_conn_queue (conn, ws->direct ? ws->token : 0, &ws->pending, ws->bytes) < 0)
+        ws->error = -1;
+    if (conn && ws->direct && conn->stream == ws->token) {
+        /** Let the replies that waited for us go */
+        conn->stream = 0;
+        list_splice_tail_init (&conn->held, &conn->obuf);
+        conn->obytes += conn->hbytes;
+        conn->hbytes = 0;
+    }
+    rt_mutex_unlock (&wa->lock);
+
+    web_frames_free (&ws->pending);
+    web_agent_kick (wa);
+
+    return ws->error;
+}
+
+static void *WebAgent (void *param)
+{
+    struct web_agent_t *wa = (struct web_agent_t *)param;
+
+    if (web_agent_open (wa) == 0)
+        web_agent_loop (wa);
+
+    task_deregistry_id (pthread_self());
+
+    return NULL;
+}
+
+static struct rt_task_t SGWebAgentTask =
+{
+    .module = THIS,
+    .name = "Web Agent Task",
+    .core = INVALID_CORE,
+    .prio = KERNEL_SCHED,
+    .argvs = &web_agent,
+    .routine = WebAgent,
+};
+
+void vpm_web_init (struct vpm_t *vpm,
+                void (*dispatch)(uint32_t origin, char *request, size_t s),
+                void (*greet)(uint32_t origin))
+{
+    struct web_agent_t *wa = &web_agent;
+
+    wa->vpm = vpm;
+    wa->lport = vpm->web_listen;
+    wa->dispatch = dispatch;
+    wa->greet = greet;
+
+    task_registry (&SGWebAgentTask);
+}
+
+/**
+* Local check and load generator of the intake path.
+* A private agent listens on an ephemeral port, clients pipeline a mix of
+* small and large requests over their own connections in odd sized writes,
+* and every request must come back whole through web_agent_reply. The
+* requests and bytes the agent cut out are reported per second.
+*/
+
+static struct web_agent_t web_test_agent = {
+    .desc = "WEB Test",
+    .efd = -1,
+    .wfd = -1,
+    .lsock = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .conns = LIST_HEAD_INIT (web_test_agent.conns),
+};
+
+struct web_test_clnt_t {
+    int     sock;
+    char    *stream;
+    size_t  s;
+    /** Each request again, as web_reply terminates it */
+    char    *expect;
+    size_t  es;
+    /** Replies matched the requests byte for byte */
+    int     match;
+};
+
+static void web_test_dispatch (uint32_t origin, char *request, size_t s)
+{
+    web_agent_reply (&web_test_agent, origin, request, s);
+}
+
+static void *web_test_loop (void *param)
+{
+    web_agent_loop ((struct web_agent_t *)param);
+    return NULL;
+}
+
+static void *web_test_writer (void *param)
+{
+    struct web_test_clnt_t *clnt = (struct web_test_clnt_t *)param;
+    size_t off = 0, l;
+    ssize_t sz;
+    unsigned int seed = (unsigned int)clnt->sock;
+
+    /** Odd sized writes, requests straddle them all the time */
+    while (off < clnt->s) {
+        l = 1 + rand_r (&seed) % 9000;
+        if (l > clnt->s - off)
+            l = clnt->s - off;
+        sz = send (clnt->sock, clnt->stream + off, l, MSG_NOSIGNAL);
+        if (sz <= 0)
+            break;
+        off += sz;
+    }
+
+    return NULL;
+}
+
+static void *web_test_reader (void *param)
+{
+    struct web_test_clnt_t *clnt = (struct web_test_clnt_t *)param;
+    char buf[65536];
+    size_t off = 0;
+    ssize_t sz;
+
+    clnt->match = 1;
+    while (off < clnt->es) {
+        sz = recv (clnt->sock, buf, sizeof (buf), 0);
+        if (sz <= 0)
+            break;
+        if ((size_t)sz > clnt->es - off ||
+            memcmp (buf, clnt->expect + off, sz))
+            clnt->match = 0;
+        off += sz;
+    }
+    if (off != clnt->es)
+        clnt->match = 0;
+
+    return NULL;
+}
+
+/**
+* Pipelined requests, every 64th a mass query with a long list.
+* expect gets the replies they are echoed as, '\n' '\0' after each.
+*/
+static size_t web_test_stream (struct web_test_clnt_t *clnt, long requests, long base)
+{
+    size_t s = 0, es = 0, cap = 0, l;
+    long i, j;
+    char *p = NULL, *e = NULL, *q;
+
+    for (i = 0; i < requests; i ++) {
+        if (cap - es < (128 << 10)) {
+            cap = cap ? cap * 2 : (1 << 20);
+            q = (char *)krealloc (p, cap, MPF_NOFLGS, -1);
+            if (q)
+                p = q;
+            q = q ? (char *)krealloc (e, cap, MPF_NOFLGS, -1) : NULL;
+            if (!q) {
+                kfree (p);
+                kfree (e);
+                return 0;
+            }
+            e = q;
+        }
+
+        if (i % 64) {
+            l = sprintf (p + s, "{\"head\":{\"version\":1,\"direct\":0,\"cmd\":%d,\"no\":%ld},"
+                        "\"msg\":{\"id\":\"t\\\"{[%ld\",\"v\":[1,2,3]}}\n",
+                        SG_X_TARGET_QUERY, base + i, i);
+        } else {
+            l = sprintf (p + s, "{\"head\":{\"version\":1,\"direct\":0,\"cmd\":%d,\"no\":%ld},"
+                        "\"msg\":{\"ls\":[", SG_X_MASS_QUERY, base + i);
+            for (j = 0; j < 4096; j ++)
+                l += sprintf (p + s + l, "%s\"%08ld\"", j ? "," : "", j);
+            l += sprintf (p + s + l, "]}}\n");
+        }
+        memcpy (e + es, p + s, l);
+        e[es + l] = 0;
+        es += l + 1;
+        s += l;
+    }
+
+    clnt->stream = p;
+    clnt->expect = e;
+    clnt->es = es;
+    return (clnt->s = s);
+}
+
+int vpm_web_test (int clients, long requests)
+{
+    struct web_agent_t *wa = &web_test_agent;
+    struct web_test_clnt_t *clnt;
+    struct sockaddr_in sock_addr;
+    socklen_t l = sizeof (sock_addr);
+    pthread_t loop, *w, *r;
+    struct timeval start, end;
+    double sec;
+    int i, looping = 0, xret = -1;
+
+    clnt = (struct web_test_clnt_t *)kmalloc (sizeof (*clnt) * clients, MPF_CLR, -1);
+    w = (pthread_t *)kmalloc (sizeof (pthread_t) * clients * 2, MPF_CLR, -1);
+    if (!clnt || !w)
+        goto finish;
+    r = w + clients;
+
+    wa->dispatch = web_test_dispatch;
+    wa->requests = wa->bytes = 0;
+    wa->stop = 0;
+    if (web_agent_open (wa) < 0 || web_listen (wa) < 0)
+        goto finish;
+    getsockname (wa->lsock, (struct sockaddr *)&sock_addr, &l);
+    sock_addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    /** Accept as clients come, the listen backlog is short */
+    looping = !pthread_create (&loop, NULL, web_test_loop, wa);
+
+    for (i = 0; i < clients; i ++) {
+        clnt[i].sock = socket (AF_INET, SOCK_STREAM, 0);
+        if (!web_test_stream (&clnt[i], requests, (long)i * requests) || clnt[i].sock < 0 ||
+            connect (clnt[i].sock, (struct sockaddr *)&sock_addr, sizeof (sock_addr)) < 0) {
+            printf ("web test: client %d, %s\n", i, strerror (errno));
+            goto finish;
+        }
+    }
+
+    gettimeofday (&start, NULL);
+    for (i = 0; i < clients; i ++) {
+        pthread_create (&r[i], NULL, web_test_reader, &clnt[i]);
+        pthread_create (&w[i], NULL, web_test_writer, &clnt[i]);
+    }
+    for (i = 0; i < clients; i ++) {
+        pthread_join (w[i], NULL);
+        pthread_join (r[i], NULL);
+    }
+    gettimeofday (&end, NULL);
+
+    xret = 0;
+    for (i = 0; i < clients; i ++)
+        if (!clnt[i].match)
+            xret = -1;
+
+    sec = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    if (sec <= 0)
+        sec = 1e-6;
+    printf ("web test: %d clients, %" PRIu64 " requests (%.1f MB) in %.3fs, "
+            "%.0f req/s, %.1f MB/s\n",
+            clients, wa->requests, wa->bytes / 1048576.0, sec,
+            wa->requests / sec, wa->bytes / 1048576.0 / sec);
+
+finish:
+    if (looping) {
+        wa->stop = 1;
+        pthread_join (loop, NULL);
+    }
+    if (clnt) {
+        for (i = 0; i < clients; i ++) {
+            if (clnt[i].sock > 0)
+                close (clnt[i].sock);
+            kfree (clnt[i].stream);
+            kfree (clnt[i].expect);
+        }
+    }
+    web_agent_close (wa);
+    kfree (clnt);
+    kfree (w);
+    return xret;
+}
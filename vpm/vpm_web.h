@@ -0,0 +1,59 @@
+#ifndef __VPM_WEB_H__
+#define __VPM_WEB_H__
+
+/** Largest request accepted from WEB, a longer one drops the connection */
+#define WEB_REQ_MAX             (16 << 20)
+
+/** Bytes queued to one WEB connection before it is considered dead and dropped */
+#define WEB_OBUF_MAX            (64 << 20)
+
+/**
+* What mission_dispatcher puts on the worker queues.
+* origin is the WEB connection the request came in on,
+* the reply is routed back to it with web_reply.
+*/
+struct web_request_t {
+    uint32_t    origin;
+    /** Seconds the sender allows, 0 for the class default */
+    int         deadline;
+    /** When it was queued, see vpm_sched_submit */
+    uint64_t    queued;
+    size_t      s;
+    char        data[0];
+};
+
+extern void vpm_web_init (struct vpm_t *vpm,
+                void (*dispatch)(uint32_t origin, char *request, size_t s),
+                void (*greet)(uint32_t origin));
+
+extern int web_reply (uint32_t origin, const char *data, size_t s);
+
+/** Nonzero while the WEB connection origin is up */
+extern int web_origin_alive (uint32_t origin);
+
+/**
+* Changes whenever a WEB connection closes, no lock taken. An origin
+* alive at one epoch is still alive while the epoch stays the same.
+*/
+extern int web_origin_epoch ();
+
+/** A reply written in pieces, see web_stream_open */
+struct web_stream_t {
+    uint32_t    origin;
+    uint32_t    token;
+    /** Owns the connection, pieces go out as they are written */
+    int         direct;
+    /** Pieces kept back while another stream owns the connection */
+    struct list_head    pending;
+    size_t      bytes;
+    int         error;
+};
+
+extern int web_stream_open (struct web_stream_t *ws, uint32_t origin);
+extern int web_stream_write (struct web_stream_t *ws, const char *data, size_t s);
+extern int web_stream_close (struct web_stream_t *ws);
+
+/** Echo requests through a private agent, 0 if every reply came back whole */
+extern int vpm_web_test (int clients, long requests);
+
+#endif
@@ -73,6 +73,7 @@ static __rt_always_inline__ void vpw_check_env (struct vrs_trapper_t *trapper)
         rt_log_notice ("        Score Threshold: %d", atomic_add(&vpw->score_threshold, 0));
         rt_log_notice ("        Filter of Clue Layer: %d", atomic_add(&vpw->clue_layer_filter, 0));
         rt_log_notice ("        Stage: (%d:%d:%d)", atomic_add(&vpw->stage_time[0], 0), atomic_add(&vpw->stage_time[1], 0), atomic_add(&vpw->stage_time[2], 0));
+        rt_log_notice ("        Stage Speech: %d%%", atomic_read(&vpw->stage_speech));
         rt_log_notice ("        Short Voice Matcher: %d", atomic_read(&vpw->short_voice_enable));
         rt_log_notice ("        Log Directory: %s", trapper->log_dir);
 
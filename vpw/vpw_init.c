@@ -158,6 +158,12 @@ static int load_vpw_default_configure()
     if (!xret)
         atomic_set(&_this->short_voice_enable, value);
 
+    value = 0;
+    /** speech a stage needs, in percent */
+    xret = ConfYamlReadInt("stage-speech", &value);
+    if (!xret)
+        atomic_set(&_this->stage_speech, MIN(MAX(value, 0), 100));
+
     /** stage time*/
     xret = load_stage_time();
 
@@ -193,6 +199,10 @@ int load_private_vpw_config (int reload)
     /** cdr ip*/
     load_cdr_conf (reload);
 
+    /** placement only applies when threads start */
+    if (!reload)
+        task_affinity_load ("task-affinity");
+
 finish:
     return xret;
 }
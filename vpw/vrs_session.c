@@ -4,6 +4,7 @@
 #include "rt_ethxx_packet.h"
 #include "vrs_session.h"
 #include "vpm_boost.h"
+#include "vad.h"
 #include "vrs_senior.h"
 
 static struct vpw_t    *current_vpw;
@@ -54,6 +55,11 @@ struct call_data_t {
     int        bsize;        /** buffer size of data */
     int        cur_size;   /** payload size of data */
     int        stages;
+    /** Speech found in data[0, judged), kept when stage-speech is on */
+    struct vad_state_t vad;
+    int        judged;
+    /** Stage reached but short of speech, 0 for none */
+    int        pending;
 };
 
 struct cm_entry_t {
@@ -100,6 +106,7 @@ struct stats_t{
     atomic_t cdr_enq_cnt, cdr_deq_cnt, cdr_report_cnt, cdr_real_cnt;
     atomic_t topn_send, counter_send;
     atomic_t session_cnt, hitted_cnt; //用于命中统计上报
+    atomic_t stage_deferred, stage_resumed, stage_skipped;
 };
 
 static struct stats_t SGstats = {
@@ -122,6 +129,9 @@ static struct stats_t SGstats = {
     .counter_send = ATOMIC_INIT(0),
     .session_cnt = ATOMIC_INIT(0),
     .hitted_cnt = ATOMIC_INIT(0),
+    .stage_deferred = ATOMIC_INIT(0),
+    .stage_resumed = ATOMIC_INIT(0),
+    .stage_skipped = ATOMIC_INIT(0),
 };
 
 void vrs_stat_read(st_count_t *total_count)
@@ -143,6 +153,8 @@ void vrs_stat_read(st_count_t *total_count)
 /** x: 1, 2, 3*/
 #define sizeof_stagex(x)  (V_FRAME_LENGTH * 8 * atomic_read(&current_vpw->stage_time[(x-1)%3]))
 #define secsof_stagex(x)  (atomic_read(&current_vpw->stage_time[(x-1)%3]))
+/** Bytes of speech stage x needs, 0 when stage-speech is off */
+#define speechof_stagex(x)  ((int)((int64_t)sizeof_stagex(x) * atomic_read(&current_vpw->stage_speech) / 100))
 #define slotof_stream(x) ((x-1)%2)
 #define strof_stream_direction(x) (x == V_STREAM_UP ? "up" : (x == V_STREAM_DWN ? "down" : "unknown"))
 
@@ -236,6 +248,9 @@ static __rt_always_inline__ void __cs_entry_data_init(struct cs_entry_t *_this)
     for (i = 0; i < 2; i ++) {
         _this->stream[i].cur_size = 0;
         _this->stream[i].stages = 0;
+        vad_state_init (&_this->stream[i].vad, VAD_ENERGY_GATE);
+        _this->stream[i].judged = 0;
+        _this->stream[i].pending = 0;
     }
 }
 
@@ -252,14 +267,15 @@ static void *__cs_entry_alloc()
     memset64(p, 0, sizeof(struct cs_entry_t));
     rt_mutex_init(&p->lock, NULL);
 
-    p->stream[0].data = kmalloc(s, MPF_CLR, -1);
+    /** Cleared below with memset64, which streams past the cache */
+    p->stream[0].data = kmalloc(s, MPF_NOFLGS, -1);
     if (unlikely(!p->stream[0].data)) {
         kfree(p);
         p = NULL;
         goto finish;
     }
 
-    p->stream[1].data = kmalloc(s, MPF_CLR, -1);
+    p->stream[1].data = kmalloc(s, MPF_NOFLGS, -1);
     if (unlikely(!p->stream[1].data)) {
         kfree(p->stream[0].data);
         kfree(p);
@@ -645,6 +661,40 @@ static __rt_always_inline__ void sg_detector_append_curstage_entry(struct vrs_tr
     }
 }
 
+/** Judge the windows the last payload completed */
+static __rt_always_inline__ void sg_detector_judge_payload(struct call_data_t *v)
+{
+    v->judged += (int)vad_scan (&v->vad, v->data + v->judged, cursize(v) - v->judged);
+}
+
+/**
+    Match a stage once enough of the stream is speech, hold it back otherwise.
+    A stage still held when the next one is reached is skipped, one matched
+    late is matched with all the data buffered by then.
+*/
+static __rt_always_inline__ void sg_detector_trigger_curstage(struct vrs_trapper_t *rte,
+                    struct call_data_t *v, union vrs_fsnapshot_t *snapshot, int stage)
+{
+    if (v->pending) {
+        atomic_inc(&SGstats.stage_skipped);
+        v->pending = 0;
+    }
+
+    if (v->vad.valid >= (uint64_t)speechof_stagex(stage)) {
+        sg_detector_append_curstage_entry (rte, v, snapshot, stage);
+        return;
+    }
+
+    /** Stage 3 fills the buffer, no more speech can come */
+    if (stage == 3) {
+        atomic_inc(&SGstats.stage_skipped);
+        return;
+    }
+
+    v->pending = stage;
+    atomic_inc(&SGstats.stage_deferred);
+}
+
 static __rt_always_inline__ void sg_detector_decide_curstage(struct vrs_trapper_t *rte,
                         void *p, union vrs_fsnapshot_t *snapshot, struct call_data_t *v)
 {
@@ -656,22 +706,42 @@ static __rt_always_inline__ void sg_detector_decide_curstage(struct vrs_trapper_
         /** Send a 'STOP' signal to VDU */
         sg_detector_stop_injection (snapshot->call.data, snapshot->mark);
         //sg_detector_append_curstage_entry (rte, v, snapshot, stage);
+        if (v->pending) {
+            atomic_inc(&SGstats.stage_skipped);
+            v->pending = 0;
+        }
     }else {
         /** not safety here. */
         sg_detector_append_payload ((uint8_t *)(p + V_PL_OFFSET), snapshot->payload_size, v);
 
+        if (atomic_read(&current_vpw->stage_speech))
+            sg_detector_judge_payload (v);
+
         if (cursize(v) == sizeof_stagex(1)) {
             stage |= V_STAGE_1;
-            sg_detector_append_curstage_entry (rte, v, snapshot, 1);
+            sg_detector_trigger_curstage (rte, v, snapshot, 1);
         }else {
             if (cursize(v) == sizeof_stagex(2)) {
                 stage |= V_STAGE_2;
-                sg_detector_append_curstage_entry (rte, v, snapshot, 2);
+                sg_detector_trigger_curstage (rte, v, snapshot, 2);
             }
             else if (cursize(v) >= sizeof_stagex(3)) {
                 stage |= V_STAGE_3;
                 sg_detector_stop_injection (snapshot->call.data, snapshot->mark);
-                sg_detector_append_curstage_entry (rte, v, snapshot, 3);
+                sg_detector_trigger_curstage (rte, v, snapshot, 3);
+            }
+            else if (v->pending &&
+                v->vad.valid >= (uint64_t)speechof_stagex(v->pending)) {
+                /**
+                 * Enough speech came before the next stage. The entry takes
+                 * everything buffered so far, past the stage size on purpose:
+                 * the first sizeof_stagex bytes are the ones found short of
+                 * speech, the speech that made up for it is behind them.
+                 * cur_size stays below sizeof_stagex(3), the buffer size.
+                 */
+                sg_detector_append_curstage_entry (rte, v, snapshot, v->pending);
+                atomic_inc(&SGstats.stage_resumed);
+                v->pending = 0;
             }
         }
     }
@@ -1504,7 +1574,7 @@ task_finish:
 
 static __rt_always_inline__ void init_matchers (struct vrs_trapper_t *rte)
 {
-    int    i;
+    int    i, node;
     struct rt_task_t    *task;
     struct vrs_matcher_t    *matcher;
 
@@ -1532,7 +1602,14 @@ static __rt_always_inline__ void init_matchers (struct vrs_trapper_t *rte)
                 task->recycle = ALLOWED;
                 task->routine = SGMatcher;
 
-                task_spawn_quickly (task);
+                task = task_spawn_quickly (task);
+                /** Match entries are released by the matchers, keep them on their node */
+                if (i == 0 && !rte->cm_bucket_pool) {
+                    node = rt_mempolicy_prefer (task ? task->node : -1);
+                    rte->cm_bucket_pool  = rt_pool_initialize (1024,
+                                            __cm_entry_alloc, __cm_entry_free, 0);
+                    rt_mempolicy_restore (node);
+                }
             }
         }
     }
@@ -1972,6 +2049,7 @@ static void SGVpwTmrScanner(uint32_t __attribute__((__unused__)) uid,
     char    gather[GATHER_INFO_SIZE]  = {0};
     int l = 0;
     char tm[64] = {0};//tm_ymd[64] = {0};
+    struct rt_pool_stats_t cs_stats, cm_stats;
 
     if (atomic_add(&cbp.sig, 0)) {
         sg_matcher_delete_passed_massive_model (cbp.root, &cbp.tms, 90);
@@ -1993,6 +2071,17 @@ static void SGVpwTmrScanner(uint32_t __attribute__((__unused__)) uid,
         "\tReporter (enqueue=%d, dequeue=%d, reported=%d, 3rdStage=%d)\n",
             atomic_add(&SGstats.cdr_enq_cnt, 0), atomic_add(&SGstats.cdr_deq_cnt, 0), atomic_add(&SGstats.cdr_report_cnt, 0), atomic_add(&SGstats.cdr_real_cnt, 0));
 
+    if (atomic_read(&rte->vpw->stage_speech))
+        l += snprintf (gather + l, GATHER_INFO_SIZE -l,
+            "\tSpeech   (stages deferred=%d, resumed=%d, skipped=%d)\n",
+                atomic_add(&SGstats.stage_deferred, 0), atomic_add(&SGstats.stage_resumed, 0), atomic_add(&SGstats.stage_skipped, 0));
+
+    rt_pool_stats (rte->cs_bucket_pool, &cs_stats);
+    rt_pool_stats (rte->cm_bucket_pool, &cm_stats);
+    l += snprintf (gather + l, GATHER_INFO_SIZE -l,
+        "\tPool     (session hit=%lu, miss=%lu, grow=%lu; match hit=%lu, miss=%lu, grow=%lu)\n",
+            cs_stats.hits, cs_stats.misses, cs_stats.grows, cm_stats.hits, cm_stats.misses, cm_stats.grows);
+
     rt_log_notice ("%s", gather);
 }
 
@@ -2067,6 +2156,8 @@ static void *     SGReporter (void __attribute__((__unused__)) *args)
 }
 
 #define    MSG_SIZE    1024
+/** Room for an update_mod and the update_bt behind it */
+#define    VPM_RBUF_SIZE    (2 * (TLV_FRAME_HEAD_LEN + (int)sizeof (((struct tlv *)0)->v)))
 
 
 /****************************************************************************
@@ -2089,27 +2180,11 @@ static int sg_update_model_throushold(IN char *recvb, int sz)
     tid = INVALID_TARGET;
     vid = INVALID_VID;
 
-    // 获取TID
+    // 获取TID, 阈值跟在后面的req_update_bt里, 由sg_update_threshold处理
     xerror = senior_parse_vpm_vpw_request(recvb, sz, req_update_mod, &request);
     if (xerror != XSUCCESS)
         return xerror;
     sscanf (request.v, "%lu-%d.%*s", &tid, &vid);
-    // 获取Threshold
-    boost_threshold_t bt = {0};
-    memset(&request, 0, sizeof(request));
-    xerror = senior_parse_vpm_vpw_request(recvb, sz, req_update_bt, &request);
-    rt_log_debug("request: %s", request.v);
-    if (XSUCCESS == xerror) {
-        xerror = request_str_to_bt(&request, &bt);
-        if (0 == xerror) {
-            rt_log_notice("tid: %lu accurate:%d exploring:%d default:%d", tid, bt.accurate_score,
-                 bt.exploring_score, bt.default_score);
-        } else {
-            rt_log_error(ERRNO_FATAL, "request_str_to_bt");
-        }
-    } else {
-        rt_log_notice("parse_vpm_vpw_request ERROR");
-    }
 
     if (!vrmt_query (tid, &tid_index, (struct vrmt_t **)&_vrmt)) {
         sg_modelist_load (rte, ML_FLG_RLD|ML_FLG_MOD_0);
@@ -2210,6 +2285,68 @@ static int sg_update_topn(char *recvb, int sz)
     return 0;
 }
 
+/** The req_update_bt vpm sends behind an update_mod */
+static int sg_update_threshold(IN char *recvb, int sz)
+{
+    struct tlv request = {0};
+    boost_threshold_t bt = {0};
+    int xerror;
+
+    xerror = senior_parse_vpm_vpw_request(recvb, sz, req_update_bt, &request);
+    rt_log_debug("request: %s", request.v);
+    if (XSUCCESS != xerror) {
+        rt_log_notice("parse_vpm_vpw_request ERROR");
+        return xerror;
+    }
+
+    xerror = request_str_to_bt(&request, &bt);
+    if (0 == xerror) {
+        rt_log_notice("accurate:%d exploring:%d default:%d", bt.accurate_score,
+             bt.exploring_score, bt.default_score);
+    } else {
+        rt_log_error(ERRNO_FATAL, "request_str_to_bt");
+    }
+
+    return xerror;
+}
+
+/** Tell vpm what this VPW understands, first thing on a new connection */
+static void sg_notify_caps(void)
+{
+    struct vrs_trapper_t *rte = vrs_default_trapper ();
+    struct tlv request = {0};
+    message clone = NULL;
+    int l;
+
+    l = senior_notify_seq_to_req(VPW_CAP_SYNC, req_notify_caps, &request);
+    message_clone((void *)&request, l, &clone);
+    if (MQ_SUCCESS != rt_mq_send (rte->vpm_mq, clone, l))
+    {
+        kfree(clone);
+    }
+}
+
+/** Every broadcast before this sync has been applied, tell vpm */
+static void sg_notify_ack(char *recvb, int sz)
+{
+    struct vrs_trapper_t *rte = vrs_default_trapper ();
+    struct tlv request = {0};
+    message clone = NULL;
+    uint64_t seq;
+    int l;
+
+    if (senior_parse_tlv(recvb, sz, &request) ||
+        senior_req_to_notify_seq(&request, &seq))
+        return;
+
+    l = senior_notify_seq_to_req(seq, req_notify_ack, &request);
+    message_clone((void *)&request, l, &clone);
+    if (MQ_SUCCESS != rt_mq_send (rte->vpm_mq, clone, l))
+    {
+        kfree(clone);
+    }
+}
+
 static void SGVpmRequest(char *recvb, int sz)
 {
     uint8_t type = TLV_TYPE(recvb);
@@ -2219,6 +2356,10 @@ static void SGVpmRequest(char *recvb, int sz)
         sg_update_model_throushold(recvb, sz);
         break;
 
+    case req_update_bt:
+        sg_update_threshold(recvb, sz);
+        break;
+
     case req_remove_target:
         sg_remove_target(recvb, sz);
         break;
@@ -2228,12 +2369,49 @@ static void SGVpmRequest(char *recvb, int sz)
             sg_update_topn(recvb, sz);
        break;
 
+    case req_notify_sync:
+        sg_notify_ack(recvb, sz);
+        break;
     default:
         rt_log_error(ERRNO_INVALID_VAL, "Unknown type %d", type);
         break;
     }
 }
 
+/**
+* Handle every whole TLV in recvb and return the bytes left for the next read.
+* A TLV is handled as soon as all of it is in. Anything that is not a TLV
+* ends the buffer, there is no way to find the next frame after it.
+*/
+static int SGVpmRequests(char *recvb, int sz)
+{
+    int off = 0, end, l;
+    uint8_t type;
+
+    while (sz - off >= TLV_FRAME_HEAD_LEN) {
+        type = TLV_TYPE(recvb + off);
+        l = TLV_VAL_LEN(recvb + off);
+        if (type <= req_null || type >= req_max ||
+            TLV_FRAME_HEAD_LEN + l > VPM_RBUF_SIZE / 2) {
+            rt_log_error(ERRNO_INVALID_VAL, "Unknown type %d", type);
+            return 0;
+        }
+        end = off + TLV_FRAME_HEAD_LEN + l;
+        if (end > sz)
+            break;
+
+        SGVpmRequest(recvb + off, end - off);
+        off = end;
+    }
+
+    if (off) {
+        sz -= off;
+        memmove(recvb, recvb + off, sz);
+    }
+
+    return sz;
+}
+
 
 /****************************************************************************
  函数名称  : SGSendRequestToVpm
@@ -2306,9 +2484,9 @@ static struct rt_task_t     SGSendVpm = {
 void *    SGVpmAgent (void __attribute__((__unused__)) *args)
 {
     struct vrs_trapper_t *rte = vrs_default_trapper ();
-    char   recvb[MSG_SIZE] = {0};
+    char   recvb[VPM_RBUF_SIZE] = {0};
     struct vpm_t    *vpm;
-    int    rsize = 0;
+    int    rsize = 0, rlen = 0;
     int xerror, tmo;
 
     vpm = rte->vpm;
@@ -2326,6 +2504,9 @@ void *    SGVpmAgent (void __attribute__((__unused__)) *args)
 
         rt_log_notice ("Connecting to VPM (%s:%d, sock=%d): %s (%d)",
                         vpm->ip, vpm->port, vpm->sock, "success", vpm_flags_chk_bit(VPM_FLGS_CONN_BIT));
+        /** Broadcast seqs restart on a new connection */
+        rlen = 0;
+        sg_notify_caps();
 
         do {
             xerror = is_sock_ready(vpm->sock, 60 * 1000000, &tmo);
@@ -2338,8 +2519,7 @@ void *    SGVpmAgent (void __attribute__((__unused__)) *args)
                 break;
             }
 
-            memset(recvb, 0, MSG_SIZE);
-            rsize = rt_sock_recv (vpm->sock, recvb, MSG_SIZE);
+            rsize = rt_sock_recv (vpm->sock, recvb + rlen, VPM_RBUF_SIZE - rlen);
             if (rsize <= 0) {
                 rt_log_error (ERRNO_SG,
                     "Peer(VPM) (%s:%d, sock=%d, rsize=%d), %s",
@@ -2348,7 +2528,7 @@ void *    SGVpmAgent (void __attribute__((__unused__)) *args)
                 rt_sock_close (&vpm->sock, NULL);
                 break;
             }
-            SGVpmRequest(recvb, rsize);
+            rlen = SGVpmRequests(recvb, rlen + rsize);
         }while (vpm->sock > 0);
     }
 
@@ -2429,6 +2609,8 @@ void vpw_trapper_eth_init (const char *netdev, const char *logdir)
 
 void vpw_trapper_init (struct vrs_trapper_t *rte)
 {
+    int node;
+
     if (unlikely (!rte))
         return;
 
@@ -2459,12 +2641,15 @@ void vpw_trapper_init (struct vrs_trapper_t *rte)
                 senior_save_topn_bucket_disc, 1, (char **)rte, 300);
     }
 
+    /** Session entries live with the packet path, match entries are built by init_matchers. */
+    node = rt_mempolicy_prefer (rte_dispatch_task ()->node);
     rte->cs_bucket_pool  = rt_pool_initialize (2048,
-                            __cs_entry_alloc, __cs_entry_free, 0);
-
-
+                            __cs_entry_alloc, __cs_entry_free, RT_POOL_F_MAGAZINE);
+    rt_mempolicy_restore (node);
+#if !defined (ENABLE_MATCHERS)
     rte->cm_bucket_pool  = rt_pool_initialize (1024,
                             __cm_entry_alloc, __cm_entry_free, 0);
+#endif
 
     rte->cdr_bucket_pool = rt_pool_initialize (1024,
                             __cdr_entry_alloc, __cdr_entry_free, 0);